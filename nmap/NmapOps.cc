@@ -135,6 +135,7 @@ NmapOps o;
 
 NmapOps::NmapOps() {
   datadir = NULL;
+  version_cache = NULL;
   xsl_stylesheet = NULL;
   Initialize();
 }
@@ -186,6 +187,10 @@ NmapOps::~NmapOps() {
     free(datadir);
     datadir = NULL;
   }
+  if (version_cache) {
+    free(version_cache);
+    version_cache = NULL;
+  }
 
 #ifndef NOLUA
   if (scriptversion || script)
@@ -293,6 +298,10 @@ void NmapOps::Initialize() {
   randomize_hosts = 0;
   randomize_ports = 1;
   sendpref = PACKET_SEND_NOPREF;
+  capture_ring = false;
+  scan_workers = 0;
+  scan_worker = -1;
+  stateless = false;
   spoofsource = 0;
   fastscan = 0;
   device[0] = '\0';
@@ -323,6 +332,7 @@ void NmapOps::Initialize() {
   scanflags = -1;
   defeat_rst_ratelimit = 0;
   resume_ip.s_addr = 0;
+  randomize_hosts_key = 0;
   osscan_limit = 0;
   osscan_guess = 0;
   numdecoys = 0;
@@ -331,6 +341,8 @@ void NmapOps::Initialize() {
   servicescan = 0;
   override_excludeports = 0;
   version_intensity = 7;
+  if (version_cache) free(version_cache);
+  version_cache = NULL;
   pingtype = PINGTYPE_UNKNOWN;
   listscan = allowall = ackscan = bouncescan = connectscan = 0;
   nullscan = xmasscan = fragscan = synscan = windowscan = 0;
@@ -376,6 +388,7 @@ void NmapOps::Initialize() {
   scripttrace = 0;
   scriptupdatedb = 0;
   scripthelp = false;
+  script_workers = 1;
   chosenScripts.clear();
 #endif
   memset(&sourcesock, 0, sizeof(sourcesock));
@@ -550,6 +563,21 @@ dialog where you can start NPF if you have administrator privileges.";
   if (servicescan && noportscan)
     servicescan = 0;
 
+  if (stateless) {
+    if (!synscan || udpscan || sctpinitscan || sctpcookieechoscan || ipprotscan)
+      fatal("--stateless works only with a SYN scan (-sS) and no other scan types");
+    if (af() != AF_INET)
+      fatal("--stateless is only supported for IPv4");
+    if (osscan || servicescan || traceroute || numdecoys > 0 || fragscan)
+      fatal("--stateless can't be combined with -O, -sV, --traceroute, -D, or -f");
+#ifndef NOLUA
+    if (script)
+      fatal("--stateless can't be combined with -sC or --script");
+#endif
+    if (sendpref == PACKET_SEND_ETH_STRONG)
+      fatal("--stateless sends through a raw IP socket and can't be combined with --send-eth");
+  }
+
   if (defeat_rst_ratelimit && !synscan) {
       fatal("Option --defeat-rst-ratelimit works only with a SYN scan (-sS)");
   }
@@ -194,6 +194,17 @@ class NmapOps {
      Nmap will still do an ARP ping scan of a local network even when
      the pref is SEND_IP_WEAK */
   int sendpref;
+  /* Read ultra_scan, OS scan and traceroute responses from a large capture
+     ring in batches (--capture-engine ring) rather than one packet per
+     wakeup. */
+  bool capture_ring;
+  /* Number of worker processes raw port scans are split across
+     (--scan-workers); 0 or 1 scans in this process. */
+  int scan_workers;
+  /* In a scan worker process, its index; -1 in the main process. */
+  int scan_worker;
+  /* Run -sS as a stateless sweep (--stateless) instead of with ultra_scan. */
+  bool stateless;
   bool packetTrace() { return (debugging >= 3)? true : pTrace;  }
   bool versionTrace() { return packetTrace()? true : vTrace;  }
 #ifndef NOLUA
@@ -301,10 +312,14 @@ class NmapOps {
                                restore_ip.s_addr == 0.  Also
                                target_struct_get will eventually set it
                                to 0. */
+  u64 randomize_hosts_key; /* Key of the --randomize-hosts order, written to
+                              the log so --resume can walk the targets in
+                              the same order. 0 until chosen. */
 
   // Version Detection Options
   int override_excludeports;
   int version_intensity;
+  char *version_cache; // --version-cache file of earlier match results, or NULL
 
   struct in_addr decoys[MAX_DECOYS];
   int osscan_limit; /* Skip OS Scan if no open or no closed TCP ports */
@@ -383,6 +398,7 @@ class NmapOps {
   int scripttrace;
   int scriptupdatedb;
   bool scripthelp;
+  int script_workers; /* Worker processes for the script scan phase (1 = none) */
   void chooseScripts(char* argument);
   std::vector<std::string> chosenScripts;
 #endif
@@ -500,6 +500,11 @@ void Target::stopTimeOutClock(const struct timeval *now) {
   else gettimeofday(&tv, NULL);
   htn.msecs_used += TIMEVAL_MSEC_SUBTRACT(tv, htn.toclock_start);
   htn.host_end = tv.tv_sec;
+}
+void Target::setTimeOutClockUsed(unsigned long msecs_used, time_t host_end) {
+  assert(htn.toclock_running == false);
+  htn.msecs_used = msecs_used;
+  htn.host_end = host_end;
 }
   /* Returns whether the host is timedout.  If the timeoutclock is
      running, counts elapsed time for that.  Pass NULL if you don't have the
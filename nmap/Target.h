@@ -292,6 +292,11 @@ class Target {
   /* Return time_t for the start and end time of this host */
   time_t StartTime() { return htn.host_start; }
   time_t EndTime() { return htn.host_end; }
+  /* The msecs counted by the stopped timeout clock. setTimeOutClockUsed
+     replaces it and the end time with those of a copy of this Target that
+     was scanned in another process. */
+  unsigned long TimeOutClockUsed() { return htn.msecs_used; }
+  void setTimeOutClockUsed(unsigned long msecs_used, time_t host_end);
 
   /* Takes a 6-byte MAC address */
   int setMACAddress(const u8 *addy);
@@ -294,6 +294,71 @@ bail:
   return NULL;
 }
 
+/* Returns the key for the next range to be permuted. It depends only on
+   o.randomize_hosts_key and how many ranges came before, so a resumed scan
+   visits the same ranges in the same order. */
+static u64 next_permutation_key(void) {
+  static u64 nranges = 0;
+  u64 key;
+
+  key = o.randomize_hosts_key + ++nranges * 0xD1B54A32D192ED03ULL;
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+
+  return key;
+}
+
+void IndexPermutation::init(u64 n, u64 key) {
+  unsigned int bits, i;
+
+  this->n = n;
+  /* Number of bits needed for the largest index, rounded up to be even. */
+  for (bits = 0; bits < 64 && (n - 1) >> bits != 0; bits++)
+    ;
+  this->half_bits = (bits + 1) / 2;
+  if (this->half_bits == 0)
+    this->half_bits = 1;
+  this->half_mask = ((u64) 1 << this->half_bits) - 1;
+  for (i = 0; i < ROUNDS; i++) {
+    /* Spread the one key into a different key for each round. */
+    key += 0x9E3779B97F4A7C15ULL;
+    this->keys[i] = (u32) (key >> 32);
+  }
+}
+
+/* The round function: a 32-bit mixer of the half block and the round key.
+   Half blocks are never more than 32 bits, as n < 2^64. */
+static u32 feistel_round(u32 x, u32 key) {
+  x ^= key;
+  x *= 0x85EBCA6B;
+  x ^= x >> 13;
+  x *= 0xC2B2AE35;
+  x ^= x >> 16;
+  return x;
+}
+
+u64 IndexPermutation::map(u64 i) const {
+  u64 l, r, t;
+  unsigned int round;
+
+  /* The Feistel network permutes [0, 4^half_bits), which is less than four
+     times n, so this loop runs only a few times on average. Starting from
+     an index below n, it always comes back below n. */
+  do {
+    l = i >> this->half_bits;
+    r = i & this->half_mask;
+    for (round = 0; round < ROUNDS; round++) {
+      t = l ^ (feistel_round((u32) r, this->keys[round]) & this->half_mask);
+      l = r;
+      r = t;
+    }
+    i = (l << this->half_bits) | r;
+  } while (i >= this->n);
+
+  return i;
+}
+
 bool NetBlock::is_resolved_address(const struct sockaddr_storage *ss) const {
   if (this->resolvedaddrs.empty())
     return false;
@@ -301,31 +366,101 @@ bool NetBlock::is_resolved_address(const struct sockaddr_storage *ss) const {
 }
 
 NetBlockIPv4Ranges::NetBlockIPv4Ranges() {
-  unsigned int i;
+  memset(this->octets, 0, sizeof(this->octets));
+  this->prepared = false;
+  this->pos = 0;
+  this->total = 0;
+  this->permuted = false;
+}
+
+/* Turn the bit vectors into lists of values, so that walking the block doesn't
+   have to search for set bits. */
+void NetBlockIPv4Ranges::prepare() {
+  unsigned int i, j;
 
+  this->total = 1;
   for (i = 0; i < 4; i++) {
-    memset(this->octets, 0, sizeof(this->octets));
-    this->counter[i] = 0;
+    this->nvalues[i] = 0;
+    for (j = 0; j < 256; j++) {
+      if (BIT_IS_SET(this->octets[i], j))
+        this->values[i][this->nvalues[i]++] = j;
+    }
+    this->total *= this->nvalues[i];
+  }
+  this->pos = 0;
+  this->permuted = o.randomize_hosts && this->total > 1;
+  if (this->permuted)
+    this->perm.init(this->total, next_permutation_key());
+  this->prepared = true;
+}
+
+/* Return the address, in host byte order, with index i in the product of the
+   octet value lists. */
+u32 NetBlockIPv4Ranges::index_to_addr(u64 index) const {
+  u32 addr, i;
+  int k;
+
+  /* index < total <= 2^32, and 32-bit division is a lot faster. */
+  i = (u32) index;
+  addr = 0;
+  for (k = 3; k >= 0; k--) {
+    /* Fixed and wildcard octets are the common cases, and need no
+       division. */
+    if (this->nvalues[k] == 1) {
+      addr |= (u32) this->values[k][0] << (8 * (3 - k));
+    } else if (this->nvalues[k] == 256) {
+      addr |= (i & 0xFF) << (8 * (3 - k));
+      i >>= 8;
+    } else {
+      addr |= (u32) this->values[k][i % this->nvalues[k]] << (8 * (3 - k));
+      i /= this->nvalues[k];
+    }
   }
+
+  return addr;
+}
+
+unsigned int NetBlockIPv4Ranges::next_batch(u32 *addrs, unsigned int max) {
+  unsigned int n, k;
+  u32 prefix;
+
+  if (!this->prepared)
+    this->prepare();
+
+  n = 0;
+  if (this->permuted) {
+    u32 addr;
+
+    for (; n < max && this->pos < this->total; n++) {
+      /* Computed into a local first, so that the store to addrs doesn't
+         make the compiler reload this. */
+      addr = this->index_to_addr(this->perm.map(this->pos++));
+      addrs[n] = htonl(addr);
+    }
+    return n;
+  }
+
+  while (n < max && this->pos < this->total) {
+    /* In order, the addresses up to the next carry out of the last octet
+       share their first three octets, so find those only once. */
+    k = this->pos % this->nvalues[3];
+    prefix = this->index_to_addr(this->pos - k) & 0xFFFFFF00;
+    for (; k < this->nvalues[3] && n < max; k++) {
+      addrs[n++] = htonl(prefix | this->values[3][k]);
+      this->pos++;
+    }
+  }
+
+  return n;
 }
 
 bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
   struct sockaddr_in *sin;
-  unsigned int i;
+  u32 addr;
 
-  /* This first time this is called, the current values of this->counter
-     probably do not point to set bits (they point to 0.0.0.0). Find the first
-     set bit in each bitvector. If any overflow occurs, it means that there is
-     not bit set for one of the octets and therefore there are not addresses
-     overall. */
-  for (i = 0; i < 4; i++) {
-    while (this->counter[i] < 256 && !BIT_IS_SET(this->octets[i], this->counter[i]))
-      this->counter[i]++;
-    if (this->counter[i] >= 256)
-      return false;
-  }
+  if (this->next_batch(&addr, 1) == 0)
+    return false;
 
-  /* Assign the returned address based on current counters. */
   memset(ss, 0, sizeof(*ss));
   sin = (struct sockaddr_in *) ss;
   sin->sin_family = AF_INET;
@@ -333,29 +468,9 @@ bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
 #if HAVE_SOCKADDR_SA_LEN
   sin->sin_len = sizeof(*sin);
 #endif
-  sin->sin_addr.s_addr = htonl((this->counter[0] << 24) | (this->counter[1] << 16) | (this->counter[2] << 8) | this->counter[3]);
+  sin->sin_addr.s_addr = addr;
   *sslen = sizeof(*sin);
 
-  for (i = 0; i < 4; i++) {
-    bool carry;
-
-    carry = false;
-    do {
-      this->counter[3 - i] = (this->counter[3 - i] + 1) % 256;
-      if (this->counter[3 - i] == 0)
-        carry = true;
-    } while (!BIT_IS_SET(this->octets[3 - i], this->counter[3 - i]));
-    if (!carry)
-      break;
-  }
-  if (i >= 4) {
-    /* We cycled all counters. Mark them invalid for the next call. */
-    this->counter[0] = 256;
-    this->counter[1] = 256;
-    this->counter[2] = 256;
-    this->counter[3] = 256;
-  }
-
   return true;
 }
 
@@ -459,6 +574,7 @@ std::string NetBlockIPv4Ranges::str() const {
 
 void NetBlockIPv6Netmask::set_addr(const struct sockaddr_in6 *addr) {
   this->exhausted = false;
+  this->prepared = false;
   this->addr = *addr;
   this->start = this->addr.sin6_addr;
   this->cur = this->addr.sin6_addr;
@@ -484,10 +600,68 @@ static bool ipv6_equal(const struct in6_addr *a, const struct in6_addr *b) {
   return memcmp(a->s6_addr, b->s6_addr, 16) == 0;
 }
 
+unsigned int NetBlockIPv6Netmask::next_batch(struct in6_addr *addrs, unsigned int max) {
+  unsigned int n;
+  u64 offset;
+  int i, j;
+
+  if (!this->prepared) {
+    /* Count the host bits; they are the ones that differ between start and
+       end. */
+    for (i = 0; i < 16 && this->start.s6_addr[i] == this->end.s6_addr[i]; i++)
+      ;
+    this->permuted = false;
+    if (o.randomize_hosts && i >= 8 && !this->exhausted) {
+      offset = 0;
+      for (j = i; j < 16; j++)
+        offset = (offset << 8) | (this->end.s6_addr[j] & ~this->start.s6_addr[j] & 0xFF);
+      /* offset is now the number of addresses less one; a whole /64 doesn't
+         fit the count and is walked in order. */
+      if (offset != 0 && offset != ~(u64) 0) {
+        this->total = offset + 1;
+        this->pos = 0;
+        this->perm.init(this->total, next_permutation_key());
+        this->permuted = true;
+      }
+    }
+    this->prepared = true;
+  }
+
+  n = 0;
+  while (n < max && !this->exhausted) {
+    if (this->permuted) {
+      /* The host bits of start are zero, so the offset can just be ORed in. */
+      addrs[n] = this->start;
+      offset = this->perm.map(this->pos++);
+      for (i = 15; i >= 8 && offset != 0; i--, offset >>= 8)
+        addrs[n].s6_addr[i] |= offset & 0xFF;
+      n++;
+      if (this->pos == this->total)
+        this->exhausted = true;
+      continue;
+    }
+
+    addrs[n++] = this->cur;
+
+    if (ipv6_equal(&this->cur, &this->end))
+      this->exhausted = true;
+
+    /* Increment current address. */
+    for (i = 15; i >= 0; i--) {
+      this->cur.s6_addr[i]++;
+      if (this->cur.s6_addr[i] > 0)
+        break;
+    }
+  }
+
+  return n;
+}
+
 bool NetBlockIPv6Netmask::next(struct sockaddr_storage *ss, size_t *sslen) {
   struct sockaddr_in6 *sin6;
+  struct in6_addr a;
 
-  if (this->exhausted)
+  if (this->next_batch(&a, 1) == 0)
     return false;
 
   memset(ss, 0, sizeof(*ss));
@@ -503,17 +677,7 @@ bool NetBlockIPv6Netmask::next(struct sockaddr_storage *ss, size_t *sslen) {
   else
     sin6->sin6_scope_id = get_scope_id(o.device);
 
-  sin6->sin6_addr = this->cur;
-
-  if (ipv6_equal(&this->cur, &this->end))
-    exhausted = true;
-
-  /* Increment current address. */
-  for (int i = 15; i >= 0; i--) {
-    this->cur.s6_addr[i]++;
-    if (this->cur.s6_addr[i] > 0)
-      break;
-  }
+  sin6->sin6_addr = a;
 
   return true;
 }
@@ -563,6 +727,7 @@ void NetBlockIPv6Netmask::apply_netmask(int bits) {
     bits = 128;
 
   this->exhausted = false;
+  this->prepared = false;
   make_ipv6_netmask(&mask, bits);
   ipv6_or_mask(&this->start, &mask, &zeros);
   ipv6_or_mask(&this->end, &mask, &ones);
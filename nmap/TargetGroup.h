@@ -144,6 +144,22 @@ typedef unsigned long bitvector_t;
 /* A 256-element bit vector, representing legal values for one octet. */
 typedef bitvector_t octet_bitvector[(256 - 1) / (sizeof(unsigned long) * CHAR_BIT) + 1];
 
+/* A keyed pseudorandom permutation of the integers 0 to n - 1. It is a small
+   Feistel network over the next even power of two, with cycle walking to stay
+   inside the range, so it uses constant memory however large n is. */
+class IndexPermutation {
+public:
+  void init(u64 n, u64 key);
+  u64 map(u64 i) const;
+
+private:
+  static const unsigned int ROUNDS = 4;
+  u64 n;
+  unsigned int half_bits;
+  u64 half_mask;
+  u32 keys[ROUNDS];
+};
+
 class NetBlock {
 public:
   virtual ~NetBlock() {}
@@ -169,11 +185,27 @@ public:
   NetBlockIPv4Ranges();
 
   bool next(struct sockaddr_storage *ss, size_t *sslen);
+  /* Fills in up to max addresses, in network byte order, and returns how many
+     there were. Returns 0 when the block is exhausted. */
+  unsigned int next_batch(u32 *addrs, unsigned int max);
   void apply_netmask(int bits);
   std::string str() const;
 
 private:
-  unsigned int counter[4];
+  /* The allowed values of each octet, in increasing order. An address is
+     identified by its index in the product of these lists; pos is the next
+     index to return, or, with --randomize-hosts, the next index to feed
+     through perm. Filled in on the first call to next_batch. */
+  bool prepared;
+  u8 values[4][256];
+  unsigned int nvalues[4];
+  u64 pos;
+  u64 total;
+  bool permuted;
+  IndexPermutation perm;
+
+  void prepare();
+  u32 index_to_addr(u64 i) const;
 };
 
 class NetBlockIPv6Netmask : public NetBlock {
@@ -181,6 +213,9 @@ public:
   void set_addr(const struct sockaddr_in6 *addr);
 
   bool next(struct sockaddr_storage *ss, size_t *sslen);
+  /* Fills in up to max addresses and returns how many there were. Returns 0
+     when the block is exhausted. */
+  unsigned int next_batch(struct in6_addr *addrs, unsigned int max);
   void apply_netmask(int bits);
   std::string str() const;
 
@@ -190,6 +225,15 @@ private:
   struct in6_addr start;
   struct in6_addr cur;
   struct in6_addr end;
+  /* With --randomize-hosts, blocks of fewer than 2^64 addresses are walked
+     through a permutation of the offsets from start instead of from start
+     to end. pos is the next offset to permute; permuted is decided on the
+     first call to next_batch. */
+  bool prepared;
+  bool permuted;
+  u64 pos;
+  u64 total;
+  IndexPermutation perm;
 };
 
 class NetBlockHostname : public NetBlock {
@@ -225,11 +225,16 @@ struct FingerPrint {
   void sort();
 };
 
+struct FingerPrintDBCompiled;
+
 /* This structure contains the important data from the fingerprint
    database (nmap-os-db) */
 struct FingerPrintDB {
   FingerPrint *MatchPoints;
   std::vector<FingerPrint *> prints;
+  /* prints and MatchPoints lowered to numeric form for matching. Built by
+     compile_fingerprint_db() (see osscan.h). */
+  FingerPrintDBCompiled *compiled;
 
   FingerPrintDB();
   ~FingerPrintDB();
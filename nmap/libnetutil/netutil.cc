@@ -172,6 +172,7 @@
 #endif
 #ifdef HAVE_LINUX_RTNETLINK_H
 #include <linux/rtnetlink.h>
+#include <fcntl.h>
 #endif
 
 #ifndef NETINET_IN_SYSTM_H  /* This guarding is needed for at least some versions of OpenBSD */
@@ -536,75 +537,107 @@ int ip_is_reserved(struct in_addr *ip)
   return 0;
 }
 
-/* A trivial functon that maintains a cache of IP to MAC Address
-   entries.  If the command is MACCACHE_GET, this func looks for the
-   IPv4 address in ss and fills in the 'mac' parameter and returns
-   true if it is found.  Otherwise (not found), the function returns
-   false.  If the command is MACCACHE_SET, the function adds an entry
-   with the given ip (ss) and mac address.  An existing entry for the
-   IP ss will be overwritten with the new MAC address.  true is always
-   returned for the set command. */
-#define MACCACHE_GET 1
-#define MACCACHE_SET 2
-static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac) {
-  struct MacCache {
-    struct sockaddr_storage ip;
-    u8 mac[6];
-  };
-  static struct MacCache *Cache = NULL;
-  static int MacCapacity = 0;
-  static int MacCacheSz = 0;
-  int i;
-
-  if (command == MACCACHE_GET) {
-    for (i = 0; i < MacCacheSz; i++) {
-      if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-        memcpy(mac, Cache[i].mac, 6);
-        return 1;
-      }
-    }
+/* The cache of IP to MAC address entries behind mac_cache_get() and
+   mac_cache_set(). It is an open-addressed hash table with linear probing,
+   keyed by IPv4 or IPv6 address. Entries are never removed, so an empty slot
+   ends every probe sequence. */
+struct MacCacheEntry {
+  u8 family; /* 0 (AF_UNSPEC) for an empty slot */
+  u8 addr[16];
+  u8 mac[6];
+};
+
+static struct MacCacheEntry *MacCache = NULL;
+static unsigned int MacCapacity = 0; /* Always a power of two */
+static unsigned int MacCacheSz = 0;
+
+/* Fills in the family and the zero-padded address bytes that key ss in the
+   cache. Returns 0 if the address family is not supported. */
+static int mac_cache_key(const struct sockaddr_storage *ss, u8 *family, u8 *addr) {
+  memset(addr, 0, 16);
+  if (ss->ss_family == AF_INET) {
+    memcpy(addr, &((struct sockaddr_in *) ss)->sin_addr, 4);
+  } else if (ss->ss_family == AF_INET6) {
+    memcpy(addr, &((struct sockaddr_in6 *) ss)->sin6_addr, 16);
+  } else {
     return 0;
   }
-  assert(command == MACCACHE_SET);
-  if (MacCacheSz == MacCapacity) {
-    if (MacCapacity == 0)
-      MacCapacity = 32;
-    else
-      MacCapacity <<= 2;
-    Cache = (struct MacCache *) safe_realloc(Cache, MacCapacity * sizeof(struct MacCache));
-  }
+  *family = ss->ss_family;
+  return 1;
+}
 
-  /* Ensure that it isn't already there ... */
-  for (i = 0; i < MacCacheSz; i++) {
-    if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-      memcpy(Cache[i].mac, mac, 6);
-      return 1;
-    }
+/* Returns the slot holding the given key, or the empty slot where it would
+   go. The table must not be full. */
+static struct MacCacheEntry *mac_cache_slot(u8 family, const u8 *addr) {
+  u32 hash = 2166136261U ^ family;
+  unsigned int i;
+
+  /* FNV-1a */
+  for (i = 0; i < 16; i++)
+    hash = (hash ^ addr[i]) * 16777619U;
+
+  for (i = hash & (MacCapacity - 1); MacCache[i].family != 0; i = (i + 1) & (MacCapacity - 1)) {
+    if (MacCache[i].family == family && memcmp(MacCache[i].addr, addr, 16) == 0)
+      break;
   }
 
-  /* Add it to the end of the list */
-  memcpy(&Cache[i].ip, ss, sizeof(struct sockaddr_storage));
-  memcpy(Cache[i].mac, mac, 6);
-  MacCacheSz++;
-  return 1;
+  return &MacCache[i];
+}
+
+/* Doubles the table, keeping it at most half full. */
+static void mac_cache_grow(void) {
+  struct MacCacheEntry *old = MacCache;
+  unsigned int oldcapacity = MacCapacity;
+  unsigned int i;
+
+  MacCapacity = MacCapacity ? MacCapacity * 2 : 64;
+  MacCache = (struct MacCacheEntry *) safe_zalloc(MacCapacity * sizeof(struct MacCacheEntry));
+  for (i = 0; i < oldcapacity; i++) {
+    if (old[i].family != 0)
+      *mac_cache_slot(old[i].family, old[i].addr) = old[i];
+  }
+  free(old);
 }
 
 /* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it
+ * is found.  Otherwise (not found), the function returns false.
  * Function mac_cache_set() adds an entry with the given ip (ss) and
  * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true.
- * WARNING: The caller must ensure that the supplied "ss" is of family
- * AF_INET. Otherwise the function will return 0 and there would be
- * no way for the caller to tell tell the difference between an error
- * or a cache miss.*/
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * of some other address family, in which case nothing is stored. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_GET, ss, mac);
+  struct MacCacheEntry *entry;
+  u8 family, addr[16];
+
+  if (MacCacheSz == 0 || !mac_cache_key(ss, &family, addr))
+    return 0;
+
+  entry = mac_cache_slot(family, addr);
+  if (entry->family == 0)
+    return 0;
+  memcpy(mac, entry->mac, 6);
+  return 1;
 }
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_SET, ss, mac);
+  struct MacCacheEntry *entry;
+  u8 family, addr[16];
+
+  if (!mac_cache_key(ss, &family, addr))
+    return 0;
+
+  if ((MacCacheSz + 1) * 2 > MacCapacity)
+    mac_cache_grow();
+
+  entry = mac_cache_slot(family, addr);
+  if (entry->family == 0) {
+    entry->family = family;
+    memcpy(entry->addr, addr, 16);
+    MacCacheSz++;
+  }
+  memcpy(entry->mac, mac, 6);
+  return 1;
 }
 
 /* Standard BSD internet checksum routine. Uses libdnet helper functions. */
@@ -3132,57 +3165,355 @@ static void add_rtattr_addr(struct nlmsghdr *nlmsg,
   }
 }
 
-/* Does route_dst using the Linux-specific rtnetlink interface. See rtnetlink(3)
-   and rtnetlink(7). */
-static int route_dst_netlink(const struct sockaddr_storage *dst,
-                             struct route_nfo *rnfo, const char *device,
-                             const struct sockaddr_storage *spoofss) {
+/* Route lookups all go through one netlink socket, opened on first use. It is
+   also subscribed to link, address, route and rule changes, which invalidate
+   the route cache below. The socket belongs to the process that opened it; a
+   child of fork() opens its own (see netlink_open). */
+static int netlink_fd = -1;
+static pid_t netlink_pid = -1;
+static int netlink_subscribed = 0;
+static unsigned int netlink_seq = 0;
+
+/* Route cache for IPv4. It holds a copy of every route in the kernel's tables,
+   most specific first. The answer the kernel gives for one destination is
+   kept with the route it came from, and reused for any other destination that
+   has the same longest matching route. An answer is only kept when
+   RTM_F_FIB_MATCH confirms that the kernel used a route with that prefix.
+   The cache is refilled after any change notification, and is not used when
+   policy routing rules or "throw" routes could make the choice depend on more
+   than the longest match, or when there are too many routes to search. */
+#define ROUTE_CACHE_MAX_ROUTES 1024
+
+struct route_cache_entry {
+  struct sockaddr_storage prefix;
+  int prefix_bits;
+  int answered;
+  int found;
+  struct route_nfo rnfo;
+};
+
+static struct route_cache_entry *route_cache = NULL;
+static int route_cache_count = 0;
+static int route_cache_capacity = 0;
+/* -1 until the cache has been filled, then 0 or 1. */
+static int route_cache_usable = -1;
+/* The cached answers are only valid for this device and source address. */
+static char route_cache_device[64];
+static struct sockaddr_storage route_cache_spoofss;
+
+#ifndef RTM_F_FIB_MATCH
+#define RTM_F_FIB_MATCH 0x2000
+#endif
+#ifndef FRA_SUPPRESS_IFGROUP
+#define FRA_SUPPRESS_IFGROUP 13
+#endif
+#ifndef FRA_SUPPRESS_PREFIXLEN
+#define FRA_SUPPRESS_PREFIXLEN 14
+#endif
+
+static void route_cache_flush(void) {
+  route_cache_count = 0;
+  route_cache_usable = -1;
+}
+
+/* Makes sure netlink_fd is open for this process. A socket inherited across
+   fork() is shared with the parent, which would then read replies and change
+   notifications meant for the child and the other way around, so the child
+   drops it, along with the sequence numbers and the cache it was keeping. */
+static void netlink_open(void) {
   struct sockaddr_nl snl;
-  struct msghdr msg;
-  struct iovec iov;
-  struct nlmsghdr *nlmsg;
-  struct rtmsg *rtmsg;
-  struct rtattr *rtattr;
-  int intf_index;
-  unsigned char buf[512];
-  unsigned int len;
-  int fd, rc;
+  int rc;
 
-  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-  if (fd == -1)
+  if (netlink_fd != -1) {
+    if (netlink_pid == getpid())
+      return;
+    close(netlink_fd);
+    netlink_fd = -1;
+    netlink_subscribed = 0;
+    netlink_seq = 0;
+    route_cache_flush();
+  }
+  netlink_pid = getpid();
+
+  netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (netlink_fd == -1)
     netutil_fatal("%s: cannot create AF_NETLINK socket: %s", __func__, strerror(errno));
+  fcntl(netlink_fd, F_SETFD, FD_CLOEXEC);
 
   memset(&snl, 0, sizeof(snl));
   snl.nl_family = AF_NETLINK;
+  snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+    | RTMGRP_IPV4_RULE | RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
 
-  rc = bind(fd, (struct sockaddr *) &snl, sizeof(snl));
+  rc = bind(netlink_fd, (struct sockaddr *) &snl, sizeof(snl));
+  if (rc == 0) {
+    netlink_subscribed = 1;
+  } else {
+    /* Without change notifications the cache can't be trusted, but lookups
+       still work. */
+    snl.nl_groups = 0;
+    rc = bind(netlink_fd, (struct sockaddr *) &snl, sizeof(snl));
+  }
   if (rc == -1)
     netutil_fatal("%s: cannot bind AF_NETLINK socket: %s", __func__, strerror(errno));
+}
 
-  struct interface_info *ii;
-  ii = NULL;
-  intf_index = 0;
-  if (device != NULL && device[0] != '\0') {
-    ii = getInterfaceByName(device, dst->ss_family);
-    if (ii == NULL)
-      netutil_fatal("Could not find interface %s which was specified by -e", device);
-    intf_index = ii->ifindex;
+/* Receives one netlink datagram into buf. Change notifications are consumed
+   here and flush the route cache. If dontwait is true, returns -1 as soon as
+   there is nothing more to read; otherwise waits for a reply. */
+static int netlink_recv(unsigned char *buf, size_t buflen, int dontwait) {
+  struct sockaddr_nl snl;
+  struct msghdr msg;
+  struct iovec iov;
+  int len;
+
+  for (;;) {
+    iov.iov_base = buf;
+    iov.iov_len = buflen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &snl;
+    msg.msg_namelen = sizeof(snl);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    len = recvmsg(netlink_fd, &msg, dontwait ? MSG_DONTWAIT : 0);
+    if (len == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS) {
+        /* Notifications were lost. */
+        route_cache_flush();
+        continue;
+      }
+      if (dontwait && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return -1;
+      netutil_fatal("%s: cannot recvmsg: %s", __func__, strerror(errno));
+    }
+    if (snl.nl_groups != 0) {
+      route_cache_flush();
+      continue;
+    }
+    if (dontwait)
+      continue;
+    return len;
   }
+}
 
-  memset(buf, 0, sizeof(buf));
+/* Sends the requests laid out one after another in buf with a single sendmsg,
+   so that the kernel handles them as a batch. */
+static void netlink_send(unsigned char *buf, size_t len) {
+  struct sockaddr_nl snl;
+  struct msghdr msg;
+  struct iovec iov;
+  int rc;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &snl;
+  msg.msg_namelen = sizeof(snl);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  rc = sendmsg(netlink_fd, &msg, 0);
+  if (rc == -1)
+    netutil_fatal("%s: cannot sendmsg: %s", __func__, strerror(errno));
+}
+
+static void route_cache_add(struct rtmsg *rtmsg, unsigned int len) {
+  struct route_cache_entry *entry;
+  struct rtattr *rtattr;
+  int i;
+
+  if (route_cache_count == route_cache_capacity) {
+    route_cache_capacity = route_cache_capacity ? route_cache_capacity * 2 : 32;
+    route_cache = (struct route_cache_entry *) safe_realloc(route_cache,
+      route_cache_capacity * sizeof(*route_cache));
+  }
+
+  /* Insertion sort, most specific first. */
+  for (i = route_cache_count; i > 0 && route_cache[i - 1].prefix_bits < rtmsg->rtm_dst_len; i--)
+    route_cache[i] = route_cache[i - 1];
+  route_cache_count++;
+
+  entry = &route_cache[i];
+  memset(entry, 0, sizeof(*entry));
+  entry->prefix.ss_family = AF_INET;
+  entry->prefix_bits = rtmsg->rtm_dst_len;
+  for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == RTA_DST)
+      set_sockaddr(&entry->prefix, AF_INET, RTA_DATA(rtattr));
+  }
+}
+
+/* Sends a dump request of the given type and address family, and calls back
+   for every message of the reply. Returns 0 if the callback rejected one of
+   them, or the dump failed. */
+static int netlink_dump(int type, int family, int (*callback)(struct nlmsghdr *)) {
+  static unsigned char buf[32768];
+  struct nlmsghdr *nlmsg;
+  struct rtmsg *rtmsg;
+  unsigned int seq;
+  int len, ok = 1;
+
+  memset(buf, 0, NLMSG_SPACE(sizeof(*rtmsg)));
+  nlmsg = (struct nlmsghdr *) buf;
+  nlmsg->nlmsg_len = NLMSG_LENGTH(sizeof(*rtmsg));
+  nlmsg->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  nlmsg->nlmsg_type = type;
+  nlmsg->nlmsg_seq = seq = ++netlink_seq;
+  /* struct ndmsg and struct fib_rule_hdr also start with the family, and are
+     no bigger. */
+  rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+  rtmsg->rtm_family = family;
+
+  netlink_send(buf, nlmsg->nlmsg_len);
+
+  for (;;) {
+    len = netlink_recv(buf, sizeof(buf), 0);
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) len);
+         nlmsg = NLMSG_NEXT(nlmsg, len)) {
+      if (nlmsg->nlmsg_seq != seq)
+        continue;
+      if (nlmsg->nlmsg_type == NLMSG_DONE)
+        return ok;
+      if (nlmsg->nlmsg_type == NLMSG_ERROR)
+        return 0;
+      if (ok && !callback(nlmsg))
+        ok = 0;
+    }
+  }
+}
+
+/* Rejects any rule that selects on the destination or skips routes by
+   prefix length or interface group. struct fib_rule_hdr has the same layout
+   as struct rtmsg. */
+static int route_cache_check_rule(struct nlmsghdr *nlmsg) {
+  struct rtmsg *rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+  struct rtattr *rtattr;
+  unsigned int len = RTM_PAYLOAD(nlmsg);
+
+  if (nlmsg->nlmsg_type != RTM_NEWRULE)
+    return 1;
+  if (rtmsg->rtm_dst_len != 0)
+    return 0;
+  for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    /* The kernel reports these as -1 when they are not in effect. */
+    if ((rtattr->rta_type == FRA_SUPPRESS_PREFIXLEN || rtattr->rta_type == FRA_SUPPRESS_IFGROUP)
+        && *(int32_t *) RTA_DATA(rtattr) != -1)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int route_cache_collect_route(struct nlmsghdr *nlmsg) {
+  struct rtmsg *rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+
+  if (nlmsg->nlmsg_type != RTM_NEWROUTE)
+    return 1;
+  if (rtmsg->rtm_type == RTN_THROW || route_cache_count == ROUTE_CACHE_MAX_ROUTES)
+    return 0;
+  route_cache_add(rtmsg, RTM_PAYLOAD(nlmsg));
+
+  return 1;
+}
+
+/* Loads the routing tables into the cache. Returns 1 if the cache can be used. */
+static int route_cache_fill(void) {
+  route_cache_count = 0;
+  if (!netlink_dump(RTM_GETRULE, AF_INET, route_cache_check_rule))
+    return 0;
+  if (!netlink_dump(RTM_GETROUTE, AF_INET, route_cache_collect_route))
+    return 0;
+
+  return 1;
+}
+
+/* Returns the most specific cached route covering dst, or NULL. */
+static struct route_cache_entry *route_cache_lookup(const struct sockaddr_storage *dst) {
+  u32 addr = ntohl(((struct sockaddr_in *) dst)->sin_addr.s_addr);
+  int i;
+
+  /* The kernel routes these without regard to the FIB entry they match. */
+  if ((addr >> 24) == 0 || (addr >> 28) >= 0xe)
+    return NULL;
+
+  for (i = 0; i < route_cache_count; i++) {
+    if (sockaddr_equal_netmask(dst, &route_cache[i].prefix, route_cache[i].prefix_bits))
+      return &route_cache[i];
+  }
+
+  return NULL;
+}
+
+static int neighbors_loaded;
+
+/* Adds a resolved ARP or NDP entry to the MAC cache. IPv6 link-local
+   addresses are left out, as they are only unique per link. */
+static int mac_cache_collect_neighbor(struct nlmsghdr *nlmsg) {
+  struct ndmsg *ndmsg = (struct ndmsg *) NLMSG_DATA(nlmsg);
+  struct rtattr *rtattr;
+  struct sockaddr_storage ss;
+  unsigned int len = NLMSG_PAYLOAD(nlmsg, sizeof(*ndmsg));
+  const u8 *mac = NULL;
+
+  if (nlmsg->nlmsg_type != RTM_NEWNEIGH)
+    return 1;
+  if (!(ndmsg->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+    return 1;
+
+  memset(&ss, 0, sizeof(ss));
+  rtattr = (struct rtattr *) ((char *) ndmsg + NLMSG_ALIGN(sizeof(*ndmsg)));
+  for (; RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == NDA_DST)
+      set_sockaddr(&ss, ndmsg->ndm_family, RTA_DATA(rtattr));
+    else if (rtattr->rta_type == NDA_LLADDR && RTA_PAYLOAD(rtattr) == 6)
+      mac = (const u8 *) RTA_DATA(rtattr);
+  }
+  if (ss.ss_family == AF_UNSPEC || mac == NULL)
+    return 1;
+  if (ss.ss_family == AF_INET6
+      && IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *) &ss)->sin6_addr))
+    return 1;
+
+  if (mac_cache_set(&ss, (u8 *) mac))
+    neighbors_loaded++;
+
+  return 1;
+}
+
+/* Fills in an RTM_GETROUTE request for dst at buf, and returns its length. */
+static unsigned int build_route_request(unsigned char *buf, size_t buflen,
+                                        const struct sockaddr_storage *dst,
+                                        int intf_index,
+                                        const struct sockaddr_storage *spoofss,
+                                        unsigned int flags, unsigned int seq) {
+  struct nlmsghdr *nlmsg;
+  struct rtmsg *rtmsg;
+  struct rtattr *rtattr;
+  unsigned int len;
+
+  memset(buf, 0, buflen);
 
   nlmsg = (struct nlmsghdr *) buf;
 
   nlmsg->nlmsg_len = NLMSG_LENGTH(sizeof(*rtmsg));
-  assert(nlmsg->nlmsg_len <= sizeof(buf));
+  assert(nlmsg->nlmsg_len <= buflen);
   nlmsg->nlmsg_flags = NLM_F_REQUEST;
   nlmsg->nlmsg_type = RTM_GETROUTE;
+  nlmsg->nlmsg_seq = seq;
 
   rtmsg = (struct rtmsg *) (nlmsg + 1);
   rtmsg->rtm_family = dst->ss_family;
+  rtmsg->rtm_flags = flags;
 
   rtattr = RTM_RTA(rtmsg);
-  len = sizeof(buf) - ((unsigned char *) RTM_RTA(rtmsg) - buf);
+  len = buflen - ((unsigned char *) RTM_RTA(rtmsg) - buf);
 
   /* Add rtattrs for destination address and interface. */
   add_rtattr_addr(nlmsg, &rtattr, &len, RTA_DST, dst, intf_index);
@@ -3191,75 +3522,181 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
     add_rtattr_addr(nlmsg, &rtattr, &len, RTA_SRC, spoofss, intf_index);
   }
 
-  iov.iov_base = nlmsg;
-  iov.iov_len = nlmsg->nlmsg_len;
-
-  memset(&msg, 0, sizeof(msg));
-  msg.msg_name = &snl;
-  msg.msg_namelen = sizeof(snl);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-
-  rc = sendmsg(fd, &msg, 0);
-  if (rc == -1)
-    netutil_fatal("%s: cannot sendmsg: %s", __func__, strerror(errno));
-
-  iov.iov_base = buf;
-  iov.iov_len = sizeof(buf);
+  return NLMSG_ALIGN(nlmsg->nlmsg_len);
+}
 
-  len = recvmsg(fd, &msg, 0);
-  if (len <= 0)
-    netutil_fatal("%s: cannot recvmsg: %s", __func__, strerror(errno));
+/* Does route_dst using the Linux-specific rtnetlink interface. See rtnetlink(3)
+   and rtnetlink(7). */
+static int route_dst_netlink(const struct sockaddr_storage *dst,
+                             struct route_nfo *rnfo, const char *device,
+                             const struct sockaddr_storage *spoofss) {
+  struct route_cache_entry *entry;
+  struct nlmsghdr *nlmsg;
+  struct rtmsg *rtmsg;
+  struct rtattr *rtattr;
+  struct sockaddr_storage prefix;
+  int intf_index;
+  unsigned char buf[1024];
+  unsigned char reply[8192];
+  unsigned int len, reqlen, seq;
+  int rc, n, found, pending, cacheable, prefix_bits, fib_type, route_type;
+
+  netlink_open();
+
+  /* Catch up on change notifications before trusting the cache. */
+  netlink_recv(reply, sizeof(reply), 1);
+
+  entry = NULL;
+  if (dst->ss_family == AF_INET && netlink_subscribed) {
+    const char *dev = (device != NULL) ? device : "";
+
+    if (strcmp(dev, route_cache_device) != 0
+        || (spoofss == NULL) != (route_cache_spoofss.ss_family == AF_UNSPEC)
+        || (spoofss != NULL && !sockaddr_equal(spoofss, &route_cache_spoofss))) {
+      route_cache_usable = -1;
+      Strncpy(route_cache_device, dev, sizeof(route_cache_device));
+      if (spoofss != NULL)
+        route_cache_spoofss = *spoofss;
+      else
+        route_cache_spoofss.ss_family = AF_UNSPEC;
+    }
+    if (route_cache_usable == -1)
+      route_cache_usable = route_cache_fill();
+    if (route_cache_usable)
+      entry = route_cache_lookup(dst);
+  }
 
-  close(fd);
+  if (entry != NULL && entry->answered) {
+    if (entry->found)
+      *rnfo = entry->rnfo;
+    return entry->found;
+  }
 
-  if (nlmsg->nlmsg_len < sizeof(*nlmsg) || (unsigned int) len < NLMSG_LENGTH(sizeof(*nlmsg)))
-    netutil_fatal("%s: wrong size reply in recvmsg", __func__);
-  len -= NLMSG_LENGTH(sizeof(*nlmsg));
+  struct interface_info *ii;
+  ii = NULL;
+  intf_index = 0;
+  if (device != NULL && device[0] != '\0') {
+    ii = getInterfaceByName(device, dst->ss_family);
+    if (ii == NULL)
+      netutil_fatal("Could not find interface %s which was specified by -e", device);
+    intf_index = ii->ifindex;
+  }
 
-  /* See rtnetlink(7). Anything matching this route is actually unroutable. */
-  if (rtmsg->rtm_type == RTN_UNREACHABLE)
-    return 0;
+  /* The route itself, and if it can be cached, the FIB entry it came from.
+     Both go to the kernel in one batch. */
+  seq = ++netlink_seq;
+  reqlen = build_route_request(buf, sizeof(buf) / 2, dst, intf_index, spoofss, 0, seq);
+  if (entry != NULL) {
+    ++netlink_seq;
+    reqlen += build_route_request(buf + reqlen, sizeof(buf) - reqlen, dst,
+                                  intf_index, spoofss, RTM_F_FIB_MATCH, seq + 1);
+  }
+  netlink_send(buf, reqlen);
 
   /* Default values to be possibly overridden. */
+  found = 0;
+  cacheable = 0;
+  fib_type = route_type = -1;
   rnfo->direct_connect = 1;
   rnfo->nexthop.ss_family = AF_UNSPEC;
   rnfo->srcaddr.ss_family = AF_UNSPEC;
   if (spoofss != NULL)
     rnfo->srcaddr = *spoofss;
 
-  for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
-    if (rtattr->rta_type == RTA_GATEWAY) {
-      rc = set_sockaddr(&rnfo->nexthop, dst->ss_family, RTA_DATA(rtattr));
-      assert(rc != -1);
-      /* Don't consider it directly connected if nexthop != dst. */
-      if (!sockaddr_storage_equal(dst, &rnfo->nexthop))
-        rnfo->direct_connect = 0;
-    } else if (rtattr->rta_type == RTA_OIF && ii == NULL) {
-      char namebuf[IFNAMSIZ];
-      char *p;
-      int intf_index;
-
-      intf_index = *(int *) RTA_DATA(rtattr);
-      p = if_indextoname(intf_index, namebuf);
-      assert(p != NULL);
-      ii = getInterfaceByName(namebuf, dst->ss_family);
-      if (ii == NULL)
-        ii = getInterfaceByName(namebuf, AF_UNSPEC);
-      if (ii == NULL)
-        netutil_fatal("%s: can't find interface \"%s\"", __func__, namebuf);
-    } else if (rtattr->rta_type == RTA_PREFSRC && rnfo->srcaddr.ss_family == AF_UNSPEC) {
-      rc = set_sockaddr(&rnfo->srcaddr, dst->ss_family, RTA_DATA(rtattr));
-      assert(rc != -1);
+  for (pending = (entry != NULL) ? 2 : 1; pending > 0; ) {
+    n = netlink_recv(reply, sizeof(reply), 0);
+
+    for (nlmsg = (struct nlmsghdr *) reply; NLMSG_OK(nlmsg, (unsigned int) n);
+         nlmsg = NLMSG_NEXT(nlmsg, n)) {
+      if (nlmsg->nlmsg_seq != seq && nlmsg->nlmsg_seq != seq + 1)
+        continue;
+      pending--;
+      if (nlmsg->nlmsg_type != RTM_NEWROUTE)
+        continue;
+
+      rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+      len = RTM_PAYLOAD(nlmsg);
+
+      if (nlmsg->nlmsg_seq == seq + 1) {
+        /* The FIB entry that was used. The answer can be shared if it has the
+           prefix we looked up, and unless it is a multipath route, which may
+           pick a different path for every destination. The table is not
+           compared: the kernel may merge the local and main tables and report
+           either. */
+        memset(&prefix, 0, sizeof(prefix));
+        prefix.ss_family = dst->ss_family;
+        prefix_bits = rtmsg->rtm_dst_len;
+        fib_type = rtmsg->rtm_type;
+        cacheable = 1;
+        for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+          if (rtattr->rta_type == RTA_DST) {
+            rc = set_sockaddr(&prefix, dst->ss_family, RTA_DATA(rtattr));
+            assert(rc != -1);
+          } else if (rtattr->rta_type == RTA_MULTIPATH) {
+            cacheable = 0;
+          }
+        }
+        if (prefix_bits != entry->prefix_bits || !sockaddr_equal(&prefix, &entry->prefix))
+          cacheable = 0;
+        continue;
+      }
+
+      route_type = rtmsg->rtm_type;
+
+      /* See rtnetlink(7). Anything matching this route is actually unroutable. */
+      if (rtmsg->rtm_type == RTN_UNREACHABLE)
+        continue;
+
+      for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+        if (rtattr->rta_type == RTA_GATEWAY) {
+          rc = set_sockaddr(&rnfo->nexthop, dst->ss_family, RTA_DATA(rtattr));
+          assert(rc != -1);
+          /* Don't consider it directly connected if nexthop != dst. */
+          if (!sockaddr_storage_equal(dst, &rnfo->nexthop))
+            rnfo->direct_connect = 0;
+        } else if (rtattr->rta_type == RTA_OIF && ii == NULL) {
+          char namebuf[IFNAMSIZ];
+          char *p;
+          int intf_index;
+
+          intf_index = *(int *) RTA_DATA(rtattr);
+          p = if_indextoname(intf_index, namebuf);
+          assert(p != NULL);
+          ii = getInterfaceByName(namebuf, dst->ss_family);
+          if (ii == NULL)
+            ii = getInterfaceByName(namebuf, AF_UNSPEC);
+          if (ii == NULL)
+            netutil_fatal("%s: can't find interface \"%s\"", __func__, namebuf);
+        } else if (rtattr->rta_type == RTA_PREFSRC && rnfo->srcaddr.ss_family == AF_UNSPEC) {
+          rc = set_sockaddr(&rnfo->srcaddr, dst->ss_family, RTA_DATA(rtattr));
+          assert(rc != -1);
+        }
+      }
+
+      if (ii != NULL) {
+        rnfo->ii = *ii;
+        found = 1;
+      }
     }
   }
 
-  if (ii != NULL) {
-    rnfo->ii = *ii;
-    return 1;
-  } else {
-    return 0;
+  /* A gateway equal to the destination only holds for that destination, and
+     so does a route the kernel made into something other than the FIB entry
+     (a broadcast address inside a unicast route, for example). */
+  if (cacheable && rnfo->direct_connect && rnfo->nexthop.ss_family != AF_UNSPEC)
+    cacheable = 0;
+  if (route_type != fib_type)
+    cacheable = 0;
+
+  /* The notifications read while waiting may have emptied the cache. */
+  if (cacheable && route_cache_usable == 1) {
+    entry->answered = 1;
+    entry->found = found;
+    if (found)
+      entry->rnfo = *rnfo;
   }
+
+  return found;
 }
 
 #else
@@ -3500,6 +3937,49 @@ int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
 #endif
 }
 
+#ifndef HAVE_LINUX_RTNETLINK_H
+static int collect_arp_entry(const struct arp_entry *entry, void *arg) {
+  struct sockaddr_storage ss;
+  int *count = (int *) arg;
+
+  if (entry->arp_ha.addr_type != ADDR_TYPE_ETH
+      || addr_ntos(&entry->arp_pa, (struct sockaddr *) &ss) == -1)
+    return 0;
+  if (mac_cache_set(&ss, (u8 *) entry->arp_ha.addr_eth.data))
+    (*count)++;
+
+  return 0;
+}
+#endif
+
+/* Copies the system's resolved neighbors into the MAC cache in one pass, so
+ * that hosts the operating system already knows need no lookup of their own.
+ * On Linux this reads both the ARP and NDP tables over rtnetlink; elsewhere
+ * it reads the ARP table through libdnet. Returns the number of entries
+ * added, or -1 if the table could not be read. */
+int mac_cache_load_neighbors(void) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+  netlink_open();
+
+  neighbors_loaded = 0;
+  if (!netlink_dump(RTM_GETNEIGH, AF_UNSPEC, mac_cache_collect_neighbor))
+    return -1;
+
+  return neighbors_loaded;
+#else
+  arp_t *a;
+  int count = 0;
+
+  a = arp_open();
+  if (a == NULL)
+    return -1;
+  arp_loop(a, collect_arp_entry, &count);
+  arp_close(a);
+
+  return count;
+#endif
+}
+
 /* Wrapper for system function sendto(), which retries a few times when
  * the call fails. It also prints informational messages about the
  * errors encountered. It returns the number of bytes sent or -1 in
@@ -3573,31 +4053,42 @@ int send_ip_packet_eth(const struct eth_nfo *eth, const u8 *packet, unsigned int
 }
 
 
-/* Send an IP packet over a raw socket. */
-int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
-  const u8 *packet, unsigned int packetlen) {
-  struct sockaddr_in sock;
-  struct ip *ip = (struct ip *) packet;
-  struct tcp_hdr *tcp;
-  struct udp_hdr *udp;
-  int res;
+/* Fills in sock with the destination to pass to sendto() for a raw IPv4
+   packet. */
+static void ip_packet_sockaddr(const struct sockaddr_in *dst,
+  const u8 *packet, unsigned int packetlen, struct sockaddr_in *sock) {
+  const struct ip *ip = (const struct ip *) packet;
+  const struct tcp_hdr *tcp;
+  const struct udp_hdr *udp;
 
-  assert(sd >= 0);
-  sock = *dst;
+  *sock = *dst;
 
   /* It is bogus that I need the address and port info when sending a RAW IP 
      packet, but it doesn't seem to work w/o them */
   if (packetlen >= 20) {
     if (ip->ip_p == IPPROTO_TCP
         && packetlen >= (unsigned int) ip->ip_hl * 4 + 20) {
-      tcp = (struct tcp_hdr *) ((u8 *) ip + ip->ip_hl * 4);
-      sock.sin_port = tcp->th_dport;
+      tcp = (const struct tcp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+      sock->sin_port = tcp->th_dport;
     } else if (ip->ip_p == IPPROTO_UDP
                && packetlen >= (unsigned int) ip->ip_hl * 4 + 8) {
-      udp = (struct udp_hdr *) ((u8 *) ip + ip->ip_hl * 4);
-      sock.sin_port = udp->uh_dport;
+      udp = (const struct udp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+      sock->sin_port = udp->uh_dport;
     }
   }
+}
+
+/* Send an IP packet over a raw socket. */
+int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
+  const u8 *packet, unsigned int packetlen) {
+  struct sockaddr_in sock;
+#if FREEBSD || BSDI || NETBSD || DEC || MACOSX
+  struct ip *ip = (struct ip *) packet;
+#endif
+  int res;
+
+  assert(sd >= 0);
+  ip_packet_sockaddr(dst, packet, packetlen, &sock);
 
   /* Equally bogus is that the IP total len and IP fragment offset
      fields need to be in host byte order on certain BSD variants.  I
@@ -3624,6 +4115,87 @@ int send_ip_packet_sd(int sd, const struct sockaddr_in *dst,
 
 
 
+/* Send several IP packets over a raw socket. Where sendmmsg() is available
+ * they are handed to the kernel in as few calls as it will accept;
+ * otherwise this is a loop over send_ip_packet_sd(). Packets the batched
+ * call refuses are retried individually with send_ip_packet_sd() so that
+ * errors are reported the usual way. Returns the number of packets sent. */
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  u8 *const *packets, const unsigned int *packetlens, int count) {
+  int sent = 0;
+  int i;
+#if HAVE_SENDMMSG
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_in *socks;
+  int *failed;
+  int numfailed = 0;
+  int n;
+
+  assert(sd >= 0);
+  if (count <= 0)
+    return 0;
+
+  msgs = (struct mmsghdr *) safe_zalloc(count * sizeof(*msgs));
+  iovs = (struct iovec *) safe_malloc(count * sizeof(*iovs));
+  socks = (struct sockaddr_in *) safe_malloc(count * sizeof(*socks));
+  failed = (int *) safe_malloc(count * sizeof(*failed));
+
+  for (i = 0; i < count; i++) {
+    ip_packet_sockaddr(&dsts[i], packets[i], packetlens[i], &socks[i]);
+#if FREEBSD || BSDI || NETBSD || DEC || MACOSX
+    ((struct ip *) packets[i])->ip_len = ntohs(((struct ip *) packets[i])->ip_len);
+    ((struct ip *) packets[i])->ip_off = ntohs(((struct ip *) packets[i])->ip_off);
+#endif
+    iovs[i].iov_base = packets[i];
+    iovs[i].iov_len = packetlens[i];
+    msgs[i].msg_hdr.msg_name = &socks[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(socks[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  i = 0;
+  while (i < count) {
+    n = sendmmsg(sd, &msgs[i], count - i, 0);
+    if (n > 0) {
+      i += n;
+      sent += n;
+    } else {
+      /* The first remaining message failed; leave it for the slow path. */
+      failed[numfailed++] = i;
+      i++;
+    }
+  }
+
+#if FREEBSD || BSDI || NETBSD || DEC || MACOSX
+  for (i = 0; i < count; i++) {
+    ((struct ip *) packets[i])->ip_len = htons(((struct ip *) packets[i])->ip_len);
+    ((struct ip *) packets[i])->ip_off = htons(((struct ip *) packets[i])->ip_off);
+  }
+#endif
+
+  for (i = 0; i < numfailed; i++) {
+    if (send_ip_packet_sd(sd, &dsts[failed[i]], packets[failed[i]], packetlens[failed[i]]) != -1)
+      sent++;
+  }
+
+  free(msgs);
+  free(iovs);
+  free(socks);
+  free(failed);
+#else
+  for (i = 0; i < count; i++) {
+    if (send_ip_packet_sd(sd, &dsts[i], packets[i], packetlens[i]) != -1)
+      sent++;
+  }
+#endif
+
+  return sent;
+}
+
+
+
 /* Sends the supplied pre-built IPv4 packet. The packet is sent through
  * the raw socket "sd" if "eth" is NULL. Otherwise, it gets sent at raw
  * ethernet level. */
@@ -4057,6 +4629,45 @@ pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_m
   return pt;
 }
 
+/* Like my_pcap_open_live(), but asks libpcap for a capture ring of
+ * ring_bytes bytes instead of the default buffer. On Linux the bundled
+ * libpcap maps that buffer as a TPACKET_V3 ring, so a busy scan can drain
+ * many frames per wakeup and the kernel has more room before it drops.
+ * Falls back to my_pcap_open_live() when the handle can't be created this
+ * way (old libpcap, Windows, or activation failure). */
+pcap_t *my_pcap_open_ring(const char *device, int snaplen, int promisc, int to_ms, int ring_bytes){
+#if !defined(WIN32) && defined(PCAP_ERROR_ACTIVATED)
+  char err0r[PCAP_ERRBUF_SIZE];
+  pcap_t *pt;
+  int rc;
+
+  assert(device != NULL);
+
+  pt = pcap_create(device, err0r);
+  if (pt == NULL) {
+    netutil_error("pcap_create(%s) FAILED. Reported error: %s.  Falling back to pcap_open_live.", device, err0r);
+    return my_pcap_open_live(device, snaplen, promisc, to_ms);
+  }
+  if (pcap_set_snaplen(pt, snaplen) != 0
+      || pcap_set_promisc(pt, promisc) != 0
+      || pcap_set_timeout(pt, to_ms) != 0
+      || pcap_set_buffer_size(pt, ring_bytes) != 0) {
+    pcap_close(pt);
+    return my_pcap_open_live(device, snaplen, promisc, to_ms);
+  }
+  rc = pcap_activate(pt);
+  if (rc < 0) {
+    netutil_error("pcap_activate(%s) FAILED. Reported error: %s.  Falling back to pcap_open_live.", device, pcap_geterr(pt));
+    pcap_close(pt);
+    return my_pcap_open_live(device, snaplen, promisc, to_ms);
+  }
+
+  return pt;
+#else
+  return my_pcap_open_live(device, snaplen, promisc, to_ms);
+#endif
+}
+
 
 /* Set a pcap filter */
 void set_pcap_filter(const char *device, pcap_t *pd, const char *bpf, ...) {
@@ -225,15 +225,20 @@ int ip_is_reserved(struct in_addr *ip);
 
 
 /* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it
+ * is found.  Otherwise (not found), the function returns false.
  * Function mac_cache_set() adds an entry with the given ip (ss) and
  * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true. */
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * neither IPv4 nor IPv6. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac);
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac);
 
+/* Adds every resolved entry of the system's ARP (and on Linux, NDP) table
+ * to the MAC cache. Returns the number of entries added, or -1 on error. */
+int mac_cache_load_neighbors(void);
+
 const void *ip_get_data(const void *packet, unsigned int *len,
   struct abstract_ip_hdr *hdr);
 const void *ip_get_data_any(const void *packet, unsigned int *len,
@@ -474,13 +479,20 @@ const char *ippackethdrinfo(const u8 *packet, u32 len, int detail);
  * specified), along with a suitable network device (parameter "device").
  * Even if spoofss is NULL, if user specified a network device with -e,
  * it should still be passed. Note that it's OK to pass either NULL or
- * an empty string as the "device", as long as spoofss==NULL. */
+ * an empty string as the "device", as long as spoofss==NULL.
+ * On Linux, answers for IPv4 destinations are cached per route until the
+ * kernel reports a change to interfaces, addresses, routes or rules. */
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss);
 
 /* Send an IP packet over a raw socket. */
 int send_ip_packet_sd(int sd, const struct sockaddr_in *dst, const u8 *packet, unsigned int packetlen);
 
+/* Send several IP packets over a raw socket, with a single sendmmsg() call
+   where possible. Returns the number of packets sent. */
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  u8 *const *packets, const unsigned int *packetlens, int count);
+
 /* Send an IP packet over an ethernet handle. */
 int send_ip_packet_eth(const struct eth_nfo *eth, const u8 *packet, unsigned int packetlen);
 
@@ -515,6 +527,11 @@ int Sendto(const char *functionname, int sd, const unsigned char *packet,
  * valid pcap_t will always be returned. */
 pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_ms);
 
+/* Like my_pcap_open_live(), but requests a ring_bytes capture buffer (a
+ * TPACKET_V3 memory-mapped ring on Linux). Falls back to
+ * my_pcap_open_live() where that isn't available. */
+pcap_t *my_pcap_open_ring(const char *device, int snaplen, int promisc, int to_ms, int ring_bytes);
+
 /* Set a pcap filter */
 void set_pcap_filter(const char *device, pcap_t *pd, const char *bpf, ...);
 
@@ -552,20 +552,27 @@ char *executable_path(const char *argv0);
 /* addrset management functions and definitions */
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset_elem;
+struct addrset_trie_node;
 
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset {
     /* Linked list of struct addset_elem. */
     struct addrset_elem *head;
+    /* Plain CIDR blocks are kept in a trie per address family instead of the
+       list, so that huge exclude lists can be searched quickly. */
+    struct addrset_trie_node *trie4;
+    struct addrset_trie_node *trie6;
 };
 
 void nbase_set_log(void (*log_user_func)(const char *, ...),void (*log_debug_func)(const char *, ...));
 extern void addrset_init(struct addrset *set);
 extern void addrset_free(struct addrset *set);
 extern void addrset_elem_print(FILE *fp, const struct addrset_elem *elem);
+extern void addrset_print(FILE *fp, const struct addrset *set);
 extern int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns);
 extern int addrset_add_file(struct addrset *set, FILE *fd, int af, int dns);
 extern int addrset_contains(const struct addrset *set, const struct sockaddr *sa);
+extern int addrset_filter_ipv4(const struct addrset *set, u32 *addrs, int n);
 
 #ifndef STDIN_FILENO
 #define STDIN_FILENO 0
@@ -152,6 +152,17 @@ void nbase_set_log(void (*log_user_func)(const char *, ...),void (*log_debug_fun
 void addrset_init(struct addrset *set)
 {
     set->head = NULL;
+    set->trie4 = NULL;
+    set->trie6 = NULL;
+}
+
+static void trie_free(struct addrset_trie_node *node)
+{
+    if (node == NULL)
+        return;
+    trie_free(node->child[0]);
+    trie_free(node->child[1]);
+    free(node);
 }
 
 void addrset_free(struct addrset *set)
@@ -162,6 +173,8 @@ void addrset_free(struct addrset *set)
         next = elem->next;
         free(elem);
     }
+    trie_free(set->trie4);
+    trie_free(set->trie6);
 }
 
 /* A debugging function to print out the contents of an addrset_elem. For IPv4
@@ -198,6 +211,45 @@ void addrset_elem_print(FILE *fp, const struct addrset_elem *elem)
     }
 }
 
+/* Print the prefixes stored in a trie, one per line. */
+static void trie_print(FILE *fp, const struct addrset_trie_node *node, int af)
+{
+    int i;
+
+    if (node == NULL)
+        return;
+    if (node->terminal) {
+        if (af == AF_INET) {
+            fprintf(fp, "%u.%u.%u.%u", node->addr[0], node->addr[1],
+                node->addr[2], node->addr[3]);
+        } else {
+            for (i = 0; i < 16; i += 2) {
+                if (i > 0)
+                    fprintf(fp, ":");
+                fprintf(fp, "%02X", node->addr[i]);
+                fprintf(fp, "%02X", node->addr[i + 1]);
+            }
+        }
+        fprintf(fp, "/%u\n", node->bits);
+    }
+    trie_print(fp, node->child[0], af);
+    trie_print(fp, node->child[1], af);
+}
+
+/* A debugging function to print out the whole contents of an addrset: the
+   CIDR blocks in the tries, then the elements of the list. */
+void addrset_print(FILE *fp, const struct addrset *set)
+{
+    const struct addrset_elem *elem;
+
+    trie_print(fp, set->trie4, AF_INET);
+#ifdef HAVE_IPV6
+    trie_print(fp, set->trie6, AF_INET6);
+#endif
+    for (elem = set->head; elem != NULL; elem = elem->next)
+        addrset_elem_print(fp, elem);
+}
+
 /* This is a wrapper around getaddrinfo that automatically handles hints for
    IPv4/IPv6, TCP/UDP, and whether name resolution is allowed. */
 static int resolve_name(const char *name, struct addrinfo **result, int af, int use_dns)
@@ -257,6 +309,7 @@ static void apply_ipv4_netmask_bits(struct addrset_elem *elem, int bits);
 #ifdef HAVE_IPV6
 static void make_ipv6_netmask(struct in6_addr *mask, int bits);
 #endif
+static void addrset_add_elem(struct addrset *set, struct addrset_elem *elem);
 
 /* Add a host specification into the address set. Returns 1 on success, 0 on
    error. */
@@ -307,8 +360,7 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
         apply_ipv4_netmask_bits(elem, netmask_bits);
         log_debug("Add IPv4 range %s/%ld to addrset.\n", local_spec, netmask_bits > 0 ? netmask_bits : 32);
         elem->type = ADDRSET_TYPE_IPV4_BITVECTOR;
-        elem->next = set->head;
-        set->head = elem;
+        addrset_add_elem(set, elem);
         free(local_spec);
         return 1;
     } else {
@@ -383,8 +435,7 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
             continue;
         }
 
-        elem->next = set->head;
-        set->head = elem;
+        addrset_add_elem(set, elem);
     }
 
     if (addrs != NULL)
@@ -587,6 +638,180 @@ static void make_ipv6_netmask(struct in6_addr *mask, int bits)
 }
 #endif
 
+/* Return the number of leading bits, up to max, that a and b have in
+   common. */
+static int common_prefix_bits(const uint8_t *a, const uint8_t *b, int max)
+{
+    int n;
+    uint8_t diff;
+
+    for (n = 0; n < max; n += 8) {
+        diff = a[n / 8] ^ b[n / 8];
+        if (diff != 0) {
+            while ((diff & 0x80) == 0) {
+                diff <<= 1;
+                n++;
+            }
+            break;
+        }
+    }
+
+    return n < max ? n : max;
+}
+
+#define TRIE_BIT(a, n) (((a)[(n) / 8] >> (7 - (n) % 8)) & 1)
+
+static struct addrset_trie_node *trie_node_new(const uint8_t addr[16], int bits,
+    int terminal)
+{
+    struct addrset_trie_node *node;
+    int i;
+
+    node = (struct addrset_trie_node *) safe_zalloc(sizeof(*node));
+    for (i = 0; i < bits / 8; i++)
+        node->addr[i] = addr[i];
+    if (bits % 8 != 0)
+        node->addr[i] = addr[i] & (0xFF << (8 - bits % 8));
+    node->bits = bits;
+    node->terminal = terminal;
+
+    return node;
+}
+
+/* Insert the prefix addr/bits into the trie rooted at *root. Prefixes that
+   are covered by one already in the trie don't change what the trie
+   matches, so they are not stored. */
+static void trie_insert(struct addrset_trie_node **root, const uint8_t addr[16],
+    int bits)
+{
+    struct addrset_trie_node **pp, *node, *glue;
+    int common;
+
+    pp = root;
+    for (;;) {
+        node = *pp;
+        if (node == NULL) {
+            *pp = trie_node_new(addr, bits, 1);
+            return;
+        }
+
+        common = common_prefix_bits(node->addr, addr,
+            node->bits < bits ? node->bits : bits);
+        if (common < node->bits) {
+            /* The new prefix branches off above this node, or covers it and
+               everything below it. */
+            if (common == bits) {
+                trie_free(node);
+                *pp = trie_node_new(addr, bits, 1);
+            } else {
+                glue = trie_node_new(addr, common, 0);
+                glue->child[TRIE_BIT(addr, common)] = trie_node_new(addr, bits, 1);
+                glue->child[TRIE_BIT(node->addr, common)] = node;
+                *pp = glue;
+            }
+            return;
+        }
+
+        if (node->terminal)
+            return;
+        if (node->bits == bits) {
+            node->terminal = 1;
+            trie_free(node->child[0]);
+            trie_free(node->child[1]);
+            node->child[0] = NULL;
+            node->child[1] = NULL;
+            return;
+        }
+        pp = &node->child[TRIE_BIT(addr, node->bits)];
+    }
+}
+
+/* Does any prefix in the trie contain addr? Each node visited consumes at
+   least one more bit of the address, so this takes at most as many steps as
+   the address has bits. */
+static int trie_match(const struct addrset_trie_node *node, const uint8_t *addr)
+{
+    while (node != NULL) {
+        if (common_prefix_bits(node->addr, addr, node->bits) < node->bits)
+            return 0;
+        if (node->terminal)
+            return 1;
+        node = node->child[TRIE_BIT(addr, node->bits)];
+    }
+
+    return 0;
+}
+
+/* If the bit vectors describe a single CIDR block, store its base address in
+   addr and its length in *bits and return 1. That is the case when the octets
+   are single values up to one that is an aligned power-of-two range, followed
+   only by octets that are wildcards. Otherwise return 0. */
+static int ipv4_bits_to_prefix(const octet_bitvector bits[4], uint8_t addr[4],
+    int *prefix_bits)
+{
+    int i, j, first, count, open;
+
+    *prefix_bits = 0;
+    open = 0;
+    for (i = 0; i < 4; i++) {
+        first = -1;
+        count = 0;
+        for (j = 0; j < 256; j++) {
+            if (!BIT_IS_SET(bits[i], j))
+                continue;
+            if (first < 0)
+                first = j;
+            else if (j != first + count)
+                return 0;
+            count++;
+        }
+        if (count == 0 || (count & (count - 1)) != 0 || first % count != 0)
+            return 0;
+        if (open && count != 256)
+            return 0;
+        addr[i] = first;
+        if (!open) {
+            for (j = 8; count > 1; count >>= 1)
+                j--;
+            *prefix_bits += j;
+            open = j < 8;
+        }
+    }
+
+    return 1;
+}
+
+/* Add an element to the set. CIDR blocks go into the trie for their address
+   family; anything else, like an IPv4 range with a gap in it, is linked into
+   the list. */
+static void addrset_add_elem(struct addrset *set, struct addrset_elem *elem)
+{
+    uint8_t addr[16];
+    int bits;
+
+    if (elem->type == ADDRSET_TYPE_IPV4_BITVECTOR) {
+        if (ipv4_bits_to_prefix(elem->u.ipv4.bits, addr, &bits)) {
+            trie_insert(&set->trie4, addr, bits);
+            free(elem);
+            return;
+        }
+#ifdef HAVE_IPV6
+    } else if (elem->type == ADDRSET_TYPE_IPV6_NETMASK) {
+        /* make_ipv6_netmask only makes contiguous masks. */
+        for (bits = 0; bits < 128; bits++) {
+            if (!TRIE_BIT(elem->u.ipv6.mask.s6_addr, bits))
+                break;
+        }
+        trie_insert(&set->trie6, elem->u.ipv6.addr.s6_addr, bits);
+        free(elem);
+        return;
+#endif
+    }
+
+    elem->next = set->head;
+    set->head = elem;
+}
+
 static int match_ipv4_bits(const octet_bitvector bits[4], const struct sockaddr *sa)
 {
     uint8_t octets[4];
@@ -641,6 +866,20 @@ int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
 {
     struct addrset_elem *elem;
 
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+        if (trie_match(set->trie4, (const uint8_t *) &sin->sin_addr.s_addr))
+            return 1;
+#ifdef HAVE_IPV6
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+        if (trie_match(set->trie6, sin6->sin6_addr.s6_addr))
+            return 1;
+#endif
+    }
+
     for (elem = set->head; elem != NULL; elem = elem->next) {
         if (addrset_elem_match(elem, sa))
             return 1;
@@ -648,3 +887,98 @@ int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
 
     return 0;
 }
+
+/* State for removing the addresses in a trie from a sorted array. addrs[0] to
+   addrs[k - 1] are the addresses kept so far, and addrs[j] is the next one to
+   look at. */
+struct filter_state {
+    const struct addrset *set;
+    u32 *addrs;
+    int n, j, k;
+    struct sockaddr_in sin;
+};
+
+/* Keep or drop addrs[j] according to the list elements of the set, which the
+   trie walk doesn't cover. */
+static void filter_keep(struct filter_state *fs)
+{
+    u32 addr = fs->addrs[fs->j++];
+
+    if (fs->set->head != NULL) {
+        const struct addrset_elem *elem;
+
+        fs->sin.sin_addr.s_addr = addr;
+        for (elem = fs->set->head; elem != NULL; elem = elem->next) {
+            if (addrset_elem_match(elem, (struct sockaddr *) &fs->sin))
+                return;
+        }
+    }
+    fs->addrs[fs->k++] = addr;
+}
+
+/* Walk the trie in address order, dropping the addresses that fall in each
+   terminal node's block. Terminal nodes have no children, so their blocks are
+   disjoint and come in increasing order. Subtrees that end before the next
+   address or start after the last one are skipped. */
+static void filter_trie(struct filter_state *fs, const struct addrset_trie_node *node)
+{
+    u32 first, last;
+
+    if (node == NULL || fs->j >= fs->n)
+        return;
+
+    first = ((u32) node->addr[0] << 24) | ((u32) node->addr[1] << 16)
+        | ((u32) node->addr[2] << 8) | node->addr[3];
+    last = node->bits >= 32 ? first : first | (0xFFFFFFFF >> node->bits);
+    if (last < ntohl(fs->addrs[fs->j]) || first > ntohl(fs->addrs[fs->n - 1]))
+        return;
+
+    if (node->terminal) {
+        while (fs->j < fs->n && ntohl(fs->addrs[fs->j]) < first)
+            filter_keep(fs);
+        while (fs->j < fs->n && ntohl(fs->addrs[fs->j]) <= last)
+            fs->j++;
+        return;
+    }
+    filter_trie(fs, node->child[0]);
+    filter_trie(fs, node->child[1]);
+}
+
+/* Remove the addresses that are in the set from an array of n IPv4 addresses
+   in network byte order, keeping the others in their original order. Returns
+   the number of addresses left. If the addresses are in increasing order, the
+   trie is merged against the whole array in one pass instead of being searched
+   once for each address. */
+int addrset_filter_ipv4(const struct addrset *set, u32 *addrs, int n)
+{
+    struct filter_state fs;
+    int i;
+
+    if (set->trie4 == NULL && set->head == NULL)
+        return n;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.set = set;
+    fs.addrs = addrs;
+    fs.n = n;
+    fs.sin.sin_family = AF_INET;
+
+    for (i = 1; i < n; i++) {
+        if (ntohl(addrs[i - 1]) >= ntohl(addrs[i]))
+            break;
+    }
+    if (i < n) {
+        for (i = 0; i < n; i++) {
+            fs.sin.sin_addr.s_addr = addrs[i];
+            if (!addrset_contains(set, (struct sockaddr *) &fs.sin))
+                addrs[fs.k++] = addrs[i];
+        }
+        return fs.k;
+    }
+
+    filter_trie(&fs, set->trie4);
+    while (fs.j < fs.n)
+        filter_keep(&fs);
+
+    return fs.k;
+}
@@ -169,4 +169,14 @@ struct addrset_elem {
     struct addrset_elem *next;
 };
 
+/* A node in a path-compressed binary trie of network prefixes. addr holds the
+   first bits bits of the prefix, the rest are zero. Nodes that are not
+   terminal only exist to join two subtrees that differ at bit number bits. */
+struct addrset_trie_node {
+    uint8_t addr[16];
+    uint8_t bits;
+    uint8_t terminal;
+    struct addrset_trie_node *child[2];
+};
+
 #endif
@@ -0,0 +1,216 @@
+/*
+Usage: test-addrset [num_specs [num_lookups]]
+
+This is a test and benchmark program for the addrset functions from
+nbase_addrset.c. It builds a set the way a huge --excludefile would, from
+num_specs CIDR blocks (300000 by default) plus a few octet ranges that are not
+CIDR blocks, then times num_lookups calls to addrset_contains (1000000 by
+default). A sample of the lookups is checked against a linear search of the
+specifications. Then it filters a run of 16M consecutive addresses through
+addrset_filter_ipv4 in batches, checking that it agrees with addrset_contains.
+Returns 0 if all the checks pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "nbase.h"
+
+#define NUM_RANGES 100
+#define NUM_CHECKS 2000
+#define FILTER_BATCH 1024
+#define FILTER_ADDRS (1 << 24)
+
+struct cidr {
+    u32 addr;
+    int bits;
+};
+
+static u32 rnd_state = 42;
+
+/* A fixed-seed generator so that every run tests the same sets. */
+static u32 rnd(void)
+{
+    u32 hi;
+
+    rnd_state = rnd_state * 1103515245 + 12345;
+    hi = rnd_state >> 16;
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (hi << 16) | (rnd_state >> 16);
+}
+
+static u32 cidr_mask(int bits)
+{
+    return bits == 0 ? 0 : 0xFFFFFFFF << (32 - bits);
+}
+
+/* The ranges all look like 250.x.1,3.*, so only the second octet varies. */
+static int in_ranges(const u8 *range_octets, u32 addr)
+{
+    int i;
+
+    if ((addr >> 24) != 250)
+        return 0;
+    if (((addr >> 8) & 0xFF) != 1 && ((addr >> 8) & 0xFF) != 3)
+        return 0;
+    for (i = 0; i < NUM_RANGES; i++) {
+        if (range_octets[i] == ((addr >> 16) & 0xFF))
+            return 1;
+    }
+    return 0;
+}
+
+static int reference_contains(const struct cidr *cidrs, int num_cidrs,
+    const u8 *range_octets, u32 addr)
+{
+    int i;
+
+    for (i = 0; i < num_cidrs; i++) {
+        if ((addr & cidr_mask(cidrs[i].bits)) == cidrs[i].addr)
+            return 1;
+    }
+    return in_ranges(range_octets, addr);
+}
+
+/* Pick addresses near the set half of the time, so that both hits and misses
+   are common. */
+static u32 random_probe(const struct cidr *cidrs, int num_cidrs,
+    const u8 *range_octets)
+{
+    switch (rnd() % 4) {
+    case 0:
+        return cidrs[rnd() % num_cidrs].addr | (rnd() & 0x3FF);
+    case 1:
+        return (250 << 24) | (range_octets[rnd() % NUM_RANGES] << 16) | (rnd() & 0xFFFF);
+    default:
+        return rnd();
+    }
+}
+
+static double elapsed_ms(const struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec) * 1000.0
+        + (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrset set;
+    struct cidr *cidrs;
+    u8 range_octets[NUM_RANGES];
+    struct sockaddr_in sin;
+    struct timeval start;
+    char spec[64];
+    int num_specs, num_lookups, i, hits, failures;
+
+    num_specs = argc > 1 ? atoi(argv[1]) : 300000;
+    num_lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (num_specs <= 0 || num_lookups <= 0) {
+        fprintf(stderr, "Usage: %s [num_specs [num_lookups]]\n", argv[0]);
+        return 1;
+    }
+
+    cidrs = (struct cidr *) safe_malloc(num_specs * sizeof(*cidrs));
+    addrset_init(&set);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_specs; i++) {
+        u32 addr;
+
+        /* Mostly single hosts and small networks, with first octets that
+           stay clear of the 250 used by the ranges. */
+        cidrs[i].bits = 16 + rnd() % 17;
+        do {
+            addr = rnd();
+        } while ((addr >> 24) >= 240);
+        cidrs[i].addr = addr & cidr_mask(cidrs[i].bits);
+        Snprintf(spec, sizeof(spec), "%u.%u.%u.%u/%d", addr >> 24,
+            (addr >> 16) & 0xFF, (addr >> 8) & 0xFF, addr & 0xFF, cidrs[i].bits);
+        if (!addrset_add_spec(&set, spec, AF_INET, 0)) {
+            fprintf(stderr, "Error adding spec \"%s\".\n", spec);
+            return 1;
+        }
+    }
+    for (i = 0; i < NUM_RANGES; i++) {
+        range_octets[i] = rnd() & 0xFF;
+        Snprintf(spec, sizeof(spec), "250.%u.1,3.*", range_octets[i]);
+        if (!addrset_add_spec(&set, spec, AF_INET, 0)) {
+            fprintf(stderr, "Error adding spec \"%s\".\n", spec);
+            return 1;
+        }
+    }
+    printf("add %d specs: %.2f ms\n", num_specs + NUM_RANGES, elapsed_ms(&start));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+
+    hits = 0;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_lookups; i++) {
+        sin.sin_addr.s_addr = htonl(random_probe(cidrs, num_specs, range_octets));
+        if (addrset_contains(&set, (struct sockaddr *) &sin))
+            hits++;
+    }
+    printf("%d lookups, %d hits: %.2f ms\n", num_lookups, hits, elapsed_ms(&start));
+
+    failures = 0;
+    for (i = 0; i < NUM_CHECKS; i++) {
+        u32 addr = random_probe(cidrs, num_specs, range_octets);
+
+        sin.sin_addr.s_addr = htonl(addr);
+        if (addrset_contains(&set, (struct sockaddr *) &sin)
+            != reference_contains(cidrs, num_specs, range_octets, addr)) {
+            printf("FAIL %u.%u.%u.%u\n", addr >> 24, (addr >> 16) & 0xFF,
+                (addr >> 8) & 0xFF, addr & 0xFF);
+            failures++;
+        }
+    }
+    printf("%d / %d checks passed\n", NUM_CHECKS - failures, NUM_CHECKS);
+
+    {
+        u32 batch[FILTER_BATCH], kept[FILTER_BATCH];
+        u32 base = 10 << 24;
+        int n, k, j, filtered, contained;
+        double filter_ms, contains_ms;
+
+        filtered = contained = 0;
+        filter_ms = contains_ms = 0;
+        for (i = 0; i < FILTER_ADDRS; i += FILTER_BATCH) {
+            for (j = 0; j < FILTER_BATCH; j++)
+                batch[j] = htonl(base + i + j);
+            gettimeofday(&start, NULL);
+            n = addrset_filter_ipv4(&set, batch, FILTER_BATCH);
+            filter_ms += elapsed_ms(&start);
+            filtered += n;
+
+            gettimeofday(&start, NULL);
+            k = 0;
+            for (j = 0; j < FILTER_BATCH; j++) {
+                sin.sin_addr.s_addr = htonl(base + i + j);
+                if (!addrset_contains(&set, (struct sockaddr *) &sin))
+                    kept[k++] = sin.sin_addr.s_addr;
+            }
+            contains_ms += elapsed_ms(&start);
+            contained += k;
+
+            if (n != k || memcmp(batch, kept, n * sizeof(*batch)) != 0) {
+                printf("FAIL filter batch at %u.%u.%u.%u\n", (base + i) >> 24,
+                    ((base + i) >> 16) & 0xFF, ((base + i) >> 8) & 0xFF, (base + i) & 0xFF);
+                failures++;
+            }
+        }
+        printf("filter %d addresses, %d kept: %.2f ms (%.2f ms one at a time)\n",
+            FILTER_ADDRS, filtered, filter_ms, contains_ms);
+    }
+
+    addrset_free(&set);
+    free(cidrs);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -127,6 +127,7 @@
 #include "osscan.h"
 #include "osscan2.h"
 #include "scan_engine.h"
+#include "scan_engine_raw.h"
 #include "idle_scan.h"
 #include "timing.h"
 #include "NmapOps.h"
@@ -277,6 +278,8 @@ static void printusage(int rc) {
          "  --script-help=<Lua scripts>: Show help about scripts.\n"
          "           <Lua scripts> is a comma-separated list of script-files or\n"
          "           script-categories.\n"
+         "  --script-workers <num>: Split script scanning of hosts among <num>\n"
+         "           processes\n"
 #endif
          "OS DETECTION:\n"
          "  -O: Enable OS detection\n"
@@ -467,6 +470,10 @@ struct ftpinfo ftp = get_default_ftpinfo();
 /* A list of targets to be displayed by the --route-dst debugging option. */
 static std::vector<std::string> route_dst_hosts;
 
+/* A file of responses to be replayed by the --version-bench debugging
+   option. */
+static const char *version_bench_file = NULL;
+
 struct scan_lists ports = { 0 };
 
 /* This struct is used is a temporary storage place that holds options that
@@ -597,6 +604,11 @@ void parse_options(int argc, char **argv) {
     {"data-string", required_argument, 0, 0},
     {"data_length", required_argument, 0, 0},
     {"data-length", required_argument, 0, 0},
+    {"stateless", no_argument, 0, 0},
+    {"scan_workers", required_argument, 0, 0},
+    {"scan-workers", required_argument, 0, 0},
+    {"capture_engine", required_argument, 0, 0},
+    {"capture-engine", required_argument, 0, 0},
     {"send_eth", no_argument, 0, 0},
     {"send-eth", no_argument, 0, 0},
     {"send_ip", no_argument, 0, 0},
@@ -628,6 +640,8 @@ void parse_options(int argc, char **argv) {
     {"version-light", no_argument, 0, 0},
     {"version_all", no_argument, 0, 0},
     {"version-all", no_argument, 0, 0},
+    {"version_cache", required_argument, 0, 0},
+    {"version-cache", required_argument, 0, 0},
     {"system_dns", no_argument, 0, 0},
     {"system-dns", no_argument, 0, 0},
     {"log_errors", no_argument, 0, 0},
@@ -654,6 +668,8 @@ void parse_options(int argc, char **argv) {
     {"script_args_file", required_argument, 0, 0},
     {"script-help", required_argument, 0, 0},
     {"script_help", required_argument, 0, 0},
+    {"script-workers", required_argument, 0, 0},
+    {"script_workers", required_argument, 0, 0},
 #endif
     {"ip_options", required_argument, 0, 0},
     {"ip-options", required_argument, 0, 0},
@@ -668,6 +684,8 @@ void parse_options(int argc, char **argv) {
     {"disable-arp-ping", no_argument, 0, 0},
     {"route_dst", required_argument, 0, 0},
     {"route-dst", required_argument, 0, 0},
+    {"version_bench", required_argument, 0, 0},
+    {"version-bench", required_argument, 0, 0},
     {0, 0, 0, 0}
   };
 
@@ -691,6 +709,14 @@ void parse_options(int argc, char **argv) {
       } else if (optcmp(long_options[option_index].name, "script-help") == 0) {
         o.scripthelp = true;
         o.chooseScripts(optarg);
+      } else if (optcmp(long_options[option_index].name, "script-workers") == 0) {
+        o.script_workers = atoi(optarg);
+        if (o.script_workers < 1)
+          fatal("Argument to --script-workers must be at least 1");
+#ifdef WIN32
+        if (o.script_workers > 1)
+          error("Warning: --script-workers is not supported on Windows, scripts will run in one process.");
+#endif
       } else
 #endif
         if (optcmp(long_options[option_index].name, "max-os-tries") == 0) {
@@ -784,6 +810,10 @@ void parse_options(int argc, char **argv) {
           o.version_intensity = atoi(optarg);
           if (o.version_intensity < 0 || o.version_intensity > 9)
             fatal("version-intensity must be between 0 and 9");
+        } else if (optcmp(long_options[option_index].name, "version-cache") == 0) {
+          if (o.version_cache)
+            free(o.version_cache);
+          o.version_cache = strdup(optarg);
         } else if (optcmp(long_options[option_index].name, "version-light") == 0) {
           o.version_intensity = 2;
         } else if (optcmp(long_options[option_index].name, "version-all") == 0) {
@@ -811,7 +841,6 @@ void parse_options(int argc, char **argv) {
         } else if (optcmp(long_options[option_index].name, "randomize-hosts") == 0
                    || strcmp(long_options[option_index].name, "rH") == 0) {
           o.randomize_hosts = 1;
-          o.ping_group_sz = PING_GROUP_SZ * 4;
         } else if (optcmp(long_options[option_index].name, "nsock-engine") == 0) {
           if (nsock_set_default_engine(optarg) < 0)
             fatal("Unknown or non-available engine: %s", optarg);
@@ -864,6 +893,26 @@ void parse_options(int argc, char **argv) {
             error("WARNING: Payloads bigger than 1400 bytes may not be sent successfully.");
           o.extra_payload = (char *) safe_malloc(MAX(o.extra_payload_length, 1));
           get_random_bytes(o.extra_payload, o.extra_payload_length);
+        } else if (strcmp(long_options[option_index].name, "stateless") == 0) {
+          o.stateless = true;
+        } else if (optcmp(long_options[option_index].name, "scan-workers") == 0) {
+          int workers = atoi(optarg);
+          if (workers < 1 || workers > 256)
+            fatal("--scan-workers must be between 1 and 256");
+          /* Hosts are split between workers by address bits. */
+          for (o.scan_workers = 1; o.scan_workers * 2 <= workers; o.scan_workers *= 2)
+            ;
+#ifdef WIN32
+          if (o.scan_workers > 1)
+            error("WARNING: --scan-workers is not supported on Windows; scanning in one process.");
+#endif
+        } else if (optcmp(long_options[option_index].name, "capture-engine") == 0) {
+          if (strcmp(optarg, "ring") == 0)
+            o.capture_ring = true;
+          else if (strcmp(optarg, "pcap") == 0)
+            o.capture_ring = false;
+          else
+            fatal("Unknown capture engine: %s (expected \"pcap\" or \"ring\")", optarg);
         } else if (optcmp(long_options[option_index].name, "send-eth") == 0) {
           o.sendpref = PACKET_SEND_ETH_STRONG;
         } else if (optcmp(long_options[option_index].name, "send-ip") == 0) {
@@ -980,6 +1029,8 @@ void parse_options(int argc, char **argv) {
           /* The --route-dst debugging option: push these on a list to be
              resolved later after options like -6 and -S have been parsed. */
           route_dst_hosts.push_back(optarg);
+        } else if (optcmp(long_options[option_index].name, "version-bench") == 0) {
+          version_bench_file = optarg;
         } else {
           fatal("Unknown long option (%s) given@#!$#$", long_options[option_index].name);
         }
@@ -1651,7 +1702,6 @@ int nmap_main(int argc, char *argv[]) {
   int sourceaddrwarning = 0; /* Have we warned them yet about unguessable
                                 source addresses? */
   unsigned int targetno;
-  char hostname[MAXHOSTNAMELEN + 1] = "";
   struct sockaddr_storage ss;
   size_t sslen;
 
@@ -1709,6 +1759,11 @@ int nmap_main(int argc, char *argv[]) {
   }
   route_dst_hosts.clear();
 
+  if (version_bench_file != NULL) {
+    service_match_bench(version_bench_file);
+    exit(0);
+  }
+
   if (delayed_options.iflist) {
     print_iflist();
     exit(0);
@@ -1763,6 +1818,13 @@ int nmap_main(int argc, char *argv[]) {
   log_write(LOG_NORMAL | LOG_MACHINE, "%s %s scan initiated %s as: ", NMAP_NAME, NMAP_VERSION, mytime);
   log_write(LOG_NORMAL | LOG_MACHINE, "%s", command.c_str());
   log_write(LOG_NORMAL | LOG_MACHINE, "\n");
+  /* --resume needs this to visit the targets in the same order again. */
+  if (o.randomize_hosts) {
+    while (o.randomize_hosts_key == 0)
+      o.randomize_hosts_key = get_random_u64();
+    log_write(LOG_NORMAL | LOG_MACHINE, "# Host order key: %016llx\n",
+              (unsigned long long) o.randomize_hosts_key);
+  }
 
   xml_open_start_tag("nmaprun");
   xml_attribute("scanner", "nmap");
@@ -1877,6 +1939,11 @@ int nmap_main(int argc, char *argv[]) {
 
   HostGroupState hstate(o.ping_group_sz, o.randomize_hosts, argc, (const char **) argv);
 
+  /* A stateless sweep reads all of the targets itself, leaving none for the
+     host group loop below. */
+  if (o.stateless)
+    stateless_syn_sweep(&hstate, &exclude_group, &ports);
+
   do {
     ideal_scan_group_sz = determineScanGroupSize(o.numhosts_scanned, &ports);
     while (Targets.size() < ideal_scan_group_sz) {
@@ -2056,46 +2123,8 @@ int nmap_main(int argc, char *argv[]) {
     }
 #endif
 
-    for (targetno = 0; targetno < Targets.size(); targetno++) {
-      currenths = Targets[targetno];
-      /* Now I can do the output and such for each host */
-      if (currenths->timedOut(NULL)) {
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        xml_end_tag(); /* host */
-        xml_newline();
-        log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
-                  currenths->NameIP(hostname, sizeof(hostname)));
-        log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
-                  currenths->targetipstr(), currenths->HostName());
-      } else {
-        /* --open means don't show any hosts without open ports. */
-        if (o.openOnly() && !currenths->ports.hasOpenPorts())
-          continue;
-
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        printportoutput(currenths, &currenths->ports);
-        printmacinfo(currenths);
-        printosscanoutput(currenths);
-        printserviceinfooutput(currenths);
-#ifndef NOLUA
-        printhostscriptresults(currenths);
-#endif
-        if (o.traceroute)
-          printtraceroute(currenths);
-        printtimes(currenths);
-        log_write(LOG_PLAIN | LOG_MACHINE, "\n");
-        xml_end_tag(); /* host */
-        xml_newline();
-      }
-    }
+    for (targetno = 0; targetno < Targets.size(); targetno++)
+      printhostoutput(Targets[targetno]);
     log_flush_all();
 
     o.numhosts_scanned += Targets.size();
@@ -2109,6 +2138,9 @@ int nmap_main(int argc, char *argv[]) {
     o.numhosts_scanning = 0;
   } while (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned);
 
+  if (o.version_cache)
+    service_scan_cache_save();
+
 #ifndef NOLUA
   if (o.script) {
     script_scan(Targets, SCRIPT_POST_SCAN);
@@ -2255,7 +2287,18 @@ int gather_logfile_resumption_state(char *fname, int *myargc, char ***myargv) {
   nmap_arg_buffer[21 + q - p] = '\0';
 
   if (strstr(nmap_arg_buffer, "--randomize-hosts") != NULL) {
-    error("WARNING: You are attempting to resume a scan which used --randomize-hosts.  Some hosts in the last randomized batch may be missed and others may be repeated once");
+    unsigned long long key;
+
+    /* The target ranges are walked in the order given by this key, which the
+       resumed scan must reuse to know which hosts come after the last one in
+       the log. */
+    if ((q = strstr(filestr, "\n# Host order key: ")) != NULL
+        && sscanf(q + 19, "%llx", &key) == 1 && key != 0) {
+      o.randomize_hosts_key = key;
+      error("WARNING: You are attempting to resume a scan which used --randomize-hosts.  Some hosts in the last randomized batch may be missed and others may be repeated once");
+    } else {
+      error("WARNING: You are attempting to resume a scan which used --randomize-hosts, but the log file does not record the order the hosts were scanned in.  Hosts will be visited in a new order, so many may be missed or repeated");
+    }
   }
 
   *myargc = arg_parse(nmap_arg_buffer, myargv);
@@ -337,9 +337,8 @@ void *realloc();
 #define MAX_RETRANSMISSIONS 10    /* 11 probes to port at maximum */
 #endif
 
-/* Number of hosts we pre-ping and then scan.  We do a lot more if
-   randomize_hosts is set.  Every one you add to this leads to ~1K of
-   extra always-resident memory in nmap */
+/* Number of hosts we pre-ping and then scan.  Every one you add to this
+   leads to ~1K of extra always-resident memory in nmap */
 #define PING_GROUP_SZ 4096
 
 /* DO NOT change stuff after this point */
@@ -208,7 +208,9 @@ extern NmapOps o;
 //   void nmap_mass_rdns(Target **targets, int num_targets)
 //
 // mass_dns sends out CAPACITY_MIN of these hosts to the DNS
-// servers detected, alternating in sequence.
+// servers detected. Each new query goes to the server with the
+// most unused capacity at the time, so faster servers take a
+// larger share of the batch.
 
 // When a request is fulfilled (either a resolved domain, NXDomain,
 // or confirmed ServFail) CAPACITY_UP_STEP is added to the current
@@ -264,8 +266,11 @@ static int read_timeouts[][4] = {
 // Size of hash table used to hold the hosts from /etc/hosts
 #define HASH_TABLE_SIZE 256
 
-// Hash macro for etchosts
-#define IP_HASH(x) (ntohl(x)%HASH_TABLE_SIZE)
+// Size of the per-server hash table of requests on the wire,
+// indexed by DNS ID. Must be a power of two.
+#define ID_HASH_SIZE 256
+
+#define ID_HASH(id) ((id) & (ID_HASH_SIZE - 1))
 
 
 //------------------- Internal Structures ---------------------
@@ -285,6 +290,7 @@ struct dns_server {
   int write_busy;
   std::list<request *> to_process;
   std::list<request *> in_process;
+  std::list<request *> in_flight[ID_HASH_SIZE];
 };
 
 struct request {
@@ -295,11 +301,15 @@ struct request {
   dns_server *first_server;
   dns_server *curr_server;
   u16 id;
+  // Positions in curr_server->in_process and in_flight, valid while
+  // the request is waiting for an answer
+  std::list<request *>::iterator in_process_pos;
+  std::list<request *>::iterator in_flight_pos;
 };
 
 struct host_elem {
   std::string name;
-  u32 addr;
+  struct sockaddr_storage addr;
   u8 cache_hits;
 };
 
@@ -327,8 +337,8 @@ static ScanProgressMeter *SPM;
 //------------------- Prototypes and macros ---------------------
 
 static void put_dns_packet_on_wire(request *req);
-static const char *lookup_etchosts(u32 ip);
-static void addto_etchosts(u32 ip, const char *hname);
+static const char *lookup_etchosts(const struct sockaddr_storage *ip);
+static void addto_etchosts(const struct sockaddr_storage *ip, const char *hname);
 
 #define ACTION_FINISHED 0
 #define ACTION_CNAME_LIST 1
@@ -358,6 +368,7 @@ static void check_capacities(dns_server *tpserv) {
 // Closes all nsis created in connect_dns_servers()
 static void close_dns_servers() {
   std::list<dns_server>::iterator serverI;
+  int i;
 
   for(serverI = servs.begin(); serverI != servs.end(); serverI++) {
     if (serverI->connected) {
@@ -365,8 +376,48 @@ static void close_dns_servers() {
       serverI->connected = 0;
       serverI->to_process.clear();
       serverI->in_process.clear();
+      for (i = 0; i < ID_HASH_SIZE; i++)
+        serverI->in_flight[i].clear();
+    }
+  }
+}
+
+// Records that req is waiting for an answer from its current server
+static void add_in_flight(request *req) {
+  dns_server *serv = req->curr_server;
+  std::list<request *> &bucket = serv->in_flight[ID_HASH(req->id)];
+
+  serv->in_process.push_front(req);
+  req->in_process_pos = serv->in_process.begin();
+  bucket.push_front(req);
+  req->in_flight_pos = bucket.begin();
+}
+
+static void remove_in_flight(request *req) {
+  dns_server *serv = req->curr_server;
+
+  serv->in_process.erase(req->in_process_pos);
+  serv->in_flight[ID_HASH(req->id)].erase(req->in_flight_pos);
+}
+
+// Returns the server that can take a new request and has the most
+// unused capacity, or NULL if they are all busy
+static dns_server *least_loaded_server() {
+  std::list<dns_server>::iterator servI;
+  dns_server *best = NULL;
+  int spare, best_spare = 0;
+
+  for(servI = servs.begin(); servI != servs.end(); servI++) {
+    if (servI->write_busy)
+      continue;
+    spare = servI->capacity - servI->reqs_on_wire;
+    if (spare > best_spare) {
+      best = &*servI;
+      best_spare = spare;
     }
   }
+
+  return best;
 }
 
 
@@ -384,31 +435,36 @@ static int add_integer_to_dns_packet(char *packet, int c) {
   return tplen+1;
 }
 
+static void transmit_request(request *req) {
+  if (o.debugging >= TRACE_DEBUG_LEVEL)
+     log_write(LOG_STDOUT, "mass_rdns: TRANSMITTING for <%s> (server <%s>)\n", req->targ->targetipstr() , req->curr_server->hostname.c_str());
+  stat_trans++;
+  put_dns_packet_on_wire(req);
+}
+
 // Puts as many packets on the line as capacity will allow
 static void do_possible_writes() {
   std::list<dns_server>::iterator servI;
+  dns_server *tpserv;
   request *tpreq;
 
+  // Retransmissions stay on the server they were queued for
   for(servI = servs.begin(); servI != servs.end(); servI++) {
-    if (servI->write_busy == 0 && servI->reqs_on_wire < servI->capacity) {
-      tpreq = NULL;
-      if (!servI->to_process.empty()) {
-        tpreq = servI->to_process.front();
-        servI->to_process.pop_front();
-      } else if (!new_reqs.empty()) {
-        tpreq = new_reqs.front();
-        tpreq->first_server = tpreq->curr_server = &*servI;
-        new_reqs.pop_front();
-      }
-
-      if (tpreq) {
-        if (o.debugging >= TRACE_DEBUG_LEVEL)
-           log_write(LOG_STDOUT, "mass_rdns: TRANSMITTING for <%s> (server <%s>)\n", tpreq->targ->targetipstr() , servI->hostname.c_str());
-        stat_trans++;
-        put_dns_packet_on_wire(tpreq);
-      }
+    if (servI->write_busy == 0 && servI->reqs_on_wire < servI->capacity
+        && !servI->to_process.empty()) {
+      tpreq = servI->to_process.front();
+      servI->to_process.pop_front();
+      transmit_request(tpreq);
     }
   }
+
+  // New requests go wherever there is the most room
+  while (!new_reqs.empty() && (tpserv = least_loaded_server()) != NULL) {
+    tpreq = new_reqs.front();
+    tpreq->first_server = tpreq->curr_server = tpserv;
+    new_reqs.pop_front();
+    transmit_request(tpreq);
+  }
 }
 
 // nsock write handler
@@ -416,11 +472,13 @@ static void write_evt_handler(nsock_pool nsp, nsock_event evt, void *req_v) {
   request *req = (request *) req_v;
 
   req->curr_server->write_busy = 0;
-  req->curr_server->in_process.push_front(req);
+  add_in_flight(req);
 
   do_possible_writes();
 }
 
+static const char hex_digits[] = "0123456789abcdef";
+
 // Takes a DNS request structure and actually puts it on the wire
 // (calls nsock_write()). Does various other tasks like recording
 // the time for the timeout.
@@ -430,7 +488,6 @@ static void put_dns_packet_on_wire(request *req) {
   u32 ip;
   struct timeval now, timeout;
 
-  ip = (u32) ntohl(req->targ->v4host().s_addr);
   packet[0] = (req->id >> 8) & 0xFF;
   packet[1] = req->id & 0xFF;
   plen += 2;
@@ -438,13 +495,31 @@ static void put_dns_packet_on_wire(request *req) {
   memcpy(packet+plen, "\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);
   plen += 10;
 
-  plen += add_integer_to_dns_packet(packet+plen, ip & 0xFF);
-  plen += add_integer_to_dns_packet(packet+plen, (ip>>8) & 0xFF);
-  plen += add_integer_to_dns_packet(packet+plen, (ip>>16) & 0xFF);
-  plen += add_integer_to_dns_packet(packet+plen, (ip>>24) & 0xFF);
+  if (req->targ->af() == AF_INET6) {
+    const u8 *ip6 = req->targ->v6hostip()->s6_addr;
+    int i;
 
-  memcpy(packet+plen, "\x07in-addr\004arpa\x00\x00\x0c\x00\x01", 18);
-  plen += 18;
+    // One label per nibble, least significant first
+    for (i = 15; i >= 0; i--) {
+      packet[plen++] = 1;
+      packet[plen++] = hex_digits[ip6[i] & 0xF];
+      packet[plen++] = 1;
+      packet[plen++] = hex_digits[ip6[i] >> 4];
+    }
+
+    memcpy(packet+plen, "\x03ip6\004arpa\x00\x00\x0c\x00\x01", 14);
+    plen += 14;
+  } else {
+    ip = (u32) ntohl(req->targ->v4host().s_addr);
+
+    plen += add_integer_to_dns_packet(packet+plen, ip & 0xFF);
+    plen += add_integer_to_dns_packet(packet+plen, (ip>>8) & 0xFF);
+    plen += add_integer_to_dns_packet(packet+plen, (ip>>16) & 0xFF);
+    plen += add_integer_to_dns_packet(packet+plen, (ip>>24) & 0xFF);
+
+    memcpy(packet+plen, "\x07in-addr\004arpa\x00\x00\x0c\x00\x01", 18);
+    plen += 18;
+  }
 
   req->curr_server->write_busy = 1;
   req->curr_server->reqs_on_wire++;
@@ -488,7 +563,7 @@ static int deal_with_timedout_reads() {
       if (tp <= 0) {
         servI->capacity = (int) (servI->capacity * CAPACITY_MINOR_DOWN_SCALE);
         check_capacities(&*servI);
-        servI->in_process.erase(reqI);
+        remove_in_flight(tpreq);
         servI->reqs_on_wire--;
 
         // If we've tried this server enough times, move to the next one
@@ -539,52 +614,52 @@ static int deal_with_timedout_reads() {
 
 }
 
-// After processing a DNS response, we search through the IPs we're
-// looking for and update their results as necessary.
+// After processing a DNS response from serv, we look up the request
+// it answers and update its results as necessary. ss is the address
+// named in the answer, or NULL if there was none.
 // Returns non-zero if this matches a query we're looking for
-static int process_result(u32 ia, char *result, int action, u16 id) {
-  std::list<dns_server>::iterator servI;
+static int process_result(dns_server *serv, const struct sockaddr_storage *ss,
+                          char *result, int action, u16 id) {
   std::list<request *>::iterator reqI;
+  std::list<request *> &bucket = serv->in_flight[ID_HASH(id)];
   request *tpreq;
 
-  for(servI = servs.begin(); servI != servs.end(); servI++) {
-    for(reqI = servI->in_process.begin(); reqI != servI->in_process.end(); reqI++) {
-      tpreq = *reqI;
+  for(reqI = bucket.begin(); reqI != bucket.end(); reqI++) {
+    tpreq = *reqI;
 
-      if (id == tpreq->id) {
+    if (id == tpreq->id) {
 
-        if (ia != 0 && tpreq->targ->v4host().s_addr != ia)
-          continue;
+      if (ss != NULL && !sockaddr_storage_equal(tpreq->targ->TargetSockAddr(), ss))
+        continue;
 
-        if (action == ACTION_CNAME_LIST || action == ACTION_FINISHED) {
-        servI->capacity += CAPACITY_UP_STEP;
-        check_capacities(&*servI);
+      if (action == ACTION_CNAME_LIST || action == ACTION_FINISHED) {
+      serv->capacity += CAPACITY_UP_STEP;
+      check_capacities(serv);
 
-        if (result) {
-          tpreq->targ->setHostName(result);
-          addto_etchosts(tpreq->targ->v4hostip()->s_addr, result);
-        }
+      if (result) {
+        tpreq->targ->setHostName(result);
+        addto_etchosts(tpreq->targ->TargetSockAddr(), result);
+      }
 
-        servI->in_process.remove(tpreq);
-        servI->reqs_on_wire--;
+      remove_in_flight(tpreq);
+      serv->reqs_on_wire--;
 
-        total_reqs--;
+      total_reqs--;
 
-          if (action == ACTION_CNAME_LIST) cname_reqs.push_back(tpreq);
-          if (action == ACTION_FINISHED) delete tpreq;
-        } else {
-          memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
-          deal_with_timedout_reads();
-        }
+        if (action == ACTION_CNAME_LIST) cname_reqs.push_back(tpreq);
+        if (action == ACTION_FINISHED) delete tpreq;
+      } else {
+        memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
+        deal_with_timedout_reads();
+      }
 
-        do_possible_writes();
+      do_possible_writes();
 
-        // Close DNS servers if we're all done so that we kill
-        // all events and return from nsock_loop immediateley
-        if (total_reqs == 0)
-          close_dns_servers();
-        return 1;
-      }
+      // Close DNS servers if we're all done so that we kill
+      // all events and return from nsock_loop immediateley
+      if (total_reqs == 0)
+        close_dns_servers();
+      return 1;
     }
   }
 
@@ -620,6 +695,48 @@ static u32 parse_inaddr_arpa(unsigned char *buf, int maxlen) {
   return ntohl(ip);
 }
 
+// Gets an IPv6 address from a X.X. ... .X.ip6.arpa DNS encoded string
+// inside a packet (32 one-nibble labels, least significant first).
+// Returns 0 on failure.
+static int parse_ip6_arpa(unsigned char *buf, int maxlen, struct in6_addr *ia6) {
+  int i, nibble;
+
+  if (maxlen < 32 * 2 + 10) return 0; // labels and the following string
+
+  memset(ia6, 0, sizeof(*ia6));
+  for (i=0; i<32; i++) {
+    if (buf[0] != 1) return 0;
+    if (buf[1] >= '0' && buf[1] <= '9') nibble = buf[1] - '0';
+    else if (buf[1] >= 'a' && buf[1] <= 'f') nibble = buf[1] - 'a' + 10;
+    else if (buf[1] >= 'A' && buf[1] <= 'F') nibble = buf[1] - 'A' + 10;
+    else return 0;
+
+    ia6->s6_addr[15 - i/2] |= (i % 2) ? nibble << 4 : nibble;
+    buf += 2;
+  }
+
+  if (strcasecmp((char *) buf, "\x03ip6\004arpa\0")) return 0;
+
+  return 1;
+}
+
+// Fills ss with the address named by a reverse-mapping DNS name,
+// either in-addr.arpa or ip6.arpa. Returns 0 on failure.
+static int parse_arpa_name(unsigned char *buf, int maxlen, struct sockaddr_storage *ss) {
+  memset(ss, 0, sizeof(*ss));
+
+  if (maxlen > 0 && buf[0] == 1 && parse_ip6_arpa(buf, maxlen, &((struct sockaddr_in6 *) ss)->sin6_addr)) {
+    ss->ss_family = AF_INET6;
+    return 1;
+  }
+
+  ((struct sockaddr_in *) ss)->sin_addr.s_addr = parse_inaddr_arpa(buf, maxlen);
+  if (((struct sockaddr_in *) ss)->sin_addr.s_addr == 0) return 0;
+  ss->ss_family = AF_INET;
+
+  return 1;
+}
+
 
 // Turns a DNS packet encoded name (see the RFC) and turns it into
 // a normal decimal separated hostname.
@@ -693,7 +810,8 @@ static int advance_past_dns_name(u8 *buf, int buflen, int curbuf,
 
 // Nsock read handler. One nsock read for each DNS server exists at each
 // time. This function uses various helper functions as defined above.
-static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *nothing) {
+static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *serv_v) {
+  dns_server *serv = (dns_server *) serv_v;
   u8 *buf;
   int buflen, curbuf=0;
   int i, nameloc, rdlen, atype, aclass;
@@ -702,7 +820,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *nothing) {
   u16 packet_id;
 
   if (total_reqs >= 1)
-    nsock_read(nsp, nse_iod(evt), read_evt_handler, -1, NULL);
+    nsock_read(nsp, nse_iod(evt), read_evt_handler, -1, serv);
 
   if (nse_type(evt) != NSE_TYPE_READ || nse_status(evt) != NSE_STATUS_SUCCESS) {
     if (o.debugging)
@@ -743,7 +861,7 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *nothing) {
 
     // NXDomain means we're finished (doesn't exist for sure)
     // but SERVFAIL might just mean a server timeout
-    found = process_result(0, NULL, errcode == 3 ? ACTION_FINISHED : ACTION_TIMEOUT, packet_id);
+    found = process_result(serv, NULL, NULL, errcode == 3 ? ACTION_FINISHED : ACTION_TIMEOUT, packet_id);
 
     if (errcode == 2 && found) {
       if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: SERVFAIL <id = %d>\n", packet_id);
@@ -789,31 +907,29 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *nothing) {
 
     if (atype == 12 && aclass == 1) {
       // TYPE 12 is PTR
-      struct in_addr ia;
+      struct sockaddr_storage ss;
       char outbuf[512];
 
-      ia.s_addr = parse_inaddr_arpa(buf+nameloc, buflen-nameloc);
-      if (ia.s_addr == 0) return;
+      if (!parse_arpa_name(buf+nameloc, buflen-nameloc, &ss)) return;
 
       curbuf = advance_past_dns_name(buf, buflen, curbuf, &nameloc);
       if (curbuf == -1 || curbuf > buflen) return;
 
       if (encoded_name_to_normal(buf+nameloc, outbuf, sizeof(outbuf)) == -1) return;
 
-      if (process_result(ia.s_addr, outbuf, ACTION_FINISHED, packet_id)) {
-        if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: OK MATCHED <%s> to <%s>\n", inet_ntoa(ia), outbuf);
+      if (process_result(serv, &ss, outbuf, ACTION_FINISHED, packet_id)) {
+        if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: OK MATCHED <%s> to <%s>\n", inet_ntop_ez(&ss, sizeof(ss)), outbuf);
         output_summary();
         stat_ok++;
       }
     } else if (atype == 5 && aclass == 1) {
       // TYPE 5 is CNAME
-      struct in_addr ia;
+      struct sockaddr_storage ss;
 
-      ia.s_addr = parse_inaddr_arpa(buf+nameloc, buflen-nameloc);
-      if (ia.s_addr == 0) return;
+      if (!parse_arpa_name(buf+nameloc, buflen-nameloc, &ss)) return;
 
-      if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: CNAME found for <%s>\n", inet_ntoa(ia));
-      process_result(ia.s_addr, NULL, ACTION_CNAME_LIST, packet_id);
+      if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: CNAME found for <%s>\n", inet_ntop_ez(&ss, sizeof(ss)));
+      process_result(serv, &ss, NULL, ACTION_CNAME_LIST, packet_id);
     } else {
       if (rdlen < 0 || rdlen + curbuf >= buflen) return;
       curbuf += rdlen;
@@ -883,7 +999,7 @@ static void connect_dns_servers() {
     serverI->write_busy = 0;
 
     nsock_connect_udp(dnspool, serverI->nsd, connect_evt_handler, NULL, (struct sockaddr *) &serverI->addr, serverI->addr_len, 53);
-    nsock_read(dnspool, serverI->nsd, read_evt_handler, -1, NULL);
+    nsock_read(dnspool, serverI->nsd, read_evt_handler, -1, &*serverI);
     serverI->connected = 1;
   }
 
@@ -1015,8 +1131,10 @@ static void parse_resolvdotconf() {
 
 static void parse_etchosts(const char *fname) {
   FILE *fp;
-  char buf[2048], hname[256], ipaddrstr[16], *tp;
-  struct in_addr ia;
+  char buf[2048], hname[256], ipaddrstr[INET6_ADDRSTRLEN], *tp;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
 
   fp = fopen(fname, "r");
   if (fp == NULL) return; // silently is OK
@@ -1032,15 +1150,36 @@ static void parse_etchosts(const char *fname) {
     // Skip any leading whitespace
     while (*tp == ' ' || *tp == '\t') tp++;
 
-    if (sscanf(tp, "%15s %255s", ipaddrstr, hname) == 2) {
-      if (inet_pton(AF_INET, ipaddrstr, &ia))
-        addto_etchosts(ia.s_addr, hname);
+    if (sscanf(tp, "%45s %255s", ipaddrstr, hname) == 2) {
+      memset(&ss, 0, sizeof(ss));
+      if (inet_pton(AF_INET, ipaddrstr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        addto_etchosts(&ss, hname);
+      } else if (inet_pton(AF_INET6, ipaddrstr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        addto_etchosts(&ss, hname);
+      }
     }
   }
 
   fclose(fp);
 }
 
+/* Hash an IPv4 or IPv6 address into the dns cache. IPv6 addresses are
+ * hashed on their low 32 bits, where the host part usually varies. */
+static int etchosts_hash(const struct sockaddr_storage *ip) {
+  u32 key;
+
+  if (ip->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ip;
+    memcpy(&key, sin6->sin6_addr.s6_addr + 12, sizeof(key));
+  } else {
+    assert(ip->ss_family == AF_INET);
+    key = ((const struct sockaddr_in *) ip)->sin_addr.s_addr;
+  }
+  return ntohl(key) % HASH_TABLE_SIZE;
+}
+
 /* Executed when the DNS cache is full, ages entries
  * and removes any with a cache hit of 0 (the least used) */
 bool remove_and_age(host_elem &host) {
@@ -1054,7 +1193,7 @@ bool remove_and_age(host_elem &host) {
 /* Add to the dns cache. If there are too many entries
  * we age and remove the least frequently used ones to
  * make more space. */
-static void addto_etchosts(u32 ip, const char *hname) {
+static void addto_etchosts(const struct sockaddr_storage *ip, const char *hname) {
   static u16 total_size = 0;
   std::list<host_elem>::iterator it;
   host_elem he;
@@ -1075,19 +1214,19 @@ static void addto_etchosts(u32 ip, const char *hname) {
     }
   }
   he.name = hname;
-  he.addr = ip;
+  he.addr = *ip;
   he.cache_hits = 0;
-  etchosts[IP_HASH(ip)].push_back(he);
+  etchosts[etchosts_hash(ip)].push_back(he);
   total_size++;
 }
 
 /* Search for a hostname in the cache and increment
  * its cache hit counter if found */
-static const char *lookup_etchosts(u32 ip) {
+static const char *lookup_etchosts(const struct sockaddr_storage *ip) {
   std::list<host_elem>::iterator hostI;
-  int localIP_Hash = IP_HASH(ip);
+  int localIP_Hash = etchosts_hash(ip);
   for(hostI = etchosts[localIP_Hash].begin(); hostI != etchosts[localIP_Hash].end(); hostI++) {
-    if (hostI->addr == ip) {
+    if (sockaddr_storage_equal(&hostI->addr, ip)) {
       if(hostI->cache_hits < UCHAR_MAX)
         hostI->cache_hits++;
       return hostI->name.c_str();
@@ -1097,7 +1236,7 @@ static const char *lookup_etchosts(u32 ip) {
 }
 
 /* External interface to dns cache */
-const char *lookup_cached_host(u32 ip) {
+const char *lookup_cached_host(const struct sockaddr_storage *ip) {
   const char *tmp = lookup_etchosts(ip);
   return tmp;
 }
@@ -1189,8 +1328,7 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
     if (!((*hostI)->flags & HOST_UP) && !o.resolve_all) continue;
 
     // See if it's in /etc/hosts or cached
-    assert((*hostI)->af() == AF_INET);
-    tpname = lookup_etchosts((u32) (*hostI)->v4hostip()->s_addr);
+    tpname = lookup_etchosts((*hostI)->TargetSockAddr());
     if (tpname) {
       (*hostI)->setHostName(tpname);
       continue;
@@ -1341,8 +1479,7 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
 
   stat_actual = stat_ok = stat_nx = stat_sf = stat_trans = stat_dropped = stat_cname = 0;
 
-  // mass_dns only supports IPv4.
-  if (o.mass_dns && o.af() == AF_INET)
+  if (o.mass_dns)
     nmap_mass_rdns_core(targets, num_targets);
   else
     nmap_system_rdns_core(targets, num_targets);
@@ -1351,7 +1488,7 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
 
   if (stat_actual > 0) {
     if (o.debugging || o.verbose >= 3) {
-      if (o.mass_dns && o.af() == AF_INET) {
+      if (o.mass_dns) {
         // #:  Number of DNS servers used
         // OK: Number of fully reverse resolved queries
         // NX: Number of confirmations of 'No such reverse domain eXists'
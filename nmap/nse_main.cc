@@ -6,6 +6,7 @@
 #include "NmapOps.h"
 #include "timing.h"
 #include "Target.h"
+#include "TargetGroup.h"
 #include "nmap_tty.h"
 #include "xml.h"
 
@@ -21,6 +22,11 @@
 #include "nse_debug.h"
 #include "nse_lpeg.h"
 
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+#include <algorithm>
+
 #define NSE_MAIN "NSE_MAIN" /* the main function */
 
 /* Script Scan phases */
@@ -39,6 +45,9 @@
 
 #define NSE_FORMAT_TABLE "NSE_FORMAT_TABLE"
 #define NSE_FORMAT_XML "NSE_FORMAT_XML"
+#define NSE_WORKER_START "NSE_WORKER_START"
+#define NSE_WORKER_FINISH "NSE_WORKER_FINISH"
+#define NSE_WORKER_MERGE "NSE_WORKER_MERGE"
 
 #ifndef MAXPATHLEN
 #  define MAXPATHLEN 2048
@@ -481,6 +490,8 @@ ScriptResults *get_script_scan_results_obj (void)
 
 static void format_xml(lua_State *L, int pos)
 {
+  int top = lua_gettop(L);
+
   pos = lua_absindex(L, pos);
 
   /* Look up the FORMAT_XML function from nse_main.lua and call it. */
@@ -496,9 +507,64 @@ static void format_xml(lua_State *L, int pos)
   if (lua_pcall(L, 1, 1, 0) != 0) {
     if (o.debugging)
       log_write(LOG_STDOUT, "%s: Error in FORMAT_XML: %s\n", SCRIPT_ENGINE, lua_tostring(L, -1));
-    lua_pop(L, 1);
-    return;
   }
+  lua_settop(L, top);
+}
+
+/* The index of the XML log in o.logfd. */
+static int xml_logfd (void)
+{
+  int i = 0, logt = LOG_XML;
+  while ((logt & 1) == 0) {
+    i++;
+    logt >>= 1;
+  }
+  return i;
+}
+
+void ScriptResult::set_output_xml (const std::string &xml)
+{
+  output_xml = xml;
+  have_output_xml = true;
+}
+
+/* Renders the structured output as XML (what write_xml puts between the
+   script start and end tags) into xml. Returns false if there is no
+   structured output. */
+bool ScriptResult::get_output_xml (std::string &xml) const
+{
+  int i = xml_logfd();
+  FILE *fp, *saved;
+  char buf[4096];
+  size_t n;
+
+  if (have_output_xml) {
+    xml = output_xml;
+    return true;
+  }
+
+  lua_rawgeti(L_NSE, LUA_REGISTRYINDEX, output_ref);
+  if (lua_isnil(L_NSE, -1)) {
+    lua_pop(L_NSE, 1);
+    return false;
+  }
+
+  /* format_xml writes to the XML log, so point that at a temporary file. */
+  if ((fp = tmpfile()) == NULL)
+    pfatal("%s: tmpfile", SCRIPT_ENGINE);
+  saved = o.logfd[i];
+  o.logfd[i] = fp;
+  format_xml(L_NSE, -1);
+  o.logfd[i] = saved;
+  lua_pop(L_NSE, 1);
+
+  xml.clear();
+  rewind(fp);
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    xml.append(buf, n);
+  fclose(fp);
+
+  return true;
 }
 
 void ScriptResult::write_xml() const
@@ -518,6 +584,10 @@ void ScriptResult::write_xml() const
     xml_close_start_tag();
     format_xml(L_NSE, -1);
     xml_end_tag();
+  } else if (have_output_xml) {
+    xml_close_start_tag();
+    xml_write_raw("%s", output_xml.c_str());
+    xml_end_tag();
   } else {
     xml_close_empty_tag();
   }
@@ -594,14 +664,33 @@ static int init_main (lua_State *L)
   return 0;
 }
 
+/* Starts a new host group: NSE_CURRENT_HOSTS maps the name of each target
+ * (see nse_gettarget) to its Target. */
+static void set_current_hosts (lua_State *L, std::vector<Target *> *targets)
+{
+  lua_createtable(L, 0, targets->size());
+  for (std::vector<Target *>::iterator ti = targets->begin(); ti != targets->end(); ti++)
+  {
+    Target *target = (Target *) *ti;
+    const char *TargetName = target->TargetName();
+    const char *targetipstr = target->targetipstr();
+    if (TargetName != NULL && strcmp(TargetName, "") != 0)
+      lua_pushstring(L, TargetName);
+    else
+      lua_pushstring(L, targetipstr);
+    lua_pushlightuserdata(L, target);
+    lua_rawset(L, -3);
+  }
+  lua_setfield(L, LUA_REGISTRYINDEX, NSE_CURRENT_HOSTS);
+}
+
 static int run_main (lua_State *L)
 {
   std::vector<Target *> *targets = (std::vector<Target*> *)
       lua_touserdata(L, 1);
 
   /* New host group */
-  lua_newtable(L);
-  lua_setfield(L, LUA_REGISTRYINDEX, NSE_CURRENT_HOSTS);
+  set_current_hosts(L, targets);
 
   lua_getfield(L, LUA_REGISTRYINDEX, NSE_MAIN);
   assert(lua_isfunction(L, -1));
@@ -611,24 +700,12 @@ static int run_main (lua_State *L)
    */
   lua_createtable(L, targets->size(), 0);
   int targets_table = lua_gettop(L);
-  lua_getfield(L, LUA_REGISTRYINDEX, NSE_CURRENT_HOSTS);
-  int current_hosts = lua_gettop(L);
   for (std::vector<Target *>::iterator ti = targets->begin(); ti != targets->end(); ti++)
   {
-    Target *target = (Target *) *ti;
-    const char *TargetName = target->TargetName();
-    const char *targetipstr = target->targetipstr();
     lua_newtable(L);
-    set_hostinfo(L, target);
+    set_hostinfo(L, (Target *) *ti);
     lua_rawseti(L, targets_table, lua_rawlen(L, targets_table) + 1);
-    if (TargetName != NULL && strcmp(TargetName, "") != 0)
-      lua_pushstring(L, TargetName);
-    else
-      lua_pushstring(L, targetipstr);
-    lua_pushlightuserdata(L, target);
-    lua_rawset(L, current_hosts); /* add to NSE_CURRENT_HOSTS */
   }
-  lua_settop(L, targets_table);
 
   /* Push script scan phase type. Second argument to NSE main function */
   switch (o.current_scantype)
@@ -794,11 +871,8 @@ void open_nse (void)
   }
 }
 
-void script_scan (std::vector<Target *> &targets, stype scantype)
+static void script_scan_targets (std::vector<Target *> &targets)
 {
-  o.current_scantype = scantype;
-
-  assert(L_NSE != NULL);
   lua_settop(L_NSE, 0); /* clear the stack */
 
   lua_pushcfunction(L_NSE, nseU_traceback);
@@ -810,6 +884,410 @@ void script_scan (std::vector<Target *> &targets, stype scantype)
   lua_settop(L_NSE, 0);
 }
 
+#ifndef WIN32
+/* With --script-workers, the script scan phase of a host group is split among
+ * forked copies of the process. Each worker has its own copy of L_NSE (and a
+ * new nsock pool) and runs the scripts against its share of the hosts exactly
+ * as a serial scan would. It then sends back what the parent needs to put in
+ * its own Targets and state: the script results of its hosts, rendered as
+ * text and XML because their tables live in the worker's Lua state; the
+ * targets its scripts added; the time its hosts' timeout clocks counted, so
+ * that --host-timeout and the host end times come out the same; and, from
+ * nse_main.lua, the changes made to
+ * nmap.registry and to port states and versions. Script output only goes
+ * through the parent, so it is the same as in a serial scan.
+ *
+ * The data is a sequence of records, a type character followed by fields
+ * written as "<length>:<bytes>".
+ */
+#define WORKER_HOST_RESULT 'H'
+#define WORKER_HOST_CLOCK 'C'
+#define WORKER_PORT_RESULT 'P'
+#define WORKER_NEW_TARGET 'T'
+#define WORKER_LUA_DATA 'L'
+
+static void put_field (std::string &buf, const std::string &field)
+{
+  char len[32];
+  Snprintf(len, sizeof(len), "%lu:", (unsigned long) field.size());
+  buf += len;
+  buf += field;
+}
+
+static void put_field (std::string &buf, unsigned long n)
+{
+  char s[32];
+  Snprintf(s, sizeof(s), "%lu", n);
+  put_field(buf, std::string(s));
+}
+
+static bool get_field (const std::string &buf, size_t &pos, std::string &field)
+{
+  unsigned long len;
+  char *tail;
+  size_t colon;
+
+  colon = buf.find(':', pos);
+  if (colon == std::string::npos)
+    return false;
+  len = strtoul(buf.c_str() + pos, &tail, 10);
+  if (tail != buf.c_str() + colon || len > buf.size() - colon - 1)
+    return false;
+  field = buf.substr(colon + 1, len);
+  pos = colon + 1 + len;
+  return true;
+}
+
+static bool get_field (const std::string &buf, size_t &pos, unsigned long &n)
+{
+  std::string field;
+  char *tail;
+
+  if (!get_field(buf, pos, field) || field.empty())
+    return false;
+  n = strtoul(field.c_str(), &tail, 10);
+  return *tail == '\0';
+}
+
+static void put_result (std::string &buf, const ScriptResult &sr, bool want_xml)
+{
+  std::string xml;
+  bool have_xml = want_xml && sr.get_output_xml(xml);
+
+  put_field(buf, sr.get_id());
+  put_field(buf, sr.get_output_str());
+  put_field(buf, have_xml ? 1 : 0);
+  put_field(buf, xml);
+}
+
+static bool get_result (const std::string &buf, size_t &pos, ScriptResult &sr)
+{
+  std::string id, output, xml;
+  unsigned long have_xml;
+
+  if (!get_field(buf, pos, id) || !get_field(buf, pos, output)
+      || !get_field(buf, pos, have_xml) || !get_field(buf, pos, xml))
+    return false;
+  sr.set_id(id.c_str());
+  sr.set_output_str(output.data(), output.size());
+  if (have_xml)
+    sr.set_output_xml(xml);
+  return true;
+}
+
+static bool write_all (int fd, const std::string &buf)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < buf.size()) {
+    n = write(fd, buf.data() + done, buf.size() - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool read_all (int fd, std::string &buf)
+{
+  char tmp[8192];
+  ssize_t n;
+
+  for (;;) {
+    n = read(fd, tmp, sizeof(tmp));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    buf.append(tmp, n);
+  }
+}
+
+/* Runs in the worker process and does not return. The first worker also
+   prints the per-runlevel messages, which would otherwise repeat. */
+static void script_worker (std::vector<Target *> &targets,
+    const std::vector<size_t> &share, int fd, bool want_xml, bool first)
+{
+  std::vector<Target *> mine;
+  std::vector<size_t>::const_iterator si;
+  std::string buf, target;
+  int i;
+
+  /* Only the parent writes the output files. Their buffers were flushed
+     before the fork. The progress messages are also left to the parent (see
+     NSE_WORKER_START); scripts still see the user's verbosity. */
+  for (i = 0; i < LOG_NUM_FILES; i++)
+    o.logfd[i] = NULL;
+  o.noninteractive = true;
+  /* Don't let every worker's scripts draw the same random numbers. */
+  srand(get_random_uint() ^ (unsigned int) getpid());
+  nse_nsock_new_pool(L_NSE);
+
+  lua_settop(L_NSE, 0);
+  lua_getfield(L_NSE, LUA_REGISTRYINDEX, NSE_WORKER_START);
+  lua_pushboolean(L_NSE, first);
+  if (lua_pcall(L_NSE, 1, 0, 0) != 0)
+    fatal("%s: failed to start a script worker: %s", SCRIPT_ENGINE, lua_tostring(L_NSE, -1));
+
+  for (si = share.begin(); si != share.end(); si++)
+    mine.push_back(targets[*si]);
+  script_scan_targets(mine);
+
+  for (si = share.begin(); si != share.end(); si++) {
+    Target *t = targets[*si];
+    ScriptResults::const_iterator ri;
+    Port *p = NULL;
+    Port port;
+    int nresults = 0;
+
+    if (t->timeOutClockRunning())
+      t->stopTimeOutClock(NULL);
+    buf += WORKER_HOST_CLOCK;
+    put_field(buf, *si);
+    put_field(buf, t->TimeOutClockUsed());
+    put_field(buf, (unsigned long) t->EndTime());
+    put_field(buf, t->timedOut(NULL) ? 1 : 0);
+
+    for (ri = t->scriptResults.begin(); ri != t->scriptResults.end(); ri++) {
+      buf += WORKER_HOST_RESULT;
+      put_field(buf, *si);
+      put_result(buf, *ri, want_xml);
+    }
+    while (nresults < t->ports.numscriptresults
+           && (p = t->ports.nextPort(p, &port, TCPANDUDPANDSCTP, 0)) != NULL) {
+      for (ri = p->scriptResults.begin(); ri != p->scriptResults.end(); ri++) {
+        buf += WORKER_PORT_RESULT;
+        put_field(buf, *si);
+        put_field(buf, p->portno);
+        put_field(buf, p->proto);
+        put_result(buf, *ri, want_xml);
+        nresults++;
+      }
+    }
+  }
+
+  while (!(target = NewTargets::read()).empty()) {
+    buf += WORKER_NEW_TARGET;
+    put_field(buf, target);
+  }
+
+  lua_getfield(L_NSE, LUA_REGISTRYINDEX, NSE_WORKER_FINISH);
+  if (lua_pcall(L_NSE, 0, 1, 0) != 0)
+    fatal("%s: failed to finish a script worker: %s", SCRIPT_ENGINE, lua_tostring(L_NSE, -1));
+  buf += WORKER_LUA_DATA;
+  put_field(buf, std::string(lua_tostring(L_NSE, -1), lua_rawlen(L_NSE, -1)));
+
+  if (!write_all(fd, buf))
+    fatal("%s: a script worker failed to send its results: %s", SCRIPT_ENGINE, strerror(errno));
+  close(fd);
+  log_flush(LOG_STDOUT|LOG_STDERR);
+  fflush(stdout);
+  _exit(0);
+}
+
+/* Applies the records sent by one worker. Returns false if the data is
+   malformed; the records before the error are kept. */
+static bool apply_worker_results (std::vector<Target *> &targets,
+    const std::string &buf, std::vector<std::string> &lua_data)
+{
+  size_t pos = 0;
+
+  while (pos < buf.size()) {
+    char type = buf[pos++];
+    unsigned long idx, portno, proto, msecs_used, host_end, timedout;
+    std::string field;
+    ScriptResult sr;
+
+    switch (type) {
+      case WORKER_HOST_RESULT:
+        if (!get_field(buf, pos, idx) || idx >= targets.size()
+            || !get_result(buf, pos, sr))
+          return false;
+        targets[idx]->scriptResults.push_back(sr);
+        break;
+      case WORKER_HOST_CLOCK:
+        if (!get_field(buf, pos, idx) || idx >= targets.size()
+            || !get_field(buf, pos, msecs_used) || !get_field(buf, pos, host_end)
+            || !get_field(buf, pos, timedout))
+          return false;
+        /* timedOut() only looks at msecs_used; make it agree with the
+           worker's answer. */
+        if (timedout && msecs_used <= (unsigned long) o.host_timeout)
+          msecs_used = o.host_timeout + 1;
+        targets[idx]->setTimeOutClockUsed(msecs_used, (time_t) host_end);
+        break;
+      case WORKER_PORT_RESULT:
+        if (!get_field(buf, pos, idx) || idx >= targets.size()
+            || !get_field(buf, pos, portno) || !get_field(buf, pos, proto)
+            || !get_result(buf, pos, sr))
+          return false;
+        targets[idx]->ports.addScriptResult(portno, proto, sr);
+        targets[idx]->ports.numscriptresults++;
+        break;
+      case WORKER_NEW_TARGET:
+        if (!get_field(buf, pos, field))
+          return false;
+        NewTargets::insert(field.c_str());
+        break;
+      case WORKER_LUA_DATA:
+        if (!get_field(buf, pos, field))
+          return false;
+        lua_data.push_back(field);
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+static int merge_workers (lua_State *L)
+{
+  std::vector<Target *> *targets = (std::vector<Target *> *)
+      lua_touserdata(L, 1);
+  std::vector<std::string> *lua_data = (std::vector<std::string> *)
+      lua_touserdata(L, 2);
+
+  set_current_hosts(L, targets);
+  luaL_checkstack(L, lua_data->size() + 1, "merge_workers");
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_WORKER_MERGE);
+  for (size_t i = 0; i < lua_data->size(); i++)
+    lua_pushlstring(L, (*lua_data)[i].data(), (*lua_data)[i].size());
+  lua_call(L, lua_data->size(), 0);
+  return 0;
+}
+
+static bool heavier (const std::pair<int, size_t> &a, const std::pair<int, size_t> &b)
+{
+  return a.first > b.first;
+}
+
+/* Hosts with more open ports tend to take longer to script scan. Hand them out
+   heaviest first, each to the worker with the least work so far. Each share
+   stays in host group order. */
+static void partition_targets (const std::vector<Target *> &targets,
+    std::vector<std::vector<size_t> > &shares)
+{
+  std::vector<std::pair<int, size_t> > hosts;
+  std::vector<int> load(shares.size(), 0);
+  size_t i, w, min;
+
+  for (i = 0; i < targets.size(); i++) {
+    const PortList *ports = &targets[i]->ports;
+    hosts.push_back(std::make_pair(1 + ports->getStateCounts(PORT_OPEN)
+        + ports->getStateCounts(PORT_OPENFILTERED), i));
+  }
+  std::stable_sort(hosts.begin(), hosts.end(), heavier);
+  for (i = 0; i < hosts.size(); i++) {
+    min = 0;
+    for (w = 1; w < shares.size(); w++) {
+      if (load[w] < load[min])
+        min = w;
+    }
+    shares[min].push_back(hosts[i].second);
+    load[min] += hosts[i].first;
+  }
+  for (w = 0; w < shares.size(); w++)
+    std::sort(shares[w].begin(), shares[w].end());
+}
+
+static void script_scan_workers (std::vector<Target *> &targets)
+{
+  size_t nworkers = MIN((size_t) o.script_workers, targets.size());
+  std::vector<std::vector<size_t> > shares(nworkers);
+  std::vector<std::string> lua_data;
+  std::vector<pid_t> pids;
+  std::vector<int> fds;
+  ScanProgressMeter *SPM;
+  bool want_xml = o.logfd[xml_logfd()] != NULL;
+  size_t w, i, ndone;
+
+  /* The workers are silent, so print what run_main would have. */
+  if (o.verbose || o.debugging)
+    log_write(LOG_STDOUT, "%s: Script scanning %lu hosts.\n",
+        SCRIPT_ENGINE, (unsigned long) targets.size());
+  if (o.debugging)
+    log_write(LOG_STDOUT, "%s: Splitting %lu hosts among %lu script workers.\n",
+        SCRIPT_ENGINE, (unsigned long) targets.size(), (unsigned long) nworkers);
+
+  SPM = new ScanProgressMeter(SCRIPT_ENGINE);
+  partition_targets(targets, shares);
+  log_flush_all();
+  log_flush(LOG_STDOUT);
+  for (w = 0; w < nworkers; w++) {
+    int pfd[2];
+    pid_t pid;
+
+    if (pipe(pfd) == -1)
+      pfatal("%s: pipe", SCRIPT_ENGINE);
+    pid = fork();
+    if (pid == -1)
+      pfatal("%s: fork", SCRIPT_ENGINE);
+    if (pid == 0) {
+      close(pfd[0]);
+      for (i = 0; i < fds.size(); i++)
+        close(fds[i]);
+      script_worker(targets, shares[w], pfd[1], want_xml, w == 0);
+    }
+    close(pfd[1]);
+    pids.push_back(pid);
+    fds.push_back(pfd[0]);
+  }
+
+  /* A worker only writes once it is done, and then exits, so the results can
+     be collected one worker at a time. */
+  ndone = 0;
+  for (w = 0; w < nworkers; w++) {
+    std::string buf;
+    bool ok;
+    pid_t pid;
+    int status;
+
+    ok = read_all(fds[w], buf);
+    close(fds[w]);
+    while ((pid = waitpid(pids[w], &status, 0)) == -1 && errno == EINTR)
+      ;
+    ok = ok && pid == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok || !apply_worker_results(targets, buf, lua_data))
+      error("%s: Script worker %lu failed, results for some of its %lu hosts are missing.",
+          SCRIPT_ENGINE, (unsigned long) w + 1, (unsigned long) shares[w].size());
+    ndone += shares[w].size();
+    SPM->printStatsIfNecessary((double) ndone / targets.size(), NULL);
+  }
+  SPM->endTask(NULL, NULL);
+  delete SPM;
+
+  lua_settop(L_NSE, 0);
+  lua_pushcfunction(L_NSE, nseU_traceback);
+  lua_pushcfunction(L_NSE, merge_workers);
+  lua_pushlightuserdata(L_NSE, &targets);
+  lua_pushlightuserdata(L_NSE, &lua_data);
+  if (lua_pcall(L_NSE, 2, 0, 1))
+    error("%s: failed to merge script worker results: %s", SCRIPT_ENGINE,
+        lua_tostring(L_NSE, -1));
+  lua_settop(L_NSE, 0);
+}
+#endif
+
+void script_scan (std::vector<Target *> &targets, stype scantype)
+{
+  o.current_scantype = scantype;
+
+  assert(L_NSE != NULL);
+#ifndef WIN32
+  if (scantype == SCRIPT_SCAN && o.script_workers > 1 && targets.size() > 1) {
+    script_scan_workers(targets);
+    return;
+  }
+#endif
+  script_scan_targets(targets);
+}
+
 void close_nse (void)
 {
   if (L_NSE != NULL)
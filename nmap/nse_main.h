@@ -25,15 +25,22 @@ class ScriptResult
     /* Unstructured output string, for scripts that do not return a structured
        table, or return a string in addition to a table. */
     std::string output_str;
+    /* Structured output already rendered as XML, for results that were
+       produced by a script worker process and so have no table in L_NSE. */
+    std::string output_xml;
+    bool have_output_xml;
   public:
     ScriptResult() {
       output_ref = LUA_NOREF;
+      have_output_xml = false;
     }
     void clear (void);
     void set_output_tab (lua_State *, int);
     void set_output_str (const char *);
     void set_output_str (const char *, size_t);
     std::string get_output_str (void) const;
+    void set_output_xml (const std::string &);
+    bool get_output_xml (std::string &) const;
     void set_id (const char *);
     const char *get_id (void) const;
     void write_xml() const;
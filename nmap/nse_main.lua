@@ -51,6 +51,9 @@ local DESTRUCTOR = "NSE_DESTRUCTOR";
 local SELECTED_BY_NAME = "NSE_SELECTED_BY_NAME";
 local FORMAT_TABLE = "NSE_FORMAT_TABLE";
 local FORMAT_XML = "NSE_FORMAT_XML";
+local WORKER_START = "NSE_WORKER_START";
+local WORKER_FINISH = "NSE_WORKER_FINISH";
+local WORKER_MERGE = "NSE_WORKER_MERGE";
 
 -- Unique value indicating the action function is going to run.
 local ACTION_STARTING = {};
@@ -106,6 +109,7 @@ local lines = io.lines;
 local open = io.open;
 
 local math = require "math";
+local huge = math.huge;
 local max = math.max;
 
 local package = require "package";
@@ -852,6 +856,10 @@ local function get_chosen_scripts (rules)
   return chosen_scripts;
 end
 
+-- True in a script worker, where the parent prints the progress messages.
+-- The first worker still prints the runlevel messages.
+local in_worker, first_worker = false, false;
+
 -- run(threads)
 -- The main loop function for NSE. It handles running all the script threads.
 -- Arguments:
@@ -940,7 +948,8 @@ local function run (threads_iter, hosts)
     return current and current.worker;
   end);
 
-  local progress = cnse.scan_progress_meter(NAME);
+  local progress = in_worker and function () end
+      or cnse.scan_progress_meter(NAME);
 
   -- Loop while any thread is running or waiting.
   while next(running) or next(waiting) or threads_iter do
@@ -957,7 +966,9 @@ local function run (threads_iter, hosts)
     end
 
     local nr, nw = table_size(running), table_size(waiting);
-    if cnse.key_was_pressed() then
+    if in_worker then
+      -- The parent reports progress.
+    elseif cnse.key_was_pressed() then
       print_verbose(1, "Active NSE Script Threads: %d (%d waiting)\n",
           nr+nw, nw);
       progress("printStats", 1-(nr+nw)/total);
@@ -1084,6 +1095,183 @@ function format_xml(obj, key)
 end
 _R[FORMAT_XML] = format_xml
 
+-- With --script-workers, nse_main.cc forks copies of this state to run the
+-- script scan phase for a share of the hosts each. Script output is passed
+-- back by the C side. The functions below carry back everything else a worker
+-- changes that the parent must see: nmap.registry, and the port states and
+-- versions set by scripts.
+
+-- Encodes the plain data in v (tables, strings, numbers and booleans) into
+-- out, an array of strings, for decode_value. Other values, and tables that
+-- contain themselves, are encoded as nil; table entries whose key or value
+-- would be nil are left out.
+local function encode_value (v, out, active)
+  local t = type(v);
+  if t == "string" then
+    out[#out+1] = "s"..#v..":"..v;
+  elseif t == "number" then
+    if v ~= v then
+      out[#out+1] = "i?";
+    elseif v == huge then
+      out[#out+1] = "i+";
+    elseif v == -huge then
+      out[#out+1] = "i-";
+    else
+      out[#out+1] = format("n%.17g;", v);
+    end
+  elseif t == "boolean" then
+    out[#out+1] = v and "b1" or "b0";
+  elseif t == "table" and not active[v] then
+    active[v] = true;
+    out[#out+1] = "t";
+    for k, e in pairs(v) do
+      local kt, et = type(k), type(e);
+      if (kt == "string" or kt == "number" or kt == "boolean") and k == k and
+          (et == "string" or et == "number" or et == "boolean" or
+          (et == "table" and not active[e])) then
+        encode_value(k, out, active);
+        encode_value(e, out, active);
+      end
+    end
+    out[#out+1] = "e";
+    active[v] = nil;
+  else
+    out[#out+1] = "x";
+  end
+end
+
+local function encode (v)
+  local out = {};
+  encode_value(v, out, {});
+  return concat(out);
+end
+
+-- Decodes the value that starts at position i of s, returning it and the
+-- position after it.
+local function decode_value (s, i)
+  local c = sub(s, i, i);
+  if c == "s" then
+    local colon = find(s, ":", i+1, true);
+    local n = tonumber(sub(s, i+1, colon-1));
+    return sub(s, colon+1, colon+n), colon+n+1;
+  elseif c == "n" then
+    local semi = find(s, ";", i+1, true);
+    return tonumber(sub(s, i+1, semi-1)), semi+1;
+  elseif c == "i" then
+    c = sub(s, i+1, i+1);
+    return c == "+" and huge or c == "-" and -huge or 0/0, i+2;
+  elseif c == "b" then
+    return sub(s, i+1, i+1) == "1", i+2;
+  elseif c == "t" then
+    local t = {};
+    i = i+1;
+    while sub(s, i, i) ~= "e" do
+      local k, v;
+      k, i = decode_value(s, i);
+      v, i = decode_value(s, i);
+      t[k] = v;
+    end
+    return t, i+1;
+  else
+    assert(c == "x", "corrupt script worker data");
+    return nil, i+1;
+  end
+end
+
+local function decode (s)
+  return (decode_value(s, 1));
+end
+
+local function same (a, b)
+  if type(a) ~= "table" or type(b) ~= "table" then
+    return a == b or (a ~= a and b ~= b);
+  end
+  for k, v in pairs(a) do
+    if not same(v, b[k]) then return false end
+  end
+  for k in pairs(b) do
+    if a[k] == nil then return false end
+  end
+  return true;
+end
+
+-- Merges the changes one worker made to a registry table (src) into ours
+-- (dst). base is what the table held when the workers were started. Entries
+-- the worker did not change are left alone, so that workers adding different
+-- keys to the same table all keep them. Array elements past the end of the
+-- array in base were appended by the worker, and are appended to ours after
+-- those of earlier workers.
+local function merge_registry (dst, src, base)
+  local n, last = #base, #src;
+  for k, v in pairs(src) do
+    local b, d = base[k], dst[k];
+    if type(k) == "number" and k > n and k <= last and k % 1 == 0 then
+      -- appended below
+    elseif same(v, b) then
+      -- unchanged
+    elseif type(v) == "table" and type(d) == "table" then
+      merge_registry(d, v, type(b) == "table" and b or {});
+    else
+      dst[k] = v;
+    end
+  end
+  for i = n+1, last do
+    dst[#dst+1] = src[i];
+  end
+  for k in pairs(base) do
+    if src[k] == nil then
+      dst[k] = nil;
+    end
+  end
+end
+
+-- The port changes made in a worker, replayed by the parent in order.
+local worker_changes;
+
+_R[WORKER_START] = function (first)
+  in_worker, first_worker = true, first;
+  local set_port_state = nmap.set_port_state;
+  local set_port_version = nmap.set_port_version;
+  local function record (f, host, port, ...)
+    worker_changes[#worker_changes+1] = {
+      f, {ip = host.ip, targetname = host.targetname},
+      {number = port.number, protocol = port.protocol,
+        version = type(port.version) == "table" and tcopy(port.version) or nil},
+      ...
+    };
+  end
+  worker_changes = {};
+  function nmap.set_port_state (host, port, ...)
+    set_port_state(host, port, ...);
+    record("set_port_state", host, port, ...);
+  end
+  function nmap.set_port_version (host, port, ...)
+    set_port_version(host, port, ...);
+    record("set_port_version", host, port, ...);
+  end
+end
+
+_R[WORKER_FINISH] = function ()
+  return encode({registry = nmap.registry, changes = worker_changes});
+end
+
+-- Called in the parent with the data returned by WORKER_FINISH in each worker,
+-- in worker order. The workers' hosts are in NSE_CURRENT_HOSTS.
+_R[WORKER_MERGE] = function (...)
+  local base = decode(encode(nmap.registry));
+  for i = 1, select("#", ...) do
+    local data = decode((select(i, ...)));
+    merge_registry(nmap.registry, data.registry, base);
+    for _, change in ipairs(data.changes) do
+      local status, err = pcall(nmap[change[1]], unpack(change, 2));
+      if not status then
+        print_debug(1, "Failed to replay %s from a script worker: %s",
+            change[1], err);
+      end
+    end
+  end
+end
+
 -- Format NSEDoc markup (e.g., including bullet lists and <code> sections) into
 -- a display string at the given indentation level. Currently this only indents
 -- the string and doesn't interpret any other markup.
@@ -1304,6 +1492,8 @@ local function main (hosts, scantype)
 
   if scantype == NSE_PRE_SCAN then
     print_verbose(1, "Script Pre-scanning.");
+  elseif scantype == NSE_SCAN and in_worker then
+    -- The parent has said how many hosts it is scanning.
   elseif scantype == NSE_SCAN then
     if #hosts > 1 then
       print_verbose(1, "Script scanning %d hosts.", #hosts);
@@ -1358,7 +1548,9 @@ local function main (hosts, scantype)
         end
       end
     end
-    print_verbose(2, "Starting runlevel %u (of %u) scan.", runlevel, #runlevels);
+    if not in_worker or first_worker then
+      print_verbose(2, "Starting runlevel %u (of %u) scan.", runlevel, #runlevels);
+    end
     run(wrap(threads_iter), hosts)
   end
 
@@ -26,6 +26,9 @@
 
 #define DEFAULT_TIMEOUT 30000
 
+/* Registry key of the pool userdata, which is also the NSOCK_POOL upvalue. */
+#define NSE_NSOCK_POOL "NSE_NSOCK_POOL"
+
 /* Upvalues for library variables */
 enum {
   NSOCK_POOL = lua_upvalueindex(1),
@@ -76,10 +79,9 @@ static int gc_pool (lua_State *L)
   return 0;
 }
 
-static nsock_pool new_pool (lua_State *L)
+static nsock_pool pool_create (void)
 {
   nsock_pool nsp = nsp_new(NULL);
-  nsock_pool *nspp;
 
   /* configure logging */
   nsock_set_log_function(nsp, nmap_nsock_stderr_logger);
@@ -92,6 +94,17 @@ static nsock_pool new_pool (lua_State *L)
 
   nsp_setbroadcast(nsp, true);
 
+  /* Scripts against many hosts keep lots of socket timeouts pending. */
+  nsp_settimerwheel(nsp, 1);
+
+  return nsp;
+}
+
+static nsock_pool new_pool (lua_State *L)
+{
+  nsock_pool nsp = pool_create();
+  nsock_pool *nspp;
+
   nspp = (nsock_pool *) lua_newuserdata(L, sizeof(nsock_pool));
   *nspp = nsp;
   lua_newtable(L);
@@ -101,6 +114,25 @@ static nsock_pool new_pool (lua_State *L)
   return nsp;
 }
 
+/* Give the library a fresh pool, for a script worker process that was forked
+ * after the library was opened (see script_scan_workers in nse_main.cc). The
+ * inherited pool is abandoned rather than deleted: its engine state (an epoll
+ * descriptor, for instance) is shared with the parent, and tearing it down
+ * would unregister the parent's descriptors too.
+ */
+void nse_nsock_new_pool (lua_State *L)
+{
+  nsock_pool *nspp;
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_NSOCK_POOL);
+  nspp = (nsock_pool *) lua_touserdata(L, -1);
+  assert(nspp != NULL);
+  *nspp = pool_create();
+#if HAVE_OPENSSL
+  nsp_ssl_init_max_speed(*nspp);
+#endif
+  lua_pop(L, 1);
+}
+
 static nsock_pool get_pool (lua_State *L)
 {
   nsock_pool *nspp;
@@ -537,7 +569,8 @@ static int l_send (lua_State *L)
   NSOCK_UDATA_ENSURE_OPEN(L, nu);
   size_t size;
   const char *string = luaL_checklstring(L, 2, &size);
-  trace(nu->nsiod, hexify((unsigned char *) string, size).c_str(), TO);
+  if (o.scriptTrace())
+    trace(nu->nsiod, hexify((unsigned char *) string, size).c_str(), TO);
   nsock_write(nsp, nu->nsiod, callback, nu->timeout, nu, string, size);
   return yield(L, nu, "SEND", TO, 0, NULL);
 }
@@ -563,7 +596,8 @@ static int l_sendto (lua_State *L)
     return nseU_safeerror(L, "getaddrinfo returned success but no addresses");
 
   nsock_sendto(nsp, nu->nsiod, callback, nu->timeout, nu, dest->ai_addr, dest->ai_addrlen, port, string, size);
-  trace(nu->nsiod, hexify((unsigned char *) string, size).c_str(), TO);
+  if (o.scriptTrace())
+    trace(nu->nsiod, hexify((unsigned char *) string, size).c_str(), TO);
   freeaddrinfo(dest);
   return yield(L, nu, "SEND", TO, 0, NULL);
 
@@ -578,7 +612,9 @@ static void receive_callback (nsock_pool nsp, nsock_event nse, void *udata)
   {
     int len;
     const char *str = nse_readbuf(nse, &len);
-    trace(nse_iod(nse), hexify((const unsigned char *) str, len).c_str(), FROM);
+    /* Don't hex dump the data unless it is going to be printed */
+    if (o.scriptTrace())
+      trace(nse_iod(nse), hexify((const unsigned char *) str, len).c_str(), FROM);
     lua_pushboolean(L, true);
     lua_pushlstring(L, str, len);
     nse_restore(L, 2);
@@ -1060,6 +1096,8 @@ LUALIB_API int luaopen_nsock (lua_State *L)
 
   /* library upvalues */
   nsock_pool nsp = new_pool(L); /* NSOCK_POOL */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, NSE_NSOCK_POOL);
   lua_newtable(L); /* NSOCK_SOCKET */
   lua_newtable(L); /* PCAP_SOCKET */
   nseU_weaktable(L, 0, MAX_PARALLELISM, "k"); /* THREAD_SOCKETS */
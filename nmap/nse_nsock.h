@@ -4,6 +4,7 @@
 #include "nse_main.h"
 
 LUALIB_API int luaopen_nsock (lua_State *);
+void nse_nsock_new_pool (lua_State *);
 
 #endif
 
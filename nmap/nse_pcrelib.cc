@@ -25,6 +25,24 @@ extern "C" {
 
 #include "nse_pcrelib.h"
 
+/* With PCRE 8.20 or later, regexes are JIT-compiled when studied and share
+   one JIT stack; NSE runs one match at a time. */
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define NSE_PCRE_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+
+static pcre_jit_stack *nse_jit_stack(void)
+{
+        static pcre_jit_stack *stack = NULL;
+
+        if (stack == NULL)
+                stack = pcre_jit_stack_alloc(32 * 1024, 1024 * 1024);
+        return stack;
+}
+#else
+#define NSE_PCRE_STUDY_OPTIONS 0
+#define pcre_free_study pcre_free
+#endif
+
 static int get_startoffset(lua_State *L, int stackpos, size_t len)
 {
         int startoffset = luaL_optint(L, stackpos, 1);
@@ -132,8 +150,11 @@ static int Lpcre_comp(lua_State *L)
                 luaL_error(L, buf);
         }
 
-        ud->extra = pcre_study(ud->pr, 0, &error);
+        ud->extra = pcre_study(ud->pr, NSE_PCRE_STUDY_OPTIONS, &error);
         if(error) luaL_error(L, error);
+#ifdef PCRE_STUDY_JIT_COMPILE
+        if(ud->extra) pcre_assign_jit_stack(ud->extra, NULL, nse_jit_stack());
+#endif
 
         pcre_fullinfo(ud->pr, ud->extra, PCRE_INFO_CAPTURECOUNT, &ud->ncapt);
         /* need (2 ints per capture, plus one for substring match) * 3/2 */
@@ -292,7 +313,7 @@ static int Lpcre_gc (lua_State *L)
         pcre2 *ud = (pcre2 *)luaL_checkudata(L, 1, pcre_handle);
         if (ud) {
                 if(ud->pr)      pcre_free(ud->pr);
-                if(ud->extra)   pcre_free(ud->extra);
+                if(ud->extra)   pcre_free_study(ud->extra);
                 if(ud->tables)  pcre_free((void *)ud->tables);
                 if(ud->match)   free(ud->match);
         }
@@ -231,6 +231,12 @@ void nsp_setbroadcast(nsock_pool nsp, int optval);
 /* Sets the name of the interface for new sockets to bind to. */
 void nsp_setdevice(nsock_pool nsp, const char *device);
 
+/* Keeps event timeouts in a hierarchical timing wheel rather than in a binary
+ * heap if enable is non-zero. This makes adding and cancelling events with a
+ * timeout O(1), which helps when very many of them are pending. Default is off
+ * (0, false). */
+void nsp_settimerwheel(nsock_pool nsp, int enable);
+
 /* Initializes an Nsock pool to create SSL connections. This sets an internal
  * SSL_CTX, which is like a template that sets options for all connections that
  * are made from it. Returns the SSL_CTX so you can set your own options. */
@@ -358,6 +364,12 @@ nsock_event_id nse_id(nsock_event nse);
  * NUL-terminated and it may even contain nuls */
 char *nse_readbuf(nsock_event nse, int *nbytes);
 
+/* Like nse_readbuf(), but the caller takes the buffer over and must free() it
+ * when done with it. Use this rather than copying the data when it has to be
+ * kept after the handler returns. The event is left with an empty buffer. The
+ * returned buffer is never NULL. */
+char *nse_readbuf_steal(nsock_event nse, int *nbytes);
+
 /* Obtains the nsock_iod (see below) associated with the event.  Note that some
  * events (such as timers) don't have an nsock_iod associated with them */
 nsock_iod nse_iod(nsock_event nse);
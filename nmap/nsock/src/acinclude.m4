@@ -118,3 +118,30 @@ $1],[AC_MSG_RESULT([no])
 $2])
 ])dnl
 
+# AX_HAVE_IO_URING([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# Checks for the io_uring(7) system calls and for kernel headers recent
+# enough (Linux 5.11) to describe io_uring_enter() wait timeouts. liburing
+# is not needed.
+AC_DEFUN([AX_HAVE_IO_URING], [dnl
+  AC_MSG_CHECKING([for Linux io_uring(7) interface])
+  AC_CACHE_VAL([ax_cv_have_io_uring], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM([dnl
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+], [dnl
+struct io_uring_params p;
+struct io_uring_getevents_arg arg;
+int fd;
+fd = syscall(__NR_io_uring_setup, 1, &p);
+syscall(__NR_io_uring_enter, fd, 0, 0,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));])],
+      [ax_cv_have_io_uring=yes],
+      [ax_cv_have_io_uring=no])])
+  AS_IF([test "${ax_cv_have_io_uring}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
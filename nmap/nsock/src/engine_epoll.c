@@ -263,15 +263,10 @@ int epoll_loop(struct npool *nsp, int msec_timeout) {
   }
 
   do {
-    struct nevent *nse;
-
     nsock_log_debug_all(nsp, "wait for events");
 
-    nse = next_expirable_event(nsp);
-    if (!nse)
-      event_msecs = -1; /* None of the events specified a timeout */
-    else
-      event_msecs = MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+    /* -1 if none of the events specified a timeout */
+    event_msecs = expirable_next_msecs(nsp);
 
 #if HAVE_PCAP
 #ifndef PCAP_CAN_DO_SELECT
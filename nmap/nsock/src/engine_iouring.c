@@ -0,0 +1,610 @@
+/***************************************************************************
+ * engine_iouring.c -- io_uring(7) based IO engine.                        *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2013 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "nsock_internal.h"
+#include "nsock_log.h"
+
+#if HAVE_PCAP
+#include "nsock_pcap.h"
+#endif
+
+/* Number of submission queue entries. This only bounds how many requests are
+ * batched into a single io_uring_enter() call. */
+#define IOURING_SQ_ENTRIES 256
+/* Number of completion queue entries. Every armed descriptor can complete in
+ * the same round; the kernel holds on to completions that don't fit
+ * (IORING_FEAT_NODROP) until we make room. */
+#define IOURING_CQ_ENTRIES 16384
+
+#define EV_LIST_INIT_SIZE 1024
+
+#define IOURING_R_FLAGS (POLLIN | POLLPRI)
+#define IOURING_W_FLAGS POLLOUT
+#ifdef POLLRDHUP
+  #define IOURING_X_FLAGS (POLLERR | POLLHUP | POLLRDHUP)
+#else
+  #define IOURING_X_FLAGS (POLLERR | POLLHUP)
+#endif /* POLLRDHUP */
+
+/* user_data of the POLL_REMOVE requests, whose completions we ignore. Poll
+ * requests carry the descriptor in the low 32 bits and the generation of its
+ * slot in the high 32 bits, so this value can never collide with one. */
+#define IOURING_REMOVE_TAG (~(__u64)0)
+
+
+/* --- ENGINE INTERFACE PROTOTYPES --- */
+static int iouring_init(struct npool *nsp);
+static void iouring_destroy(struct npool *nsp);
+static int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev);
+static int iouring_iod_unregister(struct npool *nsp, struct niod *iod);
+static int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr);
+static int iouring_loop(struct npool *nsp, int msec_timeout);
+
+
+/* ---- ENGINE DEFINITION ---- */
+struct io_engine engine_iouring = {
+  "io_uring",
+  iouring_init,
+  iouring_destroy,
+  iouring_iod_register,
+  iouring_iod_unregister,
+  iouring_iod_modify,
+  iouring_loop
+};
+
+
+/* --- INTERNAL PROTOTYPES --- */
+static void iterate_through_event_lists(struct npool *nsp);
+
+/* defined in nsock_core.c */
+void process_iod_events(struct npool *nsp, struct niod *nsi, int ev);
+void process_event(struct npool *nsp, gh_list_t *evlist, struct nevent *nse, int ev);
+void process_expired_events(struct npool *nsp);
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+int pcap_read_on_nonselect(struct npool *nsp);
+#endif
+#endif
+
+/* defined in nsock_event.c */
+void update_first_events(struct nevent *nse);
+
+
+extern struct timeval nsock_tod;
+
+
+/*
+ * Engine specific data structures
+ */
+
+/* Per-descriptor state. Polls are one-shot: each completion disarms the
+ * descriptor and it is armed again, with whatever events its IOD watches by
+ * then, right before the next wait. Changing the watched events cancels the
+ * armed poll. Bumping gen makes any completion still in flight for an older
+ * poll on the same descriptor stale. */
+struct iouring_slot {
+  struct niod *iod;
+  unsigned int gen;
+  /* Poll mask currently armed in the kernel, or 0 */
+  short armed;
+  /* Set while the descriptor is in the dirty list */
+  char dirty;
+};
+
+struct iouring_engine_info {
+  int ringfd;
+
+  /* Submission queue ring */
+  void *sq_ptr;
+  size_t sq_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned sq_entries;
+
+  /* Completion queue ring, possibly sharing the mapping of the SQ ring */
+  void *cq_ptr;
+  size_t cq_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Descriptor slots, indexed by fd */
+  int capacity;
+  struct iouring_slot *slots;
+
+  /* Descriptors that need to be (re)armed before the next wait */
+  int *dirty;
+  int ndirty;
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static inline void slots_grow(struct iouring_engine_info *iinfo, int fd) {
+  int i = iinfo->capacity;
+
+  if (fd < iinfo->capacity)
+    return;
+
+  if (iinfo->capacity == 0)
+    iinfo->capacity = EV_LIST_INIT_SIZE;
+  while (iinfo->capacity <= fd)
+    iinfo->capacity *= 2;
+
+  iinfo->slots = (struct iouring_slot *)safe_realloc(iinfo->slots, sizeof(struct iouring_slot) * iinfo->capacity);
+  iinfo->dirty = (int *)safe_realloc(iinfo->dirty, sizeof(int) * iinfo->capacity);
+  memset(iinfo->slots + i, 0, sizeof(struct iouring_slot) * (iinfo->capacity - i));
+}
+
+static inline void mark_dirty(struct iouring_engine_info *iinfo, int fd) {
+  if (!iinfo->slots[fd].dirty) {
+    iinfo->slots[fd].dirty = 1;
+    iinfo->dirty[iinfo->ndirty++] = fd;
+  }
+}
+
+/* Number of SQEs queued that the kernel hasn't consumed yet. */
+static inline unsigned sq_pending(const struct iouring_engine_info *iinfo) {
+  return *iinfo->sq_tail - __atomic_load_n(iinfo->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Hand the queued SQEs to the kernel without waiting for anything. */
+static void submit_pending(struct npool *nsp) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int rc;
+
+  while (sq_pending(iinfo) > 0) {
+    rc = sys_io_uring_enter(iinfo->ringfd, sq_pending(iinfo), 0, 0, NULL, 0);
+    if (rc < 0 && errno != EINTR)
+      fatal("Unable to submit io_uring requests: %s", strerror(errno));
+  }
+}
+
+/* Returns a zeroed SQE at the tail of the submission ring, flushing the ring
+ * first if it is full. */
+static struct io_uring_sqe *get_sqe(struct npool *nsp) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
+
+  if (sq_pending(iinfo) >= iinfo->sq_entries)
+    submit_pending(nsp);
+  tail = *iinfo->sq_tail;
+
+  idx = tail & *iinfo->sq_mask;
+  sqe = &iinfo->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  iinfo->sq_array[idx] = idx;
+  return sqe;
+}
+
+static void queue_sqe(struct iouring_engine_info *iinfo) {
+  __atomic_store_n(iinfo->sq_tail, *iinfo->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline __u64 poll_user_data(const struct iouring_slot *slot, int fd) {
+  return ((__u64)slot->gen << 32) | (__u32)fd;
+}
+
+static void queue_poll_add(struct npool *nsp, int fd) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct iouring_slot *slot = &iinfo->slots[fd];
+  struct io_uring_sqe *sqe;
+  int ev = slot->iod->watched_events;
+  short mask = 0;
+
+  if (ev & EV_READ)
+    mask |= IOURING_R_FLAGS;
+  if (ev & EV_WRITE)
+    mask |= IOURING_W_FLAGS;
+  if (ev & EV_EXCEPT)
+    mask |= IOURING_X_FLAGS;
+  if (mask == 0)
+    return;
+
+  sqe = get_sqe(nsp);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = mask;
+  sqe->user_data = poll_user_data(slot, fd);
+  queue_sqe(iinfo);
+  slot->armed = mask;
+}
+
+/* Cancel the poll armed on fd, if any, and invalidate its completion. */
+static void disarm(struct npool *nsp, int fd) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  struct iouring_slot *slot = &iinfo->slots[fd];
+  struct io_uring_sqe *sqe;
+
+  if (slot->armed) {
+    sqe = get_sqe(nsp);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = poll_user_data(slot, fd);
+    sqe->user_data = IOURING_REMOVE_TAG;
+    queue_sqe(iinfo);
+    slot->armed = 0;
+  }
+  slot->gen++;
+}
+
+
+int iouring_init(struct npool *nsp) {
+  struct iouring_engine_info *iinfo;
+  struct io_uring_params p;
+
+  iinfo = (struct iouring_engine_info *)safe_zalloc(sizeof(struct iouring_engine_info));
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = IOURING_CQ_ENTRIES;
+  iinfo->ringfd = sys_io_uring_setup(IOURING_SQ_ENTRIES, &p);
+  if (iinfo->ringfd < 0)
+    fatal("Unable to create io_uring instance: %s", strerror(errno));
+  if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+    fatal("The io_uring engine needs Linux 5.11 or later");
+
+  iinfo->sq_entries = p.sq_entries;
+  iinfo->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  iinfo->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (iinfo->cq_len > iinfo->sq_len)
+      iinfo->sq_len = iinfo->cq_len;
+    iinfo->cq_len = 0;
+  }
+
+  iinfo->sq_ptr = mmap(NULL, iinfo->sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, iinfo->ringfd, IORING_OFF_SQ_RING);
+  if (iinfo->sq_ptr == MAP_FAILED)
+    fatal("Unable to map io_uring submission queue: %s", strerror(errno));
+  if (iinfo->cq_len) {
+    iinfo->cq_ptr = mmap(NULL, iinfo->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, iinfo->ringfd, IORING_OFF_CQ_RING);
+    if (iinfo->cq_ptr == MAP_FAILED)
+      fatal("Unable to map io_uring completion queue: %s", strerror(errno));
+  } else {
+    iinfo->cq_ptr = iinfo->sq_ptr;
+  }
+  iinfo->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  iinfo->sqes = (struct io_uring_sqe *)mmap(NULL, iinfo->sqes_len, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, iinfo->ringfd, IORING_OFF_SQES);
+  if (iinfo->sqes == MAP_FAILED)
+    fatal("Unable to map io_uring submission entries: %s", strerror(errno));
+
+  iinfo->sq_head = (unsigned *)((char *)iinfo->sq_ptr + p.sq_off.head);
+  iinfo->sq_tail = (unsigned *)((char *)iinfo->sq_ptr + p.sq_off.tail);
+  iinfo->sq_mask = (unsigned *)((char *)iinfo->sq_ptr + p.sq_off.ring_mask);
+  iinfo->sq_array = (unsigned *)((char *)iinfo->sq_ptr + p.sq_off.array);
+  iinfo->cq_head = (unsigned *)((char *)iinfo->cq_ptr + p.cq_off.head);
+  iinfo->cq_tail = (unsigned *)((char *)iinfo->cq_ptr + p.cq_off.tail);
+  iinfo->cq_mask = (unsigned *)((char *)iinfo->cq_ptr + p.cq_off.ring_mask);
+  iinfo->cqes = (struct io_uring_cqe *)((char *)iinfo->cq_ptr + p.cq_off.cqes);
+
+  slots_grow(iinfo, 0);
+
+  nsp->engine_data = (void *)iinfo;
+
+  return 1;
+}
+
+void iouring_destroy(struct npool *nsp) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert(iinfo != NULL);
+  munmap(iinfo->sqes, iinfo->sqes_len);
+  if (iinfo->cq_len)
+    munmap(iinfo->cq_ptr, iinfo->cq_len);
+  munmap(iinfo->sq_ptr, iinfo->sq_len);
+  /* Closing the ring cancels whatever is still armed */
+  close(iinfo->ringfd);
+  free(iinfo->slots);
+  free(iinfo->dirty);
+  free(iinfo);
+}
+
+int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int sd;
+
+  assert(!IOD_PROPGET(iod, IOD_REGISTERED));
+
+  iod->watched_events = ev;
+
+  sd = nsi_getsd(iod);
+  slots_grow(iinfo, sd);
+  assert(iinfo->slots[sd].iod == NULL);
+  iinfo->slots[sd].iod = iod;
+  iinfo->slots[sd].gen++;
+  mark_dirty(iinfo, sd);
+
+  IOD_PROPSET(iod, IOD_REGISTERED);
+  return 1;
+}
+
+int iouring_iod_unregister(struct npool *nsp, struct niod *iod) {
+  iod->watched_events = EV_NONE;
+
+  /* some IODs can be unregistered here if they're associated to an event that was
+   * immediately completed */
+  if (IOD_PROPGET(iod, IOD_REGISTERED)) {
+    struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+    int sd;
+
+    sd = nsi_getsd(iod);
+    disarm(nsp, sd);
+    iinfo->slots[sd].iod = NULL;
+
+    IOD_PROPCLR(iod, IOD_REGISTERED);
+  }
+  return 1;
+}
+
+int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  int new_events;
+  int sd;
+
+  assert((ev_set & ev_clr) == 0);
+  assert(IOD_PROPGET(iod, IOD_REGISTERED));
+
+  new_events = iod->watched_events;
+  new_events |= ev_set;
+  new_events &= ~ev_clr;
+
+  if (new_events == iod->watched_events)
+    return 1; /* nothing to do */
+
+  iod->watched_events = new_events;
+
+  /* The new mask is armed right before the next wait, so several changes
+   * in one round only cost one SQE, and none at all if the poll had already
+   * fired. */
+  sd = nsi_getsd(iod);
+  disarm(nsp, sd);
+  mark_dirty(iinfo, sd);
+
+  return 1;
+}
+
+int iouring_loop(struct npool *nsp, int msec_timeout) {
+  int results_left = 0;
+  int event_msecs; /* msecs before an event goes off */
+  int combined_msecs;
+  int sock_err = 0;
+  int i;
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert(msec_timeout >= -1);
+
+  if (nsp->events_pending == 0)
+    return 0; /* No need to wait on 0 events ... */
+
+  /* Arm every descriptor whose poll fired or whose events changed since the
+   * last wait. The SQEs go to the kernel with the wait below. */
+  for (i = 0; i < iinfo->ndirty; i++) {
+    int fd = iinfo->dirty[i];
+    struct iouring_slot *slot = &iinfo->slots[fd];
+
+    slot->dirty = 0;
+    if (slot->iod != NULL && !slot->armed)
+      queue_poll_add(nsp, fd);
+  }
+  iinfo->ndirty = 0;
+
+  do {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 1;
+
+    nsock_log_debug_all(nsp, "wait for events");
+
+    /* -1 if none of the events specified a timeout */
+    event_msecs = expirable_next_msecs(nsp);
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* Force a low timeout when capturing packets on systems where
+     * the pcap descriptor is not select()able. */
+    if (gh_list_count(&nsp->pcap_read_events) > 0)
+      if (event_msecs > PCAP_POLL_INTERVAL)
+        event_msecs = PCAP_POLL_INTERVAL;
+#endif
+#endif
+
+    /* We cast to unsigned because we want -1 to be very high (since it means no
+     * timeout) */
+    combined_msecs = MIN((unsigned)event_msecs, (unsigned)msec_timeout);
+
+    memset(&arg, 0, sizeof(arg));
+    if (combined_msecs >= 0) {
+      ts.tv_sec = combined_msecs / 1000;
+      ts.tv_nsec = (combined_msecs % 1000) * 1000000L;
+      arg.ts = (__u64)(unsigned long)&ts;
+    }
+    if (combined_msecs == 0)
+      min_complete = 0;
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* do non-blocking read on pcap devices that doesn't support select()
+     * If there is anything read, just leave this loop. */
+    if (pcap_read_on_nonselect(nsp)) {
+      /* okay, something was read. */
+      submit_pending(nsp);
+      results_left = 0;
+    } else
+#endif
+#endif
+    {
+      results_left = sys_io_uring_enter(iinfo->ringfd, sq_pending(iinfo),
+                                        min_complete, flags, &arg, sizeof(arg));
+      if (results_left == -1) {
+        sock_err = errno;
+        /* Timing out, or a CQ overflow the reaping below takes care of, are
+         * not errors */
+        if (sock_err == ETIME || sock_err == EBUSY)
+          results_left = 0;
+      }
+    }
+
+    gettimeofday(&nsock_tod, NULL); /* Due to io_uring delay */
+  } while (results_left == -1 && sock_err == EINTR); /* repeat only if signal occurred */
+
+  if (results_left == -1 && sock_err != EINTR) {
+    nsock_log_error(nsp, "nsock_loop error %d: %s", sock_err, socket_strerror(sock_err));
+    nsp->errnum = sock_err;
+    return -1;
+  }
+
+  iterate_through_event_lists(nsp);
+
+  return 1;
+}
+
+
+/* ---- INTERNAL FUNCTIONS ---- */
+static inline int get_evmask(int revents) {
+  int evmask = EV_NONE;
+
+  if (revents & IOURING_R_FLAGS)
+    evmask |= EV_READ;
+  if (revents & IOURING_W_FLAGS)
+    evmask |= EV_WRITE;
+  if (revents & IOURING_X_FLAGS)
+    evmask |= (EV_READ | EV_WRITE | EV_EXCEPT);
+
+  return evmask;
+}
+
+/* Iterate through all the event lists (such as connect_events, read_events,
+ * timer_events, etc) and take action for those that have completed (due to
+ * timeout, i/o, etc) */
+void iterate_through_event_lists(struct npool *nsp) {
+  struct iouring_engine_info *iinfo = (struct iouring_engine_info *)nsp->engine_data;
+  unsigned head, tail;
+
+  head = *iinfo->cq_head;
+  tail = __atomic_load_n(iinfo->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &iinfo->cqes[head & *iinfo->cq_mask];
+    __u64 user_data = cqe->user_data;
+    int res = cqe->res;
+    struct iouring_slot *slot;
+    struct niod *nsi;
+    int fd;
+
+    /* Release the CQE first: handlers may flush the SQ, which needs room in
+     * the CQ */
+    head++;
+    __atomic_store_n(iinfo->cq_head, head, __ATOMIC_RELEASE);
+
+    if (user_data == IOURING_REMOVE_TAG)
+      continue;
+    fd = (int)(__u32)user_data;
+    if (fd >= iinfo->capacity)
+      continue;
+    slot = &iinfo->slots[fd];
+    if ((unsigned int)(user_data >> 32) != slot->gen || slot->iod == NULL)
+      continue; /* stale: disarmed or descriptor reused since */
+
+    slot->armed = 0;
+    mark_dirty(iinfo, fd);
+    nsi = slot->iod;
+
+    /* process all the pending events for this IOD. A failed poll is passed
+     * on as an exceptional condition so the handlers see the socket error. */
+    process_iod_events(nsp, nsi, res < 0 ? (EV_READ | EV_WRITE | EV_EXCEPT) : get_evmask(res));
+
+    if (nsi->state == NSIOD_STATE_DELETED) {
+      gh_list_remove(&nsp->active_iods, &nsi->nodeq);
+      gh_list_prepend(&nsp->free_iods, &nsi->nodeq);
+    }
+  }
+
+  /* iterate through timers and expired events */
+  process_expired_events(nsp);
+}
+
+#endif /* HAVE_IO_URING */
+
@@ -60,14 +60,11 @@
 
 #include <string.h>
 
-#define FS_INITSIZE_DEFAULT 1024
-
-
 /* Assumes space for fs has already been allocated */
 int filespace_init(struct filespace *fs, int initial_size) {
   memset(fs, 0, sizeof(struct filespace));
   if (initial_size == 0)
-    initial_size = FS_INITSIZE_DEFAULT;
+    return 0;
 
   fs->current_alloc = initial_size;
   fs->str = (char *)safe_malloc(fs->current_alloc);
@@ -85,6 +82,29 @@ int fs_free(struct filespace *fs) {
   return 0;
 }
 
+char *fs_reserve(struct filespace *fs, int len) {
+  assert(len >= 0);
+
+  if (fs->current_alloc - fs->current_size < len + 1) {
+    int pos = fs->pos - fs->str;
+
+    fs->current_alloc = (int)(fs->current_alloc * 1.4 + 1);
+    fs->current_alloc += 100 + len;
+
+    fs->str = (char *)safe_realloc(fs->str, fs->current_alloc);
+    fs->pos = fs->str + pos;
+  }
+  return fs->str + fs->current_size;
+}
+
+void fs_commit(struct filespace *fs, int len) {
+  assert(len >= 0);
+  assert(fs->current_size + len < fs->current_alloc);
+
+  fs->current_size += len;
+  fs->str[fs->current_size] = '\0';
+}
+
 /* Concatenate a string to the end of a filespace */
 int fs_cat(struct filespace *fs, const char *str, int len) {
   if (len < 0)
@@ -93,26 +113,28 @@ int fs_cat(struct filespace *fs, const char *str, int len) {
   if (len == 0)
     return 0;
 
-  if (fs->current_alloc - fs->current_size < len + 2) {
-    char *tmpstr;
+  memcpy(fs_reserve(fs, len), str, len);
+  fs_commit(fs, len);
+  return 0;
+}
 
-    fs->current_alloc = (int)(fs->current_alloc * 1.4 + 1);
-    fs->current_alloc += 100 + len;
+void fs_attach(struct filespace *fs, char *buf, int alloc) {
+  assert(fs->str == NULL);
+  assert(alloc > 0);
 
-    tmpstr = (char *)safe_malloc(fs->current_alloc);
-    memcpy(tmpstr, fs->str, fs->current_size);
+  fs->current_alloc = alloc;
+  fs->current_size = 0;
+  fs->str = fs->pos = buf;
+  fs->str[0] = '\0';
+}
 
-    fs->pos = (fs->pos - fs->str) + tmpstr;
+char *fs_detach(struct filespace *fs, int *len) {
+  char *str = fs->str;
 
-    if (fs->str)
-      free(fs->str);
+  if (len)
+    *len = fs->current_size;
 
-    fs->str = tmpstr;
-  }
-  memcpy(fs->str + fs->current_size, str, len);
-
-  fs->current_size += len;
-  fs->str[fs->current_size] = '\0';
-  return 0;
+  fs->current_alloc = fs->current_size = 0;
+  fs->pos = fs->str = NULL;
+  return str;
 }
-
@@ -96,11 +96,31 @@ static inline char *fs_str(const struct filespace *fs) {
 }
 
 
+/* With an initial_size of 0, nothing is allocated until data is added */
 int filespace_init(struct filespace *fs, int initial_size);
 
 int fs_free(struct filespace *fs);
 
 int fs_cat(struct filespace *fs, const char *str, int len);
 
+/* Make room for len more bytes (and the terminating NUL) at the end of the
+ * filespace and return where they go. Once written, they are accounted for with
+ * fs_commit(). */
+char *fs_reserve(struct filespace *fs, int len);
+
+void fs_commit(struct filespace *fs, int len);
+
+/* Give a buffer of alloc bytes, allocated with malloc(), to an empty filespace.
+ * It now belongs to the filespace. */
+void fs_attach(struct filespace *fs, char *buf, int alloc);
+
+/* Take the buffer away from the filespace, which is left empty. The caller is
+ * responsible for freeing it. */
+char *fs_detach(struct filespace *fs, int *len);
+
+static inline int fs_alloc(const struct filespace *fs) {
+  return fs->current_alloc;
+}
+
 #endif /* FILESPACE_H */
 
@@ -237,8 +237,10 @@ int gh_heap_remove(gh_heap_t *heap, gh_hnode_t *hnode)
   count--;
   last = *hnode_ptr(heap, count);
   heap->count = count;
-  if (last == hnode)
+  if (last == hnode) {
+    gh_hnode_invalidate(hnode);
     return 0;
+  }
 
   last->index = cur_idx;
   *cur_ptr = last;
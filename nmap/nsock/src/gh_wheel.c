@@ -0,0 +1,340 @@
+/***************************************************************************
+ * gh_wheel.c -- hierarchical timing wheels.                               *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2013 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#include "nbase_config.h"
+#endif
+
+#ifdef WIN32
+#include "nbase_winconfig.h"
+#endif
+
+#include <nbase.h>
+#include "gh_wheel.h"
+
+#define GH_WHEEL_HEADS  (1 + GH_WHEEL_LEVELS * GH_WHEEL_SLOTS)
+
+
+static inline uint64_t slot_bit(unsigned int index) {
+  return (uint64_t)1 << index;
+}
+
+static inline unsigned int level_shift(int level) {
+  return GH_WHEEL_BITS * level;
+}
+
+static unsigned int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  unsigned int n = 0;
+
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+/* Distance from index from to the first bit set in the circular bitmap map,
+ * which must not be empty. */
+static unsigned int next_bit(uint64_t map, unsigned int from) {
+  if (from)
+    map = (map >> from) | (map << (GH_WHEEL_SLOTS - from));
+  return ctz64(map);
+}
+
+/* List heads are numbered: 0 is the expired list, the slots follow level by
+ * level. */
+static gh_wnode_t *head_get(gh_wheel_t *wheel, int index) {
+  if (index == 0)
+    return &wheel->expired;
+  return &wheel->slots[0][0] + (index - 1);
+}
+
+static int head_index(gh_wheel_t *wheel, const gh_wnode_t *node) {
+  if (node == &wheel->expired)
+    return 0;
+  if (node >= &wheel->slots[0][0] &&
+      node <= &wheel->slots[GH_WHEEL_LEVELS - 1][GH_WHEEL_MASK])
+    return 1 + (int)(node - &wheel->slots[0][0]);
+  return -1;
+}
+
+static inline void list_init(gh_wnode_t *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static inline int list_is_empty(const gh_wnode_t *head) {
+  return head->next == head;
+}
+
+static inline void list_append(gh_wnode_t *head, gh_wnode_t *node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static inline void list_unlink(gh_wnode_t *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  gh_wnode_invalidate(node);
+}
+
+/* Move all the nodes of src at the end of dst, leaving src empty. */
+static inline void list_splice(gh_wnode_t *dst, gh_wnode_t *src) {
+  if (list_is_empty(src))
+    return;
+
+  src->next->prev = dst->prev;
+  dst->prev->next = src->next;
+  src->prev->next = dst;
+  dst->prev = src->prev;
+  list_init(src);
+}
+
+/* Link node in the slot matching its expiration, relative to wheel->now. Does
+ * not account for it in wheel->count. */
+static void wheel_link(gh_wheel_t *wheel, gh_wnode_t *node) {
+  uint64_t expire = node->expire;
+  uint64_t delta;
+  unsigned int index;
+  int level;
+
+  if (expire <= wheel->now) {
+    list_append(&wheel->expired, node);
+    return;
+  }
+
+  delta = expire - wheel->now;
+  for (level = 0; level < GH_WHEEL_LEVELS - 1; level++) {
+    if (delta < ((uint64_t)1 << level_shift(level + 1)))
+      break;
+  }
+
+  /* Beyond the wheel range: park it as far as possible, it will be linked
+   * again when its slot cascades. */
+  if (delta >= ((uint64_t)1 << level_shift(GH_WHEEL_LEVELS)))
+    expire = wheel->now + ((uint64_t)1 << level_shift(GH_WHEEL_LEVELS)) - 1;
+
+  index = (unsigned int)(expire >> level_shift(level)) & GH_WHEEL_MASK;
+  list_append(&wheel->slots[level][index], node);
+  wheel->occupied[level] |= slot_bit(index);
+}
+
+/* Redistribute the upper level slots that come due at tick wheel->now, which
+ * is a multiple of GH_WHEEL_SLOTS. A level only moves on when the one below
+ * has wrapped. */
+static void wheel_cascade(gh_wheel_t *wheel) {
+  int level;
+
+  for (level = 1; level < GH_WHEEL_LEVELS; level++) {
+    unsigned int index;
+
+    index = (unsigned int)(wheel->now >> level_shift(level)) & GH_WHEEL_MASK;
+    if (wheel->occupied[level] & slot_bit(index)) {
+      gh_wnode_t pending;
+
+      list_init(&pending);
+      list_splice(&pending, &wheel->slots[level][index]);
+      wheel->occupied[level] &= ~slot_bit(index);
+
+      while (!list_is_empty(&pending)) {
+        gh_wnode_t *node = pending.next;
+
+        list_unlink(node);
+        wheel_link(wheel, node);
+      }
+    }
+
+    if (index != 0)
+      break;
+  }
+}
+
+/* Earliest tick at which a slot comes due: the actual expiration for level 0,
+ * the tick at which the slot cascades for the upper levels. Return 0 if all
+ * the slots are empty. */
+static int wheel_next_tick(const gh_wheel_t *wheel, uint64_t *tick) {
+  int found = 0;
+  int level;
+
+  for (level = 0; level < GH_WHEEL_LEVELS; level++) {
+    uint64_t round;
+    uint64_t candidate;
+    unsigned int from;
+
+    if (!wheel->occupied[level])
+      continue;
+
+    round = (wheel->now >> level_shift(level)) + 1;
+    from = (unsigned int)round & GH_WHEEL_MASK;
+    candidate = (round + next_bit(wheel->occupied[level], from)) << level_shift(level);
+
+    if (!found || candidate < *tick) {
+      *tick = candidate;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+void gh_wheel_init(gh_wheel_t *wheel, uint64_t now) {
+  int i;
+
+  wheel->now = now;
+  wheel->count = 0;
+  for (i = 0; i < GH_WHEEL_HEADS; i++)
+    list_init(head_get(wheel, i));
+  memset(wheel->occupied, 0, sizeof(wheel->occupied));
+}
+
+void gh_wheel_add(gh_wheel_t *wheel, gh_wnode_t *node, uint64_t expire) {
+  assert(!gh_wnode_is_valid(node));
+
+  node->expire = expire;
+  wheel_link(wheel, node);
+  wheel->count++;
+}
+
+void gh_wheel_remove(gh_wheel_t *wheel, gh_wnode_t *node) {
+  gh_wnode_t *prev;
+  int index;
+
+  if (!gh_wnode_is_valid(node))
+    return;
+
+  prev = node->prev;
+  list_unlink(node);
+  assert(wheel->count > 0);
+  wheel->count--;
+
+  /* The slot became empty, clear its occupancy bit */
+  if (list_is_empty(prev) && (index = head_index(wheel, prev)) > 0) {
+    index--;
+    wheel->occupied[index / GH_WHEEL_SLOTS] &= ~slot_bit(index % GH_WHEEL_SLOTS);
+  }
+}
+
+void gh_wheel_advance(gh_wheel_t *wheel, uint64_t now) {
+  while (wheel->now < now) {
+    unsigned int index;
+    uint64_t tick;
+
+    /* Skip straight to the next slot that has something to do, empty slots
+     * neither expire nor cascade anything. */
+    if (!wheel_next_tick(wheel, &tick) || tick > now) {
+      wheel->now = now;
+      break;
+    }
+
+    wheel->now = tick;
+    index = (unsigned int)tick & GH_WHEEL_MASK;
+    if (index == 0)
+      wheel_cascade(wheel);
+
+    if (wheel->occupied[0] & slot_bit(index)) {
+      list_splice(&wheel->expired, &wheel->slots[0][index]);
+      wheel->occupied[0] &= ~slot_bit(index);
+    }
+  }
+}
+
+gh_wnode_t *gh_wheel_pop(gh_wheel_t *wheel) {
+  gh_wnode_t *node;
+
+  if (list_is_empty(&wheel->expired))
+    return NULL;
+
+  node = wheel->expired.next;
+  list_unlink(node);
+  wheel->count--;
+  return node;
+}
+
+int gh_wheel_next(gh_wheel_t *wheel, uint64_t *tick) {
+  if (wheel->count == 0)
+    return 0;
+
+  if (!list_is_empty(&wheel->expired)) {
+    *tick = wheel->now;
+    return 1;
+  }
+
+  return wheel_next_tick(wheel, tick);
+}
+
+gh_wnode_t *gh_wheel_iter(gh_wheel_t *wheel, gh_wnode_t *node) {
+  int index = 0;
+
+  if (node != NULL) {
+    if (head_index(wheel, node->next) < 0)
+      return node->next;
+    index = head_index(wheel, node->next) + 1;
+  }
+
+  for (; index < GH_WHEEL_HEADS; index++) {
+    gh_wnode_t *head = head_get(wheel, index);
+
+    if (!list_is_empty(head))
+      return head->next;
+  }
+  return NULL;
+}
@@ -0,0 +1,156 @@
+/***************************************************************************
+ * gh_wheel.h -- hierarchical timing wheels.                               *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2013 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef GH_WHEEL_H
+#define GH_WHEEL_H
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#include "nbase_config.h"
+#endif
+
+#ifdef WIN32
+#include "nbase_winconfig.h"
+#endif
+
+#include "error.h"
+#include <assert.h>
+#include <stdint.h>
+
+
+#if !defined(container_of)
+#include <stddef.h>
+
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+
+/* Each level has 64 slots, so that its occupancy fits a single uint64_t bitmap.
+ * With 1ms ticks, five levels cover a little more than twelve days; anything
+ * further away is parked in the last slot reachable and cascaded down again
+ * when that slot comes due. */
+#define GH_WHEEL_BITS     6
+#define GH_WHEEL_SLOTS    (1 << GH_WHEEL_BITS)
+#define GH_WHEEL_MASK     (GH_WHEEL_SLOTS - 1)
+#define GH_WHEEL_LEVELS   5
+
+
+typedef struct gh_wheel_node {
+  struct gh_wheel_node *next;
+  struct gh_wheel_node *prev;
+  /* Tick at which the node expires */
+  uint64_t expire;
+} gh_wnode_t;
+
+typedef struct gh_wheel {
+  /* Last tick processed by gh_wheel_advance() */
+  uint64_t now;
+  unsigned int count;
+  /* Nodes that are due but were not popped yet */
+  gh_wnode_t expired;
+  /* Circular lists, the slots themselves are the sentinels */
+  gh_wnode_t slots[GH_WHEEL_LEVELS][GH_WHEEL_SLOTS];
+  /* Bit n of occupied[l] is set when slots[l][n] is not empty */
+  uint64_t occupied[GH_WHEEL_LEVELS];
+} gh_wheel_t;
+
+
+void gh_wheel_init(gh_wheel_t *wheel, uint64_t now);
+
+/* Schedule node for the given tick. Ticks in the past are due immediately. */
+void gh_wheel_add(gh_wheel_t *wheel, gh_wnode_t *node, uint64_t expire);
+
+/* Unlink node from the wheel. Nodes that are not scheduled are ignored. */
+void gh_wheel_remove(gh_wheel_t *wheel, gh_wnode_t *node);
+
+/* Move the clock forward to tick now, collecting the nodes that came due. They
+ * are retrieved with gh_wheel_pop(). */
+void gh_wheel_advance(gh_wheel_t *wheel, uint64_t now);
+
+/* Return the next due node, or NULL when there is none left. */
+gh_wnode_t *gh_wheel_pop(gh_wheel_t *wheel);
+
+/* Store in *tick the earliest tick at which gh_wheel_advance() may have
+ * something to do. Nodes parked in the upper levels make this a lower bound
+ * only: waking up then cascades them down and a later call refines the value.
+ * Return 0 if the wheel is empty, 1 otherwise. */
+int gh_wheel_next(gh_wheel_t *wheel, uint64_t *tick);
+
+/* Iterate over all scheduled nodes, in no particular order. Pass NULL to get
+ * the first one. The iteration is only valid as long as the wheel is left
+ * untouched. */
+gh_wnode_t *gh_wheel_iter(gh_wheel_t *wheel, gh_wnode_t *node);
+
+
+static inline unsigned int gh_wheel_count(gh_wheel_t *wheel) {
+  return wheel->count;
+}
+
+static inline int gh_wheel_is_empty(gh_wheel_t *wheel) {
+  return wheel->count == 0;
+}
+
+static inline void gh_wnode_invalidate(gh_wnode_t *node) {
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+static inline int gh_wnode_is_valid(const gh_wnode_t *node) {
+  return (node && node->next != NULL);
+}
+
+#endif /* GH_WHEEL_H */
@@ -608,7 +608,7 @@ void handle_timer_result(struct npool *ms, struct nevent *nse, enum nse_status s
 
 /* Returns -1 if an error, otherwise the number of newly written bytes */
 static int do_actual_read(struct npool *ms, struct nevent *nse) {
-  char buf[8192];
+  char *buf;
   int buflen = 0;
   struct niod *iod = nse->iod;
   int err = 0;
@@ -623,8 +623,12 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
       struct sockaddr_storage peer;
       socklen_t peerlen;
 
+      /* Receive straight at the end of the event buffer */
+      iobuf_get(ms, nse);
+      buf = fs_reserve(&nse->iobuf, NSOCK_READ_SIZE);
+
       peerlen = sizeof(peer);
-      buflen = recvfrom(iod->sd, buf, sizeof(buf), 0, (struct sockaddr *)&peer, &peerlen);
+      buflen = recvfrom(iod->sd, buf, NSOCK_READ_SIZE, 0, (struct sockaddr *)&peer, &peerlen);
 
       /* Using recv() was failing, at least on UNIX, for non-network sockets
        * (i.e. stdin) in this case, a read() is done - as on ENOTSOCK we may
@@ -633,7 +637,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
         if (socket_errno() == ENOTSOCK) {
           peer.ss_family = AF_UNSPEC;
           peerlen = 0;
-          buflen = read(iod->sd, buf, sizeof(buf));
+          buflen = read(iod->sd, buf, NSOCK_READ_SIZE);
         }
       }
       if (buflen == -1) {
@@ -646,12 +650,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
         iod->peerlen = peerlen;
       }
       if (buflen > 0) {
-        if (fs_cat(&nse->iobuf, buf, buflen) == -1) {
-          nse->event_done = 1;
-          nse->status = NSE_STATUS_ERROR;
-          nse->errnum = ENOMEM;
-          return -1;
-        }
+        fs_commit(&nse->iobuf, buflen);
 
         /* Sometimes a service just spews and spews data.  So we return after a
          * somewhat large amount to avoid monopolizing resources and avoid DOS
@@ -664,7 +663,7 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
          * return only one datagram at a time. The consistency of the above
          * assignment of iod->peer depends on not consolidating more than one
          * UDP read buffer. */
-        if (buflen > 0 && buflen < sizeof(buf))
+        if (buflen > 0 && buflen < NSOCK_READ_SIZE)
           return fs_length(&nse->iobuf) - startlen;
       }
     } while (buflen > 0 || (buflen == -1 && err == EINTR));
@@ -680,14 +679,15 @@ static int do_actual_read(struct npool *ms, struct nevent *nse) {
   } else {
 #if HAVE_OPENSSL
     /* OpenSSL read */
-    while ((buflen = SSL_read(iod->ssl, buf, sizeof(buf))) > 0) {
+    for (;;) {
+      iobuf_get(ms, nse);
+      buf = fs_reserve(&nse->iobuf, NSOCK_READ_SIZE);
 
-      if (fs_cat(&nse->iobuf, buf, buflen) == -1) {
-        nse->event_done = 1;
-        nse->status = NSE_STATUS_ERROR;
-        nse->errnum = ENOMEM;
-        return -1;
-      }
+      buflen = SSL_read(iod->ssl, buf, NSOCK_READ_SIZE);
+      if (buflen <= 0)
+        break;
+
+      fs_commit(&nse->iobuf, buflen);
 
       /* Sometimes a service just spews and spews data.  So we return
        * after a somewhat large amount to avoid monopolizing resources
@@ -1140,7 +1140,7 @@ void process_iod_events(struct npool *nsp, struct niod *nsi, int ev) {
         gh_list_append(&nsp->free_events, &nse->nodeq_io);
 
         if (nse->timeout.tv_sec)
-          gh_heap_remove(&nsp->expirables, &nse->expire);
+          expirable_remove(nsp, nse);
       }
     }
   }
@@ -1195,7 +1195,32 @@ static int nevent_unref(struct npool *nsp, struct nevent *nse) {
   return 0;
 }
 
+static void process_expired_event(struct npool *nsp, struct nevent *nse) {
+  process_event(nsp, NULL, nse, EV_NONE);
+  assert(nse->event_done);
+  update_first_events(nse);
+  nevent_unref(nsp, nse);
+}
+
 void process_expired_events(struct npool *nsp) {
+  if (nsp->wheel) {
+    gh_wnode_t *wnode;
+
+    gh_wheel_advance(nsp->wheel, timeval_tick(&nsock_tod));
+    while ((wnode = gh_wheel_pop(nsp->wheel)) != NULL) {
+      struct nevent *nse;
+
+      nse = container_of(wnode, struct nevent, wexpire);
+      if (!event_timedout(nse)) {
+        /* Due later within the current millisecond */
+        gh_wheel_add(nsp->wheel, wnode, wnode->expire + 1);
+        continue;
+      }
+      process_expired_event(nsp, nse);
+    }
+    return;
+  }
+
   for (;;) {
     gh_hnode_t *hnode;
     struct nevent *nse;
@@ -1209,13 +1234,66 @@ void process_expired_events(struct npool *nsp) {
       break;
 
     gh_heap_pop(&nsp->expirables);
-    process_event(nsp, NULL, nse, EV_NONE);
-    assert(nse->event_done);
-    update_first_events(nse);
-    nevent_unref(nsp, nse);
+    process_expired_event(nsp, nse);
   }
 }
 
+void expirable_add(struct npool *nsp, struct nevent *nse) {
+  if (nsp->wheel)
+    gh_wheel_add(nsp->wheel, &nse->wexpire, timeval_tick(&nse->timeout));
+  else
+    gh_heap_push(&nsp->expirables, &nse->expire);
+}
+
+void expirable_remove(struct npool *nsp, struct nevent *nse) {
+  if (nsp->wheel)
+    gh_wheel_remove(nsp->wheel, &nse->wexpire);
+  else if (gh_hnode_is_valid(&nse->expire))
+    gh_heap_remove(&nsp->expirables, &nse->expire);
+}
+
+struct nevent *expirable_iter(struct npool *nsp, struct nevent *nse) {
+  gh_hnode_t *hnode;
+
+  if (nsp->wheel) {
+    gh_wnode_t *wnode;
+
+    wnode = gh_wheel_iter(nsp->wheel, nse ? &nse->wexpire : NULL);
+    if (!wnode)
+      return NULL;
+    return container_of(wnode, struct nevent, wexpire);
+  }
+
+  hnode = gh_heap_find(&nsp->expirables, nse ? nse->expire.index + 1 : 0);
+  if (!hnode)
+    return NULL;
+  return container_of(hnode, struct nevent, expire);
+}
+
+int expirable_next_msecs(struct npool *nsp) {
+  gh_hnode_t *hnode;
+  struct nevent *nse;
+
+  if (nsp->wheel) {
+    u64 tick, now;
+
+    if (!gh_wheel_next(nsp->wheel, &tick))
+      return -1;
+
+    now = timeval_tick(&nsock_tod);
+    if (tick <= now)
+      return 0;
+    return (int)MIN(tick - now, INT_MAX);
+  }
+
+  hnode = gh_heap_min(&nsp->expirables);
+  if (!hnode)
+    return -1;
+
+  nse = container_of(hnode, struct nevent, expire);
+  return MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+}
+
 /* Calling this function will cause nsock_loop to quit on its next iteration
  * with a return value of NSOCK_LOOP_QUIT. */
 void nsock_loop_quit(nsock_pool nsp) {
@@ -1246,7 +1324,7 @@ void nsp_add_event(struct npool *nsp, struct nevent *nse) {
 
   if (!nse->event_done && nse->timeout.tv_sec) {
     /* This event is expirable, add it to the queue */
-    gh_heap_push(&nsp->expirables, &nse->expire);
+    expirable_add(nsp, nse);
   }
 
   /* Now we do the event type specific actions */
@@ -70,6 +70,13 @@
   #define ENGINE_EPOLL
 #endif /* HAVE_EPOLL */
 
+#if HAVE_IO_URING
+  extern struct io_engine engine_iouring;
+  #define ENGINE_IOURING &engine_iouring,
+#else
+  #define ENGINE_IOURING
+#endif /* HAVE_IO_URING */
+
 #if HAVE_KQUEUE
   extern struct io_engine engine_kqueue;
   #define ENGINE_KQUEUE &engine_kqueue,
@@ -92,6 +99,7 @@ extern struct io_engine engine_select;
  * available on your system. Engines must be sorted by order of preference */
 static struct io_engine *available_engines[] = {
   ENGINE_EPOLL
+  ENGINE_IOURING
   ENGINE_KQUEUE
   ENGINE_POLL
   ENGINE_SELECT
@@ -148,6 +156,9 @@ const char *nsock_list_engines(void) {
 #if HAVE_EPOLL
   "epoll "
 #endif
+#if HAVE_IO_URING
+  "io_uring "
+#endif
 #if HAVE_KQUEUE
   "kqueue "
 #endif
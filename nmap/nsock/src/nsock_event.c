@@ -112,12 +112,29 @@ nsock_event_id nse_id(nsock_event nse) {
  * The buffer should not be modified or free'd */
 char *nse_readbuf(nsock_event nse, int *nbytes) {
   struct nevent *me = (struct nevent *)nse;
+  static char empty[1];
 
   if (nbytes)
     *nbytes = fs_length(&(me->iobuf));
+
+  /* Nothing was read, so no buffer was allocated */
+  if (fs_str(&(me->iobuf)) == NULL && me->type == NSE_TYPE_READ)
+    return empty;
+
   return fs_str(&(me->iobuf));
 }
 
+char *nse_readbuf_steal(nsock_event nse, int *nbytes) {
+  struct nevent *me = (struct nevent *)nse;
+  char *buf;
+
+  buf = fs_detach(&(me->iobuf), nbytes);
+  if (buf == NULL)
+    buf = (char *)safe_zalloc(1);
+
+  return buf;
+}
+
 static void first_ev_next(struct nevent *nse, gh_lnode_t **first, int nodeq2) {
   if (!first || !*first)
     return;
@@ -185,7 +202,6 @@ void update_first_events(struct nevent *nse) {
 int nsock_event_cancel(nsock_pool ms_pool, nsock_event_id id, int notify) {
   struct npool *nsp = (struct npool *)ms_pool;
   enum nse_type type;
-  unsigned int i;
   gh_list_t *event_list = NULL, *event_list2 = NULL;
   gh_lnode_t *current, *next;
   struct nevent *nse = NULL;
@@ -211,11 +227,8 @@ int nsock_event_cancel(nsock_pool ms_pool, nsock_event_id id, int notify) {
       break;
 
     case NSE_TYPE_TIMER:
-      for (i = 0; i < gh_heap_count(&nsp->expirables); i++) {
-        gh_hnode_t *hnode;
-
-        hnode = gh_heap_find(&nsp->expirables, i);
-        nse = container_of(hnode, struct nevent, expire);
+      for (nse = expirable_iter(nsp, NULL); nse != NULL;
+           nse = expirable_iter(nsp, nse)) {
         if (nse->id == id)
           return nevent_delete(nsp, nse, NULL, NULL, notify);
       }
@@ -307,7 +320,7 @@ int nevent_delete(struct npool *nsp, struct nevent *nse, gh_list_t *event_list,
   assert(nse->event_done);
 
   if (nse->timeout.tv_sec)
-    gh_heap_remove(&nsp->expirables, &nse->expire);
+    expirable_remove(nsp, nse);
 
   if (event_list) {
     update_first_events(nse);
@@ -438,12 +451,14 @@ struct nevent *event_new(struct npool *nsp, enum nse_type type,
   nse->type = type;
   nse->status = NSE_STATUS_NONE;
   gh_hnode_invalidate(&nse->expire);
+  gh_wnode_invalidate(&nse->wexpire);
 #if HAVE_OPENSSL
   nse->sslinfo.ssl_desire = SSL_ERROR_NONE;
 #endif
 
+  /* Buffers are allocated on demand, see iobuf_get() */
   if (type == NSE_TYPE_READ || type ==  NSE_TYPE_WRITE)
-    filespace_init(&(nse->iobuf), 1024);
+    filespace_init(&(nse->iobuf), 0);
 
 #if HAVE_PCAP
   if (type == NSE_TYPE_PCAP_READ) {
@@ -488,7 +503,7 @@ void event_delete(struct npool *nsp, struct nevent *nse) {
 
   /* First free the IOBuf inside it if necessary */
   if (nse->type == NSE_TYPE_READ || nse->type ==  NSE_TYPE_WRITE) {
-    fs_free(&nse->iobuf);
+    iobuf_put(nsp, nse);
   }
   #if HAVE_PCAP
   if (nse->type == NSE_TYPE_PCAP_READ) {
@@ -502,6 +517,37 @@ void event_delete(struct npool *nsp, struct nevent *nse) {
 }
 
 
+void iobuf_get(struct npool *nsp, struct nevent *nse) {
+  char *buf;
+
+  if (fs_str(&nse->iobuf) != NULL)
+    return;
+
+  if (nsp->free_iobufs != NULL) {
+    buf = (char *)nsp->free_iobufs;
+    nsp->free_iobufs = *(void **)buf;
+    nsp->free_iobufs_count--;
+    nsp->iobufs_reused++;
+  } else {
+    buf = (char *)safe_malloc(NSOCK_IOBUF_SIZE);
+    nsp->iobufs_allocated++;
+  }
+  fs_attach(&nse->iobuf, buf, NSOCK_IOBUF_SIZE);
+}
+
+void iobuf_put(struct npool *nsp, struct nevent *nse) {
+  if (fs_alloc(&nse->iobuf) == NSOCK_IOBUF_SIZE &&
+      nsp->free_iobufs_count < NSOCK_IOBUF_CACHE_MAX) {
+    void **buf = (void **)fs_detach(&nse->iobuf, NULL);
+
+    *buf = nsp->free_iobufs;
+    nsp->free_iobufs = buf;
+    nsp->free_iobufs_count++;
+  } else {
+    fs_free(&nse->iobuf);
+  }
+}
+
 /* Takes an nse_type (as returned by nse_type() and returns a static string name
  * that you can use for printing, etc. */
 const char *nse_type2str(enum nse_type type) {
@@ -73,6 +73,7 @@
 
 #include "gh_list.h"
 #include "gh_heap.h"
+#include "gh_wheel.h"
 #include "filespace.h"
 #include "nsock.h" /* The public interface -- I need it for some enum defs */
 #include "nsock_ssl.h"
@@ -133,6 +134,16 @@ enum iod_state {
 #define EV_WRITE  0x02
 #define EV_EXCEPT 0x04
 
+/* Bytes asked for by each recv()/SSL_read() */
+#define NSOCK_READ_SIZE 8192
+
+/* Read buffers are taken from a per-pool cache on the first read into an
+ * event, and given back to it when the event is deleted. They are sized so that
+ * a full read fits with its terminating NUL. At most NSOCK_IOBUF_CACHE_MAX are
+ * kept, larger buffers are freed. */
+#define NSOCK_IOBUF_SIZE      (NSOCK_READ_SIZE + 1)
+#define NSOCK_IOBUF_CACHE_MAX 64
+
 
 /* ------------------- STRUCTURES ------------------- */
 
@@ -171,7 +182,11 @@ struct npool {
 #if HAVE_PCAP
   gh_list_t pcap_read_events;
 #endif
+  /* Events with a timeout. They are kept in the binary heap unless the pool was
+   * switched to the timing wheel with nsp_settimerwheel(), in which case wheel
+   * is non-NULL and the heap stays empty. */
   gh_heap_t expirables;
+  gh_wheel_t *wheel;
 
   /* Active iods and related lists of events */
   gh_list_t active_iods;
@@ -180,6 +195,13 @@ struct npool {
   gh_list_t free_iods;
   /* When an event is deleted, we stick it here for later reuse */
   gh_list_t free_events;
+  /* Unused read buffers, chained through their first bytes */
+  void *free_iobufs;
+  int free_iobufs_count;
+
+  /* Read buffer usage, logged when the pool is deleted */
+  unsigned long iobufs_allocated;
+  unsigned long iobufs_reused;
 
   /* Number of events pending (total) on all lists */
   int events_pending;
@@ -349,6 +371,8 @@ struct nevent {
 
   /* slot in the expirable binheap */
   gh_hnode_t expire;
+  /* slot in the timing wheel, when the pool uses one */
+  gh_wnode_t wexpire;
 
   /* For some reasons (see nsock_pcap.c) we register pcap events as both read
    * and pcap_read events when in PCAP_BSD_SELECT_HACK mode. We then need two
@@ -459,11 +483,33 @@ void event_dispatch_and_delete(struct npool *nsp, struct nevent *nse, int notify
  * remember to do this if you call event_delete() directly */
 void event_delete(struct npool *nsp, struct nevent *nse);
 
+/* Attach a read buffer to an event that has none yet, reusing one from the pool
+ * cache when possible. Events only get one once there is something to read, so
+ * a pending read with no data costs no buffer memory. */
+void iobuf_get(struct npool *nsp, struct nevent *nse);
+
+/* Release the buffer of an event, keeping it in the pool cache if it is a
+ * standard read buffer and the cache is not full. */
+void iobuf_put(struct npool *nsp, struct nevent *nse);
+
 /* Add an event to the appropriate nsp event list, handles housekeeping such as
  * adjusting the descriptor select/poll lists, registering the timeout value,
  * etc. */
 void nsp_add_event(struct npool *nsp, struct nevent *nse);
 
+/* Register/unregister the timeout of an event, in whichever structure the pool
+ * keeps them. Removing an event that is not registered is harmless. */
+void expirable_add(struct npool *nsp, struct nevent *nse);
+void expirable_remove(struct npool *nsp, struct nevent *nse);
+
+/* Iterate over the registered events, in no particular order. Pass NULL to get
+ * the first one. */
+struct nevent *expirable_iter(struct npool *nsp, struct nevent *nse);
+
+/* Number of milliseconds until the next timeout is (or may be) due, or -1 if no
+ * event has a timeout. This is how long the engines can wait. */
+int expirable_next_msecs(struct npool *nsp);
+
 void nsock_connect_internal(struct npool *ms, struct nevent *nse, int type, int proto, struct sockaddr_storage *ss, size_t sslen, unsigned short port);
 
 /* Comments on using the following handle_*_result functions are available in nsock_core.c */
@@ -492,14 +538,9 @@ void nsock_trace_handler_callback(struct npool *ms, struct nevent *nse);
 void nsi_set_ssl_session(struct niod *iod, SSL_SESSION *sessid);
 #endif
 
-static inline struct nevent *next_expirable_event(struct npool *nsp) {
-  gh_hnode_t *hnode;
-
-  hnode = gh_heap_min(&nsp->expirables);
-  if (!hnode)
-    return NULL;
-
-  return container_of(hnode, struct nevent, expire);
+/* The timing wheel ticks are milliseconds */
+static inline u64 timeval_tick(const struct timeval *tv) {
+  return (u64)tv->tv_sec * 1000 + tv->tv_usec / 1000;
 }
 
 static inline struct nevent *lnode_nevent(gh_lnode_t *lnode) {
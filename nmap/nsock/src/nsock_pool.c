@@ -131,6 +131,39 @@ void nsp_setdevice(nsock_pool nsp, const char *device) {
   mt->device = device;
 }
 
+/* Chooses where the timeouts of pending events are kept. The default binary
+ * heap is fine for most uses; a non-zero value switches to a hierarchical
+ * timing wheel, with constant time insertion and cancellation, which pays off
+ * when tens of thousands of events with timeouts are pending at once. Events
+ * already registered are moved over. */
+void nsp_settimerwheel(nsock_pool nsp, int enable) {
+  struct npool *mt = (struct npool *)nsp;
+  struct nevent *nse;
+
+  if (enable && mt->wheel == NULL) {
+    gh_hnode_t *hnode;
+
+    mt->wheel = (gh_wheel_t *)safe_malloc(sizeof(gh_wheel_t));
+    gh_wheel_init(mt->wheel, timeval_tick(nsock_gettimeofday()));
+
+    while ((hnode = gh_heap_pop(&mt->expirables)) != NULL) {
+      nse = container_of(hnode, struct nevent, expire);
+      expirable_add(mt, nse);
+    }
+  } else if (!enable && mt->wheel != NULL) {
+    gh_wheel_t *wheel = mt->wheel;
+    gh_wnode_t *wnode;
+
+    mt->wheel = NULL;
+    while ((wnode = gh_wheel_iter(wheel, NULL)) != NULL) {
+      gh_wheel_remove(wheel, wnode);
+      nse = container_of(wnode, struct nevent, wexpire);
+      expirable_add(mt, nse);
+    }
+    free(wheel);
+  }
+}
+
 static int expirable_cmp(gh_hnode_t *n1, gh_hnode_t *n2) {
   struct nevent *nse1;
   struct nevent *nse2;
@@ -252,11 +285,8 @@ void nsp_delete(nsock_pool ms_pool) {
   }
 
   /* Kill timers too, they're not in event lists */
-  while (gh_heap_count(&nsp->expirables) > 0) {
-    gh_hnode_t *hnode;
-
-    hnode = gh_heap_pop(&nsp->expirables);
-    nse = container_of(hnode, struct nevent, expire);
+  while ((nse = expirable_iter(nsp, NULL)) != NULL) {
+    expirable_remove(nsp, nse);
 
     if (nse->type == NSE_TYPE_TIMER) {
       nse->status = NSE_STATUS_KILL;
@@ -268,6 +298,7 @@ void nsp_delete(nsock_pool ms_pool) {
   }
 
   gh_heap_free(&nsp->expirables);
+  free(nsp->wheel);
 
   /* foreach struct niod */
   for (current = gh_list_first_elem(&nsp->active_iods);
@@ -293,6 +324,17 @@ void nsp_delete(nsock_pool ms_pool) {
     free(nse);
   }
 
+  nsock_log_debug(nsp, "Read buffers: %lu allocated, %lu reused, %d cached (%d bytes each)",
+                  nsp->iobufs_allocated, nsp->iobufs_reused,
+                  nsp->free_iobufs_count, NSOCK_IOBUF_SIZE);
+
+  while (nsp->free_iobufs != NULL) {
+    void *buf = nsp->free_iobufs;
+
+    nsp->free_iobufs = *(void **)buf;
+    free(buf);
+  }
+
   gh_list_free(&nsp->active_iods);
   gh_list_free(&nsp->free_iods);
   gh_list_free(&nsp->free_events);
@@ -0,0 +1,170 @@
+/*
+ * Nsock regression test suite
+ * Same license as nmap -- see http://nmap.org/book/man-legal.html
+ *
+ * Compare the binary heap and the timing wheel as timeout stores, with many
+ * concurrent timers that mostly get cancelled before they fire. Not part of
+ * the regression suite, build it with "make bench_timers".
+ */
+
+#include "test-common.h"
+#include "../src/gh_heap.h"
+#include "../src/gh_wheel.h"
+#include <sys/time.h>
+
+
+#define BENCH_TIMERS  100000
+#define BENCH_CHURN   2000000
+
+struct timer {
+  uint64_t expire;
+  gh_hnode_t hnode;
+  gh_wnode_t wnode;
+};
+
+static struct timer *Timers;
+static unsigned int *Order;
+
+static int hnode_cmp(gh_hnode_t *n1, gh_hnode_t *n2) {
+  return container_of(n1, struct timer, hnode)->expire <
+         container_of(n2, struct timer, hnode)->expire;
+}
+
+static double elapsed_ms(const struct timeval *start) {
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) * 1000.0 +
+         (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* Connect and read timeouts in nmap are a few seconds to a few tens of
+ * seconds, in 1ms ticks. */
+static uint64_t random_timeout(uint64_t now) {
+  return now + 1000 + rand() % 30000;
+}
+
+static void shuffle(void) {
+  unsigned int i, j, tmp;
+
+  for (i = 0; i < BENCH_TIMERS; i++)
+    Order[i] = i;
+  for (i = BENCH_TIMERS - 1; i > 0; i--) {
+    j = rand() % (i + 1);
+    tmp = Order[i];
+    Order[i] = Order[j];
+    Order[j] = tmp;
+  }
+}
+
+static void report(const char *store, const char *phase, double ms, unsigned int ops) {
+  printf("%-6s %-28s %9.2f ms %8.1f ns/op\n", store, phase, ms, ms * 1e6 / ops);
+}
+
+static void bench_heap(void) {
+  gh_heap_t heap;
+  struct timeval start;
+  uint64_t now = 0;
+  unsigned int i;
+
+  srand(42);
+  shuffle();
+  gh_heap_init(&heap, hnode_cmp);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_TIMERS; i++) {
+    Timers[i].expire = random_timeout(now);
+    gh_hnode_invalidate(&Timers[i].hnode);
+    gh_heap_push(&heap, &Timers[i].hnode);
+  }
+  report("heap", "add 100k", elapsed_ms(&start), BENCH_TIMERS);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_CHURN; i++) {
+    struct timer *t = &Timers[Order[i % BENCH_TIMERS]];
+    gh_hnode_t *hnode;
+
+    now = i / 100;
+    while ((hnode = gh_heap_min(&heap)) != NULL &&
+           container_of(hnode, struct timer, hnode)->expire <= now)
+      gh_heap_pop(&heap);
+
+    if (gh_hnode_is_valid(&t->hnode))
+      gh_heap_remove(&heap, &t->hnode);
+    t->expire = random_timeout(now);
+    gh_hnode_invalidate(&t->hnode);
+    gh_heap_push(&heap, &t->hnode);
+  }
+  report("heap", "cancel+add (100k pending)", elapsed_ms(&start), BENCH_CHURN);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_TIMERS * 9 / 10; i++) {
+    if (gh_hnode_is_valid(&Timers[Order[i]].hnode))
+      gh_heap_remove(&heap, &Timers[Order[i]].hnode);
+  }
+  for (;;) {
+    gh_hnode_t *hnode = gh_heap_pop(&heap);
+
+    if (hnode == NULL)
+      break;
+    now = container_of(hnode, struct timer, hnode)->expire;
+  }
+  report("heap", "cancel 90%, expire rest", elapsed_ms(&start), BENCH_TIMERS);
+
+  gh_heap_free(&heap);
+}
+
+static void bench_wheel(void) {
+  gh_wheel_t wheel;
+  struct timeval start;
+  uint64_t now = 0;
+  unsigned int i;
+
+  srand(42);
+  shuffle();
+  gh_wheel_init(&wheel, now);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_TIMERS; i++) {
+    gh_wnode_invalidate(&Timers[i].wnode);
+    gh_wheel_add(&wheel, &Timers[i].wnode, random_timeout(now));
+  }
+  report("wheel", "add 100k", elapsed_ms(&start), BENCH_TIMERS);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_CHURN; i++) {
+    struct timer *t = &Timers[Order[i % BENCH_TIMERS]];
+
+    now = i / 100;
+    gh_wheel_advance(&wheel, now);
+    while (gh_wheel_pop(&wheel) != NULL)
+      ;
+
+    gh_wheel_remove(&wheel, &t->wnode);
+    gh_wheel_add(&wheel, &t->wnode, random_timeout(now));
+  }
+  report("wheel", "cancel+add (100k pending)", elapsed_ms(&start), BENCH_CHURN);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_TIMERS * 9 / 10; i++)
+    gh_wheel_remove(&wheel, &Timers[Order[i]].wnode);
+  while (gh_wheel_next(&wheel, &now)) {
+    gh_wheel_advance(&wheel, now);
+    while (gh_wheel_pop(&wheel) != NULL)
+      ;
+  }
+  report("wheel", "cancel 90%, expire rest", elapsed_ms(&start), BENCH_TIMERS);
+}
+
+int main(int argc, char *argv[]) {
+  Timers = calloc(BENCH_TIMERS, sizeof(struct timer));
+  Order = calloc(BENCH_TIMERS, sizeof(unsigned int));
+  assert(Timers != NULL && Order != NULL);
+
+  bench_heap();
+  bench_wheel();
+
+  free(Timers);
+  free(Order);
+  return 0;
+}
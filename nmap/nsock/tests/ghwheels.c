@@ -0,0 +1,192 @@
+/*
+ * Nsock regression test suite
+ * Same license as nmap -- see http://nmap.org/book/man-legal.html
+ */
+
+#include "test-common.h"
+#include "../src/gh_wheel.h"
+#include <time.h>
+
+
+#define WHEEL_NODES  50000
+#define WHEEL_START  1000000
+
+struct testitem {
+  uint64_t val;
+  gh_wnode_t  node;
+};
+
+static struct testitem *mkitems(int count) {
+  struct testitem *items;
+  int i;
+
+  items = calloc(count, sizeof(struct testitem));
+  assert(items != NULL);
+  for (i = 0; i < count; i++)
+    gh_wnode_invalidate(&items[i].node);
+  return items;
+}
+
+static uint64_t node2val(gh_wnode_t *wnode) {
+  struct testitem *item;
+
+  item = container_of(wnode, struct testitem, node);
+  return item->val;
+}
+
+/* Nodes must come out exactly at the tick they were scheduled for, whatever
+ * level of the wheel they went through. */
+static int ghwheel_ordering(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  uint64_t now, last = 0;
+  int i, popped = 0;
+
+  srand(time(NULL));
+
+  gh_wheel_init(&wheel, WHEEL_START);
+  items = mkitems(WHEEL_NODES);
+
+  for (i = 0; i < WHEEL_NODES; i++) {
+    switch (i % 4) {
+      case 0: items[i].val = WHEEL_START + rand() % 64; break;
+      case 1: items[i].val = WHEEL_START + rand() % 5000; break;
+      case 2: items[i].val = WHEEL_START + rand() % 300000; break;
+      default: items[i].val = WHEEL_START + i; break;
+    }
+    gh_wheel_add(&wheel, &items[i].node, items[i].val);
+  }
+  AssertEqual(gh_wheel_count(&wheel), WHEEL_NODES);
+
+  now = WHEEL_START;
+  while (!gh_wheel_is_empty(&wheel)) {
+    gh_wnode_t *wnode;
+    uint64_t next;
+
+    AssertEqual(gh_wheel_next(&wheel, &next), 1);
+    __ASSERT_BASE(next >= now);
+
+    /* Jump straight to the announced tick, nothing may be due before */
+    if (next > now) {
+      gh_wheel_advance(&wheel, next - 1);
+      AssertEqual(gh_wheel_pop(&wheel), NULL);
+    }
+    now = next;
+    gh_wheel_advance(&wheel, now);
+
+    while ((wnode = gh_wheel_pop(&wheel)) != NULL) {
+      AssertEqual(node2val(wnode), now);
+      __ASSERT_BASE(node2val(wnode) >= last);
+      last = node2val(wnode);
+      popped++;
+    }
+  }
+  AssertEqual(popped, WHEEL_NODES);
+  AssertEqual(gh_wheel_next(&wheel, &now), 0);
+
+  free(items);
+  return 0;
+}
+
+/* Cancelled nodes must never fire, and the wheel must keep working when
+ * they are scheduled again. */
+static int ghwheel_cancel(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  gh_wnode_t *wnode;
+  int i, popped = 0, iterated = 0;
+
+  gh_wheel_init(&wheel, 0);
+  items = mkitems(WHEEL_NODES);
+
+  for (i = 0; i < WHEEL_NODES; i++) {
+    items[i].val = 1 + (i * 7919) % 100000;
+    gh_wheel_add(&wheel, &items[i].node, items[i].val);
+  }
+
+  /* Removing twice is harmless */
+  for (i = 0; i < WHEEL_NODES; i += 2) {
+    gh_wheel_remove(&wheel, &items[i].node);
+    gh_wheel_remove(&wheel, &items[i].node);
+    __ASSERT_BASE(!gh_wnode_is_valid(&items[i].node));
+  }
+  AssertEqual(gh_wheel_count(&wheel), WHEEL_NODES / 2);
+
+  for (wnode = gh_wheel_iter(&wheel, NULL); wnode != NULL;
+       wnode = gh_wheel_iter(&wheel, wnode))
+    iterated++;
+  AssertEqual(iterated, WHEEL_NODES / 2);
+
+  /* Reschedule a few of the cancelled ones far away */
+  for (i = 0; i < 100; i += 2) {
+    items[i].val = 200000 + i;
+    gh_wheel_add(&wheel, &items[i].node, items[i].val);
+  }
+
+  gh_wheel_advance(&wheel, 200100);
+  while ((wnode = gh_wheel_pop(&wheel)) != NULL) {
+    struct testitem *item = container_of(wnode, struct testitem, node);
+
+    __ASSERT_BASE(((item - items) & 1) || item->val >= 200000);
+    popped++;
+  }
+  AssertEqual(popped, WHEEL_NODES / 2 + 50);
+  __ASSERT_BASE(gh_wheel_is_empty(&wheel));
+
+  free(items);
+  return 0;
+}
+
+/* Expirations beyond the range of the wheel get cascaded until due. */
+static int ghwheel_far(void *tdata) {
+  gh_wheel_t wheel;
+  struct testitem *items;
+  uint64_t far = (uint64_t)1 << 34;
+  int i;
+
+  gh_wheel_init(&wheel, 5);
+  items = mkitems(3);
+
+  for (i = 0; i < 3; i++) {
+    items[i].val = far + i;
+    gh_wheel_add(&wheel, &items[i].node, items[i].val);
+  }
+
+  gh_wheel_advance(&wheel, far - 1);
+  AssertEqual(gh_wheel_pop(&wheel), NULL);
+  AssertEqual(gh_wheel_count(&wheel), 3);
+
+  gh_wheel_advance(&wheel, far + 2);
+  for (i = 0; i < 3; i++) {
+    gh_wnode_t *wnode = gh_wheel_pop(&wheel);
+
+    AssertNonNull(wnode);
+    AssertEqual(node2val(wnode), far + i);
+  }
+  AssertEqual(gh_wheel_pop(&wheel), NULL);
+
+  free(items);
+  return 0;
+}
+
+static int ghwheel_run(void *tdata) {
+  int rc;
+
+  rc = ghwheel_ordering(tdata);
+  if (rc)
+    return rc;
+
+  rc = ghwheel_cancel(tdata);
+  if (rc)
+    return rc;
+
+  return ghwheel_far(tdata);
+}
+
+
+const struct test_case TestGHWheels = {
+  .t_name     = "test nsock internal ghwheels",
+  .t_setup    = NULL,
+  .t_run      = ghwheel_run,
+  .t_teardown = NULL
+};
@@ -27,6 +27,7 @@ char *socket_strerror(int errnum);
 
 extern const struct test_case TestPoolUserData;
 extern const struct test_case TestTimer;
+extern const struct test_case TestTimerWheel;
 extern const struct test_case TestLogLevels;
 extern const struct test_case TestErrLevels;
 extern const struct test_case TestConnectTCP;
@@ -34,6 +35,7 @@ extern const struct test_case TestConnectFailure;
 extern const struct test_case TestGHLists;
 extern const struct test_case TestGHHeaps;
 extern const struct test_case TestHeapOrdering;
+extern const struct test_case TestGHWheels;
 extern const struct test_case TestCancelTCP;
 extern const struct test_case TestCancelUDP;
 extern const struct test_case TestCancelSSL;
@@ -44,6 +46,7 @@ static const struct test_case *TestCases[] = {
   &TestPoolUserData,
   /* ---- timer.c */
   &TestTimer,
+  &TestTimerWheel,
   /* ---- logs.c */
   &TestLogLevels,
   &TestErrLevels,
@@ -55,6 +58,8 @@ static const struct test_case *TestCases[] = {
   /* ---- ghheaps.c */
   &TestGHHeaps,
   &TestHeapOrdering,
+  /* ---- ghwheels.c */
+  &TestGHWheels,
   /* ---- cancel.c */
   &TestCancelTCP,
   &TestCancelUDP,
@@ -227,12 +227,14 @@ const char *string_pool_sprintf(const char *fmt, ...)
   return s;
 }
 
-FingerPrintDB::FingerPrintDB() : MatchPoints(NULL) {
+FingerPrintDB::FingerPrintDB() : MatchPoints(NULL), compiled(NULL) {
 }
 
 FingerPrintDB::~FingerPrintDB() {
   std::vector<FingerPrint *>::iterator current;
 
+  if (compiled != NULL)
+    delete compiled;
   if (MatchPoints != NULL)
     delete MatchPoints;
   for (current = prints.begin(); current != prints.end(); current++)
@@ -531,6 +533,245 @@ double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *o
   return (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
 }
 
+/* Returns the ID of the attribute attr of test, assigning a new one if it
+   hasn't been seen before. */
+static unsigned int intern_attribute(FingerPrintDBCompiled *C,
+                                     const char *test, const char *attr) {
+  std::pair<std::map<std::pair<std::string, std::string>, unsigned int>::iterator, bool> pair;
+
+  pair = C->attr_ids.insert(std::make_pair(std::make_pair(std::string(test), std::string(attr)),
+                                           (unsigned int) C->attr_names.size()));
+  if (pair.second) {
+    C->attr_names.push_back(std::make_pair(test, attr));
+    C->points.push_back(FP_POINTS_NO_TEST);
+    C->points_values.push_back(NULL);
+  }
+
+  return pair.first->second;
+}
+
+/* Lowers an expression as understood by expr_match into a FingerExpr and
+   its terms. Every term is reduced to a test that can be decided from the
+   observed value's parsed number alone, except for literals, which are
+   interned so that they can be compared by pointer. */
+static void compile_expr(FingerPrintDBCompiled *C, FingerExpr *E, const char *expr) {
+  char exprcpy[512];
+  char *p, *q, *q1;
+  int expchar;
+  FingerTerm T;
+
+  Strncpy(exprcpy, expr, sizeof(exprcpy));
+  p = exprcpy;
+
+  if (strchr(expr, '|')) {
+    E->is_and = false; expchar = '|';
+  } else {
+    E->is_and = true; expchar = '&';
+  }
+  E->first_term = C->terms.size();
+
+  do {
+    q = strchr(p, expchar);
+    if (q)
+      *q = '\0';
+    T.lo = T.hi = 0;
+    T.literal = NULL;
+    if (strcmp(p, "+") == 0) {
+      T.op = FP_TERM_NONZERO;
+    } else if (*p == '<' && isxdigit((int) (unsigned char) p[1])) {
+      T.op = FP_TERM_RANGE;
+      T.hi = strtol(p + 1, NULL, 16);
+      /* val < 0 never matches. */
+      if (T.hi == 0)
+        T.lo = 1;
+      else
+        T.hi--;
+    } else if (*p == '>' && isxdigit((int) (unsigned char) p[1])) {
+      T.op = FP_TERM_RANGE;
+      T.lo = strtol(p + 1, NULL, 16);
+      T.hi = UINT_MAX;
+      /* val > UINT_MAX never matches. */
+      if (T.lo == UINT_MAX)
+        T.hi = 0;
+      else
+        T.lo++;
+    } else if (((q1 = strchr(p, '-')) != NULL) && isxdigit((int) (unsigned char) p[0]) && isxdigit((int) (unsigned char) q1[1])) {
+      T.op = FP_TERM_RANGE;
+      *q1 = '\0';
+      T.lo = strtol(p, NULL, 16);
+      T.hi = strtol(q1 + 1, NULL, 16);
+      if (T.hi < T.lo && o.debugging) {
+        error("Range error in reference expr: %s", expr);
+      }
+    } else {
+      T.op = FP_TERM_LITERAL;
+      T.literal = string_pool_insert(p);
+    }
+    C->terms.push_back(T);
+    if (q)
+      p = q + 1;
+  } while (q);
+
+  E->num_terms = C->terms.size() - E->first_term;
+}
+
+void compile_fingerprint_db(FingerPrintDB *DB) {
+  FingerPrintDBCompiled *C;
+  std::vector<FingerPrint *>::const_iterator current_os;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  char *endptr;
+
+  if (DB->compiled != NULL)
+    delete DB->compiled;
+  C = DB->compiled = new FingerPrintDBCompiled;
+
+  /* Attributes that aren't mentioned in MatchPoints keep FP_POINTS_NO_TEST
+     or FP_POINTS_NO_ATTR; like compare_fingerprints, we only complain about
+     them if an observed fingerprint actually has them. */
+  if (DB->MatchPoints != NULL) {
+    for (test = DB->MatchPoints->tests.begin(); test != DB->MatchPoints->tests.end(); test++) {
+      for (av = test->results.begin(); av != test->results.end(); av++) {
+        unsigned int id = intern_attribute(C, test->name, av->attribute);
+        int points;
+
+        errno = 0;
+        points = strtol(av->value, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || points < 0)
+          points = FP_POINTS_BOGUS;
+        C->points[id] = points;
+        C->points_values[id] = av->value;
+      }
+    }
+  }
+
+  for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
+    FingerPrintCompiled P;
+
+    P.first_expr = C->exprs.size();
+    for (test = (*current_os)->tests.begin(); test != (*current_os)->tests.end(); test++) {
+      bool known_test = DB->MatchPoints != NULL
+        && std::binary_search(DB->MatchPoints->tests.begin(), DB->MatchPoints->tests.end(), *test);
+
+      for (av = test->results.begin(); av != test->results.end(); av++) {
+        FingerExpr E;
+
+        E.attr_id = intern_attribute(C, test->name, av->attribute);
+        if (known_test && C->points[E.attr_id] == FP_POINTS_NO_TEST)
+          C->points[E.attr_id] = FP_POINTS_NO_ATTR;
+        E.points = C->points[E.attr_id];
+        compile_expr(C, &E, av->value);
+        C->exprs.push_back(E);
+      }
+    }
+    P.num_exprs = C->exprs.size() - P.first_expr;
+    C->prints.push_back(P);
+  }
+}
+
+/* An observed attribute value, parsed once so that it can be checked against
+   every FingerTerm in the DB. */
+struct FingerObservedValue {
+  bool present;
+  bool empty;
+  bool num_ok;       /* The whole value parsed as a hex number. */
+  unsigned int num;
+  const char *value; /* From string_pool_insert. */
+};
+
+/* Lays out the attributes of the observed fingerprint FP by attribute ID.
+   Attributes that no reference print mentions are dropped. */
+static void compile_observed(const FingerPrintDBCompiled *C, const FingerPrint *FP,
+                             std::vector<FingerObservedValue> &vals) {
+  std::map<std::pair<std::string, std::string>, unsigned int>::const_iterator id;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  FingerObservedValue V;
+  char *endptr;
+
+  V.present = false;
+  vals.assign(C->attr_names.size(), V);
+
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    for (av = test->results.begin(); av != test->results.end(); av++) {
+      id = C->attr_ids.find(std::make_pair(std::string(test->name), std::string(av->attribute)));
+      if (id == C->attr_ids.end())
+        continue;
+      V.present = true;
+      V.empty = (*av->value == '\0');
+      V.num = strtol(av->value, &endptr, 16);
+      V.num_ok = (*endptr == '\0');
+      V.value = string_pool_insert(av->value);
+      vals[id->second] = V;
+    }
+  }
+}
+
+/* The equivalent of expr_match for a compiled expression. */
+static bool compiled_expr_match(const FingerPrintDBCompiled *C, const FingerExpr *E,
+                                const FingerObservedValue *V) {
+  const FingerTerm *T, *end;
+  bool term;
+
+  end = &C->terms[E->first_term] + E->num_terms;
+  for (T = &C->terms[E->first_term]; T < end; T++) {
+    switch (T->op) {
+    case FP_TERM_NONZERO:
+      term = !V->empty && V->num_ok && V->num != 0;
+      break;
+    case FP_TERM_RANGE:
+      /* expr_match only rejects an empty value for these in an '&'
+         expression; otherwise "" is treated as 0. */
+      term = !(E->is_and && V->empty) && V->num_ok && V->num >= T->lo && V->num <= T->hi;
+      break;
+    default:
+      term = (V->value == T->literal);
+      break;
+    }
+    if (E->is_and && !term)
+      return false;
+    if (!E->is_and && term)
+      return true;
+  }
+
+  return E->is_and;
+}
+
+/* The equivalent of compare_fingerprints (without verbose output) for the
+   idx'th print in DB. */
+static double compare_compiled_fingerprint(const FingerPrintDB *DB, unsigned int idx,
+                                           const std::vector<FingerObservedValue> &vals) {
+  const FingerPrintDBCompiled *C = DB->compiled;
+  const FingerPrintCompiled *P = &C->prints[idx];
+  const FingerExpr *E, *end;
+  const FingerObservedValue *V;
+  unsigned long num_subtests = 0, num_subtests_succeeded = 0;
+
+  end = &C->exprs[P->first_expr] + P->num_exprs;
+  for (E = &C->exprs[P->first_expr]; E < end; E++) {
+    V = &vals[E->attr_id];
+    if (!V->present)
+      continue;
+    if (E->points < 0) {
+      const char *test = C->attr_names[E->attr_id].first;
+      const char *attr = C->attr_names[E->attr_id].second;
+
+      if (E->points == FP_POINTS_NO_TEST)
+        fatal("%s: Failed to locate test %s in MatchPoints directive of fingerprint file", __func__, test);
+      else if (E->points == FP_POINTS_NO_ATTR)
+        fatal("%s: Failed to find point amount for test %s.%s", __func__, test, attr);
+      else
+        fatal("%s: Got bogus point amount (%s) for test %s.%s", __func__, C->points_values[E->attr_id], test, attr);
+    }
+    num_subtests += E->points;
+    if (compiled_expr_match(C, E, V))
+      num_subtests_succeeded += E->points;
+  }
+
+  assert(num_subtests_succeeded <= num_subtests);
+  return (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
+}
+
 /* Takes a fingerprint and looks for matches inside the passed in
    reference fingerprint DB.  The results are stored in in FPR (which
    must point to an instantiated FingerPrintResultsIPv4 class) -- results
@@ -544,7 +785,7 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
                                                            to be added to the
                                                            list */
   std::vector<FingerPrint *>::const_iterator current_os;
-  FingerPrint FP_copy;
+  std::vector<FingerObservedValue> observed;
   double acc;
   int state;
   int skipfp;
@@ -557,15 +798,16 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
   assert(FPR);
   assert(accuracy_threshold >= 0 && accuracy_threshold <= 1);
 
-  FP_copy = *FP;
-  FP_copy.sort();
+  assert(DB->compiled != NULL);
+
+  compile_observed(DB->compiled, FP, observed);
 
   FPR->overall_results = OSSCAN_SUCCESS;
 
   for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
     skipfp = 0;
 
-    acc = compare_fingerprints(*current_os, &FP_copy, DB->MatchPoints, 0);
+    acc = compare_compiled_fingerprint(DB, current_os - DB->prints.begin(), observed);
 
     /*    error("Comp to %s: %li/%li=%f", o.reference_FPs1[i]->OS_name, num_subtests_succeeded, num_subtests, acc); */
     if (acc >= FPR_entrance_requirement || acc == 1.0) {
@@ -1286,6 +1528,9 @@ fparse:
   }
 
   fclose(fp);
+
+  compile_fingerprint_db(DB);
+
   return DB;
 }
 
@@ -131,6 +131,10 @@
 #include "FingerPrintResults.h"
 #include "Target.h"
 
+#include <map>
+#include <string>
+#include <vector>
+
 #define OSSCAN_SUCCESS 0
 #define OSSCAN_NOMATCHES -1
 #define OSSCAN_TOOMANYMATCHES -2
@@ -142,6 +146,54 @@
 
 /* moved to global_structures.h */
 
+/* The reference database in a form that can be matched against without any
+   string work. Every (test, attribute) pair in the DB is interned to a small
+   integer ID, MatchPoints values are parsed once, and each expression is
+   lowered to a list of numeric range terms. */
+
+enum FingerTermOp {
+  FP_TERM_NONZERO,   /* "+" */
+  FP_TERM_RANGE,     /* "<N", ">N", "N-M": lo <= val <= hi */
+  FP_TERM_LITERAL    /* anything else, compared as an interned string */
+};
+
+struct FingerTerm {
+  u8 op;
+  unsigned int lo, hi;
+  const char *literal; /* From string_pool_insert, so comparable by pointer. */
+};
+
+/* Point values that can't be used, reported when a comparison needs them. */
+#define FP_POINTS_NO_TEST -1
+#define FP_POINTS_NO_ATTR -2
+#define FP_POINTS_BOGUS -3
+
+struct FingerExpr {
+  unsigned int attr_id;
+  int points;
+  bool is_and;   /* '&' rather than '|' expression */
+  unsigned int first_term, num_terms;
+};
+
+struct FingerPrintCompiled {
+  unsigned int first_expr, num_exprs;
+};
+
+struct FingerPrintDBCompiled {
+  /* Attribute IDs, indexed by "TEST.ATTR" while compiling and matching
+     observed fingerprints. */
+  std::map<std::pair<std::string, std::string>, unsigned int> attr_ids;
+  std::vector<std::pair<const char *, const char *> > attr_names;
+  /* Indexed by attribute ID: the MatchPoints value and its text, which is
+     only kept for error messages. */
+  std::vector<int> points;
+  std::vector<const char *> points_values;
+  /* Parallel to FingerPrintDB::prints. */
+  std::vector<FingerPrintCompiled> prints;
+  std::vector<FingerExpr> exprs;
+  std::vector<FingerTerm> terms;
+};
+
 /**********************  PROTOTYPES  ***********************************/
 
 /* The OS database consists of many small strings, many of which appear
@@ -167,6 +219,10 @@ FingerPrintDB *parse_fingerprint_reference_file(const char *dbname);
 
 void free_fingerprint_file(FingerPrintDB *DB);
 
+/* Builds DB->compiled from DB->prints and DB->MatchPoints. Called by
+   parse_fingerprint_file; must be called again if either is modified. */
+void compile_fingerprint_db(FingerPrintDB *DB);
+
 /* Compares 2 fingerprints -- a referenceFP (can have expression
    attributes) with an observed fingerprint (no expressions).  If
    verbose is nonzero, differences will be printed.  The comparison
@@ -433,10 +433,16 @@ static void begin_sniffer(HostOsScan *HOS, std::vector<Target *> &Targets) {
   }
 
   /* Open a network interface for packet capture */
-  HOS->pd = my_pcap_open_live(Targets[0]->deviceName(), 8192,
-    o.spoofsource ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2);
+  if (o.capture_ring)
+    HOS->pd = my_pcap_open_ring(Targets[0]->deviceName(), 8192,
+      o.spoofsource ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2, PCAP_RING_BYTES);
+  else
+    HOS->pd = my_pcap_open_live(Targets[0]->deviceName(), 8192,
+      o.spoofsource ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2);
   if (HOS->pd == NULL)
     fatal("%s", PCAP_OPEN_ERRMSG);
+  if (o.capture_ring)
+    pcap_ring_enable(HOS->pd);
 
   /* Build the final BPF filter */
   if (doIndividual)
@@ -1392,6 +1398,7 @@ HostOsScan::~HostOsScan() {
     rawsd = -1;
   }
   if (pd) {
+    pcap_ring_disable(pd);
     pcap_close(pd);
     pd = NULL;
   }
@@ -2451,6 +2451,51 @@ void printtimes(Target *currenths) {
   }
 }
 
+/* Prints the full report for one scanned host: the header, ports, MAC,
+   OS, service, script, traceroute and timing information, wrapped in a
+   <host> element. A host that timed out gets only its header. */
+void printhostoutput(Target *currenths) {
+  char hostname[MAXHOSTNAMELEN + 1];
+
+  if (currenths->timedOut(NULL)) {
+    xml_open_start_tag("host");
+    xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+    xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+    xml_close_start_tag();
+    write_host_header(currenths);
+    xml_end_tag(); /* host */
+    xml_newline();
+    log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
+              currenths->NameIP(hostname, sizeof(hostname)));
+    log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
+              currenths->targetipstr(), currenths->HostName());
+    return;
+  }
+
+  /* --open means don't show any hosts without open ports. */
+  if (o.openOnly() && !currenths->ports.hasOpenPorts())
+    return;
+
+  xml_open_start_tag("host");
+  xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+  xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+  xml_close_start_tag();
+  write_host_header(currenths);
+  printportoutput(currenths, &currenths->ports);
+  printmacinfo(currenths);
+  printosscanoutput(currenths);
+  printserviceinfooutput(currenths);
+#ifndef NOLUA
+  printhostscriptresults(currenths);
+#endif
+  if (o.traceroute)
+    printtraceroute(currenths);
+  printtimes(currenths);
+  log_write(LOG_PLAIN | LOG_MACHINE, "\n");
+  xml_end_tag(); /* host */
+  xml_newline();
+}
+
 /* Prints a status message while the program is running */
 void printStatusMessage() {
   // Pre-computations
@@ -2531,6 +2576,19 @@ void printfinaloutput() {
   if (o.verbose && o.isr00t && o.RawScan())
     log_write(LOG_STDOUT | LOG_SKID, "           %s\n",
               getFinalPacketStats(statbuf, sizeof(statbuf)));
+#if HAVE_SYS_RESOURCE_H
+  if (o.debugging) {
+    struct rusage ru;
+
+    /* ru_maxrss is in kilobytes, except on Mac OS X where it is in bytes. */
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+#ifdef MACOSX
+      log_write(LOG_STDOUT, "Peak memory usage: %.1f MB\n", ru.ru_maxrss / 1048576.0);
+#else
+      log_write(LOG_STDOUT, "Peak memory usage: %.1f MB\n", ru.ru_maxrss / 1024.0);
+#endif
+  }
+#endif
 
   Strncpy(mytime, ctime(&timep), sizeof(mytime));
   chomp(mytime);
@@ -265,6 +265,9 @@ void printtraceroute(Target *currenths);
 /* Print "times for host" output with latency. */
 void printtimes(Target *currenths);
 
+/* Print the full report for one scanned host, or a note that it timed out. */
+void printhostoutput(Target *currenths);
+
 /* Print a detailed list of Nmap interfaces and routes to
    normal/skiddy/stdout output */
 int print_iflist(void);
@@ -458,17 +458,21 @@ void PortList::addScriptResult(u16 portno, int protocol, ScriptResult& sr) {
    IPPROTO_IP)
 
 
+/* Values of the two-bit codes in PortList::port_codes. Compact class i is
+   code i + 1. */
+#define PORTLIST_CODE_DEFAULT 0
+#define PORTLIST_CODE_FULL 3
+
 PortList::PortList() {
   int proto;
   memset(state_counts_proto, 0, sizeof(state_counts_proto));
-  memset(port_list, 0, sizeof(port_list));
+  memset(port_codes, 0, sizeof(port_codes));
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) {
-    if(port_list_count[proto] > 0)
-      port_list[proto] = (Port**) safe_zalloc(sizeof(Port*)*port_list_count[proto]);
     default_port_state[proto].proto = PORTLISTPROTO2INPROTO(proto);
     default_port_state[proto].reason.reason_id = ER_NORESPONSE;
     state_counts_proto[proto][default_port_state[proto].state] = port_list_count[proto];
+    compact[proto][0].members = compact[proto][1].members = 0;
   }
 
   numscriptresults = 0;
@@ -476,7 +480,8 @@ PortList::PortList() {
 }
 
 PortList::~PortList() {
-  int proto, i;
+  std::map<u16, Port *>::iterator it;
+  int proto;
 
   if (idstr) {
     free(idstr);
@@ -484,16 +489,13 @@ PortList::~PortList() {
   }
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) { // for every protocol
-    if(port_list[proto]) {
-      for(i=0; i < port_list_count[proto]; i++) { // free every Port
-        if(port_list[proto][i]) {
-          port_list[proto][i]->freeService(true);
-          port_list[proto][i]->freeScriptResults();
-          delete port_list[proto][i];
-        }
-      }
-      free(port_list[proto]);
+    for (it = full_ports[proto].begin(); it != full_ports[proto].end(); it++) {
+      it->second->freeService(true);
+      it->second->freeScriptResults();
+      delete it->second;
     }
+    if (port_codes[proto])
+      free(port_codes[proto]);
   }
 }
 
@@ -502,7 +504,7 @@ void PortList::setDefaultPortState(u8 protocol, int state) {
   int i;
 
   for (i = 0; i < port_list_count[proto]; i++) {
-    if (port_list[proto][i] == NULL) {
+    if (getCode(proto, i) == PORTLIST_CODE_DEFAULT) {
       state_counts_proto[proto][default_port_state[proto].state]--;
       state_counts_proto[proto][state]++;
     }
@@ -512,9 +514,10 @@ void PortList::setDefaultPortState(u8 protocol, int state) {
 }
 
 void PortList::setPortState(u16 portno, u8 protocol, int state) {
-  const Port *oldport;
-  Port *current;
   int proto = INPROTO2PORTLISTPROTO(protocol);
+  u16 mapped_pno;
+  u8 mapped_proto;
+  int code, oldstate;
 
   assert(state < PORT_HIGHEST_STATE);
 
@@ -534,20 +537,37 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 
   assert(protocol!=IPPROTO_IP || portno<256);
 
-  oldport = lookupPort(portno, protocol);
-  if (oldport != NULL) {
+  mapped_pno = portno;
+  mapped_proto = protocol;
+  mapPort(&mapped_pno, &mapped_proto);
+  code = getCode(proto, mapped_pno);
+
+  if (code != PORTLIST_CODE_DEFAULT) {
+    oldstate = getPortState(portno, protocol);
     /* We must discount our statistics from the old values.  Also warn
        if a complete duplicate */
-    if (o.debugging && oldport->state == state) {
+    if (o.debugging && oldstate == state) {
       error("Duplicate port (%hu/%s)", portno, proto2ascii_lowercase(protocol));
     }
-    state_counts_proto[proto][oldport->state]--;
+    state_counts_proto[proto][oldstate]--;
   } else {
     state_counts_proto[proto][default_port_state[proto].state]--;
   }
-  current = createPort(portno, protocol);
 
-  current->state = state;
+  if (code == PORTLIST_CODE_FULL) {
+    full_ports[proto][mapped_pno]->state = state;
+  } else {
+    state_reason_t reason;
+
+    if (code == PORTLIST_CODE_DEFAULT) {
+      state_reason_init(&reason);
+      reason.reason_id = ER_NORESPONSE;
+    } else {
+      reason = compact[proto][code - 1].reason;
+      compact[proto][code - 1].members--;
+    }
+    storeCompact(proto, mapped_pno, state, &reason);
+  }
   state_counts_proto[proto][state]++;
 
   if(state == PORT_FILTERED || state == PORT_OPENFILTERED)
@@ -556,20 +576,24 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 }
 
 int PortList::getPortState(u16 portno, u8 protocol) {
-  const Port *port;
+  int code;
 
-  port = lookupPort(portno, protocol);
-  if (port == NULL)
-    return default_port_state[INPROTO2PORTLISTPROTO(protocol)].state;
+  mapPort(&portno, &protocol);
+  code = getCode(protocol, portno);
+  if (code == PORTLIST_CODE_DEFAULT)
+    return default_port_state[protocol].state;
+  else if (code == PORTLIST_CODE_FULL)
+    return full_ports[protocol][portno]->state;
 
-  return port->state;
+  return compact[protocol][code - 1].state;
 }
 
 /* Return true if nothing special is known about this port; i.e., it's in the
    default state as defined by setDefaultPortState and every other data field is
    unset. */
 bool PortList::portIsDefault(u16 portno, u8 protocol) {
-  return lookupPort(portno, protocol) == NULL;
+  mapPort(&portno, &protocol);
+  return getCode(protocol, portno) == PORTLIST_CODE_DEFAULT;
 }
 
   /* Saves an identification string for the target containing these
@@ -612,7 +636,9 @@ Port *PortList::nextPort(const Port *cur, Port *next,
                          int allowed_protocol, int allowed_state) {
   int proto;
   int mapped_pno;
-  Port *port;
+  int code;
+  const Port *port;
+  const struct compact_class *cls;
 
   if (cur) {
     proto = INPROTO2PORTLISTPROTO(cur->proto);
@@ -630,17 +656,30 @@ Port *PortList::nextPort(const Port *cur, Port *next,
     mapped_pno = 0;
   }
 
-  if(port_list[proto] != NULL) {
+  if(port_map[proto] != NULL) {
     for(;mapped_pno < port_list_count[proto]; mapped_pno++) {
-      port = port_list[proto][mapped_pno];
-      if (port && (allowed_state==0 || port->state==allowed_state)) {
-        *next = *port;
-        return next;
-      }
-      if (!port && (allowed_state==0 || default_port_state[proto].state==allowed_state)) {
-        *next = default_port_state[proto];
-        next->portno = port_map_rev[proto][mapped_pno];
-        return next;
+      code = getCode(proto, mapped_pno);
+      if (code == PORTLIST_CODE_FULL) {
+        port = full_ports[proto].find(mapped_pno)->second;
+        if (allowed_state==0 || port->state==allowed_state) {
+          *next = *port;
+          return next;
+        }
+      } else if (code == PORTLIST_CODE_DEFAULT) {
+        if (allowed_state==0 || default_port_state[proto].state==allowed_state) {
+          *next = default_port_state[proto];
+          next->portno = port_map_rev[proto][mapped_pno];
+          return next;
+        }
+      } else {
+        cls = &compact[proto][code - 1];
+        if (allowed_state==0 || cls->state==allowed_state) {
+          *next = default_port_state[proto];
+          next->portno = port_map_rev[proto][mapped_pno];
+          next->state = cls->state;
+          next->reason = cls->reason;
+          return next;
+        }
       }
     }
   }
@@ -667,7 +706,7 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
   if (*protocol == IPPROTO_IP)
     assert(*portno < 256);
-  if(port_map[mapped_protocol]==NULL || port_list[mapped_protocol]==NULL) {
+  if(port_map[mapped_protocol]==NULL) {
     fatal("%s(%i,%i): you're trying to access uninitialized protocol", __func__, *portno, *protocol);
   }
   mapped_portno = port_map[mapped_protocol][*portno];
@@ -679,9 +718,13 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
   *protocol = mapped_protocol;
 }
 
+/* Returns the Port object for a port, or NULL if it has none (it is in the
+   default state or a compact class). */
 const Port *PortList::lookupPort(u16 portno, u8 protocol) const {
   mapPort(&portno, &protocol);
-  return port_list[protocol][portno];
+  if (getCode(protocol, portno) != PORTLIST_CODE_FULL)
+    return NULL;
+  return full_ports[protocol].find(portno)->second;
 }
 
 /* Create the port if it doesn't exist; otherwise this is like lookupPort. */
@@ -689,52 +732,140 @@ Port *PortList::createPort(u16 portno, u8 protocol) {
   Port *p;
   u16 mapped_portno;
   u8 mapped_protocol;
+  int code;
 
   mapped_portno = portno;
   mapped_protocol = protocol;
   mapPort(&mapped_portno, &mapped_protocol);
 
-  p = port_list[mapped_protocol][mapped_portno];
-  if (p == NULL) {
-    p = new Port();
-    p->portno = portno;
-    p->proto = protocol;
+  code = getCode(mapped_protocol, mapped_portno);
+  if (code == PORTLIST_CODE_FULL)
+    return full_ports[mapped_protocol][mapped_portno];
+
+  p = new Port();
+  p->portno = portno;
+  p->proto = protocol;
+  if (code == PORTLIST_CODE_DEFAULT) {
     p->state = default_port_state[mapped_protocol].state;
     p->reason.reason_id = ER_NORESPONSE;
-    port_list[mapped_protocol][mapped_portno] = p;
+  } else {
+    p->state = compact[mapped_protocol][code - 1].state;
+    p->reason = compact[mapped_protocol][code - 1].reason;
+    compact[mapped_protocol][code - 1].members--;
   }
+  full_ports[mapped_protocol][mapped_portno] = p;
+  setCode(mapped_protocol, mapped_portno, PORTLIST_CODE_FULL);
 
-  return port_list[mapped_protocol][mapped_portno];
+  return p;
 }
 
 int PortList::forgetPort(u16 portno, u8 protocol) {
-  Port *answer = NULL;
+  u16 mapped_pno = portno;
+  u8 mapped_proto = protocol;
+  int code, oldstate;
 
   log_write(LOG_PLAIN, "Removed %d\n", portno);
 
-  mapPort(&portno, &protocol);
+  mapPort(&mapped_pno, &mapped_proto);
 
-  answer = port_list[protocol][portno];
-  if (answer == NULL)
+  code = getCode(mapped_proto, mapped_pno);
+  if (code == PORTLIST_CODE_DEFAULT)
     return -1;
 
-  state_counts_proto[protocol][answer->state]--;
-  state_counts_proto[protocol][default_port_state[protocol].state]++;
-
-  delete answer;
+  oldstate = getPortState(portno, protocol);
+  state_counts_proto[mapped_proto][oldstate]--;
+  state_counts_proto[mapped_proto][default_port_state[mapped_proto].state]++;
 
-  port_list[protocol][portno] = NULL;
+  if (code == PORTLIST_CODE_FULL) {
+    delete full_ports[mapped_proto][mapped_pno];
+    full_ports[mapped_proto].erase(mapped_pno);
+  } else {
+    compact[mapped_proto][code - 1].members--;
+  }
+  setCode(mapped_proto, mapped_pno, PORTLIST_CODE_DEFAULT);
 
   if (o.verbose) {
     log_write(LOG_STDOUT, "Deleting port %hu/%s, which we thought was %s\n",
-              portno, proto2ascii_lowercase(answer->proto),
-              statenum2str(answer->state));
+              portno, proto2ascii_lowercase(protocol),
+              statenum2str(oldstate));
     log_flush(LOG_STDOUT);
   }
 
   return 0;
 }
 
+static bool reasons_equal(const state_reason_t *a, const state_reason_t *b) {
+  if (a->reason_id != b->reason_id || a->ttl != b->ttl
+      || a->ip_addr.sockaddr.sa_family != b->ip_addr.sockaddr.sa_family)
+    return false;
+  if (a->ip_addr.sockaddr.sa_family == AF_INET)
+    return a->ip_addr.in.sin_addr.s_addr == b->ip_addr.in.sin_addr.s_addr;
+  if (a->ip_addr.sockaddr.sa_family == AF_INET6)
+    return memcmp(&a->ip_addr.in6.sin6_addr, &b->ip_addr.in6.sin6_addr,
+                  sizeof(a->ip_addr.in6.sin6_addr)) == 0;
+  return true;
+}
+
+int PortList::getCode(int proto, int mapped_pno) const {
+  if (port_codes[proto] == NULL)
+    return PORTLIST_CODE_DEFAULT;
+  return (port_codes[proto][mapped_pno / 4] >> (mapped_pno % 4 * 2)) & 3;
+}
+
+void PortList::setCode(int proto, int mapped_pno, int code) {
+  u8 *byte;
+
+  if (port_codes[proto] == NULL) {
+    if (code == PORTLIST_CODE_DEFAULT)
+      return;
+    port_codes[proto] = (u8 *) safe_zalloc((port_list_count[proto] + 3) / 4);
+  }
+  byte = &port_codes[proto][mapped_pno / 4];
+  *byte = (*byte & ~(3 << (mapped_pno % 4 * 2))) | (code << (mapped_pno % 4 * 2));
+}
+
+/* Records a port that has nothing but a state and a reason: in a compact
+   class with the same state and reason if there is one, else in an unused
+   class, else as a full Port. The port must not currently be full or counted
+   in a class. Open ports are always full. */
+void PortList::storeCompact(int proto, int mapped_pno, u8 state,
+                            const state_reason_t *reason) {
+  struct compact_class *cls;
+  Port *p;
+  int i;
+
+  if (state != PORT_OPEN) {
+    for (i = 0; i < 2; i++) {
+      cls = &compact[proto][i];
+      if (cls->members > 0 && cls->state == state && reasons_equal(&cls->reason, reason))
+        break;
+    }
+    if (i == 2) {
+      for (i = 0; i < 2; i++) {
+        cls = &compact[proto][i];
+        if (cls->members == 0) {
+          cls->state = state;
+          cls->reason = *reason;
+          break;
+        }
+      }
+    }
+    if (i < 2) {
+      compact[proto][i].members++;
+      setCode(proto, mapped_pno, i + 1);
+      return;
+    }
+  }
+
+  p = new Port();
+  p->portno = port_map_rev[proto][mapped_pno];
+  p->proto = PORTLISTPROTO2INPROTO(proto);
+  p->state = state;
+  p->reason = *reason;
+  full_ports[proto][mapped_pno] = p;
+  setCode(proto, mapped_pno, PORTLIST_CODE_FULL);
+}
+
 /* Just free memory used by PortList::port_map[]. Should be done somewhere
  * before closing nmap. */
 void PortList::freePortMap() {
@@ -782,8 +913,8 @@ void PortList::initializePortMap(int protocol, u16 *ports, int portcount) {
     port_map_rev[proto][i] = ports[i];
   }
   /* So now port_map should have such structure (lets scan 2nd,4th and 6th port):
-   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_list structure
-   * 	port_list[port_2,port_4,port_6] */
+   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_codes
+   * 	port_codes[port_2,port_4,port_6] */
 }
 
   /* Cycles through the 0 or more "ignored" ports which should be
@@ -918,17 +1049,39 @@ bool PortList::isTCPwrapped(u16 portno) const {
 
 int PortList::setStateReason(u16 portno, u8 proto, reason_t reason, u8 ttl,
   const struct sockaddr_storage *ip_addr) {
-    Port *answer = NULL;
-
-    answer = createPort(portno, proto);
+    state_reason_t *answer;
+    state_reason_t compact_reason;
+    u16 mapped_pno = portno;
+    u8 mapped_proto = proto;
+    int code;
+    u8 state;
+
+    mapPort(&mapped_pno, &mapped_proto);
+    code = getCode(mapped_proto, mapped_pno);
+    if (code == PORTLIST_CODE_FULL) {
+      answer = &full_ports[mapped_proto][mapped_pno]->reason;
+    } else if (code == PORTLIST_CODE_DEFAULT) {
+      state = default_port_state[mapped_proto].state;
+      state_reason_init(&compact_reason);
+      compact_reason.reason_id = ER_NORESPONSE;
+      answer = &compact_reason;
+    } else {
+      state = compact[mapped_proto][code - 1].state;
+      compact_reason = compact[mapped_proto][code - 1].reason;
+      compact[mapped_proto][code - 1].members--;
+      answer = &compact_reason;
+    }
 
     /* set new reason and increment its count */
-    answer->reason.reason_id = reason;
+    answer->reason_id = reason;
     if (ip_addr == NULL)
-      answer->reason.ip_addr.sockaddr.sa_family = AF_UNSPEC;
+      answer->ip_addr.sockaddr.sa_family = AF_UNSPEC;
     else
-      answer->reason.set_ip_addr(ip_addr);
-        answer->reason.ttl = ttl;
+      answer->set_ip_addr(ip_addr);
+        answer->ttl = ttl;
+
+    if (code != PORTLIST_CODE_FULL)
+      storeCompact(mapped_proto, mapped_pno, state, &compact_reason);
     return 0;
 }
 
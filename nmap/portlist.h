@@ -132,6 +132,8 @@
 
 #include "portreasons.h"
 
+#include <map>
+
 /* port states */
 #define PORT_UNKNOWN 0
 #define PORT_CLOSED 1
@@ -329,20 +331,37 @@ class PortList {
   Port *createPort(u16 portno, u8 protocol);
   /* Set Port structure to PortList structure.*/
   void  setPortEntry(u16 portno, u8 protocol, Port *port);
+  int getCode(int proto, int mapped_pno) const;
+  void setCode(int proto, int mapped_pno, int code);
+  void storeCompact(int proto, int mapped_pno, u8 state, const state_reason_t *reason);
 
   /* A string identifying the system these ports are on.  Just used for
      printing open ports, if it is set with setIdStr() */
   char *idstr;
   /* Number of ports in each state per each protocol. */
   int state_counts_proto[PORTLIST_PROTO_MAX][PORT_HIGHEST_STATE];
-  Port **port_list[PORTLIST_PROTO_MAX];
+  /* Most ports of a large scan end up in one or two states with the same
+     reason (closed by a reset, filtered by no response), so instead of a Port
+     object each port gets two bits in port_codes: PORTLIST_CODE_DEFAULT,
+     one of the two compact classes below, or PORTLIST_CODE_FULL for ports
+     with a Port object in full_ports. Ports that are open or have service or
+     script results are always full. port_codes is allocated when the first
+     port of a protocol leaves the default state. */
+  struct compact_class {
+    u8 state;
+    state_reason_t reason;
+    int members;
+  };
+  u8 *port_codes[PORTLIST_PROTO_MAX];
+  struct compact_class compact[PORTLIST_PROTO_MAX][2];
+  std::map<u16, Port *> full_ports[PORTLIST_PROTO_MAX];
  protected:
-  /* Maps port_number to index in port_list array.
+  /* Maps port_number to index in port_codes.
    * Only functions: getPortEntry, setPortEntry, initializePortMap and
    * nextPort should access this structure directly. */
   static u16 *port_map[PORTLIST_PROTO_MAX];
   static u16 *port_map_rev[PORTLIST_PROTO_MAX];
-  /* Number of allocated elements in port_list per each protocol. */
+  /* Number of ports scanned per each protocol. */
   static int port_list_count[PORTLIST_PROTO_MAX];
   Port default_port_state[PORTLIST_PROTO_MAX];
 };
@@ -143,8 +143,12 @@
 #include "struct_ip.h"
 
 #include <math.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
 #include <list>
 #include <map>
+#include <new>
 
 extern NmapOps o;
 
@@ -153,6 +157,10 @@ void UltraScanInfo::log_overall_rates(int logt) {
   if (send_rate_meter.getNumBytes() > 0)
     log_write(logt, ", %.2f bytes / s", send_rate_meter.getOverallByteRate(&now));
   log_write(logt, ".\n");
+  if (demux_lookups > 0) {
+    log_write(logt, "Response demultiplexing: %lu host lookups, %.3f usec / lookup.\n",
+              demux_lookups, (double) demux_usecs / demux_lookups);
+  }
 }
 
 void UltraScanInfo::log_current_rates(int logt, bool update) {
@@ -298,6 +306,58 @@ UltraProbe::~UltraProbe() {
     delete probes.CP;
 }
 
+/* Number of probes in each slab of an UltraProbePool. */
+#define PROBE_POOL_SLAB_SIZE 512
+
+UltraProbePool::UltraProbePool() {
+  slab_used = PROBE_POOL_SLAB_SIZE;
+  allocs = reuses = 0;
+  live = peak_live = 0;
+}
+
+UltraProbePool::~UltraProbePool() {
+  std::vector<UltraProbe *>::iterator slab;
+
+  for (slab = slabs.begin(); slab != slabs.end(); slab++)
+    ::operator delete(*slab);
+}
+
+UltraProbe *UltraProbePool::alloc() {
+  UltraProbe *slot;
+
+  if (!freelist.empty()) {
+    slot = freelist.back();
+    freelist.pop_back();
+    reuses++;
+  } else {
+    if (slab_used == PROBE_POOL_SLAB_SIZE) {
+      slabs.push_back((UltraProbe *) ::operator new(PROBE_POOL_SLAB_SIZE * sizeof(UltraProbe)));
+      slab_used = 0;
+    }
+    slot = slabs.back() + slab_used++;
+  }
+  allocs++;
+  live++;
+  if (live > peak_live)
+    peak_live = live;
+
+  return new (slot) UltraProbe();
+}
+
+void UltraProbePool::release(UltraProbe *probe) {
+  assert(live > 0);
+  probe->~UltraProbe();
+  freelist.push_back(probe);
+  live--;
+}
+
+void UltraProbePool::log_stats(int logt) const {
+  log_write(logt, "Probe allocation: %lu probes, %u peak live, %.1f%% reused, %lu KB in %lu slabs.\n",
+            allocs, peak_live, allocs ? 100.0 * reuses / allocs : 0.0,
+            (unsigned long) (slabs.size() * PROBE_POOL_SLAB_SIZE * sizeof(UltraProbe) / 1024),
+            (unsigned long) slabs.size());
+}
+
 GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI) {
   memset(&latestip, 0, sizeof(latestip));
   memset(&timeout, 0, sizeof(timeout));
@@ -494,6 +554,7 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   retry_capped_warned = false;
   num_probes_active = 0;
   num_probes_waiting_retransmit = 0;
+  probe_index_seq = 0;
   lastping_sent = lastprobe_sent = lastrcvd = USI->now;
   lastping_sent_numprobes = 0;
   nxtpseq = 1;
@@ -762,6 +823,7 @@ UltraScanInfo::~UltraScanInfo() {
     rawsd = -1;
   }
   if (pd) {
+    pcap_ring_disable(pd);
     pcap_close(pd);
     pd = NULL;
   }
@@ -959,6 +1021,17 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
   numInitialTargets = Targets.size();
   nextI = incompleteHosts.begin();
 
+  /* Size the host index for a load factor of at most 1/2. */
+  unsigned int buckets = 16;
+  while (buckets < 2 * incompleteHosts.size())
+    buckets <<= 1;
+  hostIndex.resize(buckets);
+  for (std::list<HostScanStats *>::iterator hostI = incompleteHosts.begin();
+       hostI != incompleteHosts.end(); hostI++) {
+    hostIndexBucket((*hostI)->target->TargetSockAddr()).push_back(*hostI);
+  }
+  demux_lookups = demux_usecs = 0;
+
   gstats = new GroupScanStats(this); /* Peeks at several elements in USI - careful of order */
   gstats->num_hosts_timedout += num_timedout;
 
@@ -1109,33 +1182,52 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
   return (TIMEVAL_MSEC_SUBTRACT(lowhtime, now) == 0);
 }
 
+/* Returns the hostIndex bucket for the address ss. */
+std::list<HostScanStats *> &UltraScanInfo::hostIndexBucket(const struct sockaddr_storage *ss) {
+  u32 h = 0;
+
+  if (ss->ss_family == AF_INET) {
+    h = ntohl(((const struct sockaddr_in *) ss)->sin_addr.s_addr);
+  } else if (ss->ss_family == AF_INET6) {
+    const u8 *a = ((const struct sockaddr_in6 *) ss)->sin6_addr.s6_addr;
+    int i;
+
+    for (i = 0; i < 16; i += 4)
+      h ^= (a[i] << 24) | (a[i + 1] << 16) | (a[i + 2] << 8) | a[i + 3];
+  }
+
+  return hostIndex[h & (hostIndex.size() - 1)];
+}
+
 /* Find a HostScanStats by its IP address in the incomplete and completed lists.
-   Returns NULL if none are found. */
+   Returns NULL if none are found. A host group never has two targets with the
+   same address (see target_needs_new_hostgroup), so at most one host in the
+   index can match. */
 HostScanStats *UltraScanInfo::findHost(struct sockaddr_storage *ss) {
+  std::list<HostScanStats *> &bucket = hostIndexBucket(ss);
   std::list<HostScanStats *>::iterator hss;
-  struct sockaddr_storage target_addr;
-  size_t target_addr_len;
+  HostScanStats *found = NULL;
+  struct timeval begin, end;
+
+  if (o.debugging)
+    gettimeofday(&begin, NULL);
 
-  for (hss = incompleteHosts.begin(); hss != incompleteHosts.end(); hss++) {
-    target_addr_len = sizeof(target_addr);
-    (*hss)->target->TargetSockAddr(&target_addr, &target_addr_len);
-    if (sockaddr_storage_cmp(&target_addr, ss) == 0) {
-      if (o.debugging > 2)
-        log_write(LOG_STDOUT, "Found %s in incomplete hosts list.\n", (*hss)->target->targetipstr());
-      return *hss;
+  for (hss = bucket.begin(); hss != bucket.end(); hss++) {
+    if (sockaddr_storage_cmp((*hss)->target->TargetSockAddr(), ss) == 0) {
+      found = *hss;
+      break;
     }
   }
-  for (hss = completedHosts.begin(); hss != completedHosts.end(); hss++) {
-    target_addr_len = sizeof(target_addr);
-    (*hss)->target->TargetSockAddr(&target_addr, &target_addr_len);
-    if (sockaddr_storage_cmp(&target_addr, ss) == 0) {
-      if (o.debugging > 2)
-        log_write(LOG_STDOUT, "Found %s in completed hosts list.\n", (*hss)->target->targetipstr());
-      return *hss;
-    }
+
+  demux_lookups++;
+  if (o.debugging) {
+    gettimeofday(&end, NULL);
+    demux_usecs += TIMEVAL_SUBTRACT(end, begin);
+    if (found != NULL && o.debugging > 2)
+      log_write(LOG_STDOUT, "Found %s in hosts list.\n", found->target->targetipstr());
   }
 
-  return NULL;
+  return found;
 }
 
 /* Check if incompleteHosts list contains less than n elements. This function
@@ -1182,6 +1274,7 @@ int UltraScanInfo::removeCompletedHosts() {
 
       TIMEVAL_MSEC_ADD(compare, hss->completiontime, completedHostLifetime);
       if (TIMEVAL_AFTER(now, compare) ) {
+        hostIndexBucket(hss->target->TargetSockAddr()).remove(hss);
         completedHosts.erase(hostI);
         hostsRemoved++;
       }
@@ -1550,6 +1643,63 @@ int HostScanStats::freshPortsLeft() {
   return 0;
 }
 
+/* The probe_index key for a probe with the given protocol and ports. */
+static inline u64 probe_index_key(u8 proto, u16 sport, u16 dport) {
+  return ((u64) proto << 32) | ((u32) sport << 16) | dport;
+}
+
+void HostScanStats::addOutstandingProbe(UltraProbe *probe) {
+  struct probe_index_entry entry;
+
+  probes_outstanding.push_back(probe);
+  if (probe->type != UltraProbe::UP_IP)
+    return;
+  entry.seq = probe_index_seq++;
+  entry.probeI = probes_outstanding.end();
+  entry.probeI--;
+  probe_index.insert(std::make_pair(probe_index_key(probe->protocol(), probe->sport(), probe->dport()), entry));
+}
+
+/* Removes the probe_index entry for the probe at probeI, if any. */
+static void probe_index_remove(HostScanStats *hss, std::list<UltraProbe *>::iterator probeI) {
+  UltraProbe *probe = *probeI;
+  std::pair<HostScanStats::probe_index_t::iterator, HostScanStats::probe_index_t::iterator> range;
+  HostScanStats::probe_index_t::iterator indexI;
+
+  if (probe->type != UltraProbe::UP_IP)
+    return;
+  range = hss->probeIndexRange(probe->protocol(), probe->sport(), probe->dport());
+  for (indexI = range.first; indexI != range.second; indexI++) {
+    if (indexI->second.probeI == probeI) {
+      hss->probe_index.erase(indexI);
+      return;
+    }
+  }
+  assert(0);
+}
+
+std::pair<HostScanStats::probe_index_t::iterator, HostScanStats::probe_index_t::iterator>
+HostScanStats::probeIndexRange(u8 proto, u16 sport, u16 dport) {
+  return probe_index.equal_range(probe_index_key(proto, sport, dport));
+}
+
+std::list<UltraProbe *>::iterator HostScanStats::newestProbe(u8 proto) {
+  probe_index_t::iterator indexI, end;
+  std::list<UltraProbe *>::iterator newest = probes_outstanding.end();
+  unsigned long newest_seq = 0;
+
+  indexI = probe_index.lower_bound(probe_index_key(proto, 0, 0));
+  end = probe_index.upper_bound(probe_index_key(proto, 0xFFFF, 0xFFFF));
+  for (; indexI != end; indexI++) {
+    if (newest == probes_outstanding.end() || indexI->second.seq > newest_seq) {
+      newest = indexI->second.probeI;
+      newest_seq = indexI->second.seq;
+    }
+  }
+
+  return newest;
+}
+
 /* Removes a probe from probes_outstanding, adjusts HSS and USS
    active probe stats accordingly, then deletes the probe. */
 void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator probeI) {
@@ -1571,8 +1721,9 @@ void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator pr
   if (probe->type == UltraProbe::UP_CONNECT && probe->CP()->sd > 0)
     USI->gstats->CSI->clearSD(probe->CP()->sd);
 
+  probe_index_remove(this, probeI);
   probes_outstanding.erase(probeI);
-  delete probe;
+  USI->probe_pool.release(probe);
 }
 
 /* Removes all probes from probes_outstanding using
@@ -1951,9 +2102,10 @@ void HostScanStats::moveProbeToBench(std::list<UltraProbe *>::iterator probeI) {
     probe_bench.reserve(128);
   }
   probe_bench.push_back(*probe->pspec());
+  probe_index_remove(this, probeI);
   probes_outstanding.erase(probeI);
   num_probes_waiting_retransmit--;
-  delete probe;
+  USI->probe_pool.release(probe);
 }
 
 /* Called when a ping response is discovered. If adjust_timing is false, timing
@@ -2643,6 +2795,345 @@ static void startTimeOutClocks(std::vector<Target *> &Targets) {
   }
 }
 
+/* With --scan-workers, hosts are divided between worker processes by the low
+   bits of their IPv4 address, so that each worker's pcap filter can select
+   its own replies without listing every host, and a host group of
+   consecutive addresses is spread over all workers. nworkers is a power of
+   two. */
+int scan_worker_for_target(Target *target, int nworkers) {
+  u32 addr = ntohl(target->v4hostip()->s_addr);
+
+  return addr & (nworkers - 1);
+}
+
+#ifndef WIN32
+/* What a worker process sends back for each of its hosts. It is followed by
+   num_defaults (protocol, state) byte pairs giving the default port states,
+   then num_ports worker_port_result records for ports in other states. The
+   records never leave the machine, so they are written as raw structs. */
+struct worker_host_result {
+  struct timeout_info to;
+  probespec pingprobe;
+  int pingprobe_state;
+  int weird_responses;
+  state_reason_t reason;
+  u8 mac[6];
+  bool mac_set;
+  int num_defaults;
+  int num_ports;
+};
+
+struct worker_port_result {
+  u16 portno;
+  u8 proto;
+  u8 state;
+  state_reason_t reason;
+};
+
+static void write_worker_results(FILE *fp, std::vector<Target *> &Targets,
+                                 const struct timeout_info *group_to) {
+  static const u8 protos[] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP };
+  std::vector<Target *>::iterator hostI;
+  std::vector<struct worker_port_result> ports;
+  std::vector<u8> defaults;
+  struct worker_host_result hr;
+  struct worker_port_result pr;
+  Port port, *p;
+  unsigned int i;
+
+  if (fwrite(group_to, sizeof(*group_to), 1, fp) != 1)
+    pfatal("%s: fwrite", __func__);
+  for (hostI = Targets.begin(); hostI != Targets.end(); hostI++) {
+    Target *t = *hostI;
+
+    ports.clear();
+    defaults.clear();
+    for (i = 0; i < sizeof(protos) / sizeof(*protos); i++) {
+      bool have_default = false;
+
+      for (p = t->ports.nextPort(NULL, &port, protos[i], 0); p != NULL;
+           p = t->ports.nextPort(p, &port, protos[i], 0)) {
+        if (t->ports.portIsDefault(p->portno, p->proto)) {
+          if (!have_default) {
+            defaults.push_back(p->proto);
+            defaults.push_back(p->state);
+            have_default = true;
+          }
+          continue;
+        }
+        pr.portno = p->portno;
+        pr.proto = p->proto;
+        pr.state = p->state;
+        pr.reason = p->reason;
+        ports.push_back(pr);
+      }
+    }
+
+    memset(&hr, 0, sizeof(hr));
+    hr.to = t->to;
+    hr.pingprobe = t->pingprobe;
+    hr.pingprobe_state = t->pingprobe_state;
+    hr.weird_responses = t->weird_responses;
+    hr.reason = t->reason;
+    if (t->MACAddress() != NULL) {
+      memcpy(hr.mac, t->MACAddress(), sizeof(hr.mac));
+      hr.mac_set = true;
+    }
+    hr.num_defaults = defaults.size() / 2;
+    hr.num_ports = ports.size();
+    if (fwrite(&hr, sizeof(hr), 1, fp) != 1
+        || (!defaults.empty() && fwrite(&defaults[0], 1, defaults.size(), fp) != defaults.size())
+        || (!ports.empty() && fwrite(&ports[0], sizeof(pr), ports.size(), fp) != ports.size()))
+      pfatal("%s: fwrite", __func__);
+  }
+  if (fflush(fp) != 0)
+    pfatal("%s: fflush", __func__);
+}
+
+/* Reads a worker's results file. If apply is false, only checks that the file
+   is complete; otherwise copies the results into Targets. Returns false if the
+   file is truncated. */
+static bool read_worker_results(FILE *fp, std::vector<Target *> &Targets,
+                                struct timeout_info *group_to, bool apply) {
+  std::vector<Target *>::iterator hostI;
+  struct worker_host_result hr;
+  struct worker_port_result pr;
+  struct sockaddr_storage ss;
+  u8 def[2];
+  int i;
+
+  if (fread(group_to, sizeof(*group_to), 1, fp) != 1)
+    return false;
+  for (hostI = Targets.begin(); hostI != Targets.end(); hostI++) {
+    Target *t = *hostI;
+
+    if (fread(&hr, sizeof(hr), 1, fp) != 1 || hr.num_defaults < 0 || hr.num_ports < 0)
+      return false;
+    if (!apply) {
+      if (fseek(fp, hr.num_defaults * sizeof(def) + hr.num_ports * sizeof(pr), SEEK_CUR) != 0)
+        return false;
+      continue;
+    }
+    t->to = hr.to;
+    t->pingprobe = hr.pingprobe;
+    t->pingprobe_state = hr.pingprobe_state;
+    t->weird_responses = hr.weird_responses;
+    t->reason = hr.reason;
+    if (hr.mac_set)
+      t->setMACAddress(hr.mac);
+    for (i = 0; i < hr.num_defaults; i++) {
+      if (fread(def, sizeof(def), 1, fp) != 1)
+        return false;
+      t->ports.setDefaultPortState(def[0], def[1]);
+    }
+    for (i = 0; i < hr.num_ports; i++) {
+      if (fread(&pr, sizeof(pr), 1, fp) != 1)
+        return false;
+      t->ports.setPortState(pr.portno, pr.proto, pr.state);
+      memset(&ss, 0, sizeof(ss));
+      if (pr.reason.ip_addr.sockaddr.sa_family == AF_INET)
+        memcpy(&ss, &pr.reason.ip_addr.in, sizeof(pr.reason.ip_addr.in));
+      else if (pr.reason.ip_addr.sockaddr.sa_family == AF_INET6)
+        memcpy(&ss, &pr.reason.ip_addr.in6, sizeof(pr.reason.ip_addr.in6));
+      t->ports.setStateReason(pr.portno, pr.proto, pr.reason.reason_id,
+                              pr.reason.ttl,
+                              ss.ss_family == AF_UNSPEC ? NULL : &ss);
+    }
+  }
+
+  if (!apply) {
+    /* fseek can go past the end of the file, so make sure it didn't. */
+    long end = ftell(fp);
+
+    if (end == -1 || fseek(fp, 0, SEEK_END) != 0 || ftell(fp) != end)
+      return false;
+  }
+
+  return true;
+}
+
+/* Folds one worker's group timing into the merged timing to. Each worker saw
+   only its own share of the hosts, so take the most conservative of them. */
+static void merge_worker_timeouts(struct timeout_info *to,
+                                  const struct timeout_info *worker_to) {
+  to->srtt = MAX(to->srtt, worker_to->srtt);
+  to->rttvar = MAX(to->rttvar, worker_to->rttvar);
+  to->timeout = MAX(to->timeout, worker_to->timeout);
+}
+
+/* Whether ultra_scan can split Targets between worker processes. Only raw
+   IPv4 TCP, UDP and SCTP port scans are sharded: the others either need the
+   whole host group at once (ping scans feed pingprobe selection and host
+   discovery state) or can't be split by address in a pcap filter. */
+static bool scan_workers_usable(std::vector<Target *> &Targets, stype scantype) {
+  if (o.scan_workers <= 1 || o.scan_worker >= 0 || Targets.size() < 2)
+    return false;
+  if (o.af() != AF_INET || (o.sendpref & PACKET_SEND_ETH_STRONG) == PACKET_SEND_ETH_STRONG)
+    return false;
+  switch (scantype) {
+  case SYN_SCAN:
+  case ACK_SCAN:
+  case WINDOW_SCAN:
+  case NULL_SCAN:
+  case FIN_SCAN:
+  case MAIMON_SCAN:
+  case XMAS_SCAN:
+  case UDP_SCAN:
+  case SCTP_INIT_SCAN:
+  case SCTP_COOKIE_ECHO_SCAN:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Runs ultra_scan in o.scan_workers child processes, each scanning the hosts
+   whose address falls in its share (see scan_worker_for_target), and then
+   copies their results back into Targets. Workers run quietly; open ports are
+   reported here as their results are merged, in target order. Group rate and
+   parallelism limits are divided evenly between the workers, and the group
+   timing they return is merged into to. The hosts of a worker that fails are
+   scanned again in this process. Returns false if the hosts would all go to
+   one worker, in which case the caller should scan in-process. */
+static bool ultra_scan_workers(std::vector<Target *> &Targets,
+                               struct scan_lists *ports, stype scantype,
+                               struct timeout_info *to) {
+  std::vector<std::vector<Target *> > shards(o.scan_workers);
+  std::vector<pid_t> pids(o.scan_workers, -1);
+  std::vector<FILE *> results(o.scan_workers, (FILE *) NULL);
+  std::vector<Target *>::iterator hostI;
+  std::vector<Target *> rescan;
+  struct timeout_info group_to;
+  ScanProgressMeter *SPM;
+  struct timeval now;
+  int nworkers, numports, i, status, saved_scan_workers;
+  bool have_group_to = false;
+  pid_t pid;
+
+  for (hostI = Targets.begin(); hostI != Targets.end(); hostI++)
+    shards[scan_worker_for_target(*hostI, o.scan_workers)].push_back(*hostI);
+  nworkers = 0;
+  for (i = 0; i < o.scan_workers; i++) {
+    if (!shards[i].empty())
+      nworkers++;
+  }
+  if (nworkers < 2)
+    return false;
+
+  if (scantype == UDP_SCAN)
+    numports = ports->udp_count;
+  else if (scantype == SCTP_INIT_SCAN || scantype == SCTP_COOKIE_ECHO_SCAN)
+    numports = ports->sctp_count;
+  else
+    numports = ports->tcp_count;
+  if (o.verbose) {
+    log_write(LOG_STDOUT, "Scanning %d hosts [%d port%s/host] with %d workers\n",
+              (int) Targets.size(), numports, (numports != 1) ? "s" : "", nworkers);
+  }
+  SPM = new ScanProgressMeter(scantype2str(scantype));
+  set_default_port_state(Targets, scantype);
+  log_flush_all();
+
+  for (i = 0; i < o.scan_workers; i++) {
+    if (shards[i].empty())
+      continue;
+    results[i] = tmpfile();
+    if (results[i] == NULL)
+      pfatal("%s: tmpfile", __func__);
+    pids[i] = fork();
+    if (pids[i] == -1)
+      pfatal("%s: fork", __func__);
+    if (pids[i] == 0) {
+      struct timeout_info worker_to;
+      int l;
+
+      /* The worker only reports back through its results file. */
+      for (hostI = shards[i].begin(); hostI != shards[i].end(); hostI++) {
+        if ((*hostI)->timeOutClockRunning())
+          (*hostI)->stopTimeOutClock(NULL);
+      }
+      o.scan_worker = i;
+      o.verbose = 0;
+      o.debugging = 0;
+      o.noninteractive = true;
+      for (l = 0; l < LOG_NUM_FILES; l++)
+        o.logfd[l] = NULL;
+      if (o.min_packet_send_rate != 0.0)
+        o.min_packet_send_rate /= nworkers;
+      if (o.max_packet_send_rate != 0.0)
+        o.max_packet_send_rate /= nworkers;
+      if (o.max_parallelism)
+        o.max_parallelism = MAX(1, o.max_parallelism / nworkers);
+      if (o.min_parallelism)
+        o.min_parallelism = MAX(1, o.min_parallelism / nworkers);
+      if (to != NULL)
+        worker_to = *to;
+      else
+        memset(&worker_to, 0, sizeof(worker_to));
+      ultra_scan(shards[i], ports, scantype, to != NULL ? &worker_to : NULL);
+      write_worker_results(results[i], shards[i], &worker_to);
+      fflush(stdout);
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < o.scan_workers; i++) {
+    bool ok;
+
+    if (pids[i] == -1)
+      continue;
+    while ((pid = waitpid(pids[i], &status, 0)) == -1 && errno == EINTR)
+      ;
+    /* The worker's hosts were being scanned until now. */
+    gettimeofday(&now, NULL);
+    ok = pid == pids[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    /* Check the whole file before changing any Target, so that a failed
+       worker's hosts are rescanned from a clean state. */
+    rewind(results[i]);
+    ok = ok && read_worker_results(results[i], shards[i], &group_to, false);
+    if (ok) {
+      rewind(results[i]);
+      read_worker_results(results[i], shards[i], &group_to, true);
+      if (to != NULL) {
+        if (!have_group_to)
+          *to = group_to;
+        else
+          merge_worker_timeouts(to, &group_to);
+        have_group_to = true;
+      }
+    } else {
+      error("Scan worker %d (pid %d) failed; scanning its %u hosts again without workers",
+            i, (int) pids[i], (unsigned int) shards[i].size());
+      rescan.insert(rescan.end(), shards[i].begin(), shards[i].end());
+    }
+    fclose(results[i]);
+    for (hostI = shards[i].begin(); hostI != shards[i].end(); hostI++) {
+      if ((*hostI)->timeOutClockRunning())
+        (*hostI)->stopTimeOutClock(&now);
+    }
+  }
+
+  if (o.verbose) {
+    char additional_info[128];
+
+    Snprintf(additional_info, sizeof(additional_info), "%lu total ports",
+             (unsigned long) numports * Targets.size());
+    SPM->endTask(NULL, additional_info);
+  }
+  delete SPM;
+
+  if (!rescan.empty()) {
+    /* ultra_scan would otherwise hand them to workers again. */
+    saved_scan_workers = o.scan_workers;
+    o.scan_workers = 1;
+    ultra_scan(rescan, ports, scantype, to);
+    o.scan_workers = saved_scan_workers;
+  }
+
+  return true;
+}
+#endif
+
 /* 3rd generation Nmap scanning function. Handles most Nmap port scan types.
 
    The parameter to gives group timing information, and if it is not NULL,
@@ -2651,6 +3142,8 @@ static void startTimeOutClocks(std::vector<Target *> &Targets) {
    NULL (its default value), a default timeout_info will be used. */
 void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
                 stype scantype, struct timeout_info *to) {
+  unsigned long batch_packets_start, batch_calls_start;
+
   o.current_scantype = scantype;
 
   increment_base_port();
@@ -2674,6 +3167,11 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
   o.numhosts_scanning = Targets.size();
 
   startTimeOutClocks(Targets);
+#ifndef WIN32
+  if (scan_workers_usable(Targets, scantype)
+      && ultra_scan_workers(Targets, ports, scantype, to))
+    return;
+#endif
   UltraScanInfo USI(Targets, ports, scantype);
 
   /* Use the requested timeouts. */
@@ -2693,13 +3191,20 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
     begin_sniffer(&USI, Targets);
   /* Otherwise, no sniffer needed! */
 
+  send_ip_batch_stats(&batch_packets_start, &batch_calls_start);
+
   while (!USI.incompleteHostsEmpty()) {
+    /* Probes sent on the raw socket during this round are queued and go out
+       together just before we start waiting for responses. */
+    if (USI.rawsd >= 0)
+      send_ip_batch_begin(USI.rawsd);
     doAnyPings(&USI);
     doAnyOutstandingRetransmits(&USI); // Retransmits from probes_outstanding
     /* Retransmits from retry_stack -- goes after OutstandingRetransmits for
        memory consumption reasons */
     doAnyRetryStackRetransmits(&USI);
     doAnyNewProbes(&USI);
+    send_ip_batch_flush();
     gettimeofday(&USI.now, NULL);
     // printf("TRACE: Finished doAnyNewProbes() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
     printAnyStats(&USI);
@@ -2708,7 +3213,7 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
     // printf("TRACE: Finished waitForResponses() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
     processData(&USI);
 
-    if (keyWasPressed()) {
+    if (o.scan_worker < 0 && keyWasPressed()) {
       // This prints something like
       // SYN Stealth Scan Timing: About 1.14% done; ETC: 15:01 (0:43:23 remaining);
       USI.SPM->printStats(USI.getCompletionFraction(), NULL);
@@ -2746,7 +3251,19 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
   }
   if (o.debugging)
     USI.log_overall_rates(LOG_STDOUT);
+  if (o.debugging || o.packetTrace())
+    USI.probe_pool.log_stats(LOG_STDOUT);
+  if (o.debugging) {
+    unsigned long batch_packets, batch_calls;
+
+    send_ip_batch_stats(&batch_packets, &batch_calls);
+    batch_packets -= batch_packets_start;
+    batch_calls -= batch_calls_start;
+    if (batch_calls > 0)
+      log_write(LOG_STDOUT, "Raw send batching: %lu packets in %lu batches (%.1f per batch).\n",
+                batch_packets, batch_calls, (double) batch_packets / batch_calls);
+  }
 
-  if (o.debugging > 2 && USI.pd != NULL)
+  if ((o.debugging > 2 || (o.debugging && o.capture_ring)) && USI.pd != NULL)
     pcap_print_stats(LOG_PLAIN, USI.pd);
 }
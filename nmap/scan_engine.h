@@ -132,6 +132,7 @@
 #include "timing.h"
 #include "tcpip.h"
 #include <list>
+#include <map>
 #include <vector>
 
 struct probespec_tcpdata {
@@ -191,6 +192,9 @@ typedef struct probespec {
 void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
                 stype scantype, struct timeout_info *to = NULL);
 
+/* With --scan-workers, the worker process a target is assigned to. */
+int scan_worker_for_target(Target *target, int nworkers);
+
 /* Determines an ideal number of hosts to be scanned (port scan, os
    scan, version detection, etc.) in parallel after the ping scan is
    completed.  This is a balance between efficiency (more hosts in
@@ -351,6 +355,30 @@ private:
   } probes;
 };
 
+/* A freelist allocator for the UltraProbes of one UltraScanInfo. Probes are
+   carved out of slabs that live as long as the scan group, and freed probes
+   are handed out again first, so that retransmissions and new probes reuse
+   recently touched memory instead of going back to the heap. */
+class UltraProbePool {
+public:
+  UltraProbePool();
+  ~UltraProbePool();
+  /* Returns a newly constructed UltraProbe. */
+  UltraProbe *alloc();
+  /* Destroys a probe returned by alloc and keeps its memory for reuse. */
+  void release(UltraProbe *probe);
+  void log_stats(int logt) const;
+
+private:
+  std::vector<UltraProbe *> slabs;
+  std::vector<UltraProbe *> freelist;
+  unsigned int slab_used; /* Slots of the newest slab handed out so far */
+  unsigned long allocs; /* Total calls to alloc */
+  unsigned long reuses; /* allocs satisfied from the freelist */
+  unsigned int live;
+  unsigned int peak_live;
+};
+
 /* Global info for the connect scan */
 class ConnectScanInfo {
 public:
@@ -510,6 +538,9 @@ public:
   bool nextTimeout(struct timeval *when);
   UltraScanInfo *USI; /* The USI which contains this HSS */
 
+  /* Appends a newly sent probe to probes_outstanding and indexes it in
+     probe_index. */
+  void addOutstandingProbe(UltraProbe *probe);
   /* Removes a probe from probes_outstanding, adjusts HSS and USS
      active probe stats accordingly, then deletes the probe. */
   void destroyOutstandingProbe(std::list<UltraProbe *>::iterator probeI);
@@ -532,6 +563,24 @@ public:
      maximum tryno and expired) are not counted in
      probes_outstanding.  */
   std::list<UltraProbe *> probes_outstanding;
+  /* The UP_IP probes in probes_outstanding, keyed by protocol and ports (see
+     probe_index_key), so that a response can be matched to its probe without
+     walking the whole list. Entries for the same key are in the order the
+     probes were sent, and seq orders entries across keys. */
+  struct probe_index_entry {
+    unsigned long seq;
+    std::list<UltraProbe *>::iterator probeI;
+  };
+  typedef std::multimap<u64, struct probe_index_entry> probe_index_t;
+  probe_index_t probe_index;
+  unsigned long probe_index_seq;
+  /* The outstanding probes with the given protocol and ports, oldest
+     first. */
+  std::pair<probe_index_t::iterator, probe_index_t::iterator>
+    probeIndexRange(u8 proto, u16 sport, u16 dport);
+  /* The most recently sent outstanding probe with the given protocol,
+     whatever its ports, or probes_outstanding.end() if there is none. */
+  std::list<UltraProbe *>::iterator newestProbe(u8 proto);
   /* The number of probes in probes_outstanding, minus the inactive (timed out) ones */
   unsigned int num_probes_active;
   /* Probes timed out but not yet retransmitted because of congestion
@@ -706,6 +755,10 @@ public:
   /* Find a HostScanStats by its IP address in the incomplete and completed
      lists.  Returns NULL if none are found. */
   HostScanStats *findHost(struct sockaddr_storage *ss);
+  /* Number of findHost calls and the time spent in them. The time is only
+     measured when debugging, and is printed with the overall rates. */
+  unsigned long demux_lookups;
+  unsigned long demux_usecs;
 
   double getCompletionFraction();
 
@@ -746,10 +799,19 @@ public:
   eth_t *ethsd;
   u32 seqmask; /* This mask value is used to encode values in sequence
                   numbers.  It is set randomly in UltraScanInfo::Init() */
+  /* All UltraProbes of this scan are allocated from here. The hosts, and
+     with them their probes, are deleted before this is destroyed. */
+  UltraProbePool probe_pool;
 private:
 
   unsigned int numInitialTargets;
   std::list<HostScanStats *>::iterator nextI;
+  /* incompleteHosts and completedHosts, hashed by target address so that
+     findHost doesn't have to walk them for every received packet. The
+     number of buckets is a power of two. Hosts stay in the index until they
+     are dropped from completedHosts. */
+  std::vector<std::list<HostScanStats *> > hostIndex;
+  std::list<HostScanStats *> &hostIndexBucket(const struct sockaddr_storage *ss);
 
 };
 
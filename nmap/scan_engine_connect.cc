@@ -392,7 +392,7 @@ static void init_socket(int sd) {
 UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                                  u16 destport, u8 tryno, u8 pingseq) {
 
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probe_pool.alloc();
   std::list<UltraProbe *>::iterator probeI;
   int rc;
   int connect_errno = 0;
@@ -436,7 +436,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   PacketTrace::traceConnect(IPPROTO_TCP, (sockaddr *) &sock, socklen, rc,
                             connect_errno, &USI->now);
   /* This counts as probe being sent, so update structures */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   probeI = hss->probes_outstanding.end();
   probeI--;
   USI->gstats->num_probes_active++;
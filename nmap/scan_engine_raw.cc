@@ -123,14 +123,23 @@
 
 /* $Id$ */
 
+#include "nmap_dns.h"
 #include "nmap_error.h"
+#include "nmap_tty.h"
 #include "NmapOps.h"
+#include "output.h"
 #include "payload.h"
 #include "scan_engine_raw.h"
 #include "struct_ip.h"
+#include "targets.h"
 #include "tcpip.h"
+#include "timing.h"
 #include "utils.h"
+#include <algorithm>
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
 
 extern NmapOps o;
 
@@ -947,7 +956,13 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
     }
   }
 
-  if ((USI->pd = my_pcap_open_live(Targets[0]->deviceName(), 256,  (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2)) == NULL)
+  /* ARP and ND replies are read through libnetutil, which doesn't know
+     about batched handles, so those scans always use a plain handle. */
+  if (o.capture_ring && !USI->ping_scan_arp && !USI->ping_scan_nd) {
+    if ((USI->pd = my_pcap_open_ring(Targets[0]->deviceName(), 256,  (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2, PCAP_RING_BYTES)) == NULL)
+      fatal("%s", PCAP_OPEN_ERRMSG);
+    pcap_ring_enable(USI->pd);
+  } else if ((USI->pd = my_pcap_open_live(Targets[0]->deviceName(), 256,  (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2)) == NULL)
     fatal("%s", PCAP_OPEN_ERRMSG);
 
   if (USI->ping_scan_arp) {
@@ -1016,6 +1031,16 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
       pcap_filter = "dst host ";
       pcap_filter += inet_ntop_ez(&source, sizeof(source));
       pcap_filter += " and (icmp or icmp6 or tcp or udp or sctp)";
+      if (o.scan_worker >= 0) {
+        /* Only this worker's share of the targets (see
+           scan_worker_for_target). ICMP errors can come from routers, so
+           those are always kept. */
+        char workerstr[64];
+
+        Snprintf(workerstr, sizeof(workerstr), " and (icmp or ip[15] & %d = %d)",
+                 o.scan_workers - 1, o.scan_worker);
+        pcap_filter += workerstr;
+      }
     }
   } else {
     assert(0);
@@ -1032,7 +1057,7 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
 UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                              u8 tryno, u8 pingseq) {
   int rc;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probe_pool.alloc();
 
   /* 3 cheers for libdnet header files */
   u8 frame[ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN];
@@ -1059,7 +1084,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   probe->setARP(frame, sizeof(frame));
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1069,7 +1094,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
 UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             u8 tryno, u8 pingseq) {
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probe_pool.alloc();
   struct eth_nfo eth;
   struct eth_nfo *ethptr = NULL;
   u8 *packet = NULL;
@@ -1128,7 +1153,7 @@ UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   free(packet);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1259,7 +1284,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             const probespec *pspec, u8 tryno, u8 pingseq) {
   u8 *packet = NULL;
   u32 packetlen = 0;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probe_pool.alloc();
   int decoy = 0;
   u32 seq = 0;
   u32 ack = 0;
@@ -1324,6 +1349,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         }
         hss->probeSent(packetlen);
         send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        if (decoy == o.decoyturn)
+          send_ip_batch_stamp(&probe->sent);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1366,6 +1393,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         }
         hss->probeSent(packetlen);
         send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        if (decoy == o.decoyturn)
+          send_ip_batch_stamp(&probe->sent);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1423,6 +1452,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         }
         hss->probeSent(packetlen);
         send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        if (decoy == o.decoyturn)
+          send_ip_batch_stamp(&probe->sent);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1464,6 +1495,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         }
         hss->probeSent(packetlen);
         send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        if (decoy == o.decoyturn)
+          send_ip_batch_stamp(&probe->sent);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1490,6 +1523,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       }
       hss->probeSent(packetlen);
       send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      if (decoy == o.decoyturn)
+        send_ip_batch_stamp(&probe->sent);
       free(packet);
     }
   } else if (pspec->type == PS_ICMPV6) {
@@ -1513,7 +1548,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   } else assert(0);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1668,6 +1703,34 @@ bool get_ns_result(UltraScanInfo *USI, struct timeval *stime) {
   return gotone;
 }
 
+/* Fills in candidates with the outstanding probes that a response to a probe
+   with the given protocol and ports (as sent, in host byte order) could belong
+   to, newest first. Other probes can't match, so this spares the callers a
+   walk of all of probes_outstanding. In an IP protocol scan, responses are
+   matched on the protocol alone, and only the newest probe with that
+   protocol is a candidate. */
+static void probe_candidates(const UltraScanInfo *USI, HostScanStats *hss,
+                             u8 proto, u16 sport, u16 dport,
+                             std::vector<std::list<UltraProbe *>::iterator> &candidates) {
+  std::pair<HostScanStats::probe_index_t::iterator, HostScanStats::probe_index_t::iterator> range;
+  HostScanStats::probe_index_t::iterator indexI;
+  std::list<UltraProbe *>::iterator probeI;
+
+  candidates.clear();
+  if (USI->prot_scan) {
+    probeI = hss->newestProbe(proto);
+    if (probeI != hss->probes_outstanding.end())
+      candidates.push_back(probeI);
+    return;
+  }
+
+  range = hss->probeIndexRange(proto, sport, dport);
+  for (indexI = range.second; indexI != range.first; ) {
+    indexI--;
+    candidates.push_back(indexI->second.probeI);
+  }
+}
+
 /* Tries to get one *good* (finishes a probe) pcap response by the
    (absolute) time given in stime.  Even if stime is now, try an
    ultra-quick pcap read just in case.  Returns true if a "good" result
@@ -1682,6 +1745,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
   long to_usec;
   HostScanStats *hss = NULL;
   std::list<UltraProbe *>::iterator probeI;
+  std::vector<std::list<UltraProbe *>::iterator> candidates;
   UltraProbe *probe = NULL;
   int newstate = PORT_UNKNOWN;
   unsigned int probenum;
@@ -1735,11 +1799,11 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
           protoscanicmphack = true;
           protoscanicmphackaddy = hdr.src;
         } else {
-          probeI = hss->probes_outstanding.end();
-          listsz = hss->num_probes_outstanding();
+          probe_candidates(USI, hss, hdr.proto, 0, 0, candidates);
+          listsz = candidates.size();
           goodone = false;
           for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-            probeI--;
+            probeI = candidates[probenum];
             probe = *probeI;
 
             if (probe->protocol() == hdr.proto) {
@@ -1766,14 +1830,14 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      probe_candidates(USI, hss, IPPROTO_TCP, ntohs(tcp->th_dport), ntohs(tcp->th_sport), candidates);
+      listsz = candidates.size();
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -1814,8 +1878,8 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      probe_candidates(USI, hss, IPPROTO_SCTP, ntohs(sctp->sh_dport), ntohs(sctp->sh_sport), candidates);
+      listsz = candidates.size();
 
       goodone = false;
 
@@ -1824,7 +1888,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       /* Find the probe that provoked this response. */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
 
         if (probe->protocol() != IPPROTO_SCTP)
@@ -1914,8 +1978,14 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      if (USI->prot_scan) {
+        probe_candidates(USI, hss, encaps_hdr.proto, 0, 0, candidates);
+      } else {
+        /* The TCP, UDP, and SCTP headers all start with the ports. */
+        const u16 *encaps_ports = (const u16 *) encaps_data;
+        probe_candidates(USI, hss, encaps_hdr.proto, ntohs(encaps_ports[0]), ntohs(encaps_ports[1]), candidates);
+      }
+      listsz = candidates.size();
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -1925,7 +1995,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2043,8 +2113,14 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      if (USI->prot_scan) {
+        probe_candidates(USI, hss, encaps_hdr.proto, 0, 0, candidates);
+      } else {
+        /* The TCP, UDP, and SCTP headers all start with the ports. */
+        const u16 *encaps_ports = (const u16 *) encaps_data;
+        probe_candidates(USI, hss, encaps_hdr.proto, ntohs(encaps_ports[0]), ntohs(encaps_ports[1]), candidates);
+      }
+      listsz = candidates.size();
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -2054,7 +2130,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2165,15 +2241,15 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      probe_candidates(USI, hss, IPPROTO_UDP, ntohs(udp->uh_dport), ntohs(udp->uh_sport), candidates);
+      listsz = candidates.size();
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       goodone = false;
 
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
         newstate = PORT_UNKNOWN;
 
@@ -2238,11 +2314,11 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
   if (protoscanicmphack) {
     hss = USI->findHost((struct sockaddr_storage *) &protoscanicmphackaddy);
     if (hss) {
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      probe_candidates(USI, hss, IPPROTO_ICMP, 0, 0, candidates);
+      listsz = candidates.size();
 
       for (probenum = 0; probenum < listsz; probenum++) {
-        probeI--;
+        probeI = candidates[probenum];
         probe = *probeI;
 
         if (probe->protocol() == IPPROTO_ICMP) {
@@ -2273,3 +2349,494 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
   return goodone;
 }
+
+/* Stateless SYN sweep (--stateless). Instead of keeping a record of every
+   probe, each SYN carries a keyed hash of its (target, port) pair in the
+   sequence number and source port, and a reply is accepted only if its ACK
+   and destination port match the hash recomputed from the reply itself. The
+   targets are read from the HostGroupState in windows of at most
+   SWEEP_WINDOW_HOSTS addresses, and each window's hosts x ports space is
+   walked in a random order, so memory use doesn't grow with the number of
+   targets. Target objects are only made for hosts that answer. */
+
+#define SWEEP_WINDOW_HOSTS 65536
+/* Probes sent between checks for replies. */
+#define SWEEP_BATCH 64
+
+struct sweep_host {
+  Target *target;
+  unsigned int window;
+};
+
+struct sweep_window {
+  unsigned int id;
+  /* Still sending; last_sent is not set yet. */
+  bool sending;
+  struct timeval last_sent;
+  /* The window's targets, sorted, to tell replies for it from late ones. */
+  std::vector<u32> addrs;
+};
+
+class StatelessSweep {
+public:
+  StatelessSweep(const struct scan_lists *ports);
+  ~StatelessSweep();
+  void run(HostGroupState *hs, const addrset *exclude_group);
+
+private:
+  bool fillWindow(HostGroupState *hs, const addrset *exclude_group);
+  void begin(const struct sockaddr_storage *first);
+  void sendProbe(u32 addr, u16 port);
+  void readReplies(long to_usec);
+  void handleReply(const struct ip *ip, unsigned int bytes);
+  void recordResult(u32 addr, u16 port, int state, reason_t reason, u8 ttl,
+                    const struct sockaddr_storage *reason_sip);
+  void closeWindows(const struct timeval *now, bool all);
+  bool windowOf(u32 addr, unsigned int *id) const;
+  u32 cookie(u32 addr, u16 port) const;
+  u16 cookiePort(u32 addr, u16 port) const;
+
+  const u16 *portlist;
+  int numports;
+  u32 key[2];
+  u32 *addrs; /* The current window's targets, network byte order. */
+  unsigned int numaddrs;
+  unsigned int window;
+  long wait_usec;
+  std::list<sweep_window> open_windows;
+  std::map<u32, sweep_host> hosts;
+
+  struct sockaddr_storage source;
+  struct in_addr source_in;
+  char devname[32];
+  char devfullname[32];
+  int rawsd;
+  pcap_t *pd;
+
+  unsigned long probes_sent;
+  unsigned long replies;
+  unsigned long bad_cookies;
+  unsigned long late_replies;
+};
+
+StatelessSweep::StatelessSweep(const struct scan_lists *ports) {
+  portlist = ports->tcp_ports;
+  numports = ports->tcp_count;
+  key[0] = get_random_u32();
+  key[1] = get_random_u32();
+  addrs = (u32 *) safe_malloc(SWEEP_WINDOW_HOSTS * sizeof(*addrs));
+  numaddrs = 0;
+  window = 0;
+  /* Replies arriving later than this after their window was sent are lost. */
+  wait_usec = o.initialRttTimeout() * 1000;
+  rawsd = -1;
+  pd = NULL;
+  probes_sent = replies = bad_cookies = late_replies = 0;
+}
+
+StatelessSweep::~StatelessSweep() {
+  free(addrs);
+  if (rawsd >= 0)
+    close(rawsd);
+  if (pd) {
+    pcap_ring_disable(pd);
+    pcap_close(pd);
+  }
+}
+
+/* Mixes a target address and port under the given key with the MurmurHash3
+   finalizer, so cookies can't be predicted without knowing the key. */
+static u32 sweep_hash(u32 key, u32 addr, u16 port) {
+  u32 h = key ^ addr;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  h ^= port;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* The sequence number of the probe to addr:port. */
+u32 StatelessSweep::cookie(u32 addr, u16 port) const {
+  return sweep_hash(key[0], addr, port);
+}
+
+/* The source port of the probe to addr:port. */
+u16 StatelessSweep::cookiePort(u32 addr, u16 port) const {
+  if (o.magic_port_set)
+    return o.magic_port;
+  return 1024 + sweep_hash(key[1], addr, port) % (65536 - 1024);
+}
+
+/* Opens the raw socket and sniffer. All probes leave from the source address
+   and interface of the route to the first target. */
+void StatelessSweep::begin(const struct sockaddr_storage *first) {
+  struct route_nfo rnfo;
+  char filter[128];
+
+  if (!nmap_route_dst(first, &rnfo))
+    fatal("%s: failed to determine route to %s", __func__, inet_ntop_ez(first, sizeof(*first)));
+  source = rnfo.srcaddr;
+  source_in = ((struct sockaddr_in *) &source)->sin_addr;
+  Strncpy(devname, rnfo.ii.devname, sizeof(devname));
+  Strncpy(devfullname, rnfo.ii.devfullname, sizeof(devfullname));
+  o.decoys[o.decoyturn] = source_in;
+
+#ifdef WIN32
+  win32_fatal_raw_sockets(devname);
+#endif
+  rawsd = nmap_raw_socket();
+  if (rawsd < 0)
+    pfatal("Couldn't open a raw socket. Error");
+
+  /* Replies come in at the send rate, which the default capture buffer can't
+     absorb between reads, so the sweep always reads from a capture ring. */
+  if ((pd = my_pcap_open_ring(devname, 256, (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2, PCAP_RING_BYTES)) == NULL)
+    fatal("%s", PCAP_OPEN_ERRMSG);
+  pcap_ring_enable(pd);
+  Snprintf(filter, sizeof(filter), "dst host %s and (icmp or tcp)",
+           inet_ntop_ez(&source, sizeof(source)));
+  set_pcap_filter(devfullname, pd, filter);
+
+  if (o.verbose)
+    log_write(LOG_STDOUT, "Initiating stateless SYN sweep of %d port%s through %s\n",
+              numports, (numports == 1) ? "" : "s", devname);
+}
+
+/* Reads the next window of target addresses. Returns false when there are
+   none left. */
+bool StatelessSweep::fillWindow(HostGroupState *hs, const addrset *exclude_group) {
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin;
+  const char *expr;
+  int max, n;
+
+  numaddrs = 0;
+  while (numaddrs < SWEEP_WINDOW_HOSTS) {
+    max = SWEEP_WINDOW_HOSTS - numaddrs;
+    if (o.max_ips_to_scan) {
+      if (o.numhosts_scanned >= o.max_ips_to_scan)
+        break;
+      max = MIN(max, o.max_ips_to_scan - o.numhosts_scanned);
+    }
+    n = hs->current_group.get_next_hosts(addrs + numaddrs, max);
+    if (n == 0) {
+      expr = hs->next_expression();
+      if (expr == NULL)
+        break;
+      hs->current_group.parse_expr(expr, o.af());
+      continue;
+    }
+    n = addrset_filter_ipv4(exclude_group, addrs + numaddrs, n);
+    if (n > 0 && rawsd < 0) {
+      memset(&ss, 0, sizeof(ss));
+      sin = (struct sockaddr_in *) &ss;
+      sin->sin_family = AF_INET;
+#if HAVE_SOCKADDR_SA_LEN
+      sin->sin_len = sizeof(*sin);
+#endif
+      sin->sin_addr.s_addr = addrs[numaddrs];
+      begin(&ss);
+    }
+    numaddrs += n;
+    o.numhosts_scanned += n;
+  }
+
+  return numaddrs > 0;
+}
+
+void StatelessSweep::sendProbe(u32 addr, u16 port) {
+  struct sockaddr_storage dst;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &dst;
+  u8 *packet;
+  u32 packetlen;
+
+  memset(&dst, 0, sizeof(dst));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = addr;
+  packet = build_tcp_raw(&source_in, &sin->sin_addr, o.ttl, get_random_u16(),
+                         IP_TOS_DEFAULT, false, o.ipoptions, o.ipoptionslen,
+                         cookiePort(addr, port), port, cookie(addr, port), 0, 0,
+                         TH_SYN, 0, 0, (u8 *) "\x02\x04\x05\xb4", 4,
+                         o.extra_payload, o.extra_payload_length, &packetlen);
+  send_ip_packet(rawsd, NULL, &dst, packet, packetlen);
+  free(packet);
+  probes_sent++;
+}
+
+/* Waits up to to_usec for a reply, then handles every reply that is
+   already waiting. */
+void StatelessSweep::readReplies(long to_usec) {
+  struct timeval rcvdtime;
+  struct link_header linkhdr;
+  unsigned int bytes;
+  const struct ip *ip;
+
+  while ((ip = (struct ip *) readip_pcap(pd, &bytes, to_usec, &rcvdtime, &linkhdr, true)) != NULL) {
+    handleReply(ip, bytes);
+    to_usec = 0;
+  }
+}
+
+/* Checks a captured packet against the cookies and records the port state it
+   shows. */
+void StatelessSweep::handleReply(const struct ip *ip, unsigned int bytes) {
+  struct abstract_ip_hdr hdr, encaps_hdr;
+  struct sockaddr_storage reason_sip = { AF_UNSPEC };
+  const void *data;
+  unsigned int datalen, encaps_len;
+  u32 addr;
+  u16 port;
+
+  datalen = bytes;
+  data = ip_get_data(ip, &datalen, &hdr);
+  if (data == NULL || hdr.version != 4)
+    return;
+
+  if (hdr.proto == IPPROTO_TCP && datalen >= 20) {
+    const struct tcp_hdr *tcp = (const struct tcp_hdr *) data;
+    int newstate;
+    reason_t reason;
+
+    addr = ((struct sockaddr_in *) &hdr.src)->sin_addr.s_addr;
+    port = ntohs(tcp->th_sport);
+    if (ntohs(tcp->th_dport) != cookiePort(addr, port) ||
+        ntohl(tcp->th_ack) != cookie(addr, port) + 1) {
+      bad_cookies++;
+      return;
+    }
+    if ((tcp->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+      newstate = PORT_OPEN;
+      reason = ER_SYNACK;
+    } else if (tcp->th_flags & TH_RST) {
+      newstate = PORT_CLOSED;
+      reason = ER_RESETPEER;
+    } else if (tcp->th_flags & TH_SYN) {
+      /* TCP split handshake. */
+      newstate = PORT_OPEN;
+      reason = ER_SYN;
+    } else {
+      return;
+    }
+    replies++;
+    recordResult(addr, port, newstate, reason, hdr.ttl, &reason_sip);
+  } else if (hdr.proto == IPPROTO_ICMP && datalen >= 8) {
+    const struct icmp *icmp = (const struct icmp *) data;
+    const struct tcp_hdr *tcp;
+
+    if (icmp->icmp_type != 3 && icmp->icmp_type != 11)
+      return;
+    encaps_len = datalen - 8;
+    tcp = (const struct tcp_hdr *) ip_get_data((const char *) data + 8, &encaps_len, &encaps_hdr);
+    /* The quoted header only needs to reach the sequence number. */
+    if (tcp == NULL || encaps_hdr.proto != IPPROTO_TCP || encaps_len < 8 ||
+        sockaddr_storage_cmp(&encaps_hdr.src, &source) != 0)
+      return;
+    addr = ((struct sockaddr_in *) &encaps_hdr.dst)->sin_addr.s_addr;
+    port = ntohs(tcp->th_dport);
+    if (ntohs(tcp->th_sport) != cookiePort(addr, port) ||
+        ntohl(tcp->th_seq) != cookie(addr, port)) {
+      bad_cookies++;
+      return;
+    }
+    if (sockaddr_storage_cmp(&hdr.src, &encaps_hdr.dst) != 0)
+      reason_sip = hdr.src;
+    replies++;
+    recordResult(addr, port, PORT_FILTERED,
+                 icmp_to_reason(hdr.proto, icmp->icmp_type, icmp->icmp_code),
+                 hdr.ttl, &reason_sip);
+  }
+}
+
+/* Finds the open window that addr was sent in. Returns false if there is
+   none, which means the window was already closed and its hosts printed. */
+bool StatelessSweep::windowOf(u32 addr, unsigned int *id) const {
+  std::list<sweep_window>::const_iterator wi;
+
+  for (wi = open_windows.begin(); wi != open_windows.end(); wi++) {
+    if (std::binary_search(wi->addrs.begin(), wi->addrs.end(), addr)) {
+      *id = wi->id;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Sets the state of addr:port, making a Target for addr if this is its first
+   reply. Only the first reply for each port counts, and replies that arrive
+   after addr's window was closed are dropped. */
+void StatelessSweep::recordResult(u32 addr, u16 port, int state, reason_t reason,
+                                  u8 ttl, const struct sockaddr_storage *reason_sip) {
+  std::map<u32, sweep_host>::iterator it;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+  Target *t;
+
+  it = hosts.find(addr);
+  if (it == hosts.end()) {
+    sweep_host host;
+
+    if (!windowOf(addr, &host.window)) {
+      late_replies++;
+      return;
+    }
+    t = new Target();
+    memset(&ss, 0, sizeof(ss));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = addr;
+    t->setTargetSockAddr(&ss, sizeof(*sin));
+    t->setSourceSockAddr(&source, sizeof(struct sockaddr_in));
+    t->setDeviceNames(devname, devfullname);
+    t->flags = HOST_UP;
+    initialize_timeout_info(&t->to);
+    t->reason.reason_id = reason;
+    t->reason.ttl = ttl;
+    t->startTimeOutClock(NULL);
+    t->ports.setDefaultPortState(IPPROTO_TCP, PORT_FILTERED);
+    o.numhosts_up++;
+    host.target = t;
+    it = hosts.insert(std::make_pair(addr, host)).first;
+  }
+  t = it->second.target;
+
+  if (!t->ports.portIsDefault(port, IPPROTO_TCP))
+    return;
+  t->ports.setPortState(port, IPPROTO_TCP, state);
+  t->ports.setStateReason(port, IPPROTO_TCP, reason, ttl, reason_sip);
+}
+
+/* Prints and frees the hosts of every window whose last probe went out more
+   than wait_usec ago (or of all windows). */
+void StatelessSweep::closeWindows(const struct timeval *now, bool all) {
+  std::map<u32, sweep_host>::iterator it, next;
+  std::vector<Target *> done;
+  unsigned int last;
+  unsigned int i;
+
+  if (open_windows.empty() || open_windows.front().sending)
+    return;
+  if (!all && TIMEVAL_SUBTRACT(*now, open_windows.front().last_sent) < wait_usec)
+    return;
+  last = open_windows.front().id;
+  while (!open_windows.empty() && !open_windows.front().sending &&
+         (all || TIMEVAL_SUBTRACT(*now, open_windows.front().last_sent) >= wait_usec)) {
+    last = open_windows.front().id;
+    open_windows.pop_front();
+  }
+
+  for (it = hosts.begin(); it != hosts.end(); it = next) {
+    next = it;
+    next++;
+    if (all || it->second.window <= last) {
+      done.push_back(it->second.target);
+      hosts.erase(it);
+    }
+  }
+  if (done.empty())
+    return;
+
+  if (!o.noresolve)
+    nmap_mass_rdns(&done[0], done.size());
+  for (i = 0; i < done.size(); i++) {
+    done[i]->stopTimeOutClock(NULL);
+    printhostoutput(done[i]);
+    delete done[i];
+  }
+  log_flush_all();
+}
+
+void StatelessSweep::run(HostGroupState *hs, const addrset *exclude_group) {
+  struct timeval start, now, deadline;
+  u64 n, i, idx, step, offset, a, b, t;
+  int batched;
+
+  o.current_scantype = SYN_SCAN;
+  gettimeofday(&start, NULL);
+
+  while (fillWindow(hs, exclude_group)) {
+    /* Walk the window's hosts x ports index space in the order
+       offset, offset + step, offset + 2*step, ... (mod n), which visits every
+       index once when step is coprime to n. */
+    n = (u64) numaddrs * numports;
+    step = 1;
+    offset = 0;
+    if (o.randomize_ports && n > 1) {
+      do {
+        step = get_random_u64() % (n - 1) + 1;
+        for (a = n, b = step; b != 0; t = a % b, a = b, b = t)
+          ;
+      } while (a != 1);
+      offset = get_random_u64() % n;
+    }
+
+    open_windows.push_back(sweep_window());
+    open_windows.back().id = window;
+    open_windows.back().sending = true;
+    open_windows.back().addrs.assign(addrs, addrs + numaddrs);
+    std::sort(open_windows.back().addrs.begin(), open_windows.back().addrs.end());
+
+    send_ip_batch_begin(rawsd);
+    batched = 0;
+    for (i = 0; i < n; i++) {
+      idx = (offset + i * step) % n;
+      sendProbe(addrs[idx % numaddrs], portlist[idx / numaddrs]);
+      if (++batched < SWEEP_BATCH)
+        continue;
+      batched = 0;
+      send_ip_batch_flush();
+      /* --max-rate: sleep (while listening) until we are back on schedule. */
+      if (o.max_packet_send_rate != 0.0) {
+        long ahead;
+
+        gettimeofday(&now, NULL);
+        while ((ahead = (long) (probes_sent / o.max_packet_send_rate * 1000000) - TIMEVAL_SUBTRACT(now, start)) > 0) {
+          readReplies(ahead);
+          gettimeofday(&now, NULL);
+        }
+      }
+      readReplies(0);
+      gettimeofday(&now, NULL);
+      closeWindows(&now, false);
+      keyWasPressed();
+    }
+    send_ip_batch_flush();
+
+    window++;
+    open_windows.back().sending = false;
+    gettimeofday(&open_windows.back().last_sent, NULL);
+  }
+
+  /* Listen for the last replies. */
+  gettimeofday(&now, NULL);
+  if (pd != NULL) {
+    TIMEVAL_ADD(deadline, now, wait_usec);
+    while (TIMEVAL_SUBTRACT(deadline, now) > 0) {
+      readReplies(TIMEVAL_SUBTRACT(deadline, now));
+      gettimeofday(&now, NULL);
+    }
+  }
+  closeWindows(&now, true);
+
+  if (o.verbose) {
+    gettimeofday(&now, NULL);
+    log_write(LOG_STDOUT, "Completed stateless SYN sweep: %lu probes, %lu replies (%lu not matching a cookie, %lu too late) in %.2fs\n",
+              probes_sent, replies, bad_cookies, late_replies, TIMEVAL_SUBTRACT(now, start) / 1000000.0);
+  }
+  if (o.debugging && pd != NULL)
+    pcap_print_stats(LOG_PLAIN, pd);
+}
+
+void stateless_syn_sweep(HostGroupState *hs, const addrset *exclude_group,
+                         const struct scan_lists *ports) {
+  StatelessSweep sweep(ports);
+
+  sweep.run(hs, exclude_group);
+}
@@ -127,6 +127,8 @@
 #include "Target.h"
 #include <vector>
 
+class HostGroupState;
+
 void increment_base_port();
 int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime);
 void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets);
@@ -139,3 +141,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 bool get_arp_result(UltraScanInfo *USI, struct timeval *stime);
 bool get_ns_result(UltraScanInfo *USI, struct timeval *stime);
 bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime);
+
+/* Runs a stateless SYN sweep (--stateless) of every target left in hs
+   against the TCP ports in ports, printing each host that answers. */
+void stateless_syn_sweep(HostGroupState *hs, const addrset *exclude_group,
+                         const struct scan_lists *ports);
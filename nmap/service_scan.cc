@@ -158,10 +158,37 @@
 #endif
 
 #include <algorithm>
+#include <map>
 #include <list>
 
 extern NmapOps o;
 
+/* PCRE 8.20 and later can compile regexes to machine code when studying
+   them. All match regexes share one JIT stack, which is only used by one
+   pcre_exec() at a time. With an older PCRE, such as the included copy,
+   matching is interpreted as before. */
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define SERVICE_PCRE_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+#define SERVICE_JIT_STACK_MIN (32 * 1024)
+#define SERVICE_JIT_STACK_MAX (1024 * 1024)
+
+static pcre_jit_stack *service_jit_stack(void) {
+  static pcre_jit_stack *stack = NULL;
+
+  if (stack == NULL)
+    stack = pcre_jit_stack_alloc(SERVICE_JIT_STACK_MIN, SERVICE_JIT_STACK_MAX);
+  return stack;
+}
+#else
+#define SERVICE_PCRE_STUDY_OPTIONS 0
+#define pcre_free_study pcre_free
+#endif
+
+/* Responses at least this long are kept in the read buffer nsock filled
+   (8 KB) instead of being copied out of it. See
+   ServiceNFO::appendtocurrentproberesponse. */
+#define READBUF_STEAL_MIN (6 * 1024)
+
 // Details on a particular service (open port) we are trying to match
 class ServiceNFO {
 public:
@@ -229,8 +256,20 @@ public:
   // The time that the current probe was executed (meaning TCP connection
   // made or first UDP packet sent
   struct timeval currentprobe_exec_time;
+  // When the most recent connection attempt for this service was started.
+  // Compared against last_drop so one burst of failures counts as one drop.
+  struct timeval connect_time;
+  // True if the current probe was sent on the connection used by the
+  // previous one rather than on a new connection.
+  bool reused_connection;
+  // Set once the service has closed a connection we tried to reuse, so we
+  // stop trying.
+  bool reuse_failed;
   // Append newly-received data to the current response string (if any)
   void appendtocurrentproberesponse(const u8 *respstr, int respstrlen);
+  // Same, with the data read by a nsock event. The first read of a response
+  // takes the nsock buffer over instead of copying it.
+  void appendtocurrentproberesponse(nsock_event nse);
   // Get the full current response string.  Note that this pointer is
   // INVALIDATED if you call appendtocurrentproberesponse() or nextProbe()
   u8 *getcurrentproberesponse(int *respstrlen);
@@ -251,6 +290,13 @@ private:
   int servicefpalloc;
 };
 
+// Congestion control state for the services of a single target.
+struct ServiceHostTiming {
+  struct ultra_timing_vals timing;
+  unsigned int active; // # of this host's services in services_in_progress
+  unsigned int remaining; // # of this host's services in services_remaining
+};
+
 // This holds the service information for a group of Targets being service scanned.
 class ServiceGroup {
 public:
@@ -259,9 +305,16 @@ public:
   std::list<ServiceNFO *> services_finished; // Services finished (discovered or not)
   std::list<ServiceNFO *> services_in_progress; // Services currently being probed
   std::list<ServiceNFO *> services_remaining; // Probes not started yet
-  unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
+  // Congestion control for the whole group and for each host.  The group
+  // cwnd limits how many services are in progress at once; a host's cwnd
+  // limits how many of those may belong to that host.
+  struct scan_performance_vars perf;
+  struct ultra_timing_vals timing;
+  std::map<Target *, ServiceHostTiming> hosts;
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
+  unsigned int connections_reused; // Probes sent on an existing connection
+  unsigned int reuse_retries; // ... that had to be sent again on a new one
 };
 
 #define SUBSTARGS_MAX_ARGS 5
@@ -298,6 +351,8 @@ ServiceProbeMatch::ServiceProbeMatch() {
   isInitialized = false;
   matchops_ignorecase = false;
   matchops_dotall = false;
+  anchored = false;
+  partial_ok = false;
   isSoft = false;
 }
 
@@ -316,7 +371,7 @@ ServiceProbeMatch::~ServiceProbeMatch() {
     free(*it);
   matchstrlen = 0;
   if (regex_compiled) pcre_free(regex_compiled);
-  if (regex_extra) pcre_free(regex_extra);
+  if (regex_extra) pcre_free_study(regex_extra);
   isInitialized = false;
   matchops_anchor = -1;
 }
@@ -385,6 +440,213 @@ static bool next_template(const char **matchtext, char **modestr, char **tmplt,
   return true;
 }
 
+/* PCRE's default character tables only fold ASCII letters, so the match
+   prefilter does the same rather than depend on the locale. */
+static inline int ascii_lower(int c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* Returns the length of the quantifier (?, *, +, or {n}, {n,}, {n,m}, each
+   with an optional lazy or possessive suffix) starting at p, or 0 if there
+   is none there. Sets *optional if it allows zero repetitions. */
+static int regex_quantifier_len(const char *p, bool *optional) {
+  const char *q = p;
+  char *end;
+  long min;
+
+  if (*q == '?' || *q == '*') {
+    *optional = true;
+    q++;
+  } else if (*q == '+') {
+    *optional = false;
+    q++;
+  } else if (*q == '{') {
+    q++;
+    if (!isdigit((int) (unsigned char) *q))
+      return 0;
+    min = strtol(q, &end, 10);
+    q = end;
+    if (*q == ',') {
+      q++;
+      while (isdigit((int) (unsigned char) *q))
+        q++;
+    }
+    if (*q != '}')
+      return 0;
+    q++;
+    *optional = (min == 0);
+  } else {
+    return 0;
+  }
+  if (*q == '?' || *q == '+')
+    q++;
+
+  return q - p;
+}
+
+/* Skips the character class starting at the '[' at p. Returns a pointer past
+   the closing ']', or NULL if there is none. */
+static const char *regex_skip_class(const char *p) {
+  p++;
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+  while (*p != ']') {
+    if (*p == '\\' && p[1] != '\0') {
+      p++;
+    } else if (*p == '[' && p[1] == ':') {
+      const char *q = strstr(p + 2, ":]");
+      if (q != NULL)
+        p = q + 1;
+    } else if (*p == '\0') {
+      return NULL;
+    }
+    p++;
+  }
+
+  return p + 1;
+}
+
+/* Skips the group starting at the '(' at p. Returns a pointer past the
+   matching ')', or NULL if there is none. */
+static const char *regex_skip_group(const char *p) {
+  int depth = 0;
+
+  while (*p != '\0') {
+    if (*p == '\\') {
+      if (p[1] == '\0')
+        return NULL;
+      p += 2;
+      continue;
+    } else if (*p == '[') {
+      p = regex_skip_class(p);
+      if (p == NULL)
+        return NULL;
+      continue;
+    } else if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      if (--depth == 0)
+        return p + 1;
+    }
+    p++;
+  }
+
+  return NULL;
+}
+
+/* Finds literal text that any subject matching the regular expression re
+   must contain. The longest run of literal characters at the top level of
+   the pattern is stored in *required, and if the pattern starts with ^, the
+   literal run that follows it is stored in *prefix. Both are lowercased so
+   they can be compared case-insensitively, which is a necessary condition
+   whatever the regex options. Anything not understood (top-level
+   alternation, \Q...\E, option settings) leaves both empty; groups,
+   classes and escapes that aren't single characters just end a run. */
+static void regex_literals(const char *re, std::string *required,
+                           std::string *prefix) {
+  std::string run;
+  const char *p = re;
+  bool in_prefix = false;
+  bool optional;
+  int c, qlen;
+
+  required->clear();
+  prefix->clear();
+
+  if (*p == '^') {
+    in_prefix = true;
+    p++;
+  }
+
+  for (;;) {
+    c = -1; // The literal byte this atom matches, if it is one.
+    if (*p == '\0') {
+      /* Nothing left; fall through to end the last run. */
+    } else if (*p == '\\') {
+      p++;
+      switch (*p) {
+      case 'n': c = '\n'; p++; break;
+      case 'r': c = '\r'; p++; break;
+      case 't': c = '\t'; p++; break;
+      case 'f': c = '\f'; p++; break;
+      case 'a': c = '\a'; p++; break;
+      case 'e': c = 0x1b; p++; break;
+      case 'x':
+        p++;
+        if (*p == '{')
+          goto fail;
+        for (c = 0, qlen = 0; qlen < 2 && isxdigit((int) (unsigned char) *p); qlen++, p++)
+          c = c * 16 + (isdigit((int) (unsigned char) *p) ? *p - '0' : ascii_lower(*p) - 'a' + 10);
+        break;
+      case '0':
+        p++;
+        for (c = 0, qlen = 0; qlen < 2 && *p >= '0' && *p <= '7'; qlen++, p++)
+          c = c * 8 + (*p - '0');
+        break;
+      case '\0':
+      case 'Q':
+      case 'c':
+        goto fail;
+      default:
+        if (isdigit((int) (unsigned char) *p)) {
+          /* A backreference or an octal escape. */
+          while (isdigit((int) (unsigned char) *p))
+            p++;
+        } else if (isalpha((int) (unsigned char) *p)) {
+          /* A character type like \d or an assertion like \b. */
+          p++;
+        } else {
+          c = (unsigned char) *p;
+          p++;
+        }
+        break;
+      }
+    } else if (*p == '[') {
+      p = regex_skip_class(p);
+      if (p == NULL)
+        goto fail;
+    } else if (*p == '(') {
+      if (p[1] == '?' && (isalpha((int) (unsigned char) p[2]) || p[2] == '-') && p[2] != 'P')
+        goto fail;
+      p = regex_skip_group(p);
+      if (p == NULL)
+        goto fail;
+    } else if (*p == '|' || *p == ')' || *p == '?' || *p == '*' || *p == '+') {
+      goto fail;
+    } else if (*p == '.' || *p == '^' || *p == '$') {
+      p++;
+    } else if (*p == '{' && regex_quantifier_len(p, &optional) > 0) {
+      goto fail;
+    } else {
+      c = (unsigned char) *p;
+      p++;
+    }
+
+    qlen = regex_quantifier_len(p, &optional);
+    p += qlen;
+    if (c >= 0 && !(qlen > 0 && optional))
+      run += (char) ascii_lower(c);
+    if (c < 0 || qlen > 0 || *p == '\0') {
+      if (run.length() > required->length())
+        *required = run;
+      if (in_prefix)
+        *prefix = run;
+      in_prefix = false;
+      run.clear();
+    }
+    if (*p == '\0')
+      break;
+  }
+
+  return;
+
+fail:
+  required->clear();
+  prefix->clear();
+}
+
 // match text from the nmap-service-probes file.  This must be called
 // before you try and do anything with this match.  This function
 // should be passed the whole line starting with "match" or
@@ -397,6 +659,8 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   int pcre_compile_ops = 0;
   const char *pcre_errptr = NULL;
   int pcre_erroffset = 0;
+  unsigned long int re_options = 0;
+  int okpartial = 0;
   char **curr_tmp = NULL;
 
   if (isInitialized) fatal("Sorry ... %s does not yet support reinitializion", __func__);
@@ -464,9 +728,20 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
     fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
 
   // Now study the regexp for greater efficiency
-  regex_extra = pcre_study(regex_compiled, 0, &pcre_errptr);
+  regex_extra = pcre_study(regex_compiled, SERVICE_PCRE_STUDY_OPTIONS, &pcre_errptr);
   if (pcre_errptr != NULL)
     fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (regex_extra != NULL)
+    pcre_assign_jit_stack(regex_extra, NULL, service_jit_stack());
+#endif
+
+  // PCRE marks a regex anchored when every alternative starts with ^
+  // (or .* in dotall mode).  Some constructs rule out partial matching.
+  if (pcre_fullinfo(regex_compiled, regex_extra, PCRE_INFO_OPTIONS, &re_options) == 0)
+    anchored = (re_options & PCRE_ANCHORED) != 0;
+  if (pcre_fullinfo(regex_compiled, regex_extra, PCRE_INFO_OKPARTIAL, &okpartial) == 0)
+    partial_ok = okpartial != 0;
 
   free(modestr);
   free(flags);
@@ -509,6 +784,8 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
     free(flags);
   }
 
+  regex_literals(matchstr, &required_literal, &anchored_prefix);
+
   isInitialized = 1;
 }
 
@@ -574,6 +851,35 @@ const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int bufle
   return &MD_return;
 }
 
+// Returns false if no response that begins with the buflen bytes in buf
+// can match this regex, true if one might.  Only anchored regexes can be
+// ruled out: an unanchored one could match in data yet to arrive.
+bool ServiceProbeMatch::mayMatchLonger(const u8 *buf, int buflen) {
+  unsigned int i;
+  int rc;
+  int ovector[3];
+
+  if (!anchored)
+    return true;
+
+  // Cheap test first: the literal text after the ^ must agree with what
+  // we have so far.
+  for (i = 0; i < anchored_prefix.length() && i < (unsigned int) buflen; i++) {
+    if (ascii_lower(buf[i]) != (u8) anchored_prefix[i])
+      return false;
+  }
+  if (!partial_ok || buflen == 0)
+    return true;
+
+  // PCRE_ERROR_PARTIAL means the match ran into the end of buf, so more
+  // data could complete it.  Anything but a plain no-match is treated as
+  // possible, including hitting the match limit.
+  rc = pcre_exec(regex_compiled, regex_extra, (const char *) buf, buflen, 0,
+                 PCRE_PARTIAL, ovector, sizeof(ovector) / sizeof(*ovector));
+
+  return rc != PCRE_ERROR_NOMATCH;
+}
+
 // This simple function parses arguments out of a string.  The string
 // starts with the first argument.  Each argument can be a string or
 // an integer.  Strings must be enclosed in double quotes ("").  Most
@@ -640,74 +946,58 @@ static int getsubstcommandargs(struct substargs *args, char *args_start,
   return args->num_args;
 }
 
-/* These three functions manage a growing string buffer, appended to at the end.
-   Begin with strbuf_init, follow with any number of strbuf_append, and end with
-   strbuf_finish. */
-static void strbuf_init(char **buf, size_t *n, size_t *len) {
-  *buf = NULL;
-  *n = 0;
-  *len = 0;
-}
-
-static void strbuf_append(char **buf, size_t *n, size_t *len,
-  const char *from, size_t fromlen) {
-  /* Double the size of the buffer if necessary. */
-  if (*len == 0 || *len + fromlen > *n) {
-    *n = (*len + fromlen) * 2;
-    *buf = (char *) safe_realloc(*buf, *n + 1);
-  }
-  memcpy(*buf + *len, from, fromlen);
-  *len += fromlen;
-}
-
-/* Trim to length. (Also does initial allocation when *buf is empty.) */
-static void strbuf_finish(char **buf, size_t *n, size_t *len) {
-  *buf = (char *) safe_realloc(*buf, *len + 1);
-  (*buf)[*len] = '\0';
-}
-
-/* Transform a string so that it is safe to insert into the middle of a CPE URL. */
-static char *transform_cpe(const char *s) {
-  char *result;
-  size_t n, len, repllen;
-  const char *p;
-
-  strbuf_init(&result, &n, &len);
-  for (p = s; *p != '\0'; p++) {
-    const char *repl;
-    char buf[32];
+/* Where template substitutions are written. Substitutions go straight into
+   the caller's buffer rather than through a temporary string. */
+struct tmpl_out {
+  char *dst; // The next byte to write
+  const char *end; // Output may not go past here
+  bool cpe; // Make substituted text safe to insert into a CPE URL
+  bool stopped; // A NUL ended the current substitution
+};
 
+/* Appends fromlen bytes of substituted text to out. A NUL byte ends the
+   substitution, as it would if the text were a C string. If out->cpe is
+   set, the text is transformed so that it is safe to insert into the middle
+   of a CPE URL. Returns false if the text doesn't fit. */
+static bool tmpl_append(struct tmpl_out *out, const char *from, size_t fromlen) {
+  static const char hexdigits[] = "0123456789ABCDEF";
+  size_t i;
+  char c;
+
+  for (i = 0; i < fromlen && !out->stopped; i++) {
+    c = from[i];
+    if (c == '\0') {
+      out->stopped = true;
     /* Section 5.4 of the CPE specification lists these characters to be
        escaped. */
-    if (strchr(":/?#[]@!$&'()*+,;=%<>\"", *p) != NULL) {
-      Snprintf(buf, sizeof(buf), "%%%02X", *p);
-      repl = buf;
-    /* Replacing spaces with underscores is also a convention. */
-    } else if (*p == ' ') {
-      repl = "_";
-    /* Otherwise just make lower-case. */
+    } else if (out->cpe && strchr(":/?#[]@!$&'()*+,;=%<>\"", c) != NULL) {
+      if (out->end - out->dst < 3)
+        return false;
+      *out->dst++ = '%';
+      *out->dst++ = hexdigits[(c >> 4) & 0x0F];
+      *out->dst++ = hexdigits[c & 0x0F];
     } else {
-      buf[0] = tolower(*p);
-      buf[1] = '\0';
-      repl = buf;
+      if (out->dst >= out->end)
+        return false;
+      /* Replacing spaces with underscores is also a convention. Otherwise
+         just make lower-case. */
+      if (out->cpe)
+        c = (c == ' ') ? '_' : tolower((int) (unsigned char) c);
+      *out->dst++ = c;
     }
-
-    repllen = strlen(repl);
-    strbuf_append(&result, &n, &len, repl, repllen);
   }
-  strbuf_finish(&result, &n, &len);
 
-  return result;
+  return true;
 }
 
-// This function does the substitution of a placeholder like $2 or $P(4). It
-// returns a newly allocated string, or NULL if it fails. tmplvar is a template
-// variable, such as "$P(2)". We set *tmplvarend to the character after the
-// variable. subject, subjectlen, ovector, and nummatches mean the same as in
-// dotmplsubst().
-static char *substvar(char *tmplvar, char **tmplvarend,
+// This function does the substitution of a placeholder like $2 or $P(4),
+// appending the result to out. It returns zero for success, or -1 if it
+// fails or the result doesn't fit. tmplvar is a template variable, such as
+// "$P(2)". We set *tmplvarend to the character after the variable. subject,
+// subjectlen, ovector, and nummatches mean the same as in dotmplsubst().
+static int substvar(char *tmplvar, char **tmplvarend,
              const u8 *subject, int subjectlen, int *ovector,
-             int nummatches) {
+             int nummatches, struct tmpl_out *out) {
   char substcommand[16];
   char *p = NULL;
   char *p_end;
@@ -716,27 +1006,25 @@ static char *substvar(char *tmplvar, char **tmplvarend,
   int rc;
   int i;
   struct substargs command_args;
-  char *result;
-  size_t n, len;
 
   // skip the '$'
-  if (*tmplvar != '$') return NULL;
+  if (*tmplvar != '$') return -1;
   tmplvar++;
 
   if (!isdigit((int) (unsigned char) *tmplvar)) {
     int commandlen;
     /* This is a command like $P(1). */
     p = strchr(tmplvar, '(');
-    if (!p) return NULL;
+    if (!p) return -1;
     commandlen = p - tmplvar;
     if (!commandlen || commandlen >= (int) sizeof(substcommand))
-      return NULL;
+      return -1;
     memcpy(substcommand, tmplvar, commandlen);
     substcommand[commandlen] = '\0';
     tmplvar = p+1;
     // Now we grab the arguments.
     rc = getsubstcommandargs(&command_args, tmplvar, &p_end);
-    if (rc <= 0) return NULL;
+    if (rc <= 0) return -1;
     tmplvar = p_end;
   } else {
     /* This is a placeholder like $2. */
@@ -747,25 +1035,26 @@ static char *substvar(char *tmplvar, char **tmplvarend,
 
   if (tmplvarend) *tmplvarend = tmplvar;
 
-  strbuf_init(&result, &n, &len);
+  out->stopped = false;
   if (!*substcommand) {
     /* Handler for a placeholder like $2. */
-    if (subnum > 9 || subnum <= 0) return NULL;
-    if (subnum >= nummatches) return NULL;
+    if (subnum > 9 || subnum <= 0) return -1;
+    if (subnum >= nummatches) return -1;
     offstart = ovector[subnum * 2];
     offend = ovector[subnum * 2 + 1];
     assert(offstart >= 0 && offstart < subjectlen);
     assert(offend >= 0 && offend <= subjectlen);
     // A plain-jane copy
-    strbuf_append(&result, &n, &len, (const char *) subject + offstart, offend - offstart);
+    if (!tmpl_append(out, (const char *) subject + offstart, offend - offstart))
+      return -1;
   } else if (strcmp(substcommand, "P") == 0) {
     if (command_args.num_args != 1 ||
         command_args.arg_types[0] != SUBSTARGS_ARGTYPE_INT) {
-      return NULL;
+      return -1;
     }
     subnum = command_args.int_args[0];
-    if (subnum > 9 || subnum <= 0) return NULL;
-    if (subnum >= nummatches) return NULL;
+    if (subnum > 9 || subnum <= 0) return -1;
+    if (subnum >= nummatches) return -1;
     offstart = ovector[subnum * 2];
     offend = ovector[subnum * 2 + 1];
     assert(offstart >= 0 && offstart < subjectlen);
@@ -774,8 +1063,9 @@ static char *substvar(char *tmplvar, char **tmplvarend,
     // useful for collapsing unicode text that looks like
     // "W\0O\0R\0K\0G\0R\0O\0U\0P\0"
     for(i=offstart; i < offend; i++) {
-      if (isprint((int) subject[i]))
-        strbuf_append(&result, &n, &len, (const char *) subject + i, 1);
+      if (isprint((int) subject[i]) &&
+          !tmpl_append(out, (const char *) subject + i, 1))
+        return -1;
     }
   } else if (strcmp(substcommand, "SUBST") == 0) {
     char *findstr, *replstr;
@@ -784,11 +1074,11 @@ static char *substvar(char *tmplvar, char **tmplvarend,
         command_args.arg_types[0] != SUBSTARGS_ARGTYPE_INT ||
         command_args.arg_types[1] != SUBSTARGS_ARGTYPE_STRING ||
         command_args.arg_types[2] != SUBSTARGS_ARGTYPE_STRING) {
-      return NULL;
+      return -1;
     }
     subnum = command_args.int_args[0];
-    if (subnum > 9 || subnum <= 0) return NULL;
-    if (subnum >= nummatches) return NULL;
+    if (subnum > 9 || subnum <= 0) return -1;
+    if (subnum >= nummatches) return -1;
     offstart = ovector[subnum * 2];
     offend = ovector[subnum * 2 + 1];
     assert(offstart >= 0 && offstart < subjectlen);
@@ -799,18 +1089,20 @@ static char *substvar(char *tmplvar, char **tmplvarend,
     replstrlen = command_args.str_args_len[2];
     for(i=offstart; i < offend; ) {
       if (memcmp(subject + i, findstr, findstrlen) != 0) {
-        strbuf_append(&result, &n, &len, (const char *) subject + i, 1); // no match
+        // no match
+        if (!tmpl_append(out, (const char *) subject + i, 1))
+          return -1;
         i++;
       } else {
         // The find string was found, copy it to newstring
-        strbuf_append(&result, &n, &len, replstr, replstrlen);
+        if (!tmpl_append(out, replstr, replstrlen))
+          return -1;
         i += findstrlen;
       }
     }
-  } else return NULL; // Unknown command
+  } else return -1; // Unknown command
 
-  strbuf_finish(&result, &n, &len);
-  return result;
+  return 0;
 }
 
 
@@ -822,18 +1114,16 @@ static char *substvar(char *tmplvar, char **tmplvarend,
 // placed into 'newstr', as long as it doesn't exceed 'newstrlen'
 // bytes.  Trailing whitespace and commas are removed.  Returns zero for success
 //
-// The transform argument is a function pointer. If not NULL, the given
-// function is applied to all substitutions before they are inserted
-// into the result string.
+// If cpe is true, substitutions are made safe to insert into the middle of
+// a CPE URL before they are inserted into the result string.
 static int dotmplsubst(const u8 *subject, int subjectlen,
                        int *ovector, int nummatches, char *tmpl, char *newstr,
-                       int newstrlen,
-                       char *(*transform)(const char *) = NULL) {
+                       int newstrlen, bool cpe = false) {
   int newlen;
   char *srcstart=tmpl, *srcend;
   char *dst = newstr;
   char *newstrend = newstr + newstrlen; // Right after the final char
-  char *subst;
+  struct tmpl_out out;
 
   if (!newstr || !tmpl) return -1;
   if (newstrlen < 3) return -1; // fuck this!
@@ -865,25 +1155,15 @@ static int dotmplsubst(const u8 *subject, int subjectlen,
         dst += newlen;
       }
       srcstart = srcend;
-      subst = substvar(srcstart, &srcend, subject, subjectlen, ovector, nummatches);
-      if (subst == NULL)
+      /* A substitution must leave room for at least one more byte and the
+         terminating NUL. */
+      out.dst = dst;
+      out.end = newstrend - 2;
+      out.cpe = cpe;
+      if (substvar(srcstart, &srcend, subject, subjectlen, ovector, nummatches, &out) != 0
+          || out.dst >= newstrend - 1)
         return -1;
-      /* Apply transformation if requested. */
-      if (transform != NULL) {
-        char *tmp = subst;
-        subst = transform(subst);
-        free(tmp);
-        if (subst == NULL)
-          return -1;
-      }
-      newlen = strlen(subst);
-      if (dst + newlen >= newstrend - 1) {
-        free(subst);
-        return -1;
-      }
-      memcpy(dst, subst, newlen);
-      free(subst);
-      dst += newlen;
+      dst = out.dst;
       srcstart = srcend;
     }
   }
@@ -1025,7 +1305,7 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
       continue;
       break;
     }
-    rc = dotmplsubst(subject, subjectlen, ovector, nummatches, cpe_templates[i], cpe, cpelen, transform_cpe);
+    rc = dotmplsubst(subject, subjectlen, ovector, nummatches, cpe_templates[i], cpe, cpelen, true);
     if (rc != 0) {
       error("Warning: Servicescan failed to fill cpe_%c (subjectlen: %d, devicetypelen: %d). Too long? Match string was line %d: d/%s/", part, subjectlen, devicetypelen, deflineno,
             (devicetype_template)? devicetype_template : "");
@@ -1038,17 +1318,313 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
 }
 
 
+/* Chooses which matches of a probe are worth running pcre_exec() for. The
+   required literal of every match goes into an Aho-Corasick automaton, so a
+   response is scanned once for all of them; a match is a candidate only if
+   its literal was seen and the response starts with its anchored prefix.
+   Matches with neither are always candidates. Everything is compared after
+   folding ASCII case. */
+class MatchPrefilter {
+public:
+  MatchPrefilter(const std::vector<ServiceProbeMatch *> &matches);
+  // Scans buf. Must be called before mayMatch() for the same buf.
+  void scan(const u8 *buf, int buflen);
+  // Returns false if match i (in probe order) cannot match the buf last
+  // given to scan().
+  bool mayMatch(unsigned int i, const u8 *buf, int buflen) const;
+
+private:
+  struct Node {
+    std::vector<std::pair<u8, int> > next; // Sorted by byte
+    int fail;
+    int dict; // Nearest node on the fail chain that ends a literal, or 0
+    int literal; // Index of the literal ending here, or -1
+  };
+  std::vector<Node> nodes; // nodes[0] is the root
+  int root_next[256];
+  std::vector<int> match_literal; // Literal index for each match, or -1
+  std::vector<std::string> match_prefix;
+  std::vector<unsigned int> literal_seen; // == generation if seen in last scan
+  unsigned int generation;
+
+  int child(int node, u8 c) const;
+};
+
+MatchPrefilter::MatchPrefilter(const std::vector<ServiceProbeMatch *> &matches) {
+  std::map<std::string, int> literals;
+  std::map<std::string, int>::iterator li;
+  std::vector<int> queue;
+  unsigned int i, j, k;
+  int cur, nxt, f;
+
+  nodes.push_back(Node());
+  nodes[0].fail = nodes[0].dict = 0;
+  nodes[0].literal = -1;
+
+  for (i = 0; i < matches.size(); i++) {
+    const std::string &lit = matches[i]->getRequiredLiteral();
+
+    match_prefix.push_back(matches[i]->getAnchoredPrefix());
+    /* A prefix at least as long as the literal makes the literal redundant. */
+    if (lit.empty() || lit.length() <= match_prefix.back().length()) {
+      match_literal.push_back(-1);
+      continue;
+    }
+    li = literals.find(lit);
+    if (li != literals.end()) {
+      match_literal.push_back(li->second);
+      continue;
+    }
+    k = literals.size();
+    literals[lit] = k;
+    match_literal.push_back(k);
+
+    cur = 0;
+    for (j = 0; j < lit.length(); j++) {
+      nxt = child(cur, (u8) lit[j]);
+      if (nxt < 0) {
+        std::vector<std::pair<u8, int> > &v = nodes[cur].next;
+        nxt = nodes.size();
+        v.insert(std::lower_bound(v.begin(), v.end(), std::make_pair((u8) lit[j], 0)),
+                 std::make_pair((u8) lit[j], nxt));
+        nodes.push_back(Node());
+        nodes[nxt].literal = -1;
+      }
+      cur = nxt;
+    }
+    nodes[cur].literal = k;
+  }
+  literal_seen.resize(literals.size(), 0);
+  generation = 0;
+
+  /* Breadth-first, so fail links always point at finished nodes. */
+  queue.push_back(0);
+  for (i = 0; i < queue.size(); i++) {
+    cur = queue[i];
+    for (j = 0; j < nodes[cur].next.size(); j++) {
+      u8 c = nodes[cur].next[j].first;
+      nxt = nodes[cur].next[j].second;
+      queue.push_back(nxt);
+      if (cur == 0) {
+        nodes[nxt].fail = 0;
+      } else {
+        f = nodes[cur].fail;
+        while (f != 0 && child(f, c) < 0)
+          f = nodes[f].fail;
+        f = child(f, c);
+        nodes[nxt].fail = (f < 0) ? 0 : f;
+      }
+      f = nodes[nxt].fail;
+      nodes[nxt].dict = (nodes[f].literal >= 0) ? f : nodes[f].dict;
+    }
+  }
+
+  for (i = 0; i < 256; i++) {
+    nxt = child(0, (u8) i);
+    root_next[i] = (nxt < 0) ? 0 : nxt;
+  }
+}
+
+int MatchPrefilter::child(int node, u8 c) const {
+  const std::vector<std::pair<u8, int> > &v = nodes[node].next;
+  std::vector<std::pair<u8, int> >::const_iterator it;
+
+  it = std::lower_bound(v.begin(), v.end(), std::make_pair(c, 0));
+  if (it == v.end() || it->first != c)
+    return -1;
+  return it->second;
+}
+
+void MatchPrefilter::scan(const u8 *buf, int buflen) {
+  int cur = 0, nxt = 0, n, i;
+  u8 c;
+
+  if (literal_seen.empty())
+    return;
+
+  if (++generation == 0) {
+    std::fill(literal_seen.begin(), literal_seen.end(), 0);
+    generation = 1;
+  }
+
+  for (i = 0; i < buflen; i++) {
+    c = ascii_lower(buf[i]);
+    while (cur != 0 && (nxt = child(cur, c)) < 0)
+      cur = nodes[cur].fail;
+    cur = (cur == 0) ? root_next[c] : nxt;
+
+    /* Once a literal has been seen, so has everything on its dict chain. */
+    for (n = (nodes[cur].literal >= 0) ? cur : nodes[cur].dict; n != 0; n = nodes[n].dict) {
+      if (literal_seen[nodes[n].literal] == generation)
+        break;
+      literal_seen[nodes[n].literal] = generation;
+    }
+  }
+}
+
+bool MatchPrefilter::mayMatch(unsigned int i, const u8 *buf, int buflen) const {
+  const std::string &prefix = match_prefix[i];
+  unsigned int j;
+
+  if (match_literal[i] >= 0 && literal_seen[match_literal[i]] != generation)
+    return false;
+  if (prefix.length() > (unsigned int) buflen)
+    return false;
+  for (j = 0; j < prefix.length(); j++) {
+    if (ascii_lower(buf[j]) != (u8) prefix[j])
+      return false;
+  }
+
+  return true;
+}
+
+/* Turned off by service_match_bench() to time the unfiltered path. */
+static bool match_prefilter_enabled = true;
+
+/* How replies to a probe are framed, for ServiceProbe::responseComplete().
+   A binary probe that starts with a length header covering the rest of it
+   is assumed to get a reply framed the same way. */
+enum { PROBE_FRAMING_NONE,
+       PROBE_FRAMING_LEN16, /* 16-bit length, as in DNS over TCP */
+       PROBE_FRAMING_LEN32, /* 32-bit length (NetBIOS session, Kerberos) */
+       PROBE_FRAMING_RPC,   /* ONC RPC record mark with last-fragment bit */
+       PROBE_FRAMING_TPKT   /* RFC 1006 TPKT, length includes the header */
+};
+
+static int probe_framing(const u8 *p, int len) {
+  if (len < 4)
+    return PROBE_FRAMING_NONE;
+  if (p[0] == 3 && p[1] == 0 && (p[2] << 8 | p[3]) == len)
+    return PROBE_FRAMING_TPKT;
+  if (((u32) (p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3]) == (u32) len - 4)
+    return (p[0] & 0x80)? PROBE_FRAMING_RPC : PROBE_FRAMING_LEN32;
+  if ((p[0] << 8 | p[1]) == len - 2)
+    return PROBE_FRAMING_LEN16;
+  return PROBE_FRAMING_NONE;
+}
+
+/* Returns true if buf holds at least one whole frame of the given
+   PROBE_FRAMING_* type. */
+static bool frame_complete(int framing, const u8 *buf, int buflen) {
+  u32 framelen;
+
+  switch (framing) {
+  case PROBE_FRAMING_LEN16:
+    return buflen >= 2 && buflen >= (buf[0] << 8 | buf[1]) + 2;
+  case PROBE_FRAMING_LEN32:
+  case PROBE_FRAMING_RPC:
+    if (buflen < 4)
+      return false;
+    if (framing == PROBE_FRAMING_RPC && !(buf[0] & 0x80))
+      return false;
+    framelen = (u32) (buf[0] & 0x7f) << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    return framelen <= (u32) buflen - 4;
+  case PROBE_FRAMING_TPKT:
+    return buflen >= 4 && buf[0] == 3 && buf[1] == 0
+      && (buf[2] << 8 | buf[3]) >= 4 && buflen >= (buf[2] << 8 | buf[3]);
+  }
+
+  return false;
+}
+
+/* Returns a pointer to the first occurrence of the len bytes of needle in
+   the buflen bytes of buf, or NULL. */
+static const u8 *find_bytes(const u8 *buf, int buflen, const char *needle, int len) {
+  int i;
+
+  for (i = 0; i + len <= buflen; i++) {
+    if (memcmp(buf + i, needle, len) == 0)
+      return buf + i;
+  }
+
+  return NULL;
+}
+
+/* Returns true if buf is a whole HTTP, RTSP or SIP response: the headers
+   are done and the body is as long as Content-Length says, or ends with
+   the last chunk of a chunked body.  A body running until the connection
+   closes is never known to be complete. */
+static bool http_response_complete(const u8 *buf, int buflen) {
+  const u8 *hdrend, *line, *eol;
+  long contentlen = -1;
+  bool chunked = false;
+  int status;
+
+  if (buflen < 12 || (memcmp(buf, "HTTP/1.", 7) != 0 && memcmp(buf, "RTSP/1.", 7) != 0
+                      && memcmp(buf, "SIP/2.0 ", 8) != 0))
+    return false;
+  hdrend = find_bytes(buf, buflen, "\r\n\r\n", 4);
+  if (hdrend == NULL)
+    return false;
+  hdrend += 4;
+
+  line = (const u8 *) memchr(buf, ' ', hdrend - buf);
+  if (line == NULL || hdrend - line < 4 || !isdigit((int) line[1])
+      || !isdigit((int) line[2]) || !isdigit((int) line[3]))
+    return false;
+  status = (line[1] - '0') * 100 + (line[2] - '0') * 10 + (line[3] - '0');
+  // An interim response is followed by the real one.
+  if (status < 200)
+    return false;
+  if (status == 204 || status == 304)
+    return true;
+
+  for (line = buf; line < hdrend; line = eol + 1) {
+    eol = (const u8 *) memchr(line, '\n', hdrend - line);
+    if (eol == NULL)
+      break;
+    if (eol - line > 15 && strncasecmp((const char *) line, "Content-Length:", 15) == 0)
+      contentlen = strtol((const char *) line + 15, NULL, 10);
+    else if (eol - line > 18 && strncasecmp((const char *) line, "Transfer-Encoding:", 18) == 0)
+      chunked = find_bytes(line, eol - line, "chunked", 7) != NULL;
+  }
+
+  if (chunked)
+    return buflen - (hdrend - buf) >= 5 && memcmp(buf + buflen - 5, "0\r\n\r\n", 5) == 0;
+  if (contentlen >= 0)
+    return buflen - (hdrend - buf) >= contentlen;
+
+  return false;
+}
+
+/* Returns true if buf is a whole FTP/SMTP-style reply: lines that start
+   with a three-digit code, the last of which has a space after the code
+   and ends in a newline. */
+static bool reply_lines_complete(const u8 *buf, int buflen) {
+  const u8 *last;
+
+  if (buflen < 5 || buf[buflen - 1] != '\n')
+    return false;
+  if (!isdigit((int) buf[0]) || !isdigit((int) buf[1]) || !isdigit((int) buf[2])
+      || (buf[3] != ' ' && buf[3] != '-'))
+    return false;
+
+  // Find the start of the last line.
+  for (last = buf + buflen - 1; last > buf && last[-1] != '\n'; last--)
+    ;
+  if (buf + buflen - last < 5)
+    return false;
+
+  return memcmp(last, buf, 3) == 0 && last[3] == ' ';
+}
+
 ServiceProbe::ServiceProbe() {
   int i;
   probename = NULL;
   probestring = NULL;
   totalwaitms = DEFAULT_SERVICEWAITMS;
+  reuse = NULL;
   probestringlen = 0; probeprotocol = -1;
   // The default rarity level for a probe without a rarity
   // directive - should almost never have to be relied upon.
   rarity = 5;
   fallbackStr = NULL;
   for (i=0; i<MAXFALLBACKS+1; i++) fallbacks[i] = NULL;
+  prefilter = NULL;
+  anchored_fallbacks = false;
+  framing = PROBE_FRAMING_NONE;
+  memset(wait_hist, 0, sizeof(wait_hist));
+  memset(wait_ends, 0, sizeof(wait_ends));
 }
 
 ServiceProbe::~ServiceProbe() {
@@ -1062,6 +1638,8 @@ ServiceProbe::~ServiceProbe() {
   }
 
   if (fallbackStr) free(fallbackStr);
+  if (reuse) free(reuse);
+  delete prefilter;
 }
 
   // Parses the "probe " line in the nmap-service-probes file.  Pass the rest of the line
@@ -1250,6 +1828,425 @@ void ServiceProbe::addMatch(const char *match, int lineno) {
   matches.push_back(newmatch);
 }
 
+/* --version-cache remembers the outcome of matching a probe's response
+   against nmap-service-probes, so a later scan that gets a byte-identical
+   response can skip the regexes. The file is mapped when the first service
+   scan starts, and rewritten with this run's results merged in at the end.
+   It records a hash of nmap-service-probes and is ignored if that changes.
+   Integers are in host byte order.
+
+   Layout: a vc_header, nslots u32 slot numbers (record index + 1, or 0 if
+   empty) for open addressing on the record key, nrecords vc_records, and
+   strings_len bytes of strings. Each record's strs points at nine
+   consecutive NUL-terminated strings: product, version, info, hostname,
+   ostype, devicetype, and the application, hardware and OS CPEs. */
+#define VC_MAGIC "NmapVC01"
+#define VC_NSTRS 9
+#define VC_FNV_BASIS 0xcbf29ce484222325ULL
+#define VC_CHECK_BASIS 0x84222325cbf29ce4ULL
+
+struct vc_header {
+  char magic[8];
+  u64 probes_hash;
+  u32 nslots; // A power of two
+  u32 nrecords;
+  u32 strings_len;
+  u32 reserved;
+};
+
+struct vc_record {
+  u64 key; // Hash of the probe name, protocol and response; never 0
+  u64 check; // A second hash of the response, and its length
+  s32 lineno; // Line of the match in nmap-service-probes, or 0 for none
+  u32 depth; // Index of the matching probe in the probe's fallbacks
+  u32 strs; // Offset of the strings
+  u32 reserved;
+};
+
+/* FNV-1a, continuing from h. */
+static u64 vc_hash(const u8 *buf, size_t len, u64 h) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/* Final mixing step of MurmurHash3, so that all bits of the FNV result
+   affect the low bits used as a slot number. */
+static u64 vc_mix(u64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+class VersionCache {
+public:
+  VersionCache(const char *filename, u64 probes_hash);
+  ~VersionCache();
+  /* Looks up a response to probe. On a hit, returns true and sets *MD to the
+     cached result (NULL if nothing matched) and *depth to the index of the
+     fallback that matched. *MD is only valid until the next lookup. */
+  bool lookup(ServiceProbe *probe, const u8 *buf, int buflen,
+              const struct MatchDetails **MD, int *depth);
+  /* Records the result of matching a response that lookup() missed. */
+  void add(ServiceProbe *probe, const u8 *buf, int buflen,
+           const struct MatchDetails *MD, int depth);
+  void save();
+
+private:
+  struct result {
+    s32 lineno;
+    u32 depth;
+    std::string strs; // The nine strings, as in the file
+  };
+
+  char *filename;
+  u64 probes_hash;
+  char *map;
+  int maplen;
+  /* These point into map, and are NULL if there was no usable file. */
+  const struct vc_header *hdr;
+  const u32 *slots;
+  const struct vc_record *records;
+  const char *strings;
+  std::map<std::pair<u64, u64>, struct result> added;
+  unsigned long hits, misses;
+
+  void keys(ServiceProbe *probe, const u8 *buf, int buflen,
+            u64 *key, u64 *check);
+  const struct vc_record *find(u64 key, u64 check);
+  const char *recordStrings(const struct vc_record *rec);
+};
+
+static VersionCache *version_cache = NULL;
+
+VersionCache::VersionCache(const char *filename, u64 probes_hash) {
+  const struct vc_header *h;
+  size_t expected;
+
+  this->filename = strdup(filename);
+  this->probes_hash = probes_hash;
+  hdr = NULL;
+  slots = NULL;
+  records = NULL;
+  strings = NULL;
+  hits = misses = 0;
+
+  map = mmapfile(this->filename, &maplen, O_RDONLY);
+  if (map == NULL)
+    return;
+
+  h = (const struct vc_header *) map;
+  if ((size_t) maplen < sizeof(*h) || memcmp(h->magic, VC_MAGIC, sizeof(h->magic)) != 0)
+    fatal("%s is not a version cache file; refusing to overwrite it.", filename);
+  if (h->probes_hash != probes_hash) {
+    if (o.verbose)
+      log_write(LOG_PLAIN, "Discarding version cache %s: nmap-service-probes has changed.\n", filename);
+    return;
+  }
+  expected = sizeof(*h) + h->nslots * sizeof(u32) + h->nrecords * sizeof(struct vc_record) + h->strings_len;
+  if (h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 || h->nrecords >= h->nslots
+      || expected != (size_t) maplen
+      || (h->strings_len > 0 && map[maplen - 1] != '\0')) {
+    error("Warning: Version cache %s is corrupt; it will be overwritten.", filename);
+    return;
+  }
+
+  hdr = h;
+  slots = (const u32 *) (map + sizeof(*h));
+  records = (const struct vc_record *) (slots + h->nslots);
+  strings = (const char *) (records + h->nrecords);
+}
+
+VersionCache::~VersionCache() {
+  if (map != NULL)
+    munmap(map, maplen);
+  free(filename);
+}
+
+void VersionCache::keys(ServiceProbe *probe, const u8 *buf, int buflen,
+                        u64 *key, u64 *check) {
+  const char *name = probe->getName();
+  u8 proto = probe->getProbeProtocol();
+
+  *key = vc_hash((const u8 *) name, strlen(name) + 1, VC_FNV_BASIS);
+  *key = vc_mix(vc_hash(buf, buflen, vc_hash(&proto, 1, *key)));
+  if (*key == 0)
+    *key = 1;
+  *check = vc_mix(vc_hash(buf, buflen, VC_CHECK_BASIS) ^ (u64) buflen);
+}
+
+const struct vc_record *VersionCache::find(u64 key, u64 check) {
+  u32 mask, slot, idx;
+
+  if (hdr == NULL)
+    return NULL;
+
+  mask = hdr->nslots - 1;
+  for (slot = key & mask; (idx = slots[slot]) != 0; slot = (slot + 1) & mask) {
+    if (idx > hdr->nrecords)
+      return NULL;
+    if (records[idx - 1].key == key && records[idx - 1].check == check)
+      return &records[idx - 1];
+  }
+
+  return NULL;
+}
+
+/* Returns the strings of a record in the mapped file, or NULL if they run
+   off the end of it. */
+const char *VersionCache::recordStrings(const struct vc_record *rec) {
+  const char *p, *end;
+  int i;
+
+  if (rec->strs >= hdr->strings_len)
+    return NULL;
+  p = strings + rec->strs;
+  end = strings + hdr->strings_len;
+  for (i = 0; i < VC_NSTRS; i++) {
+    p = (const char *) memchr(p, '\0', end - p);
+    if (p == NULL || ++p > end)
+      return NULL;
+  }
+
+  return strings + rec->strs;
+}
+
+bool VersionCache::lookup(ServiceProbe *probe, const u8 *buf, int buflen,
+                          const struct MatchDetails **MD, int *depth) {
+  static struct MatchDetails MD_cached;
+  static char product[80], version[80], info[256], hostname[80];
+  static char ostype[32], devicetype[32];
+  static char cpe_a[80], cpe_h[80], cpe_o[80];
+  struct { const char **field; char *buf; size_t len; } fields[VC_NSTRS] = {
+    { &MD_cached.product, product, sizeof(product) },
+    { &MD_cached.version, version, sizeof(version) },
+    { &MD_cached.info, info, sizeof(info) },
+    { &MD_cached.hostname, hostname, sizeof(hostname) },
+    { &MD_cached.ostype, ostype, sizeof(ostype) },
+    { &MD_cached.devicetype, devicetype, sizeof(devicetype) },
+    { &MD_cached.cpe_a, cpe_a, sizeof(cpe_a) },
+    { &MD_cached.cpe_h, cpe_h, sizeof(cpe_h) },
+    { &MD_cached.cpe_o, cpe_o, sizeof(cpe_o) },
+  };
+  std::map<std::pair<u64, u64>, struct result>::iterator it;
+  const struct vc_record *rec;
+  ServiceProbeMatch *match;
+  const char *strs;
+  s32 lineno;
+  u32 fallback;
+  u64 key, check;
+  int i;
+
+  keys(probe, buf, buflen, &key, &check);
+  it = added.find(std::make_pair(key, check));
+  if (it != added.end()) {
+    lineno = it->second.lineno;
+    fallback = it->second.depth;
+    strs = it->second.strs.data();
+  } else if ((rec = find(key, check)) != NULL && (strs = recordStrings(rec)) != NULL) {
+    lineno = rec->lineno;
+    fallback = rec->depth;
+  } else {
+    misses++;
+    return false;
+  }
+
+  if (lineno == 0 && fallback <= MAXFALLBACKS) {
+    *MD = NULL;
+    *depth = fallback;
+    hits++;
+    return true;
+  }
+
+  /* The service name and softness come from the match itself, which exists
+     because nmap-service-probes is unchanged. */
+  match = NULL;
+  if (fallback < MAXFALLBACKS && probe->fallbacks[fallback] != NULL)
+    match = probe->fallbacks[fallback]->getMatchByLine(lineno);
+  if (match == NULL) {
+    misses++;
+    return false;
+  }
+
+  memset(&MD_cached, 0, sizeof(MD_cached));
+  MD_cached.isSoft = match->isSoftMatch();
+  MD_cached.serviceName = match->getName();
+  MD_cached.lineno = lineno;
+  for (i = 0; i < VC_NSTRS; i++) {
+    if (*strs != '\0') {
+      Strncpy(fields[i].buf, strs, fields[i].len);
+      *fields[i].field = fields[i].buf;
+    }
+    strs += strlen(strs) + 1;
+  }
+
+  *MD = &MD_cached;
+  *depth = fallback;
+  hits++;
+  return true;
+}
+
+void VersionCache::add(ServiceProbe *probe, const u8 *buf, int buflen,
+                       const struct MatchDetails *MD, int depth) {
+  const char *fields[VC_NSTRS];
+  struct result r;
+  u64 key, check;
+  int i;
+
+  r.lineno = 0;
+  r.depth = depth;
+  if (MD != NULL && MD->serviceName != NULL) {
+    r.lineno = MD->lineno;
+    fields[0] = MD->product;
+    fields[1] = MD->version;
+    fields[2] = MD->info;
+    fields[3] = MD->hostname;
+    fields[4] = MD->ostype;
+    fields[5] = MD->devicetype;
+    fields[6] = MD->cpe_a;
+    fields[7] = MD->cpe_h;
+    fields[8] = MD->cpe_o;
+  } else {
+    for (i = 0; i < VC_NSTRS; i++)
+      fields[i] = NULL;
+  }
+  for (i = 0; i < VC_NSTRS; i++) {
+    if (fields[i] != NULL)
+      r.strs.append(fields[i]);
+    r.strs.push_back('\0');
+  }
+
+  keys(probe, buf, buflen, &key, &check);
+  added[std::make_pair(key, check)] = r;
+}
+
+void VersionCache::save() {
+  std::map<std::pair<u64, u64>, struct result>::iterator it;
+  std::map<std::string, u32> stroffs;
+  std::map<std::string, u32>::iterator si;
+  std::vector<struct vc_record> recs;
+  std::vector<u32> newslots;
+  std::string strs, str;
+  struct vc_header newhdr;
+  char tmpname[1024];
+  u32 i, n, nslots, mask, slot;
+  FILE *fp;
+
+  if (o.verbose)
+    log_write(LOG_STDOUT, "Version cache %s: %lu hits, %lu misses.\n", filename, hits, misses);
+  if (added.empty())
+    return;
+
+  /* Merge the old records with the new ones, which replace any old record
+     for the same response that lookup() couldn't use. */
+  n = added.size() + (hdr ? hdr->nrecords : 0);
+  for (nslots = 16; nslots < 2 * n; nslots *= 2)
+    ;
+  mask = nslots - 1;
+  newslots.resize(nslots, 0);
+  recs.reserve(n);
+
+  for (i = 0; hdr != NULL && i < hdr->nrecords; i++) {
+    const char *p = recordStrings(&records[i]);
+    int j;
+
+    if (p == NULL || added.count(std::make_pair(records[i].key, records[i].check)) > 0)
+      continue;
+    recs.push_back(records[i]);
+    str.clear();
+    for (j = 0; j < VC_NSTRS; j++) {
+      str.append(p);
+      str.push_back('\0');
+      p += strlen(p) + 1;
+    }
+    si = stroffs.find(str);
+    if (si == stroffs.end()) {
+      recs.back().strs = strs.size();
+      stroffs[str] = strs.size();
+      strs.append(str);
+    } else {
+      recs.back().strs = si->second;
+    }
+  }
+  for (it = added.begin(); it != added.end(); it++) {
+    struct vc_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.key = it->first.first;
+    rec.check = it->first.second;
+    rec.lineno = it->second.lineno;
+    rec.depth = it->second.depth;
+    si = stroffs.find(it->second.strs);
+    if (si == stroffs.end()) {
+      rec.strs = strs.size();
+      stroffs[it->second.strs] = strs.size();
+      strs.append(it->second.strs);
+    } else {
+      rec.strs = si->second;
+    }
+    recs.push_back(rec);
+  }
+  for (i = 0; i < recs.size(); i++) {
+    for (slot = recs[i].key & mask; newslots[slot] != 0; slot = (slot + 1) & mask)
+      ;
+    newslots[slot] = i + 1;
+  }
+
+  memset(&newhdr, 0, sizeof(newhdr));
+  memcpy(newhdr.magic, VC_MAGIC, sizeof(newhdr.magic));
+  newhdr.probes_hash = probes_hash;
+  newhdr.nslots = nslots;
+  newhdr.nrecords = recs.size();
+  newhdr.strings_len = strs.size();
+
+  /* Write a new file and rename it over the old one, which is still mapped. */
+  Snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    gh_perror("Failed to write version cache %s", tmpname);
+    return;
+  }
+  if (fwrite(&newhdr, sizeof(newhdr), 1, fp) != 1
+      || fwrite(&newslots[0], sizeof(u32), nslots, fp) != nslots
+      || (!recs.empty() && fwrite(&recs[0], sizeof(struct vc_record), recs.size(), fp) != recs.size())
+      || (!strs.empty() && fwrite(strs.data(), 1, strs.size(), fp) != strs.size())) {
+    gh_perror("Failed to write version cache %s", tmpname);
+    fclose(fp);
+    remove(tmpname);
+    return;
+  }
+  fclose(fp);
+
+  if (map != NULL) {
+    munmap(map, maplen);
+    map = NULL;
+    hdr = NULL;
+  }
+#ifdef WIN32
+  remove(filename);
+#endif
+  if (rename(tmpname, filename) != 0)
+    gh_perror("Failed to rename %s to %s", tmpname, filename);
+  added.clear();
+}
+
+void service_scan_cache_save(void) {
+  if (version_cache == NULL)
+    return;
+  version_cache->save();
+  delete version_cache;
+  version_cache = NULL;
+}
+
 /* Parses the given nmap-service-probes file into the AP class Must
    NOT be made static because I have external maintenance tools
    (servicematch) which use this */
@@ -1264,6 +2261,15 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
   if (!fp)
     fatal("Failed to open nmap-service-probes file %s for reading", filename);
 
+  if (o.version_cache) {
+    size_t n;
+
+    AP->probes_hash = VC_FNV_BASIS;
+    while ((n = fread(line, 1, sizeof(line), fp)) > 0)
+      AP->probes_hash = vc_hash((u8 *) line, n, AP->probes_hash);
+    rewind(fp);
+  }
+
   while(fgets(line, sizeof(line), fp)) {
     lineno++;
 
@@ -1313,6 +2319,11 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
         if (waitms < 100 || waitms > 300000)
           fatal("Error on line %d of nmap-service-probes file (%s): bad totalwaitms value.  Must be between 100 and 300000 milliseconds", lineno, filename);
         newProbe->totalwaitms = waitms;
+      } else if (strncmp(line, "reuse", 5) == 0 && (line[5] == '\0' || isspace((int) (unsigned char) line[5]))) {
+        char group[32];
+        if (sscanf(line + 5, "%31s", group) != 1)
+          fatal("Error on line %d of nmap-service-probes file (%s): the reuse directive needs a group name", lineno, filename);
+        newProbe->reuse = strdup(group);
       } else if (strncmp(line, "match ", 6) == 0 || strncmp(line, "softmatch ", 10) == 0) {
         newProbe->addMatch(line, lineno);
       } else if (strncmp(line, "Exclude ", 8) == 0) {
@@ -1402,8 +2413,14 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
 const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0) {
   std::vector<ServiceProbeMatch *>::iterator vi;
   const struct MatchDetails *MD;
+  bool filter = (prefilter != NULL && match_prefilter_enabled);
+
+  if (filter)
+    prefilter->scan(buf, buflen);
 
   for(vi = matches.begin(); vi != matches.end(); vi++) {
+    if (filter && !prefilter->mayMatch(vi - matches.begin(), buf, buflen))
+      continue;
     MD = (*vi)->testMatch(buf, buflen);
     if (MD->serviceName) {
       if (n == 0)
@@ -1415,10 +2432,113 @@ const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, in
   return NULL;
 }
 
+ServiceProbeMatch *ServiceProbe::getMatchByLine(int lineno) {
+  std::vector<ServiceProbeMatch *>::iterator vi;
+
+  for(vi = matches.begin(); vi != matches.end(); vi++) {
+    if ((*vi)->getLineNo() == lineno)
+      return *vi;
+  }
+
+  return NULL;
+}
+
+void ServiceProbe::compilePrefilter() {
+  delete prefilter;
+  prefilter = new MatchPrefilter(matches);
+}
+
+void ServiceProbe::compileCompletion() {
+  std::vector<ServiceProbeMatch *>::iterator vi;
+  int i;
+
+  anchored_fallbacks = true;
+  for (i = 0; fallbacks[i] != NULL && anchored_fallbacks; i++) {
+    for (vi = fallbacks[i]->matches.begin(); vi != fallbacks[i]->matches.end(); vi++) {
+      if (!(*vi)->isAnchored()) {
+        anchored_fallbacks = false;
+        break;
+      }
+    }
+  }
+
+  if (probeprotocol == IPPROTO_TCP)
+    framing = probe_framing(probestring, probestringlen);
+  else
+    framing = PROBE_FRAMING_NONE;
+}
+
+bool ServiceProbe::responseComplete(const u8 *buf, int buflen, bool softmatched) {
+  std::vector<ServiceProbeMatch *>::iterator vi;
+  int i;
+
+  if (framing != PROBE_FRAMING_NONE && frame_complete(framing, buf, buflen))
+    return true;
+  if (http_response_complete(buf, buflen))
+    return true;
+  // Only a banner is sure to be followed by silence.  A reply to a probe
+  // sent on a fresh connection may come after the banner.
+  if (isNullProbe() && reply_lines_complete(buf, buflen))
+    return true;
+
+  if (!anchored_fallbacks)
+    return false;
+  for (i = 0; fallbacks[i] != NULL; i++) {
+    for (vi = fallbacks[i]->matches.begin(); vi != fallbacks[i]->matches.end(); vi++) {
+      if (softmatched && (*vi)->isSoftMatch())
+        continue;
+      if ((*vi)->mayMatchLonger(buf, buflen))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void ServiceProbe::recordWait(long waitms, int how) {
+  int bucket = 0;
+
+  assert(how >= 0 && how < PROBE_WAIT_NUM_ENDS);
+  while (waitms > 0 && bucket < PROBE_WAIT_BUCKETS - 1) {
+    waitms >>= 1;
+    bucket++;
+  }
+  wait_hist[bucket]++;
+  wait_ends[how]++;
+}
+
+void ServiceProbe::printWaitStats() {
+  char hist[PROBE_WAIT_BUCKETS * 20];
+  unsigned int total = 0;
+  int i, len = 0;
+
+  for (i = 0; i < PROBE_WAIT_NUM_ENDS; i++)
+    total += wait_ends[i];
+  if (total == 0)
+    return;
+
+  for (i = 0; i < PROBE_WAIT_BUCKETS; i++) {
+    if (wait_hist[i] == 0)
+      continue;
+    if (i == PROBE_WAIT_BUCKETS - 1)
+      len += Snprintf(hist + len, sizeof(hist) - len, " >=%ld:%u", 1L << (i - 1), wait_hist[i]);
+    else
+      len += Snprintf(hist + len, sizeof(hist) - len, " <%ld:%u", 1L << i, wait_hist[i]);
+  }
+  log_write(LOG_STDOUT, "  %s/%s: %u waits (%u matched, %u complete, %u timed out, %u closed); ms:%s\n",
+            proto2ascii_lowercase(probeprotocol), probename, total,
+            wait_ends[PROBE_WAIT_MATCHED], wait_ends[PROBE_WAIT_COMPLETE],
+            wait_ends[PROBE_WAIT_TIMEOUT], wait_ends[PROBE_WAIT_CLOSED], hist);
+
+  memset(wait_hist, 0, sizeof(wait_hist));
+  memset(wait_ends, 0, sizeof(wait_ends));
+}
+
 AllProbes::AllProbes() {
   nullProbe = NULL;
   excluded_seen = false;
   memset(&excludedports, 0, sizeof(excludedports));
+  probes_hash = 0;
 }
 
 AllProbes::~AllProbes() {
@@ -1500,8 +2620,11 @@ void AllProbes::compileFallbacks() {
   curr = probes.begin();
 
   // The NULL probe is a special case:
-  if (nullProbe != NULL)
+  if (nullProbe != NULL) {
     nullProbe->fallbacks[0] = nullProbe;
+    nullProbe->compilePrefilter();
+    nullProbe->compileCompletion();
+  }
 
   while (curr != probes.end()) {
 
@@ -1539,6 +2662,9 @@ void AllProbes::compileFallbacks() {
     if ((*curr)->fallbackStr) free((*curr)->fallbackStr);
     (*curr)->fallbackStr = NULL;
 
+    (*curr)->compilePrefilter();
+    (*curr)->compileCompletion();
+
     curr++;
   }
 
@@ -1561,9 +2687,12 @@ ServiceNFO::ServiceNFO(AllProbes *newAP) {
   tunnel = SERVICE_TUNNEL_NONE;
   ssl_session = NULL;
   softMatchFound = false;
+  reused_connection = false;
+  reuse_failed = false;
   servicefplen = servicefpalloc = 0;
   servicefp = NULL;
   memset(&currentprobe_exec_time, 0, sizeof(currentprobe_exec_time));
+  memset(&connect_time, 0, sizeof(connect_time));
 }
 
 ServiceNFO::~ServiceNFO() {
@@ -1841,6 +2970,24 @@ void ServiceNFO::appendtocurrentproberesponse(const u8 *respstr, int respstrlen)
   currentresplen += respstrlen;
 }
 
+void ServiceNFO::appendtocurrentproberesponse(nsock_event nse) {
+  const u8 *respstr;
+  int respstrlen;
+
+  respstr = (u8 *) nse_readbuf(nse, &respstrlen);
+
+  /* Take over nsock's read buffer only when the response fills most of it.
+     Shorter responses are copied, so the buffer goes back to nsock's cache
+     and the service holds only as much memory as the response needs. */
+  if (currentresplen == 0 && respstrlen >= READBUF_STEAL_MIN) {
+    if (currentresp) free(currentresp);
+    currentresp = (u8 *) nse_readbuf_steal(nse, &currentresplen);
+    return;
+  }
+
+  appendtocurrentproberesponse(respstr, respstrlen);
+}
+
 // Get the full current response string.  Note that this pointer is
 // INVALIDATED if you call appendtocurrentproberesponse() or nextProbe()
 u8 *ServiceNFO::getcurrentproberesponse(int *respstrlen) {
@@ -1849,6 +2996,52 @@ u8 *ServiceNFO::getcurrentproberesponse(int *respstrlen) {
 }
 
 
+/* Initialize a service scan congestion window, as init_ultra_timing_vals()
+   does for scan_engine. */
+static void init_service_timing(struct ultra_timing_vals *timing, int cwnd,
+                                const struct scan_performance_vars *perf,
+                                const struct timeval *now) {
+  timing->cwnd = cwnd;
+  timing->ssthresh = perf->initial_ssthresh;
+  timing->num_replies_expected = 0;
+  timing->num_replies_received = 0;
+  timing->num_updates = 0;
+  timing->last_drop = *now;
+}
+
+/* A connection to svc (or, for UDP, a probe) got an answer: open up the
+   host and group windows. */
+static void service_timing_ack(ServiceGroup *SG, ServiceNFO *svc) {
+  ServiceHostTiming *ht = &SG->hosts[svc->target];
+
+  ht->timing.num_replies_expected++;
+  ht->timing.num_updates++;
+  ht->timing.ack(&SG->perf);
+  SG->timing.num_replies_expected++;
+  SG->timing.num_updates++;
+  SG->timing.ack(&SG->perf);
+}
+
+/* A connection to svc timed out or was refused.  Ports only get here after
+   the port scan found them open, so this means the target or something in
+   front of it can't keep up.  Connections started before the last drop
+   don't count again. */
+static void service_timing_drop(ServiceGroup *SG, ServiceNFO *svc,
+                                const struct timeval *now) {
+  ServiceHostTiming *ht = &SG->hosts[svc->target];
+
+  ht->timing.num_replies_expected++;
+  SG->timing.num_replies_expected++;
+  if (TIMEVAL_AFTER(svc->connect_time, ht->timing.last_drop))
+    ht->timing.drop(ht->active, &SG->perf, now);
+  if (TIMEVAL_AFTER(svc->connect_time, SG->timing.last_drop))
+    SG->timing.drop_group(SG->services_in_progress.size(), &SG->perf, now);
+  if (o.debugging > 1) {
+    log_write(LOG_PLAIN, "Service scan connect to %s:%hu failed; host cwnd %.2f, group cwnd %.2f\n",
+              svc->target->targetipstr(), svc->portno, ht->timing.cwnd, SG->timing.cwnd);
+  }
+}
+
 ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   unsigned int targetno;
   ServiceNFO *svc;
@@ -1857,6 +3050,7 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   int desired_par;
   struct timeval now;
   num_hosts_timedout = 0;
+  connections_reused = reuse_retries = 0;
   gettimeofday(&now, NULL);
 
   for(targetno = 0 ; targetno < Targets.size(); targetno++) {
@@ -1871,6 +3065,7 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
       services_remaining.push_back(svc);
+      hosts[svc->target].remaining++;
     }
   }
 
@@ -1888,6 +3083,7 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
       services_remaining.push_back(svc);
+      hosts[svc->target].remaining++;
     }
   }
 
@@ -1896,11 +3092,25 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   if (o.timing_level == 3) desired_par = 20;
   if (o.timing_level == 4) desired_par = 30;
   if (o.timing_level >= 5) desired_par = 40;
-  // TODO: Come up with better ways to determine ideal_parallelism
-  int min_par, max_par;
-  min_par = o.min_parallelism;
-  max_par = MAX(min_par, o.max_parallelism ? o.max_parallelism : 100);
-  ideal_parallelism = box(min_par, max_par, desired_par);
+  /* The timing template only gives the starting window now; it grows as
+     connections succeed and shrinks when they time out or are refused.
+     --min-parallelism and --max-parallelism bound it.  The slow templates
+     stay serial unless --max-parallelism says otherwise. */
+  perf.init();
+  perf.low_cwnd = MAX(o.min_parallelism, 1);
+  if (o.max_parallelism)
+    perf.max_cwnd = MAX(perf.low_cwnd, o.max_parallelism);
+  else
+    perf.max_cwnd = MAX(perf.low_cwnd, o.timing_level < 3 ? 1 : 100);
+  perf.group_initial_cwnd = box(perf.low_cwnd, perf.max_cwnd, desired_par);
+  perf.host_initial_cwnd = perf.group_initial_cwnd;
+  init_service_timing(&timing, perf.group_initial_cwnd, &perf, &now);
+  // remaining was counted above
+  for (targetno = 0; targetno < Targets.size(); targetno++) {
+    ServiceHostTiming *ht = &hosts[Targets[targetno]];
+    init_service_timing(&ht->timing, perf.host_initial_cwnd, &perf, &now);
+    ht->active = 0;
+  }
 }
 
 ServiceGroup::~ServiceGroup() {
@@ -1967,18 +3177,61 @@ static void adjustPortStateIfNecessary(ServiceNFO *svc) {
     return 0;
   }
 
+// Closes svc's TCP connection (if nsi is not NULL) and starts a new one to
+// the service, through the current tunnel.  servicescan_connect_handler()
+// sends the current probe once it is up.
+static void reconnectService(nsock_pool nsp, nsock_iod nsi, ServiceNFO *svc) {
+  struct sockaddr_storage ss;
+  size_t ss_len;
+
+  svc->reused_connection = false;
+  if (nsi)
+    nsi_delete(nsi, NSOCK_PENDING_SILENT);
+  if ((svc->niod = nsi_new(nsp, svc)) == NULL) {
+    fatal("Failed to allocate Nsock I/O descriptor in %s()", __func__);
+  }
+  if (o.spoofsource) {
+    o.SourceSockAddr(&ss, &ss_len);
+    nsi_set_localaddr(svc->niod, &ss, ss_len);
+  }
+  if (o.ipoptionslen)
+    nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
+  svc->connect_time = *nsock_gettimeofday();
+  if (svc->target->TargetName()) {
+    if (nsi_set_hostname(svc->niod, svc->target->TargetName()) == -1)
+      fatal("nsi_set_hostname(\"%s\" failed in %s()", svc->target->TargetName(), __func__);
+  }
+  svc->target->TargetSockAddr(&ss, &ss_len);
+  if (svc->tunnel == SERVICE_TUNNEL_NONE) {
+    nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler,
+                      DEFAULT_CONNECT_TIMEOUT, svc,
+                      (struct sockaddr *) &ss, ss_len,
+                      svc->portno);
+  } else {
+    assert(svc->tunnel == SERVICE_TUNNEL_SSL);
+    nsock_connect_ssl(nsp, svc->niod, servicescan_connect_handler,
+                      DEFAULT_CONNECT_SSL_TIMEOUT, svc,
+                      (struct sockaddr *) &ss,
+                      ss_len, svc->proto, svc->portno, svc->ssl_session);
+  }
+}
+
 // This simple helper function is used to start the next probe.  If
 // the probe exists, execution begins (and the previous one is cleaned
 // up if necessary) .  Otherwise, the service is listed as finished
 // and moved to the finished list.  If you pass 'true' for alwaysrestart, a
 // new connection will be made even if the previous probe was the NULL probe.
 // You would do this, for example, if the other side has closed the connection.
+// Pass 'true' for reuse if the response to the previous probe is known to be
+// complete; then a TCP probe is sent on the same connection if both probes are
+// in the same "reuse" group.  The matches of a probe are written against what
+// a server says on a fresh connection, so a connection is only handed on
+// between probes of one protocol, which get the same kind of answer on it.
 static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
-                           ServiceNFO *svc, bool alwaysrestart) {
+                           ServiceNFO *svc, bool alwaysrestart, bool reuse) {
   bool isInitial = svc->probe_state == PROBESTATE_INITIAL;
   ServiceProbe *probe = svc->currentProbe();
-  struct sockaddr_storage ss;
-  size_t ss_len;
+  const ServiceProbe *prev = probe;
 
   if (!alwaysrestart && probe->isNullProbe()) {
     // The difference here is that we can reuse the same (TCP) connection
@@ -2001,35 +3254,19 @@ static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
     if (!isInitial)
       probe = svc->nextProbe(true); // if was initial, currentProbe() returned the right one to execute.
     if (probe) {
-      // For a TCP probe, we start by requesting a new connection to the target
-      if (svc->proto == IPPROTO_TCP) {
-        nsi_delete(nsi, NSOCK_PENDING_SILENT);
-        if ((svc->niod = nsi_new(nsp, svc)) == NULL) {
-          fatal("Failed to allocate Nsock I/O descriptor in %s()", __func__);
-        }
-        if (o.spoofsource) {
-          o.SourceSockAddr(&ss, &ss_len);
-          nsi_set_localaddr(svc->niod, &ss, ss_len);
-        }
-        if (o.ipoptionslen)
-          nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
-        if (svc->target->TargetName()) {
-          if (nsi_set_hostname(svc->niod, svc->target->TargetName()) == -1)
-            fatal("nsi_set_hostname(\"%s\" failed in %s()", svc->target->TargetName(), __func__);
-        }
-        svc->target->TargetSockAddr(&ss, &ss_len);
-        if (svc->tunnel == SERVICE_TUNNEL_NONE) {
-          nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler,
-                            DEFAULT_CONNECT_TIMEOUT, svc,
-                            (struct sockaddr *) &ss, ss_len,
-                            svc->portno);
-        } else {
-          assert(svc->tunnel == SERVICE_TUNNEL_SSL);
-          nsock_connect_ssl(nsp, svc->niod, servicescan_connect_handler,
-                            DEFAULT_CONNECT_SSL_TIMEOUT, svc,
-                            (struct sockaddr *) &ss,
-                            ss_len, svc->proto, svc->portno, svc->ssl_session);
-        }
+      if (svc->proto == IPPROTO_TCP && reuse && !svc->reuse_failed
+          && prev->reuse && probe->reuse && strcmp(prev->reuse, probe->reuse) == 0) {
+        // The server is done answering the last probe and this one is
+        // safe to send after it, so skip the new handshake.
+        SG->connections_reused++;
+        svc->reused_connection = true;
+        svc->currentprobe_exec_time = *nsock_gettimeofday();
+        send_probe_text(nsp, nsi, svc, probe);
+        nsock_read(nsp, nsi, servicescan_read_handler,
+                   svc->probe_timemsleft(probe, nsock_gettimeofday()), svc);
+      } else if (svc->proto == IPPROTO_TCP) {
+        // For a TCP probe, we start by requesting a new connection to the target
+        reconnectService(nsp, nsi, svc);
       } else {
         assert(svc->proto == IPPROTO_UDP);
         /* Can maintain the same UDP "connection" */
@@ -2048,6 +3285,31 @@ static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
   return;
 }
 
+/* Returns true if svc's current probe was sent on a reused connection and
+   nothing has been received in reply. */
+static bool emptyReusedResponse(ServiceNFO *svc) {
+  int len;
+
+  if (!svc->reused_connection)
+    return false;
+  svc->getcurrentproberesponse(&len);
+
+  return len == 0;
+}
+
+/* Called when a probe sent on a reused connection got nothing back before the
+   connection failed or the wait ran out.  The server may not take more than
+   one request per connection, so the probe is sent again on a new one. */
+static void retryOnNewConnection(nsock_pool nsp, nsock_iod nsi,
+                                 ServiceGroup *SG, ServiceNFO *svc) {
+  if (o.debugging > 1 || o.versionTrace())
+    log_write(LOG_PLAIN, "Service scan probe %s to %s:%hu got no response on the existing connection; retrying on a new one\n",
+              svc->currentProbe()->getName(), svc->target->targetipstr(), svc->portno);
+  SG->reuse_retries++;
+  svc->reuse_failed = true;
+  reconnectService(nsp, nsi, svc);
+}
+
 /* Sometimes the normal service scan will detect a
    tunneling/encryption protocol such as SSL.  Instead of just
    reporting "ssl", we can make an SSL connection and try to determine
@@ -2091,7 +3353,7 @@ static int scanThroughTunnel(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
   svc->cpe_a_matched[0] = svc->cpe_h_matched[0] = svc->cpe_o_matched[0] = '\0';
   svc->softMatchFound = false;
    svc->resetProbes(true);
-  startNextProbe(nsp, nsi, SG, svc, true);
+  startNextProbe(nsp, nsi, SG, svc, true, false);
   return 1;
 #else
   return 0;
@@ -2159,6 +3421,7 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
   if (member != SG->services_in_progress.end()) {
     assert(*member == svc);
     SG->services_in_progress.erase(member);
+    SG->hosts[target].active--;
   } else {
     /* A probe can finish from services_remaining if the host times out before the
        probe has even started */
@@ -2167,6 +3430,7 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
     assert(member != SG->services_remaining.end());
     assert(*member == svc);
     SG->services_remaining.erase(member);
+    SG->hosts[target].remaining--;
   }
 
   SG->services_finished.push_back(svc);
@@ -2181,22 +3445,49 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
   return;
 }
 
+// True if the host has services waiting and room in its window to start one.
+static bool host_can_launch(const ServiceHostTiming *ht) {
+  return ht->remaining > 0 && ht->active < (unsigned int) ht->timing.cwnd;
+}
+
 // This function consults the ServiceGroup to determine whether any
 // more probes can be launched at this time.  If so, it determines the
 // appropriate ones and then starts them up.
 static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
   ServiceNFO *svc;
   ServiceProbe *nextprobe;
+  ServiceHostTiming *ht;
+  std::map<Target *, ServiceHostTiming>::iterator hostI;
+  std::list<ServiceNFO *>::iterator svcI, nextI;
+  unsigned int open_hosts = 0;
   struct sockaddr_storage ss;
   size_t ss_len;
   static int warn_no_scanning=1;
 
-  while (SG->services_in_progress.size() < SG->ideal_parallelism &&
-         !SG->services_remaining.empty()) {
+  // Count the hosts that could take another service so we can stop walking
+  // services_remaining once they are all full.
+  for (hostI = SG->hosts.begin(); hostI != SG->hosts.end(); hostI++) {
+    if (host_can_launch(&hostI->second))
+      open_hosts++;
+  }
+
+  for (svcI = SG->services_remaining.begin();
+       svcI != SG->services_remaining.end() && open_hosts > 0 &&
+         SG->services_in_progress.size() < (unsigned int) SG->timing.cwnd;
+       svcI = nextI) {
+    // end_svcprobe() removes svc from services_remaining
+    nextI = svcI;
+    nextI++;
+    svc = *svcI;
+    // Leave it for later if its host has all the probes it can take
+    ht = &SG->hosts[svc->target];
+    if (!host_can_launch(ht))
+      continue;
     // Start executing a probe from the new list and move it to in_progress
-    svc = SG->services_remaining.front();
     if (svc->target->timedOut(nsock_gettimeofday())) {
       end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, NULL);
+      if (!host_can_launch(ht))
+        open_hosts--;
       continue;
     }
     nextprobe = svc->nextProbe(true);
@@ -2207,6 +3498,8 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
         warn_no_scanning=0;
       }
       end_svcprobe(nsp, PROBESTATE_FINISHED_NOMATCH, SG, svc, NULL);
+      if (!host_can_launch(ht))
+        open_hosts--;
       continue;
     }
 
@@ -2223,6 +3516,7 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
     }
     if (o.ipoptionslen)
       nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
+    svc->connect_time = *nsock_gettimeofday();
     svc->target->TargetSockAddr(&ss, &ss_len);
     if (svc->proto == IPPROTO_TCP)
       nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler,
@@ -2236,9 +3530,13 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
                         svc->portno);
     }
     // Now remove it from the remaining service list
-    SG->services_remaining.pop_front();
+    SG->services_remaining.erase(svcI);
+    ht->remaining--;
     // And add it to the in progress list
     SG->services_in_progress.push_back(svc);
+    ht->active++;
+    if (!host_can_launch(ht))
+      open_hosts--;
   }
   return 0;
 }
@@ -2275,8 +3573,10 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
 #endif
 
     /* If the port is TCP, it is now known to be open rather than openfiltered */
-    if (svc->proto == IPPROTO_TCP)
+    if (svc->proto == IPPROTO_TCP) {
       adjustPortStateIfNecessary(svc);
+      service_timing_ack(SG, svc);
+    }
 
     // Yeah!  Connection made to the port.  Send the appropriate probe
     // text (if any is needed -- might be NULL probe)
@@ -2294,6 +3594,7 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
         // and move it to the finished bin.
         if (o.debugging)
           error("Got nsock CONNECT response with status %s - aborting this service", nse_status2str(status));
+        service_timing_drop(SG, svc, nsock_gettimeofday());
         end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, nsi);
         break;
 
@@ -2345,6 +3646,13 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
     return;
   }
 
+  // A connection kept from the previous probe may have been closed by the
+  // other side in the meantime.
+  if (emptyReusedResponse(svc)) {
+    retryOnNewConnection(nsp, nsi, SG, svc);
+    return;
+  }
+
   if (status == NSE_STATUS_ERROR || status == NSE_STATUS_PROXYERROR) {
         err = nse_errorcode(nse);
         error("Got nsock WRITE error #%d (%s)", err, strerror(err));
@@ -2362,6 +3670,15 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
   return;
 }
 
+/* Adds the time svc has waited for a response to its current probe to that
+   probe's wait statistics. */
+static void record_probe_wait(ServiceNFO *svc, int how) {
+  ServiceProbe *probe = svc->currentProbe();
+
+  if (probe != NULL)
+    probe->recordWait(TIMEVAL_MSEC_SUBTRACT(*nsock_gettimeofday(), svc->currentprobe_exec_time), how);
+}
+
 static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
   nsock_iod nsi = nse_iod(nse);
   enum nse_status status = nse_status(nse);
@@ -2373,6 +3690,8 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
   int readstrlen;
   const struct MatchDetails *MD;
   int fallbackDepth=0;
+  int timeleft;
+  bool complete;
 
   assert(type == NSE_TYPE_READ);
 
@@ -2380,15 +3699,27 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, nsi);
   } else if (status == NSE_STATUS_SUCCESS) {
     // w00p, w00p, we read something back from the port.
-    readstr = (u8 *) nse_readbuf(nse, &readstrlen);
     adjustPortStateIfNecessary(svc); /* A response means PORT_OPENFILTERED is really PORT_OPEN */
-    svc->appendtocurrentproberesponse(readstr, readstrlen);
+    /* There is no handshake for UDP, so the first answer to a probe is what
+       opens the window */
+    if (svc->proto == IPPROTO_UDP) {
+      int oldlen;
+      svc->getcurrentproberesponse(&oldlen);
+      if (oldlen == 0)
+        service_timing_ack(SG, svc);
+    }
+    svc->appendtocurrentproberesponse(nse);
     // now get the full version
     readstr = svc->getcurrentproberesponse(&readstrlen);
 
-    for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
-      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
-      if (MD && MD->serviceName) break; // Found one!
+    if (version_cache == NULL
+        || !version_cache->lookup(probe, readstr, readstrlen, &MD, &fallbackDepth)) {
+      for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
+        MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
+        if (MD && MD->serviceName) break; // Found one!
+      }
+      if (version_cache != NULL)
+        version_cache->add(probe, readstr, readstrlen, MD, fallbackDepth);
     }
 
     if (MD && MD->serviceName) {
@@ -2436,6 +3767,7 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
           Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
         svc->softMatchFound = MD->isSoft;
         if (!svc->softMatchFound) {
+          record_probe_wait(svc, PROBE_WAIT_MATCHED);
           // We might be able to continue scan through a tunnel protocol
           // like SSL
           if (scanThroughTunnel(nsp, nsi, SG, svc) == 0)
@@ -2445,36 +3777,51 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     }
 
     if (!MD || !MD->serviceName || MD->isSoft) {
-      // Didn't match... maybe reading more until timeout will help
-      // TODO: For efficiency I should be able to test if enough data
-      // has been received rather than always waiting for the reading
-      // to timeout.  For now I'll limit it to 4096 bytes just to
-      // avoid reading megs from services like chargen.  But better
-      // approach is needed.
-      if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) {
-        nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
+      // Didn't match... maybe reading more until timeout will help,
+      // unless the response is already complete or can no longer
+      // match anything.  Reading stops at 4096 bytes to avoid reading
+      // megs from services like chargen.
+      timeleft = svc->probe_timemsleft(probe);
+      complete = timeleft > 0 && readstrlen < 4096
+        && probe->responseComplete(readstr, readstrlen, svc->softMatchFound);
+      if (timeleft > 0 && readstrlen < 4096 && !complete) {
+        nsock_read(nsp, nsi, servicescan_read_handler, timeleft, svc);
       } else {
         // Failed -- lets go to the next probe.
+        if (complete) {
+          if (o.debugging > 1 || o.versionTrace())
+            log_write(LOG_PLAIN, "Service scan response to probe %s from %s:%hu is complete; not waiting for more\n",
+                      probe->getName(), svc->target->targetipstr(), svc->portno);
+          record_probe_wait(svc, PROBE_WAIT_COMPLETE);
+        } else {
+          record_probe_wait(svc, PROBE_WAIT_TIMEOUT);
+        }
         if (readstrlen > 0)
           svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
-        startNextProbe(nsp, nsi, SG, svc, false);
+        startNextProbe(nsp, nsi, SG, svc, false, complete);
       }
     }
+  } else if (status != NSE_STATUS_KILL && emptyReusedResponse(svc)) {
+    // Nothing came back on the old connection; the server probably closed
+    // it.  This is not the probe's fault, so don't count it as a response.
+    retryOnNewConnection(nsp, nsi, SG, svc);
   } else if (status == NSE_STATUS_TIMEOUT) {
     // Failed to read enough to make a match in the given amount of time.  So we
     // move on to the next probe.  If this was a NULL probe, we can simply
     // send the new probe text immediately.  Otherwise we make a new connection.
 
+    record_probe_wait(svc, PROBE_WAIT_TIMEOUT);
     readstr = svc->getcurrentproberesponse(&readstrlen);
     if (readstrlen > 0)
       svc->addToServiceFingerprint(svc->currentProbe()->getName(), readstr,
                                    readstrlen);
-    startNextProbe(nsp, nsi, SG, svc, false);
+    startNextProbe(nsp, nsi, SG, svc, false, false);
 
   } else if (status == NSE_STATUS_EOF) {
     // The jerk closed on us during read request!
     // If this was during the NULL probe, let's (for now) assume
     // the port is TCP wrapped.  Otherwise, we'll treat it as a nomatch
+    record_probe_wait(svc, PROBE_WAIT_CLOSED);
     readstr = svc->getcurrentproberesponse(&readstrlen);
     if (readstrlen > 0)
       svc->addToServiceFingerprint(svc->currentProbe()->getName(), readstr,
@@ -2486,11 +3833,12 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
 
       // Perhaps this service didn't like the particular probe text.
       // We'll try the next one
-      startNextProbe(nsp, nsi, SG, svc, true);
+      startNextProbe(nsp, nsi, SG, svc, true, false);
     }
   } else if (status == NSE_STATUS_ERROR) {
     // Errors might happen in some cases ... I'll worry about later
     int err = nse_errorcode(nse);
+    record_probe_wait(svc, PROBE_WAIT_CLOSED);
     switch(err) {
     case ECONNRESET:
     case ECONNREFUSED: // weird to get this on a connected socket (shrug) but
@@ -2503,7 +3851,7 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
       } else {
         // Perhaps this service didn't like the particular probe text.  We'll try the
         // next one
-        startNextProbe(nsp, nsi, SG, svc, true);
+        startNextProbe(nsp, nsi, SG, svc, true, false);
       }
       break;
     case ENETUNREACH:
@@ -2530,7 +3878,7 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     case EIO:
       // Usually an SSL error of some sort (those are presently
       // hardcoded to EIO).  I'll just try the next probe.
-      startNextProbe(nsp, nsi, SG, svc, true);
+      startNextProbe(nsp, nsi, SG, svc, true, false);
       break;
     default:
       fatal("Unexpected error in NSE_TYPE_READ callback.  Error code: %d (%s)", err,
@@ -2648,6 +3996,7 @@ static void remove_excluded_ports(AllProbes *AP, ServiceGroup *SG) {
                                         NULL, NULL, NULL, NULL, NULL, NULL);
 
       SG->services_remaining.erase(i);
+      SG->hosts[svc->target].remaining--;
       SG->services_finished.push_back(svc);
     }
   }
@@ -2655,6 +4004,18 @@ static void remove_excluded_ports(AllProbes *AP, ServiceGroup *SG) {
 }
 
 
+/* Prints how long each probe waited for responses during this service scan,
+   and how the waits ended, so the effect of timeouts can be judged. */
+static void print_probe_wait_stats(AllProbes *AP) {
+  std::vector<ServiceProbe *>::iterator vi;
+
+  log_write(LOG_STDOUT, "Service scan wait times by probe:\n");
+  if (AP->nullProbe)
+    AP->nullProbe->printWaitStats();
+  for (vi = AP->probes.begin(); vi != AP->probes.end(); vi++)
+    (*vi)->printWaitStats();
+}
+
 /* Execute a service fingerprinting scan against all open ports of the
    Targets specified. */
 int service_scan(std::vector<Target *> &Targets) {
@@ -2672,6 +4033,8 @@ int service_scan(std::vector<Target *> &Targets) {
 
   AP = AllProbes::service_scan_init();
 
+  if (o.version_cache && version_cache == NULL)
+    version_cache = new VersionCache(o.version_cache, AP->probes_hash);
 
   // Now I convert the targets into a new ServiceGroup
   SG = new ServiceGroup(Targets, AP);
@@ -2713,6 +4076,10 @@ int service_scan(std::vector<Target *> &Targets) {
 
   nsp_setdevice(nsp, o.device);
 
+  /* Every probe has a connect or read timeout pending, and most of them are
+     cancelled when the response comes in. */
+  nsp_settimerwheel(nsp, 1);
+
   if (o.proxy_chain) {
     nsp_set_proxychain(nsp, o.proxy_chain);
   }
@@ -2750,6 +4117,16 @@ int service_scan(std::vector<Target *> &Targets) {
     SG->SPM->endTask(NULL, additional_info);
   }
 
+  if (o.debugging || o.versionTrace())
+    print_probe_wait_stats(AP);
+  if (o.debugging)
+    log_write(LOG_STDOUT, "Service scan final parallelism: %.2f (range %d-%d)\n",
+              SG->timing.cwnd, SG->perf.low_cwnd, SG->perf.max_cwnd);
+  if ((o.verbose || o.versionTrace()) && SG->connections_reused > 0)
+    log_write(LOG_STDOUT, "Service scan sent %u probes on existing connections: %u handshakes saved, %u retried on a new connection.\n",
+              SG->connections_reused, SG->connections_reused - SG->reuse_retries,
+              SG->reuse_retries);
+
   // Yeah - done with the service scan.  Now I go through the results
   // discovered, store the important info away, and free up everything
   // else.
@@ -2759,3 +4136,87 @@ int service_scan(std::vector<Target *> &Targets) {
 
   return 0;
 }
+
+/* Returns the line number of the first match for buf in the fallback chain
+   of probe, or 0 if nothing matched. */
+static int bench_match(ServiceProbe *probe, const u8 *buf, int buflen) {
+  const struct MatchDetails *MD;
+  int i;
+
+  for (i = 0; probe->fallbacks[i] != NULL; i++) {
+    MD = probe->fallbacks[i]->testMatch(buf, buflen);
+    if (MD && MD->serviceName)
+      return MD->lineno;
+  }
+
+  return 0;
+}
+
+void service_match_bench(const char *filename) {
+  const char *probenames[] = { "NULL", "GenericLines" };
+  std::vector<std::string> responses;
+  std::vector<int> results[2];
+  struct timeval start, end;
+  double rate[2], elapsed;
+  unsigned long count;
+  unsigned int i, len, mismatches;
+  char line[8192];
+  ServiceProbe *probe;
+  AllProbes *AP;
+  FILE *fp;
+  int p, pass;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    pfatal("Failed to open response file %s for reading", filename);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    if (cstring_unescape(line, &len) == NULL)
+      fatal("Bad escape in response file %s: %s", filename, line);
+    responses.push_back(std::string(line, len));
+  }
+  fclose(fp);
+  if (responses.empty())
+    fatal("No responses in %s", filename);
+
+  AP = AllProbes::service_scan_init();
+
+  for (p = 0; p < 2; p++) {
+    probe = AP->getProbeByName(probenames[p], IPPROTO_TCP);
+    if (probe == NULL)
+      continue;
+
+    /* Time each pass for at least two seconds. */
+    for (pass = 0; pass < 2; pass++) {
+      match_prefilter_enabled = (pass == 1);
+      count = 0;
+      gettimeofday(&start, NULL);
+      do {
+        for (i = 0; i < responses.size(); i++) {
+          int lineno = bench_match(probe, (const u8 *) responses[i].data(), responses[i].length());
+          if (count < responses.size())
+            results[pass].push_back(lineno);
+          count++;
+        }
+        gettimeofday(&end, NULL);
+        elapsed = TIMEVAL_FSEC_SUBTRACT(end, start);
+      } while (elapsed < 2.0);
+      rate[pass] = count / elapsed;
+    }
+    match_prefilter_enabled = true;
+
+    mismatches = 0;
+    for (i = 0; i < responses.size(); i++) {
+      if (results[0][i] != results[1][i])
+        mismatches++;
+    }
+    log_write(LOG_STDOUT, "%s probe: %u responses, %.0f matches/s without prefilter, %.0f matches/s with prefilter (%.1fx)%s\n",
+              probenames[p], (unsigned int) responses.size(), rate[0], rate[1],
+              rate[1] / rate[0], mismatches ? "" : ", same results");
+    if (mismatches > 0)
+      error("WARNING: %u responses matched differently with the prefilter", mismatches);
+    results[0].clear();
+    results[1].clear();
+  }
+}
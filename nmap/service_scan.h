@@ -132,6 +132,7 @@
 #include "portlist.h"
 
 #include <vector>
+#include <string>
 
 #ifdef HAVE_PCRE_PCRE_H
 # include <pcre/pcre.h>
@@ -179,6 +180,17 @@ struct MatchDetails {
 
 /**********************  CLASSES     ***********************************/
 
+class MatchPrefilter;
+
+/* How the wait for a response to a probe ended, for
+   ServiceProbe::recordWait(). */
+enum probe_wait_end { PROBE_WAIT_MATCHED, PROBE_WAIT_COMPLETE,
+                      PROBE_WAIT_TIMEOUT, PROBE_WAIT_CLOSED,
+                      PROBE_WAIT_NUM_ENDS };
+/* Bucket 0 holds waits under 1ms, bucket n waits of 2^(n-1) to 2^n - 1 ms
+   and the last one everything longer. */
+#define PROBE_WAIT_BUCKETS 16
+
 class ServiceProbeMatch {
  public:
   ServiceProbeMatch();
@@ -206,6 +218,20 @@ class ServiceProbeMatch {
   // The Line number where this match string was defined.  Returns
   // -1 if unknown.
   int getLineNo() { return deflineno; }
+  // Is this a "softmatch" line?
+  bool isSoftMatch() { return isSoft; }
+  // A lowercased literal string that appears in every response this
+  // regex can match, or "" if none was found.  The longest one is kept.
+  const std::string &getRequiredLiteral() { return required_literal; }
+  // A lowercased literal string that every response this regex can
+  // match starts with (from a leading ^), or "".
+  const std::string &getAnchoredPrefix() { return anchored_prefix; }
+  // Is the regex anchored to the start of the response?  Only anchored
+  // regexes can be ruled out by mayMatchLonger().
+  bool isAnchored() { return anchored; }
+  // Returns false if no response that begins with the buflen bytes in
+  // buf can match this regex, true if one might (or we can't tell).
+  bool mayMatchLonger(const u8 *buf, int buflen);
  private:
   int deflineno; // The line number where this match is defined.
   bool isInitialized; // Has InitMatch yet been called?
@@ -217,6 +243,8 @@ class ServiceProbeMatch {
   pcre_extra *regex_extra;
   bool matchops_ignorecase;
   bool matchops_dotall;
+  bool anchored; // Regex can only match at the start of the response
+  bool partial_ok; // PCRE can tell us about partial matches of it
   bool isSoft; // is this a soft match? ("softmatch" keyword in nmap-service-probes)
   // If any of these 3 are non-NULL, a product, version, or template
   // string was given to deduce the application/version info via
@@ -232,6 +260,8 @@ class ServiceProbeMatch {
   // The anchor is for SERVICESCAN_STATIC matches.  If the anchor is not -1, the match must
   // start at that zero-indexed position in the response str.
   int matchops_anchor;
+  std::string required_literal;
+  std::string anchored_prefix;
 // Details to fill out and return for testMatch() calls
   struct MatchDetails MD_return;
 
@@ -264,6 +294,10 @@ class ServiceProbe {
                                    // probe (e.g. an SMTP probe would commonly identify port 25)
 // Amount of time to wait after a connection succeeds (or packet sent) for a responses.
   int totalwaitms;
+  // The "reuse" group of this probe, or NULL.  The probe may be sent on a
+  // TCP connection that already carried a complete response to an earlier
+  // probe of the same group, instead of on a new one.
+  char *reuse;
 
   // Parses the "probe " line in the nmap-service-probes file.  Pass the rest of the line
   // after "probe ".  The format better be:
@@ -331,6 +365,32 @@ class ServiceProbe {
   // return NULL if there are no match lines at all in this probe.
   const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n);
 
+  // Returns the match of this probe defined on the given line of
+  // nmap-service-probes, or NULL if there is none.
+  ServiceProbeMatch *getMatchByLine(int lineno);
+
+  // Builds the literal-string prefilter testMatch() uses to skip
+  // matches that cannot succeed.  Call after all matches are added.
+  void compilePrefilter();
+
+  // Works out which of the checks used by responseComplete() apply to
+  // this probe.  Call after the fallbacks have been filled in.
+  void compileCompletion();
+
+  // Returns true if reading more of a response that starts with buf
+  // cannot change what it matches, either because the protocol framing
+  // says the response is complete or because no match line in this
+  // probe or its fallbacks could match a longer response.  If
+  // softmatched is true, only hard matches are considered.
+  bool responseComplete(const u8 *buf, int buflen, bool softmatched);
+
+  // Adds the time waited for a response to this probe (from sending it
+  // until the result was known) to the wait statistics.  how is one of
+  // the PROBE_WAIT_* values.
+  void recordWait(long waitms, int how);
+  // Prints and then clears the wait statistics, if there are any.
+  void printWaitStats();
+
   char *fallbackStr;
   ServiceProbe *fallbacks[MAXFALLBACKS+1];
 
@@ -347,6 +407,11 @@ class ServiceProbe {
   std::vector<const char *> detectedServices;
   int probeprotocol;
   std::vector<ServiceProbeMatch *> matches; // first-ever use of STL in Nmap!
+  MatchPrefilter *prefilter;
+  bool anchored_fallbacks; // Every match in the fallbacks is anchored
+  int framing; // PROBE_FRAMING_* of responses to this probe
+  unsigned int wait_hist[PROBE_WAIT_BUCKETS]; // Counts by log2(ms) + 1
+  unsigned int wait_ends[PROBE_WAIT_NUM_ENDS];
 };
 
 class AllProbes {
@@ -371,6 +436,8 @@ public:
   int isExcluded(unsigned short port, int proto);
   bool excluded_seen;
   struct scan_lists excludedports;
+  // Hash of the nmap-service-probes contents, for --version-cache.
+  u64 probes_hash;
 
   static AllProbes *service_scan_init(void);
   static void service_scan_free(void);
@@ -390,5 +457,14 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename);
    Targets specified. */
 int service_scan(std::vector<Target *> &Targets);
 
+/* Writes the --version-cache file, adding the results of this run. */
+void service_scan_cache_save(void);
+
+/* Replays the responses in filename (one per line, with C-style escapes)
+   through the NULL and GenericLines probes with and without the match
+   prefilter, and prints the matching rate of each. For the --version-bench
+   debugging option. */
+void service_match_bench(const char *filename);
+
 #endif /* SERVICE_SCAN_H */
 
@@ -248,10 +248,7 @@ int load_exclude_string(addrset *excludelist, const char *s) {
 /* A debug routine to dump some information to stdout. Invoked if debugging is
    set to 4 or higher. */
 int dumpExclude(addrset *exclude_group) {
-  const struct addrset_elem *elem;
-
-  for (elem = exclude_group->head; elem != NULL; elem = elem->next)
-    addrset_elem_print(stdout, elem);
+  addrset_print(stdout, exclude_group);
 
   return 1;
 }
@@ -353,11 +350,10 @@ int TargetGroup::parse_expr(const char *target_expr, int af) {
     return 1;
 }
 
-/* Grab the next host from this expression (if any) and updates its internal
-   state to reflect that the IP was given out.  Returns 0 and
-   fills in ss if successful.  ss must point to a pre-allocated
-   sockaddr_storage structure */
-int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
+/* Resolve the netblock if it is a bare hostname and check that it is of the
+   address family being scanned. Returns 0 if it is ready to give out
+   addresses. */
+int TargetGroup::check_netblock() {
   if (this->netblock == NULL)
     return -1;
 
@@ -391,12 +387,35 @@ int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
     return -1;
   }
 
+  return 0;
+}
+
+/* Grab the next host from this expression (if any) and updates its internal
+   state to reflect that the IP was given out.  Returns 0 and
+   fills in ss if successful.  ss must point to a pre-allocated
+   sockaddr_storage structure */
+int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
+  if (this->check_netblock() != 0)
+    return -1;
+
   if (this->netblock->next(ss, sslen))
     return 0;
   else
     return -1;
 }
 
+int TargetGroup::get_next_hosts(u32 *addrs, int max) {
+  NetBlockIPv4Ranges *netblock_ranges;
+
+  if (this->check_netblock() != 0)
+    return 0;
+
+  netblock_ranges = dynamic_cast<NetBlockIPv4Ranges *>(this->netblock);
+  assert(netblock_ranges != NULL);
+
+  return netblock_ranges->next_batch(addrs, max);
+}
+
 /* Returns true iff the given address is the one that was resolved to create
    this target group; i.e., not one of the addresses derived from it with a
    netmask. */
@@ -440,10 +459,14 @@ HostGroupState::HostGroupState(int lookahead, int rnd, int argc, const char **ar
   current_batch_sz = 0;
   next_batch_no = 0;
   randomize = rnd;
+  addrbuf = (u32 *) safe_malloc(sizeof(u32) * ADDRBUF_SIZE);
+  addrbuf_len = 0;
+  addrbuf_next = 0;
 }
 
 HostGroupState::~HostGroupState() {
   free(hostbatch);
+  free(addrbuf);
 }
 
 /* Returns true iff the defer buffer is not yet full. */
@@ -566,6 +589,42 @@ bail:
   return NULL;
 }
 
+/* Get the next address from the current TargetGroup. IPv4 addresses are read
+   in batches, and the exclude list is applied to a whole batch at once. Returns
+   0 and fills in ss if successful, like TargetGroup::get_next_host. */
+static int next_host_from_group(HostGroupState *hs, const addrset *exclude_group,
+  struct sockaddr_storage *ss, size_t *sslen) {
+  struct sockaddr_in *sin;
+
+  if (o.af() != AF_INET) {
+    do {
+      if (hs->current_group.get_next_host(ss, sslen) != 0)
+        return -1;
+    } while (hostInExclude((struct sockaddr *) ss, *sslen, exclude_group));
+    return 0;
+  }
+
+  while (hs->addrbuf_next >= hs->addrbuf_len) {
+    hs->addrbuf_next = 0;
+    hs->addrbuf_len = hs->current_group.get_next_hosts(hs->addrbuf, HostGroupState::ADDRBUF_SIZE);
+    if (hs->addrbuf_len == 0)
+      return -1;
+    if (exclude_group != NULL)
+      hs->addrbuf_len = addrset_filter_ipv4(exclude_group, hs->addrbuf, hs->addrbuf_len);
+  }
+
+  memset(ss, 0, sizeof(*ss));
+  sin = (struct sockaddr_in *) ss;
+  sin->sin_family = AF_INET;
+#if HAVE_SOCKADDR_SA_LEN
+  sin->sin_len = sizeof(*sin);
+#endif
+  sin->sin_addr.s_addr = hs->addrbuf[hs->addrbuf_next++];
+  *sslen = sizeof(*sin);
+
+  return 0;
+}
+
 static Target *next_target(HostGroupState *hs, const addrset *exclude_group,
   struct scan_lists *ports, int pingtype) {
   struct sockaddr_storage ss;
@@ -581,7 +640,7 @@ static Target *next_target(HostGroupState *hs, const addrset *exclude_group,
 
 tryagain:
 
-  if (hs->current_group.get_next_host(&ss, &sslen) != 0) {
+  if (next_host_from_group(hs, exclude_group, &ss, &sslen) != 0) {
     const char *expr;
     /* We are going to have to pop in another expression. */
     for (;;) {
@@ -608,10 +667,6 @@ tryagain:
     goto tryagain;
   }
 
-  /* Check exclude list. */
-  if (hostInExclude((struct sockaddr *) &ss, sslen, exclude_group))
-    goto tryagain;
-
   t = setup_target(hs, &ss, sslen, pingtype);
   if (t == NULL)
     goto tryagain;
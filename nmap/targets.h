@@ -173,6 +173,11 @@ public:
      fills in ss if successful.  ss must point to a pre-allocated
      sockaddr_storage structure */
   int get_next_host(struct sockaddr_storage *ss, size_t *sslen);
+  /* Grab up to max IPv4 addresses, in network byte order, from this
+     expression at once. Only for use when o.af() is AF_INET. Returns the
+     number of addresses filled in, 0 when there are no more or in case of
+     error. */
+  int get_next_hosts(u32 *addrs, int max);
   /* Returns true iff the given address is the one that was resolved to create
      this target group; i.e., not one of the addresses derived from it with a
      netmask. */
@@ -184,12 +189,17 @@ public:
   const std::list<struct sockaddr_storage> &get_resolved_addrs(void) const;
   /* is the current expression a named host */
   int get_namedhost() const;
+
+private:
+  int check_netblock();
 };
 
 class HostGroupState {
 public:
   /* The maximum number of entries we want to allow storing in defer_buffer. */
   static const unsigned int DEFER_LIMIT = 64;
+  /* The number of IPv4 addresses read from a TargetGroup at once. */
+  static const int ADDRBUF_SIZE = 1024;
 
   HostGroupState(int lookahead, int randomize, int argc, const char *argv[]);
   ~HostGroupState();
@@ -213,6 +223,11 @@ public:
                     scan (they will also be out of order when given back one
                     at a time to the client program */
   TargetGroup current_group; /* For batch chunking -- targets in queue */
+  /* IPv4 addresses read ahead from current_group, with excluded ones already
+     removed. The next one to use is addrbuf[addrbuf_next]. */
+  u32 *addrbuf;
+  int addrbuf_len;
+  int addrbuf_next;
 
   /* Returns true iff the defer buffer is not yet full. */
   bool defer(Target *t);
@@ -504,6 +504,93 @@ struct addrinfo *resolve_all(const char *hostname, int pf) {
 }
 
 
+/* Raw IPv4 socket sends queued between send_ip_batch_begin() and
+   send_ip_batch_flush(). Packets are copied into per-slot buffers that are
+   reused from one batch to the next. */
+#define SEND_IP_BATCH_MAX 64
+static struct {
+  int sd; /* -1 when not batching */
+  int count;
+  bool last_queued;
+  u8 *packets[SEND_IP_BATCH_MAX];
+  unsigned int bufsizes[SEND_IP_BATCH_MAX];
+  unsigned int packetlens[SEND_IP_BATCH_MAX];
+  struct sockaddr_in dsts[SEND_IP_BATCH_MAX];
+  struct timeval *stamps[SEND_IP_BATCH_MAX];
+  unsigned long packets_sent;
+  unsigned long batches;
+} ip_batch = { -1 };
+
+static void send_ip_batch_send() {
+  struct timeval start, end;
+  long elapsed;
+  int i;
+
+  if (ip_batch.count == 0)
+    return;
+  gettimeofday(&start, NULL);
+  send_ip_packets_sd(ip_batch.sd, ip_batch.dsts, ip_batch.packets,
+                     ip_batch.packetlens, ip_batch.count);
+  gettimeofday(&end, NULL);
+  /* The packets only left now, so that's when their RTT clock starts. The
+     kernel handles them one after the other within the call, so spread the
+     send times evenly over its duration. */
+  elapsed = TIMEVAL_SUBTRACT(end, start);
+  for (i = 0; i < ip_batch.count; i++) {
+    if (ip_batch.stamps[i] != NULL)
+      TIMEVAL_ADD(*ip_batch.stamps[i], start, elapsed * i / ip_batch.count);
+  }
+  ip_batch.packets_sent += ip_batch.count;
+  ip_batch.batches++;
+  ip_batch.count = 0;
+}
+
+static int send_ip_batch_queue(const struct sockaddr_in *dst,
+                               const u8 *packet, unsigned int packetlen) {
+  int i = ip_batch.count;
+
+  if (packetlen > ip_batch.bufsizes[i]) {
+    ip_batch.packets[i] = (u8 *) safe_realloc(ip_batch.packets[i], packetlen);
+    ip_batch.bufsizes[i] = packetlen;
+  }
+  memcpy(ip_batch.packets[i], packet, packetlen);
+  ip_batch.packetlens[i] = packetlen;
+  ip_batch.dsts[i] = *dst;
+  ip_batch.stamps[i] = NULL;
+  ip_batch.count++;
+  ip_batch.last_queued = true;
+  if (ip_batch.count == SEND_IP_BATCH_MAX) {
+    send_ip_batch_send();
+    ip_batch.last_queued = false;
+  }
+
+  return packetlen;
+}
+
+void send_ip_batch_begin(int sd) {
+#if HAVE_SENDMMSG
+  assert(ip_batch.count == 0);
+  ip_batch.sd = sd;
+  ip_batch.last_queued = false;
+#endif
+}
+
+void send_ip_batch_stamp(struct timeval *tv) {
+  if (ip_batch.last_queued)
+    ip_batch.stamps[ip_batch.count - 1] = tv;
+}
+
+void send_ip_batch_flush() {
+  send_ip_batch_send();
+  ip_batch.sd = -1;
+  ip_batch.last_queued = false;
+}
+
+void send_ip_batch_stats(unsigned long *packets, unsigned long *batches) {
+  *packets = ip_batch.packets_sent;
+  *batches = ip_batch.batches;
+}
+
 /* Send a pre-built IPv4 packet. Handles fragmentation and whether to send with
    an ethernet handle or a socket. */
 static int send_ipv4_packet(int sd, const struct eth_nfo *eth,
@@ -519,6 +606,8 @@ static int send_ipv4_packet(int sd, const struct eth_nfo *eth,
   if (o.fragscan && !(ntohs(ip->ip_off) & IP_DF) &&
       (packetlen - ip->ip_hl * 4 > (unsigned int) o.fragscan)) {
     res = send_frag_ip_packet(sd, eth, dst, packet, packetlen, o.fragscan);
+  } else if (eth == NULL && sd >= 0 && sd == ip_batch.sd) {
+    res = send_ip_batch_queue(dst, packet, packetlen);
   } else {
     res = send_ip_packet_eth_or_sd(sd, eth, dst, packet, packetlen);
   }
@@ -545,6 +634,8 @@ int send_ip_packet(int sd, const struct eth_nfo *eth,
                    const u8 *packet, unsigned int packetlen) {
   struct ip *ip = (struct ip *) packet;
 
+  ip_batch.last_queued = false;
+
   /* Ensure there's enough to read ip->ip_v at least. */
   if (packetlen < 1)
     return -1;
@@ -1556,11 +1647,112 @@ char *readipv4_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   return buf;
 }
 
+/* State for the one capture handle (normally ultra_scan's) that is read in
+   batches. Every frame that is ready when the handle becomes readable is
+   copied out of the kernel ring in a single nonblocking pcap_dispatch() and
+   then handed out one at a time by readip_pcap(). Frames are laid out so
+   that the network header following the link header is 8-byte aligned,
+   which lets readip_pcap() return them in place instead of copying them
+   again into its aligned buffer. */
+static struct {
+  pcap_t *pd;
+  unsigned int offset;
+  char *buf;
+  size_t bufsz;
+  size_t used;
+  size_t next;
+  unsigned long frames;
+  unsigned long batches;
+} pcap_ring;
+
+#define PCAP_RING_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+/* Where a frame's pcap_pkthdr stored at hdrpos has its captured bytes. */
+static size_t pcap_ring_datapos(size_t hdrpos) {
+  return PCAP_RING_ALIGN(hdrpos + sizeof(struct pcap_pkthdr) + pcap_ring.offset)
+    - pcap_ring.offset;
+}
+
+static void pcap_ring_store(u_char *user, const struct pcap_pkthdr *h,
+                            const u_char *bytes) {
+  size_t hdrpos, datapos;
+
+  hdrpos = PCAP_RING_ALIGN(pcap_ring.used);
+  datapos = pcap_ring_datapos(hdrpos);
+  if (datapos + h->caplen > pcap_ring.bufsz) {
+    pcap_ring.bufsz = MAX(pcap_ring.bufsz * 2, datapos + h->caplen);
+    pcap_ring.buf = (char *) safe_realloc(pcap_ring.buf, pcap_ring.bufsz);
+  }
+  memcpy(pcap_ring.buf + hdrpos, h, sizeof(*h));
+  memcpy(pcap_ring.buf + datapos, bytes, h->caplen);
+  pcap_ring.used = datapos + h->caplen;
+  pcap_ring.frames++;
+}
+
+/* Copies every frame currently available on pd into the batch. Returns the
+   number of frames read. */
+static int pcap_ring_fill(pcap_t *pd, unsigned int offset) {
+  int n;
+
+  pcap_ring.offset = offset;
+  pcap_ring.used = pcap_ring.next = 0;
+  n = pcap_dispatch(pd, -1, pcap_ring_store, NULL);
+  if (n < 0)
+    fatal("%s: pcap_dispatch failed: %s", __func__, pcap_geterr(pd));
+  if (n > 0)
+    pcap_ring.batches++;
+  return n;
+}
+
+/* Returns the next frame of the batch, filling in head, or NULL if the batch
+   is exhausted. */
+static char *pcap_ring_pop(struct pcap_pkthdr *head) {
+  size_t hdrpos, datapos;
+
+  if (pcap_ring.next >= pcap_ring.used)
+    return NULL;
+  hdrpos = PCAP_RING_ALIGN(pcap_ring.next);
+  datapos = pcap_ring_datapos(hdrpos);
+  memcpy(head, pcap_ring.buf + hdrpos, sizeof(*head));
+  pcap_ring.next = datapos + head->caplen;
+  return pcap_ring.buf + datapos;
+}
+
+void pcap_ring_enable(pcap_t *pd) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+
+  assert(pd != NULL);
+  /* The batch is drained with a nonblocking pcap_dispatch() after
+     pcap_select() has said the descriptor is readable, so this only works
+     where that descriptor is meaningful. */
+  if (!pcap_selectable_fd_one_to_one())
+    return;
+  if (pcap_setnonblock(pd, 1, errbuf) < 0) {
+    error("%s: pcap_setnonblock: %s", __func__, errbuf);
+    return;
+  }
+  pcap_ring.pd = pd;
+  pcap_ring.used = pcap_ring.next = 0;
+  pcap_ring.frames = pcap_ring.batches = 0;
+  if (pcap_ring.buf == NULL) {
+    pcap_ring.bufsz = 65536;
+    pcap_ring.buf = (char *) safe_malloc(pcap_ring.bufsz);
+  }
+}
+
+void pcap_ring_disable(pcap_t *pd) {
+  if (pd == NULL || pd != pcap_ring.pd)
+    return;
+  pcap_ring.pd = NULL;
+  pcap_ring.used = pcap_ring.next = 0;
+}
+
 char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
                   struct timeval *rcvdtime, struct link_header *linknfo, bool validate) {
   unsigned int offset = 0;
   struct pcap_pkthdr head;
   char *p;
+  char *buf;
   int datalink;
   int timedout = 0;
   struct timeval tv_start, tv_end;
@@ -1693,10 +1885,20 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
 #endif
 
     p = NULL;
+    if (pd == pcap_ring.pd) {
+      /* Batched handle: only wait when everything already read is used up. */
+      p = pcap_ring_pop(&head);
+      if (p == NULL) {
+        if (pcap_select(pd, to_usec) == 0)
+          timedout = 1;
+        else if (pcap_ring_fill(pd, offset) > 0)
+          p = pcap_ring_pop(&head);
+      }
+    }
     /* It may be that protecting this with !pcap_selectable_fd_one_to_one is not
        necessary, that it is always safe to do a nonblocking read in this way on
        all platforms. But I have only tested it on Solaris. */
-    if (!pcap_selectable_fd_one_to_one()) {
+    else if (!pcap_selectable_fd_one_to_one()) {
       int rc, nonblock;
 
       nonblock = pcap_getnonblock(pd, NULL);
@@ -1708,7 +1910,7 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
       assert(rc == 0);
     }
 
-    if (p == NULL) {
+    if (p == NULL && !timedout && pd != pcap_ring.pd) {
       /* Nonblocking pcap_next didn't get anything. */
       if (pcap_select(pd, to_usec) == 0)
         timedout = 1;
@@ -1747,15 +1949,21 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
     return NULL;
   }
   *len = head.caplen - offset;
-  if (*len > alignedbufsz) {
-    alignedbuf = (char *) safe_realloc(alignedbuf, *len);
-    alignedbufsz = *len;
+  if (pd == pcap_ring.pd) {
+    /* Batched frames are already stored aligned; hand them out in place. */
+    buf = p;
+  } else {
+    if (*len > alignedbufsz) {
+      alignedbuf = (char *) safe_realloc(alignedbuf, *len);
+      alignedbufsz = *len;
+    }
+    memcpy(alignedbuf, p, *len);
+    buf = alignedbuf;
   }
-  memcpy(alignedbuf, p, *len);
 
   if (validate) {
     /* Let's see if this packet passes inspection.. */
-    if (!validatepkt((u8 *) alignedbuf, len)) {
+    if (!validatepkt((u8 *) buf, len)) {
       *len = 0;
       return NULL;
     }
@@ -1779,12 +1987,12 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   }
 
   if (rcvdtime)
-    PacketTrace::trace(PacketTrace::RCVD, (u8 *) alignedbuf, *len,
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) buf, *len,
                        rcvdtime);
   else
-    PacketTrace::trace(PacketTrace::RCVD, (u8 *) alignedbuf, *len);
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) buf, *len);
 
-  return alignedbuf;
+  return buf;
 }
 
 /* Attempts to read one IPv6 Neighbor Solicitation reply packet from the pcap
@@ -1892,6 +2100,12 @@ void pcap_print_stats(int logt, pcap_t *pd) {
   }
 
   log_write(logt, "pcap stats: %u packets received by filter, %u dropped by kernel.\n", stat.ps_recv, stat.ps_drop);
+  if (pd == pcap_ring.pd) {
+    log_write(logt, "pcap ring: %lu frames in %lu batches (%.1f per wakeup), %u dropped by interface.\n",
+              pcap_ring.frames, pcap_ring.batches,
+              pcap_ring.batches ? (double) pcap_ring.frames / pcap_ring.batches : 0.0,
+              stat.ps_ifdrop);
+  }
 }
 
 
@@ -1986,9 +2200,19 @@ bool setTargetNextHopMAC(Target *target) {
 /* Like to getTargetNextHopMAC(), but for arbitrary hosts (not Targets) */
 bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_storage *srcss,
                    const struct sockaddr_storage *dstss, u8 *dstmac) {
+  static bool neighbors_loaded = false;
   arp_t *a;
   struct arp_entry ae;
 
+  /* Seed the Nmap arp cache with everything the system has resolved, rather
+     than asking about one host at a time. */
+  if (!neighbors_loaded) {
+    int n = mac_cache_load_neighbors();
+    if (o.debugging > 1 && n >= 0)
+      log_write(LOG_STDOUT, "Loaded %d entries from the system neighbor cache\n", n);
+    neighbors_loaded = true;
+  }
+
   /* First, let us check the Nmap arp cache ... */
   if (mac_cache_get(dstss, dstmac))
     return true;
@@ -463,10 +463,35 @@ u8 *build_igmp_raw(const struct in_addr *source, const struct in_addr *victim,
 // invalid (Windows and Amiga), readip_pcap returns the time you called it.
 bool pcap_recv_timeval_valid();
 
+/* Between send_ip_batch_begin() and send_ip_batch_flush(), IPv4 packets
+   that send_ip_packet() would write to the raw socket sd are queued instead
+   and later handed to the kernel together (with sendmmsg() where it is
+   available; elsewhere begin is a no-op and sends stay immediate).
+   send_ip_batch_stamp() asks for *tv to be set to the time the most
+   recently queued packet actually goes out, so RTTs measured from it stay
+   accurate. send_ip_batch_stats() returns running totals of batched packets
+   and of the calls used to send them. */
+void send_ip_batch_begin(int sd);
+void send_ip_batch_stamp(struct timeval *tv);
+void send_ip_batch_flush();
+void send_ip_batch_stats(unsigned long *packets, unsigned long *batches);
+
 /* Prints stats from a pcap descriptor (number of received and dropped
    packets). */
 void pcap_print_stats(int logt, pcap_t *pd);
 
+/* Makes readip_pcap() read pd in batches: when pd becomes readable, every
+   frame ready in the capture ring is copied out at once and subsequent calls
+   are served from that batch without waiting. Only one handle at a time can
+   be batched; call pcap_ring_disable() before closing it. Does nothing on
+   platforms where pcap_select() isn't reliable. */
+void pcap_ring_enable(pcap_t *pd);
+void pcap_ring_disable(pcap_t *pd);
+
+/* Capture buffer requested for --capture-engine ring. Big enough to absorb
+   several seconds of replies at high --min-rate without kernel drops. */
+#define PCAP_RING_BYTES (32 * 1024 * 1024)
+
 
 
 /* A simple function I wrote to help in debugging, shows the important fields
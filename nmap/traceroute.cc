@@ -918,8 +918,14 @@ TracerouteState::TracerouteState(std::vector<Target *> &targets) {
   }
 
   /* Assume that all the targets share the same device. */
-  if((pd=my_pcap_open_live(targets[0]->deviceName(), 128, o.spoofsource, 2))==NULL)
+  if (o.capture_ring)
+    pd = my_pcap_open_ring(targets[0]->deviceName(), 128, o.spoofsource, 2, PCAP_RING_BYTES);
+  else
+    pd = my_pcap_open_live(targets[0]->deviceName(), 128, o.spoofsource, 2);
+  if (pd == NULL)
     fatal("%s", PCAP_OPEN_ERRMSG);
+  if (o.capture_ring)
+    pcap_ring_enable(pd);
   sslen = sizeof(srcaddr);
   targets[0]->SourceSockAddr(&srcaddr, &sslen);
   n = Snprintf(pcap_filter, sizeof(pcap_filter), "(ip or ip6) and dst host %s",
@@ -944,6 +950,7 @@ TracerouteState::~TracerouteState() {
 
   if (rawsd != -1)
     close(rawsd);
+  pcap_ring_disable(pd);
   pcap_close(pd);
 
   for (it = hosts.begin(); it != hosts.end(); it++)